@@ -381,6 +381,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    bs->alloc_map = bdrv_alloc_map_new();
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -1156,6 +1157,10 @@ static void bdrv_backing_attach(BdrvChild *c)
     pstrcpy(parent->backing_format, sizeof(parent->backing_format),
             backing_hd->drv ? backing_hd->drv->format_name : "");
 
+    /* Both chains have changed */
+    bdrv_alloc_map_reset(parent);
+    bdrv_alloc_map_reset(backing_hd);
+
     bdrv_op_block_all(backing_hd, parent->backing_blocker);
     /* Otherwise we won't be able to commit or stream */
     bdrv_op_unblock(backing_hd, BLOCK_OP_TYPE_COMMIT_TARGET,
@@ -1186,6 +1191,7 @@ static void bdrv_backing_detach(BdrvChild *c)
     BlockDriverState *parent = c->opaque;
 
     assert(parent->backing_blocker);
+    bdrv_alloc_map_reset(parent);
     bdrv_op_unblock_all(c->bs, parent->backing_blocker);
     error_free(parent->backing_blocker);
     parent->backing_blocker = NULL;
@@ -4615,6 +4621,7 @@ static void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    bdrv_alloc_map_free(bs->alloc_map);
     g_free(bs);
 }
 
@@ -5707,6 +5714,9 @@ static void coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs,
             error_setg_errno(errp, -ret, "Could not refresh total sector count");
             return;
         }
+
+        /* The image may have been written to while we were inactive */
+        bdrv_alloc_map_reset(bs);
     }
 
     QLIST_FOREACH(parent, &bs->parents, next_parent) {
@@ -6908,6 +6918,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_alloc_map_reset(c->bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -262,6 +262,22 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     qemu_mutex_unlock(&stats->lock);
 }
 
+/*
+ * Account @num_requests that were merged into a request coming from another
+ * queue of a multiqueue device.  These are also included in the count
+ * passed to block_acct_merge_done().
+ */
+void block_acct_merge_cross_queue_done(BlockAcctStats *stats,
+                                       enum BlockAcctType type,
+                                       int num_requests)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    stats->merged_cross_queue[type] += num_requests;
+    qemu_mutex_unlock(&stats->lock);
+}
+
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
     return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
@@ -0,0 +1,541 @@
+/*
+ * Merged allocation map for deep backing chains
+ *
+ * Finding out where the data at some offset comes from normally means
+ * asking each layer of the backing chain in turn, which gets slow for
+ * chains that are dozens of snapshots deep.  The allocation map caches,
+ * for each chunk of the top node, the depth of the first layer that
+ * allocates it.  It is filled lazily, one segment of chunks at a time,
+ * from the block status of each layer (for qcow2, its L2 tables), and
+ * chunks are invalidated when any layer of the chain is written to.
+ *
+ * Chunks whose allocation differs within the chunk are marked mixed, and
+ * callers fall back to walking the chain for them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qemu/host-utils.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+/* Shallower chains are cheap enough to walk */
+#define ALLOC_MAP_MIN_DEPTH         8
+
+#define ALLOC_MAP_SEGMENT_BITS      12
+#define ALLOC_MAP_SEGMENT_CHUNKS    (1 << ALLOC_MAP_SEGMENT_BITS)
+
+#define ALLOC_MAP_DEFAULT_CHUNK     (64 * KiB)
+#define ALLOC_MAP_MIN_CHUNK         (4 * KiB)
+#define ALLOC_MAP_MAX_CHUNK         (2 * MiB)
+
+/* Chunk states; smaller values are the depth of the first allocating layer */
+#define ALLOC_MAP_NONE              0xfffd  /* no layer allocates the chunk */
+#define ALLOC_MAP_MIXED             0xfffe  /* allocation varies in the chunk */
+#define ALLOC_MAP_UNKNOWN           0xffff  /* not looked up yet */
+#define ALLOC_MAP_MAX_DEPTH         ALLOC_MAP_NONE
+
+struct BdrvAllocMap {
+    QemuMutex lock;
+
+    /*
+     * Bumped when the map is reset, and per segment when chunks are
+     * invalidated, so that lookups racing with either do not store stale
+     * results.
+     */
+    uint64_t gen;
+    uint64_t *seg_gen;
+
+    bool valid;                 /* The fields below describe the chain */
+    /*
+     * The chain is deep and regular enough.  Read without the lock by
+     * bdrv_alloc_map_invalidate(), so most writes do not take it.
+     */
+    bool usable;
+    BlockDriverState **layers;  /* layers[0] is the node itself */
+    int nb_layers;
+    int64_t size;
+    int chunk_bits;
+    int64_t nb_chunks;
+    int64_t nb_segments;
+    uint16_t **segments;        /* NULL until looked up */
+};
+
+BdrvAllocMap *bdrv_alloc_map_new(void)
+{
+    BdrvAllocMap *map = g_new0(BdrvAllocMap, 1);
+
+    qemu_mutex_init(&map->lock);
+    return map;
+}
+
+static void alloc_map_reset_locked(BdrvAllocMap *map)
+{
+    int64_t i;
+
+    if (map->segments) {
+        for (i = 0; i < map->nb_segments; i++) {
+            g_free(map->segments[i]);
+        }
+    }
+    g_free(map->segments);
+    g_free(map->seg_gen);
+    g_free(map->layers);
+
+    map->segments = NULL;
+    map->seg_gen = NULL;
+    map->layers = NULL;
+    map->nb_layers = 0;
+    map->valid = false;
+    atomic_set(&map->usable, false);
+    map->gen++;
+}
+
+void bdrv_alloc_map_free(BdrvAllocMap *map)
+{
+    alloc_map_reset_locked(map);
+    qemu_mutex_destroy(&map->lock);
+    g_free(map);
+}
+
+static bool bdrv_is_cow_layer(BlockDriverState *bs)
+{
+    BdrvChild *c;
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass == &child_of_bds && (c->role & BDRV_CHILD_COW)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Describe the backing chain of @bs in its map.  Only the top of a chain
+ * gets a usable map, and only if all layers have the same length and
+ * plainly forward unallocated reads to their backing node.
+ */
+static void alloc_map_setup(BlockDriverState *bs, BdrvAllocMap *map)
+{
+    BlockDriverState *p, **layers;
+    BlockDriverInfo bdi;
+    bool usable;
+    uint64_t gen;
+    int64_t size, chunk_size;
+    int n, i;
+
+    qemu_mutex_lock(&map->lock);
+    gen = map->gen;
+    qemu_mutex_unlock(&map->lock);
+
+    n = 0;
+    for (p = bs; p; p = backing_bs(p)) {
+        n++;
+    }
+
+    size = bdrv_getlength(bs);
+    usable = n >= ALLOC_MAP_MIN_DEPTH && n < ALLOC_MAP_MAX_DEPTH &&
+             size > 0 && !bdrv_is_cow_layer(bs);
+
+    layers = g_new(BlockDriverState *, n);
+    for (i = 0, p = bs; p; i++, p = backing_bs(p)) {
+        layers[i] = p;
+        if (usable &&
+            (!p->drv || p->drv->is_filter ||
+             (p != bs && atomic_read(&p->copy_on_read)) ||
+             bdrv_getlength(p) != size))
+        {
+            usable = false;
+        }
+    }
+
+    chunk_size = ALLOC_MAP_DEFAULT_CHUNK;
+    if (usable && bdrv_get_info(bs, &bdi) == 0 &&
+        bdi.cluster_size >= ALLOC_MAP_MIN_CHUNK &&
+        bdi.cluster_size <= ALLOC_MAP_MAX_CHUNK &&
+        is_power_of_2(bdi.cluster_size))
+    {
+        chunk_size = bdi.cluster_size;
+    }
+
+    qemu_mutex_lock(&map->lock);
+    if (map->gen != gen || map->valid) {
+        /* Reset meanwhile, or set up by someone else */
+        qemu_mutex_unlock(&map->lock);
+        g_free(layers);
+        return;
+    }
+
+    map->valid = true;
+    atomic_set(&map->usable, usable);
+    if (usable) {
+        map->layers = layers;
+        map->nb_layers = n;
+        map->size = size;
+        map->chunk_bits = ctz32(chunk_size);
+        map->nb_chunks = DIV_ROUND_UP(size, chunk_size);
+        map->nb_segments = DIV_ROUND_UP(map->nb_chunks,
+                                        ALLOC_MAP_SEGMENT_CHUNKS);
+        map->segments = g_new0(uint16_t *, map->nb_segments);
+        map->seg_gen = g_new0(uint64_t, map->nb_segments);
+    } else {
+        g_free(layers);
+    }
+    qemu_mutex_unlock(&map->lock);
+
+    /*
+     * Pairs with the barrier in bdrv_alloc_map_invalidate(): writes that do
+     * not see the map as usable yet have completed before it is filled.
+     */
+    smp_mb();
+
+    trace_bdrv_alloc_map_setup(bs, n, usable, chunk_size);
+}
+
+/*
+ * Return layer @depth of the chain, or NULL if the map or segment @seg
+ * was invalidated since @gen and @seg_gen were sampled.
+ */
+static BlockDriverState *alloc_map_get_layer(BdrvAllocMap *map, uint64_t gen,
+                                             int64_t seg, uint64_t seg_gen,
+                                             int depth)
+{
+    BlockDriverState *p = NULL;
+
+    qemu_mutex_lock(&map->lock);
+    if (map->gen == gen && map->seg_gen[seg] == seg_gen) {
+        p = map->layers[depth];
+    }
+    qemu_mutex_unlock(&map->lock);
+
+    return p;
+}
+
+/*
+ * Find the first layer that allocates each of the @nb chunks starting at
+ * @first, which all lie in segment @seg, and store it in @vals.
+ *
+ * Every layer is only asked about the chunks that the layers above it do
+ * not allocate, so each layer costs one block status query per run of such
+ * chunks.
+ *
+ * Returns 0 on success, -EAGAIN if the map was invalidated meanwhile, and
+ * another negative errno on failure.
+ */
+static int alloc_map_build(BdrvAllocMap *map, uint64_t gen, int64_t seg,
+                           uint64_t seg_gen, int64_t first, int64_t nb,
+                           uint16_t *vals)
+{
+    int64_t size, chunk_size, base, i, j, k;
+    int nb_layers, d;
+    int ret;
+
+    /* The geometry only changes when the map is reset */
+    qemu_mutex_lock(&map->lock);
+    if (map->gen != gen) {
+        qemu_mutex_unlock(&map->lock);
+        return -EAGAIN;
+    }
+    size = map->size;
+    chunk_size = (int64_t)1 << map->chunk_bits;
+    nb_layers = map->nb_layers;
+    qemu_mutex_unlock(&map->lock);
+
+    base = first * chunk_size;
+    for (i = 0; i < nb; i++) {
+        vals[i] = ALLOC_MAP_UNKNOWN;
+    }
+
+    for (d = 0; d < nb_layers; d++) {
+        bool undecided = false;
+
+        for (i = 0; i < nb; i = j) {
+            int64_t offset, end;
+
+            if (vals[i] != ALLOC_MAP_UNKNOWN) {
+                j = i + 1;
+                continue;
+            }
+            /* Query up to the next chunk that is already decided */
+            for (j = i + 1; j < nb && vals[j] == ALLOC_MAP_UNKNOWN; j++) {
+                /* nothing */
+            }
+            undecided = true;
+
+            offset = base + i * chunk_size;
+            end = MIN(base + j * chunk_size, size);
+
+            while (offset < end) {
+                BlockDriverState *p;
+                int64_t n;
+
+                p = alloc_map_get_layer(map, gen, seg, seg_gen, d);
+                if (!p) {
+                    return -EAGAIN;
+                }
+
+                ret = bdrv_is_allocated(p, offset, end - offset, &n);
+                if (ret < 0) {
+                    return ret;
+                }
+                if (!n) {
+                    return -EIO;
+                }
+
+                /*
+                 * Chunks that the extent covers completely are provided by
+                 * this layer, the others are only partly allocated here.
+                 */
+                for (k = (offset - base) / chunk_size;
+                     ret && k < j && base + k * chunk_size < offset + n;
+                     k++)
+                {
+                    int64_t chunk_start = base + k * chunk_size;
+                    int64_t chunk_end = MIN(chunk_start + chunk_size, size);
+
+                    if (vals[k] != ALLOC_MAP_UNKNOWN) {
+                        continue;
+                    }
+                    if (chunk_start >= offset && chunk_end <= offset + n) {
+                        vals[k] = d;
+                    } else {
+                        vals[k] = ALLOC_MAP_MIXED;
+                    }
+                }
+                offset += n;
+            }
+        }
+
+        if (!undecided) {
+            break;
+        }
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (vals[i] == ALLOC_MAP_UNKNOWN) {
+            vals[i] = ALLOC_MAP_NONE;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Look up which layer of the backing chain of @bs provides the data at
+ * @offset, without walking the chain.
+ *
+ * Returns 0 if the map cannot answer, because the chain is too shallow or
+ * irregular, @base is not part of it, or the allocation varies within the
+ * first chunk.  The caller must then walk the chain itself.
+ *
+ * Otherwise returns BDRV_ALLOC_MAP_ALLOCATED if a layer above @base
+ * allocates the range and BDRV_ALLOC_MAP_UNALLOCATED if none does, and sets
+ * @pnum to the number of bytes, at most @bytes, that share the answer.
+ * @depth, if non-NULL, is set to the depth of the first layer above @base
+ * that allocates them, where @bs has depth 0, or to the number of layers
+ * above @base if none does.  @child, if non-NULL, is set to the backing
+ * link that leads to the layer whose block status applies to the range:
+ * the allocating layer, or the last layer above @base.  It is NULL if that
+ * layer is @bs itself.
+ *
+ * Errors while filling the map are not reported; the caller walks the
+ * chain instead and sees them for the range it is actually interested in.
+ */
+int bdrv_alloc_map_lookup(BlockDriverState *bs, BlockDriverState *base,
+                          int64_t offset, int64_t bytes, int64_t *pnum,
+                          int *depth, BdrvChild **child)
+{
+    BdrvAllocMap *map = bs->alloc_map;
+    uint16_t *vals, val;
+    uint64_t gen, seg_gen;
+    int64_t chunk, seg, first, nb, end, i;
+    int base_depth, d;
+    int ret;
+
+    if (backing_bs(bs) == base || bytes <= 0) {
+        return 0;
+    }
+
+    if (!atomic_read(&map->valid)) {
+        alloc_map_setup(bs, map);
+    }
+
+    qemu_mutex_lock(&map->lock);
+    if (!map->valid || !map->usable || offset >= map->size) {
+        goto unanswered;
+    }
+
+    for (base_depth = 0; base_depth < map->nb_layers; base_depth++) {
+        if (map->layers[base_depth] == base) {
+            break;
+        }
+    }
+    if (base_depth < 2 || (base && base_depth == map->nb_layers)) {
+        goto unanswered;
+    }
+
+    chunk = offset >> map->chunk_bits;
+    seg = chunk >> ALLOC_MAP_SEGMENT_BITS;
+
+    if (!map->segments[seg]) {
+        first = seg << ALLOC_MAP_SEGMENT_BITS;
+        nb = MIN(ALLOC_MAP_SEGMENT_CHUNKS, map->nb_chunks - first);
+    } else if (map->segments[seg][chunk & (ALLOC_MAP_SEGMENT_CHUNKS - 1)] ==
+               ALLOC_MAP_UNKNOWN)
+    {
+        uint16_t *segment = map->segments[seg];
+
+        /* Only look up the invalidated chunks again */
+        first = chunk;
+        nb = 1;
+        while (first + nb < map->nb_chunks &&
+               (first + nb) >> ALLOC_MAP_SEGMENT_BITS == seg &&
+               segment[(first + nb) & (ALLOC_MAP_SEGMENT_CHUNKS - 1)] ==
+               ALLOC_MAP_UNKNOWN)
+        {
+            nb++;
+        }
+    } else {
+        nb = 0;
+    }
+
+    if (nb) {
+        int64_t build_offset = first << map->chunk_bits;
+
+        gen = map->gen;
+        seg_gen = map->seg_gen[seg];
+        qemu_mutex_unlock(&map->lock);
+
+        vals = g_new(uint16_t, nb);
+        ret = alloc_map_build(map, gen, seg, seg_gen, first, nb, vals);
+        trace_bdrv_alloc_map_build(bs, build_offset, nb, ret);
+        if (ret < 0) {
+            g_free(vals);
+            return 0;
+        }
+
+        qemu_mutex_lock(&map->lock);
+        if (map->gen != gen || map->seg_gen[seg] != seg_gen) {
+            g_free(vals);
+            goto unanswered;
+        }
+        if (!map->segments[seg]) {
+            map->segments[seg] = vals;
+        } else {
+            memcpy(map->segments[seg] + (first & (ALLOC_MAP_SEGMENT_CHUNKS - 1)),
+                   vals, nb * sizeof(vals[0]));
+            g_free(vals);
+        }
+    }
+
+    val = map->segments[seg][chunk & (ALLOC_MAP_SEGMENT_CHUNKS - 1)];
+    if (val == ALLOC_MAP_MIXED || val == ALLOC_MAP_UNKNOWN) {
+        goto unanswered;
+    }
+
+    /* Extend the answer over the following chunks in the same state */
+    end = offset + MIN(bytes, map->size - offset);
+    for (i = chunk + 1; i << map->chunk_bits < end; i++) {
+        uint16_t *segment = map->segments[i >> ALLOC_MAP_SEGMENT_BITS];
+
+        if (!segment || segment[i & (ALLOC_MAP_SEGMENT_CHUNKS - 1)] != val) {
+            break;
+        }
+    }
+    *pnum = MIN(i << map->chunk_bits, end) - offset;
+
+    d = val == ALLOC_MAP_NONE ? map->nb_layers : val;
+    ret = d < base_depth ? BDRV_ALLOC_MAP_ALLOCATED
+                         : BDRV_ALLOC_MAP_UNALLOCATED;
+    d = MIN(d, base_depth);
+    if (depth) {
+        *depth = d;
+    }
+    if (child) {
+        d = MIN(d, base_depth - 1);
+        *child = d ? map->layers[d - 1]->backing : NULL;
+    }
+    qemu_mutex_unlock(&map->lock);
+    return ret;
+
+unanswered:
+    qemu_mutex_unlock(&map->lock);
+    return 0;
+}
+
+/*
+ * Forget the allocation of [@offset, @offset + @bytes) in the map of @bs
+ * and in those of the nodes that have @bs in their backing chain.
+ */
+void bdrv_alloc_map_invalidate(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes)
+{
+    BdrvAllocMap *map = bs->alloc_map;
+    BdrvChild *c;
+
+    /* Pairs with the barrier in alloc_map_setup() */
+    smp_mb();
+    if (!atomic_read(&map->usable)) {
+        goto parents;
+    }
+
+    qemu_mutex_lock(&map->lock);
+    if (map->usable && offset < map->size && bytes > 0) {
+        int64_t chunk = offset >> map->chunk_bits;
+        int64_t end = DIV_ROUND_UP(MIN(bytes, map->size - offset) + offset,
+                                   (int64_t)1 << map->chunk_bits);
+
+        while (chunk < end) {
+            int64_t seg = chunk >> ALLOC_MAP_SEGMENT_BITS;
+            int64_t seg_first = seg << ALLOC_MAP_SEGMENT_BITS;
+            int64_t seg_end = MIN(seg_first + ALLOC_MAP_SEGMENT_CHUNKS, end);
+
+            map->seg_gen[seg]++;
+            if (chunk == seg_first && seg_end == seg_first +
+                ALLOC_MAP_SEGMENT_CHUNKS)
+            {
+                g_free(map->segments[seg]);
+                map->segments[seg] = NULL;
+            } else if (map->segments[seg]) {
+                for (; chunk < seg_end; chunk++) {
+                    map->segments[seg][chunk - seg_first] = ALLOC_MAP_UNKNOWN;
+                }
+            }
+            chunk = seg_end;
+        }
+    }
+    qemu_mutex_unlock(&map->lock);
+
+parents:
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass == &child_of_bds && (c->role & BDRV_CHILD_COW)) {
+            bdrv_alloc_map_invalidate(c->opaque, offset, bytes);
+        }
+    }
+}
+
+/*
+ * Drop the map of @bs and of the nodes that have @bs in their backing
+ * chain, for changes that are not confined to a range, such as a resize
+ * or a change of the chain itself.
+ */
+void bdrv_alloc_map_reset(BlockDriverState *bs)
+{
+    BdrvAllocMap *map = bs->alloc_map;
+    BdrvChild *c;
+
+    qemu_mutex_lock(&map->lock);
+    if (map->valid) {
+        alloc_map_reset_locked(map);
+    }
+    qemu_mutex_unlock(&map->lock);
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass == &child_of_bds && (c->role & BDRV_CHILD_COW)) {
+            bdrv_alloc_map_reset(c->opaque);
+        }
+    }
+}
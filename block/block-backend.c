@@ -78,6 +78,8 @@ struct BlockBackend {
 
     bool allow_aio_context_change;
     bool allow_write_beyond_eof;
+    /* AIO requests may run in the IOThread that submits them */
+    bool allow_multiqueue;
 
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
@@ -804,6 +806,21 @@ BlockBackend *blk_by_public(BlockBackendPublic *public)
 /*
  * Disassociates the currently associated BlockDriverState from @blk.
  */
+/*
+ * The IOThreads that submitted requests through @blk may go away once it
+ * stops using them, so have the drivers release what they set up for them.
+ *
+ * Called with the AioContext lock of @blk held.
+ */
+static void blk_drop_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    bdrv_drained_begin(bs);
+    bdrv_drop_multiqueue(bs);
+    bdrv_drained_end(bs);
+}
+
 void blk_remove_bs(BlockBackend *blk)
 {
     ThrottleGroupMember *tgm = &blk->public.throttle_group_member;
@@ -825,6 +842,9 @@ void blk_remove_bs(BlockBackend *blk)
      * to avoid that and a potential QEMU crash.
      */
     blk_drain(blk);
+    if (blk->allow_multiqueue) {
+        blk_drop_multiqueue(blk);
+    }
     bdrv_root_unref_child(blk->root);
     blk->root = NULL;
 }
@@ -1136,6 +1156,40 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+/*
+ * Let AIO requests that are submitted from an IOThread other than the one
+ * @blk lives in run in the submitting IOThread, instead of being handed
+ * over to the home AioContext.  Requests still fall back to the home
+ * AioContext whenever the graph below @blk does not support it.
+ */
+void blk_set_allow_multiqueue(BlockBackend *blk, bool allow)
+{
+    AioContext *ctx;
+
+    if (blk->allow_multiqueue && !allow && blk_bs(blk)) {
+        ctx = blk_get_aio_context(blk);
+        aio_context_acquire(ctx);
+        blk->allow_multiqueue = false;
+        blk_drop_multiqueue(blk);
+        aio_context_release(ctx);
+        return;
+    }
+    blk->allow_multiqueue = allow;
+}
+
+/* Called with the AioContext lock of @blk held */
+static bool blk_use_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    return blk->allow_multiqueue && bs &&
+           ctx != qemu_get_aio_context() &&
+           ctx != bdrv_get_aio_context(bs) &&
+           !blk->public.throttle_group_member.throttle_state &&
+           bdrv_supports_multiqueue(bs);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1419,6 +1473,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
 {
     BlkAioEmAIOCB *acb;
     Coroutine *co;
+    AioContext *ctx;
 
     blk_inc_in_flight(blk);
     acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
@@ -1433,12 +1488,17 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    if (blk_use_multiqueue(blk)) {
+        ctx = qemu_get_current_aio_context();
+        aio_co_enter(ctx, co);
+    } else {
+        ctx = blk_get_aio_context(blk);
+        bdrv_coroutine_enter(blk_bs(blk), co);
+    }
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
-                                         blk_aio_complete_bh, acb);
+        replay_bh_schedule_oneshot_event(ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -157,6 +157,7 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool io_uring_fixed_files:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -169,6 +170,11 @@ typedef struct BDRVRawState {
     } stats;
 
     PRManager *pr_mgr;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* The node's own ring for the io-uring-* options, see raw_open_io_uring */
+    LuringState *io_uring;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -447,6 +453,24 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-fixed-files",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the image file with io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM with io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "submit io_uring requests from a kernel thread "
+                    "(default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -475,6 +499,80 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * Registered files and SQPOLL are properties of a whole ring, so the
+ * io-uring-* options give the node a ring of its own instead of sharing the
+ * one of its AioContext.
+ */
+static int raw_open_io_uring(BlockDriverState *bs, QemuOpts *opts,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    bool fixed_files = qemu_opt_get_bool(opts, "io-uring-fixed-files", false);
+    bool fixed_buffers = qemu_opt_get_bool(opts, "io-uring-fixed-buffers",
+                                           false);
+    bool sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    int ret;
+
+    if (!fixed_files && !fixed_buffers && !sqpoll) {
+        return 0;
+    }
+    if (!s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed-files, io-uring-fixed-buffers and "
+                   "io-uring-sqpoll require aio=io_uring");
+        return -EINVAL;
+    }
+
+    s->io_uring = luring_init(sqpoll ? LURING_SQPOLL : 0, errp);
+    if (!s->io_uring) {
+        error_prepend(errp, "Unable to use io_uring: ");
+        return -EINVAL;
+    }
+    luring_attach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+
+    /* Before Linux 5.11, the SQPOLL thread only accepts registered files */
+    s->io_uring_fixed_files = fixed_files || sqpoll;
+    if (s->io_uring_fixed_files) {
+        ret = luring_register_file(s->io_uring, s->fd, errp);
+        if (ret < 0) {
+            luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+            luring_cleanup(s->io_uring);
+            s->io_uring = NULL;
+            return ret;
+        }
+    }
+
+    if (fixed_buffers) {
+        luring_register_ram(s->io_uring);
+    }
+    return 0;
+}
+#endif
+
+/* Switch to a new file descriptor for the image, closing the old one */
+static void raw_replace_fd(BlockDriverState *bs, int fd)
+{
+    BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_fixed_files) {
+        Error *local_err = NULL;
+
+        luring_unregister_file(s->io_uring, s->fd);
+        if (luring_register_file(s->io_uring, fd, &local_err) < 0) {
+            error_reportf_err(local_err, "Unable to register the new file "
+                              "descriptor, falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+            s->io_uring_fixed_files = false;
+        }
+    }
+#endif
+
+    qemu_close(s->fd);
+    s->fd = fd;
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -701,6 +799,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    ret = raw_open_io_uring(bs, opts, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+#endif
+
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK;
     if (S_ISREG(st.st_mode)) {
         /* When extending regular files, we get zeros from the OS */
@@ -1056,8 +1161,7 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
-    qemu_close(s->fd);
-    s->fd = rs->fd;
+    raw_replace_fd(state->bs, rs->fd);
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1888,11 +1992,51 @@ out:
     return result;
 }
 
+/*
+ * Requests normally run in the AioContext of @bs, but a multiqueue
+ * BlockBackend may run them in the IOThread that submitted them.  The
+ * thread pool and the native AIO contexts are only safe to use from the
+ * thread that owns them, so pick those of the context we are running in.
+ */
+static AioContext *raw_get_request_context(BlockDriverState *bs)
+{
+    if (qemu_in_coroutine()) {
+        return qemu_coroutine_get_aio_context(qemu_coroutine_self());
+    }
+    return qemu_get_current_aio_context();
+}
+
+#ifdef CONFIG_LINUX_AIO
+/* Returns NULL if the context has no Linux AIO context and can't get one */
+static LinuxAioState *raw_get_linux_aio(BlockDriverState *bs)
+{
+    AioContext *ctx = raw_get_request_context(bs);
+
+    if (ctx == bdrv_get_aio_context(bs)) {
+        return aio_get_linux_aio(ctx);
+    }
+    return aio_setup_linux_aio(ctx, NULL);
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/* Returns NULL if the context has no io_uring and can't get one */
+static LuringState *raw_get_linux_io_uring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    AioContext *ctx = raw_get_request_context(bs);
+
+    if (ctx == bdrv_get_aio_context(bs)) {
+        return s->io_uring ?: aio_get_linux_io_uring(ctx);
+    }
+    return aio_setup_linux_io_uring(ctx, NULL);
+}
+#endif
+
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(raw_get_request_context(bs));
     return thread_pool_submit_co(pool, func, arg);
 }
 
@@ -1901,6 +2045,12 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *ring = NULL;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    LinuxAioState *aio = NULL;
+#endif
 
     if (fd_open(bs) < 0)
         return -EIO;
@@ -1914,14 +2064,13 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    } else if (s->use_linux_io_uring &&
+               (ring = raw_get_linux_io_uring(bs))) {
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return luring_co_submit(bs, ring, s->fd, offset, qiov, type);
 #endif
 #ifdef CONFIG_LINUX_AIO
-    } else if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    } else if (s->use_linux_aio && (aio = raw_get_linux_aio(bs))) {
         assert(qiov->size == bytes);
         return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -1963,14 +2112,18 @@ static void raw_aio_plug(BlockDriverState *bs)
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_plug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
+            laio_io_plug(bs, aio);
+        }
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_plug(bs, aio);
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
     }
 #endif
 }
@@ -1980,14 +2133,18 @@ static void raw_aio_unplug(BlockDriverState *bs)
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_unplug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(bs);
+        if (aio) {
+            laio_io_unplug(bs, aio);
+        }
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_unplug(bs, aio);
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
     }
 #endif
 }
@@ -2011,13 +2168,26 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        LuringState *aio = raw_get_linux_io_uring(bs);
+        if (aio) {
+            return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        }
     }
 #endif
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2033,6 +2203,9 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_attach_aio_context(s->io_uring, new_context);
+    }
     if (s->use_linux_io_uring) {
         Error *local_err;
         if (!aio_setup_linux_io_uring(new_context, &local_err)) {
@@ -2048,6 +2221,15 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+        luring_cleanup(s->io_uring);
+        s->io_uring = NULL;
+        s->io_uring_fixed_files = false;
+    }
+#endif
+
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3013,8 +3195,7 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
-        qemu_close(s->fd);
-        s->fd = s->perm_change_fd;
+        raw_replace_fd(bs, s->perm_change_fd);
         s->open_flags = s->perm_change_flags;
     }
     s->perm_change_fd = 0;
@@ -3090,6 +3271,7 @@ BlockDriver bdrv_file = {
     .protocol_name = "file",
     .instance_size = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe = NULL, /* no probe for protocols */
     .bdrv_parse_filename = raw_parse_filename,
     .bdrv_file_open = raw_open,
@@ -3114,6 +3296,7 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
@@ -3448,7 +3631,7 @@ hdev_co_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
         struct sg_io_hdr *io_hdr = buf;
         if (io_hdr->cmdp[0] == PERSISTENT_RESERVE_OUT ||
             io_hdr->cmdp[0] == PERSISTENT_RESERVE_IN) {
-            return pr_manager_execute(s->pr_mgr, bdrv_get_aio_context(bs),
+            return pr_manager_execute(s->pr_mgr, raw_get_request_context(bs),
                                       s->fd, io_hdr);
         }
     }
@@ -3510,6 +3693,7 @@ static BlockDriver bdrv_host_device = {
     .protocol_name        = "host_device",
     .instance_size      = sizeof(BDRVRawState),
     .bdrv_needs_filename = true,
+    .supports_multiqueue = true,
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_file_open     = hdev_open,
@@ -3532,6 +3716,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
@@ -3656,6 +3841,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
@@ -3788,6 +3974,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
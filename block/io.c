@@ -667,6 +667,21 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/*
+ * (Re-)index @req in bs->tracked_requests_tree by its overlap range.
+ * Zero-length requests are indexed as one byte wide, which is a superset
+ * of what tracked_request_overlaps() considers to overlap them.
+ *
+ * Called with bs->reqs_lock held.
+ */
+static void tracked_request_index(BdrvTrackedRequest *req)
+{
+    req->overlap_node.start = req->overlap_offset;
+    req->overlap_node.last = req->overlap_offset +
+                             MAX(req->overlap_bytes, 1) - 1;
+    interval_tree_insert(&req->bs->tracked_requests_tree, &req->overlap_node);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -680,6 +695,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->bs->tracked_requests_tree, &req->overlap_node);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
@@ -710,6 +726,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_index(req);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
@@ -727,43 +744,51 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
+/* Find a request that @opaque, the current request, has to wait for */
+static bool tracked_request_conflicts(IntervalTreeNode *node, void *opaque)
+{
+    BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                           overlap_node);
+    BdrvTrackedRequest *self = opaque;
+
+    if (req == self || (!req->serialising && !self->serialising)) {
+        return false;
+    }
+    if (!tracked_request_overlaps(req, self->overlap_offset,
+                                  self->overlap_bytes)) {
+        return false;
+    }
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
+}
+
 static bool coroutine_fn
 bdrv_wait_serialising_requests_locked(BlockDriverState *bs,
                                       BdrvTrackedRequest *self)
 {
+    IntervalTreeNode *node;
     BdrvTrackedRequest *req;
-    bool retry;
     bool waited = false;
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue, &bs->reqs_lock);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
-        }
-    } while (retry);
+    while ((node = interval_tree_find(&bs->tracked_requests_tree,
+                                      self->overlap_node.start,
+                                      self->overlap_node.last,
+                                      tracked_request_conflicts, self))) {
+        req = container_of(node, BdrvTrackedRequest, overlap_node);
+        self->waiting_for = req;
+        qemu_co_queue_wait(&req->wait_queue, &bs->reqs_lock);
+        self->waiting_for = NULL;
+        waited = true;
+    }
     return waited;
 }
 
@@ -783,6 +808,11 @@ bool bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    /* The overlap range may have grown, here or in the caller */
+    interval_tree_remove(&bs->tracked_requests_tree, &req->overlap_node);
+    tracked_request_index(req);
+
     waited = bdrv_wait_serialising_requests_locked(bs, req);
     qemu_co_mutex_unlock(&bs->reqs_lock);
     return waited;
@@ -806,6 +836,39 @@ BdrvTrackedRequest *coroutine_fn bdrv_co_get_self_request(BlockDriverState *bs)
     return NULL;
 }
 
+static bool tracked_request_may_write(IntervalTreeNode *node, void *opaque)
+{
+    BdrvTrackedRequest *req = container_of(node, BdrvTrackedRequest,
+                                           overlap_node);
+
+    /* Copy-on-read requests are serialising and write as well */
+    return req->co != opaque &&
+           (req->type != BDRV_TRACKED_READ || req->serialising);
+}
+
+/**
+ * Return whether a request on @bs may modify the range
+ * [@offset, @offset + @bytes) right now.  If @ignore_self is true, the
+ * request of the current coroutine is not taken into account.
+ */
+bool coroutine_fn bdrv_co_has_overlapping_writes(BlockDriverState *bs,
+                                                 int64_t offset,
+                                                 int64_t bytes,
+                                                 bool ignore_self)
+{
+    bool ret;
+
+    qemu_co_mutex_lock(&bs->reqs_lock);
+    ret = interval_tree_find(&bs->tracked_requests_tree, offset,
+                             offset + MAX(bytes, 1) - 1,
+                             tracked_request_may_write,
+                             ignore_self ? qemu_coroutine_self() : NULL)
+          != NULL;
+    qemu_co_mutex_unlock(&bs->reqs_lock);
+
+    return ret;
+}
+
 /**
  * Round a region to cluster boundaries
  */
@@ -839,6 +902,53 @@ static int bdrv_get_cluster_size(BlockDriverState *bs)
     }
 }
 
+/*
+ * Return true if requests to @bs may run in AioContexts other than its
+ * own.  This needs @bs and everything below it to be driven by drivers
+ * that allow it, and none of the per-node features whose request paths
+ * assume a single thread.
+ *
+ * Called with the AioContext lock of @bs held.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue ||
+        atomic_read(&bs->copy_on_read) ||
+        !QLIST_EMPTY(&bs->before_write_notifiers.notifiers)) {
+        return false;
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Tell @bs and the nodes below it that requests from other AioContexts
+ * than their own have stopped, so that they can release the resources they
+ * set up for them.  The AioContexts may be destroyed afterwards.
+ *
+ * Called with @bs drained and its AioContext lock held.
+ */
+void bdrv_drop_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (bs->drv && bs->drv->bdrv_drop_multiqueue) {
+        bs->drv->bdrv_drop_multiqueue(bs);
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_drop_multiqueue(child->bs);
+    }
+}
+
 void bdrv_inc_in_flight(BlockDriverState *bs)
 {
     atomic_inc(&bs->in_flight);
@@ -1764,6 +1874,43 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     return ret;
 }
 
+/*
+ * Read data that @bs does not allocate itself from its backing chain.
+ *
+ * Where the allocation map knows which layer provides the data, the read
+ * is sent to that layer directly instead of passing through each layer in
+ * between.
+ */
+int coroutine_fn bdrv_co_preadv_backing(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes,
+    QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags)
+{
+    assert(bs->backing);
+
+    while (bytes) {
+        BdrvChild *child = NULL;
+        int64_t n;
+        int ret;
+
+        if (!bdrv_alloc_map_lookup(bs, NULL, offset, bytes, &n, NULL, &child) ||
+            !child) {
+            child = bs->backing;
+            n = bytes;
+        }
+
+        ret = bdrv_co_preadv_part(child, offset, n, qiov, qiov_offset, flags);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags)
 {
@@ -1963,6 +2110,12 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
             break;
         }
     }
+
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_alloc_map_reset(bs);
+    } else {
+        bdrv_alloc_map_invalidate(bs, offset, bytes);
+    }
 }
 
 /*
@@ -2473,10 +2626,19 @@ static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
                                                    BlockDriverState **file)
 {
     BlockDriverState *p;
+    BdrvChild *child;
+    int64_t n;
     int ret = 0;
     bool first = true;
 
     assert(bs != base);
+
+    /* Go straight to the right layer if the allocation map knows it */
+    if (bdrv_alloc_map_lookup(bs, base, offset, bytes, &n, NULL, &child)) {
+        p = child ? child->bs : bs;
+        return bdrv_co_block_status(p, want_zero, offset, n, pnum, map, file);
+    }
+
     for (p = bs; p != base; p = backing_bs(p)) {
         ret = bdrv_co_block_status(p, want_zero, offset, bytes, pnum, map,
                                    file);
@@ -2598,6 +2760,16 @@ int bdrv_is_allocated_above(BlockDriverState *top,
 
     assert(base || !include_base);
 
+    if (top != base) {
+        ret = bdrv_alloc_map_lookup(top, include_base ? backing_bs(base) : base,
+                                    offset, bytes, &n, NULL, NULL);
+        if (ret) {
+            *pnum = n;
+            return ret == BDRV_ALLOC_MAP_ALLOCATED;
+        }
+        n = bytes;
+    }
+
     intermediate = top;
     while (include_base || intermediate != base) {
         int64_t pnum_inter;
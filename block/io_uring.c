@@ -16,12 +16,23 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
+#include "exec/cpu-common.h"
+#include "exec/ramlist.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Registered file table size */
+#define MAX_FIXED_FILES 16
+
+/* Kernel limits for registered buffers */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+#define MAX_FIXED_BUFS 1024
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,6 +67,23 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* Registered files, -1 for unused slots.  See luring_register_file(). */
+    bool files_registered;
+    int fixed_files[MAX_FIXED_FILES];
+
+    /*
+     * Guest RAM registered as fixed buffers, sorted by address.  RAMBlock
+     * notifiers bump ram_gen from the main loop; the table is only used
+     * while buf_gen matches it, and is registered again once the ring is
+     * idle.  See luring_register_ram().
+     */
+    bool use_fixed_bufs;
+    RAMBlockNotifier ram_notifier;
+    unsigned int ram_gen;
+    unsigned int buf_gen;
+    struct iovec *fixed_bufs;
+    unsigned int nb_fixed_bufs;
 } LuringState;
 
 /**
@@ -102,10 +130,12 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
                       remaining);
 
-    /* Update sqe */
+    /* Update sqe, a read into a fixed buffer continues as a plain readv */
+    luringcb->sqeq.opcode = IORING_OP_READV;
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+    luringcb->sqeq.buf_index = 0;
 
     luring_resubmit(s, luringcb);
 }
@@ -312,6 +342,187 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/* Returns the registered file index of @fd, or -1 */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int luring_register_file(LuringState *s, int fd, Error **errp)
+{
+    int i, ret;
+
+    if (!s->files_registered) {
+        /* A sparse table that files are added to and removed from */
+        for (i = 0; i < MAX_FIXED_FILES; i++) {
+            s->fixed_files[i] = -1;
+        }
+        ret = io_uring_register_files(&s->ring, s->fixed_files,
+                                      MAX_FIXED_FILES);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to register io_uring files");
+            return ret;
+        }
+        s->files_registered = true;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES && s->fixed_files[i] != -1; i++) {
+        /* Find a free slot */
+    }
+    if (i == MAX_FIXED_FILES) {
+        error_setg(errp, "Too many io_uring registered files");
+        return -ENOSPC;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register io_uring file");
+        return ret;
+    }
+    s->fixed_files[i] = fd;
+    trace_luring_register_file(s, fd, i);
+    return 0;
+}
+
+void luring_unregister_file(LuringState *s, int fd)
+{
+    int i = luring_fixed_file(s, fd);
+    int unused = -1;
+
+    if (i < 0) {
+        return;
+    }
+    io_uring_register_files_update(&s->ring, i, &unused, 1);
+    s->fixed_files[i] = -1;
+    trace_luring_unregister_file(s, fd, i);
+}
+
+static void luring_ram_block_changed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    atomic_inc(&s->ram_gen);
+}
+
+static int luring_collect_ram_block(RAMBlock *rb, void *opaque)
+{
+    GArray *bufs = opaque;
+    uint8_t *host = qemu_ram_get_host_addr(rb);
+    ram_addr_t length = qemu_ram_get_used_length(rb);
+
+    while (host && length) {
+        struct iovec iov = {
+            .iov_base = host,
+            .iov_len = MIN(length, MAX_FIXED_BUF_SIZE),
+        };
+
+        g_array_append_val(bufs, iov);
+        host += iov.iov_len;
+        length -= iov.iov_len;
+    }
+    return 0;
+}
+
+static gint luring_compare_bufs(gconstpointer a, gconstpointer b)
+{
+    const struct iovec *iov_a = a, *iov_b = b;
+
+    if (iov_a->iov_base == iov_b->iov_base) {
+        return 0;
+    }
+    return (uintptr_t)iov_a->iov_base < (uintptr_t)iov_b->iov_base ? -1 : 1;
+}
+
+/* Register the current guest RAM.  No request may use the old table. */
+static void luring_update_fixed_bufs(LuringState *s)
+{
+    GArray *bufs;
+    int ret = 0;
+
+    s->buf_gen = atomic_read(&s->ram_gen);
+    if (s->nb_fixed_bufs) {
+        io_uring_unregister_buffers(&s->ring);
+        g_free(s->fixed_bufs);
+        s->fixed_bufs = NULL;
+        s->nb_fixed_bufs = 0;
+    }
+
+    bufs = g_array_new(FALSE, FALSE, sizeof(struct iovec));
+    qemu_ram_foreach_block(luring_collect_ram_block, bufs);
+    g_array_sort(bufs, luring_compare_bufs);
+    if (bufs->len > MAX_FIXED_BUFS) {
+        g_array_set_size(bufs, MAX_FIXED_BUFS);
+    }
+
+    if (bufs->len) {
+        ret = io_uring_register_buffers(&s->ring, (struct iovec *)bufs->data,
+                                        bufs->len);
+    }
+    trace_luring_register_buffers(s, bufs->len, ret);
+    if (ret < 0) {
+        /* Usually RLIMIT_MEMLOCK, or RAM that is backed by a regular file */
+        warn_report_once("Failed to register guest RAM with io_uring: %s",
+                         strerror(-ret));
+        g_array_free(bufs, TRUE);
+        return;
+    }
+
+    s->nb_fixed_bufs = bufs->len;
+    s->fixed_bufs = (struct iovec *)g_array_free(bufs, FALSE);
+}
+
+/* Returns the index of the registered buffer that holds @iov, or -1 */
+static int luring_fixed_buf(LuringState *s, const struct iovec *iov)
+{
+    uintptr_t start = (uintptr_t)iov->iov_base;
+    unsigned int lo = 0, hi = s->nb_fixed_bufs;
+
+    if (s->buf_gen != atomic_read(&s->ram_gen)) {
+        return -1;
+    }
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        uintptr_t buf_start = (uintptr_t)s->fixed_bufs[mid].iov_base;
+        uintptr_t buf_end = buf_start + s->fixed_bufs[mid].iov_len;
+
+        if (start < buf_start) {
+            hi = mid;
+        } else if (start >= buf_end) {
+            lo = mid + 1;
+        } else {
+            return iov->iov_len <= buf_end - start ? mid : -1;
+        }
+    }
+    return -1;
+}
+
+void luring_register_ram(LuringState *s)
+{
+    if (s->use_fixed_bufs) {
+        return;
+    }
+
+    s->use_fixed_bufs = true;
+    s->ram_notifier.ram_block_added = luring_ram_block_changed;
+    s->ram_notifier.ram_block_removed = luring_ram_block_changed;
+    ram_block_notifier_add(&s->ram_notifier);
+
+    /* Picked up by the first request */
+    atomic_inc(&s->ram_gen);
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -328,15 +539,39 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    int file_index = luring_fixed_file(s, fd);
+    int buf_index = -1;
+
+    /* Buffers can only be registered again while none of them is in use */
+    if (s->use_fixed_bufs && s->buf_gen != atomic_read(&s->ram_gen) &&
+        !s->io_q.in_flight && !s->io_q.in_queue) {
+        luring_update_fixed_bufs(s);
+    }
+
+    if (file_index >= 0) {
+        fd = file_index;
+    }
+    if (qiov && qiov->niov == 1 && s->nb_fixed_bufs) {
+        buf_index = luring_fixed_buf(s, &qiov->iov[0]);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -346,6 +581,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file_index >= 0) {
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -402,15 +640,20 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned int flags, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    unsigned int setup_flags = 0;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (flags & LURING_SQPOLL) {
+        setup_flags |= IORING_SETUP_SQPOLL;
+    }
+
+    rc = io_uring_queue_init(MAX_ENTRIES, ring, setup_flags);
     if (rc < 0) {
         error_setg_errno(errp, errno, "failed to init linux io_uring ring");
         g_free(s);
@@ -424,6 +667,10 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->use_fixed_bufs) {
+        ram_block_notifier_remove(&s->ram_notifier);
+        g_free(s->fixed_bufs);
+    }
     io_uring_queue_exit(&s->ring);
     g_free(s);
     trace_luring_cleanup_state(s);
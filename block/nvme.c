@@ -32,6 +32,8 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+/* Admin queue plus up to one I/O queue per submitting AioContext */
+#define NVME_MAX_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -39,6 +41,9 @@
  */
 #define NVME_NUM_REQS (NVME_QUEUE_SIZE - 1)
 
+#define INDEX_ADMIN     0
+#define INDEX_IO(n)     (1 + (n))
+
 typedef struct BDRVNVMeState BDRVNVMeState;
 
 typedef struct {
@@ -64,6 +69,13 @@ typedef struct {
     /* Read from I/O code path, initialized under BQL */
     BDRVNVMeState   *s;
     int             index;
+    /*
+     * The AioContext that processes completions.  INDEX_IO(0) follows the
+     * AioContext of the BDS, the other I/O queues are bound to the IOThread
+     * that uses them, or to none, and have an MSI-X vector of their own.
+     */
+    AioContext      *aio_context;
+    EventNotifier   irq_notifier;
 
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
@@ -76,6 +88,7 @@ typedef struct {
     NVMeRequest reqs[NVME_NUM_REQS];
     int         need_kick;
     int         inflight;
+    bool        plugged;
 
     /* Thread-safe, no lock necessary */
     QEMUBH      *completion_bh;
@@ -110,9 +123,14 @@ struct BDRVNVMeState {
     /* The submission/completion queue pairs.
      * [0]: admin queue.
      * [1..]: io queues.
+     * Queues are only ever added, so that the I/O path can look them up
+     * without a lock; @queue_lock serializes the creation of new ones and
+     * the binding of idle ones to an IOThread.
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    int max_queues;
+    CoMutex queue_lock;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -124,7 +142,6 @@ struct BDRVNVMeState {
     int blkshift;
 
     uint64_t max_transfer;
-    bool plugged;
 
     bool supports_write_zeroes;
     bool supports_discard;
@@ -207,6 +224,7 @@ static void nvme_free_req_queue_cb(void *opaque)
 }
 
 static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
+                                             AioContext *aio_context,
                                              int idx, int size,
                                              Error **errp)
 {
@@ -219,10 +237,10 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
     qemu_mutex_init(&q->lock);
     q->s = s;
     q->index = idx;
+    q->aio_context = aio_context;
     qemu_co_queue_init(&q->free_req_queue);
     q->prp_list_pages = qemu_blockalign0(bs, s->page_size * NVME_NUM_REQS);
-    q->completion_bh = aio_bh_new(bdrv_get_aio_context(bs),
-                                  nvme_process_completion_bh, q);
+    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages,
                           s->page_size * NVME_NUM_REQS,
                           false, &prp_list_iova);
@@ -264,7 +282,7 @@ static void nvme_kick(NVMeQueuePair *q)
 {
     BDRVNVMeState *s = q->s;
 
-    if (s->plugged || !q->need_kick) {
+    if (q->plugged || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -315,7 +333,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(q->aio_context,
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -361,7 +379,7 @@ static bool nvme_process_completion(NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (s->plugged) {
+    if (q->plugged) {
         trace_nvme_process_completion_queue_plugged(s, q->index);
         return false;
     }
@@ -430,11 +448,13 @@ static void nvme_process_completion_bh(void *opaque)
      * called aio_poll(). The callback may be waiting for further completions
      * so notify the device that it has space to fill in more completions now.
      */
+    qemu_mutex_lock(&q->lock);
     smp_mb_release();
     *q->cq.doorbell = cpu_to_le32(q->cq.head);
     nvme_wake_free_req_locked(q);
 
     nvme_process_completion(q);
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_trace_command(const NvmeCmd *cmd)
@@ -465,7 +485,13 @@ static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
     q->sq.tail = (q->sq.tail + 1) % NVME_QUEUE_SIZE;
     q->need_kick++;
     nvme_kick(q);
-    nvme_process_completion(q);
+    /*
+     * IOThreads without a queue of their own submit to INDEX_IO(0); leave
+     * its completions to the thread that polls it.
+     */
+    if (q->aio_context == qemu_get_current_aio_context()) {
+        nvme_process_completion(q);
+    }
     qemu_mutex_unlock(&q->lock);
 }
 
@@ -491,6 +517,57 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     return ret;
 }
 
+typedef struct {
+    Coroutine *co;
+    int ret;
+    AioContext *ctx;
+} NVMeCoData;
+
+static void nvme_rw_cb_bh(void *opaque)
+{
+    NVMeCoData *data = opaque;
+    qemu_coroutine_enter(data->co);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+    data->ret = ret;
+    /*
+     * The completion may be processed by another thread, so always go
+     * through a BH; it cannot run before the coroutine has yielded.
+     */
+    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+}
+
+/* Submit @cmd and wait for it to complete in the current AioContext */
+static coroutine_fn int nvme_co_submit(NVMeQueuePair *q, NVMeRequest *req,
+                                       NvmeCmd *cmd)
+{
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_coroutine_get_aio_context(qemu_coroutine_self()),
+        .ret = -EINPROGRESS,
+    };
+
+    nvme_submit_command(q, req, cmd, nvme_rw_cb, &data);
+    qemu_coroutine_yield();
+    assert(data.ret != -EINPROGRESS);
+    return data.ret;
+}
+
+/* Run an admin command, waiting for it in whatever way the caller can */
+static int nvme_admin_cmd(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *q = s->queues[INDEX_ADMIN];
+
+    if (qemu_in_coroutine()) {
+        return nvme_co_submit(q, nvme_get_free_req(q), cmd);
+    }
+    return nvme_cmd_sync(bs, q, cmd);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -520,7 +597,7 @@ static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
     }
     cmd.prp1 = cpu_to_le64(iova);
 
-    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
         error_setg(errp, "Failed to identify controller");
         goto out;
     }
@@ -544,7 +621,7 @@ static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 
     cmd.cdw10 = 0;
     cmd.nsid = cpu_to_le32(namespace);
-    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+    if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
         error_setg(errp, "Failed to identify namespace");
         goto out;
     }
@@ -577,31 +654,38 @@ out:
     qemu_vfree(resp);
 }
 
+static bool nvme_poll_queue(NVMeQueuePair *q)
+{
+    bool progress = false;
+    const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
+    NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
+
+    /*
+     * Do an early check for completions. q->lock isn't needed because
+     * nvme_process_completion() only runs in the event loop thread of the
+     * queue and cannot race with itself.
+     */
+    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+        return false;
+    }
+
+    qemu_mutex_lock(&q->lock);
+    while (nvme_process_completion(q)) {
+        /* Keep polling */
+        progress = true;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return progress;
+}
+
+/* The admin queue and INDEX_IO(0) share MSI-X vector 0 */
 static bool nvme_poll_queues(BDRVNVMeState *s)
 {
     bool progress = false;
     int i;
 
-    for (i = 0; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
-        NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
-
-        /*
-         * Do an early check for completions. q->lock isn't needed because
-         * nvme_process_completion() only runs in the event loop thread and
-         * cannot race with itself.
-         */
-        if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
-            continue;
-        }
-
-        qemu_mutex_lock(&q->lock);
-        while (nvme_process_completion(q)) {
-            /* Keep polling */
-            progress = true;
-        }
-        qemu_mutex_unlock(&q->lock);
+    for (i = INDEX_ADMIN; i <= INDEX_IO(0) && i < s->nr_queues; i++) {
+        progress |= nvme_poll_queue(s->queues[i]);
     }
     return progress;
 }
@@ -615,28 +699,63 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+static void nvme_handle_queue_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_handle_queue_event(q->s, q->index);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_queue_poll_cb(q->s, q->index);
+    return nvme_poll_queue(q);
+}
+
+/*
+ * Create the next I/O queue pair and have its completions processed in
+ * @aio_context.  May be called from a coroutine running in @aio_context.
+ */
+static bool nvme_add_io_queue(BlockDriverState *bs, AioContext *aio_context,
+                              Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int n = s->nr_queues;
+    int vector = n - INDEX_IO(0);
     NVMeQueuePair *q;
     NvmeCmd cmd;
     int queue_size = NVME_QUEUE_SIZE;
 
-    q = nvme_create_queue_pair(bs, n, queue_size, errp);
+    trace_nvme_add_io_queue(s, n, aio_context);
+    q = nvme_create_queue_pair(bs, aio_context, n, queue_size, errp);
     if (!q) {
         return false;
     }
+    if (vector) {
+        if (event_notifier_init(&q->irq_notifier, 0)) {
+            error_setg(errp, "Failed to init event notifier");
+            nvme_free_queue_pair(q);
+            return false;
+        }
+        if (qemu_vfio_pci_set_irq(s->vfio, &q->irq_notifier,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, vector, errp)) {
+            goto fail;
+        }
+    }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
-        .cdw11 = cpu_to_le32(0x3),
+        .cdw11 = cpu_to_le32((vector << 16) | 0x3),
     };
-    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
-        nvme_free_queue_pair(q);
-        return false;
+        goto fail;
     }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_SQ,
@@ -644,15 +763,134 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
         .cdw11 = cpu_to_le32(0x1 | (n << 16)),
     };
-    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+    if (nvme_admin_cmd(bs, &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
-        nvme_free_queue_pair(q);
-        return false;
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n & 0xFFFF),
+        };
+        nvme_admin_cmd(bs, &cmd);
+        goto fail;
+    }
+    if (vector) {
+        aio_set_event_notifier(aio_context, &q->irq_notifier, false,
+                               nvme_handle_queue_event, nvme_queue_poll_cb);
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
-    s->nr_queues++;
+    atomic_store_release(&s->nr_queues, n + 1);
     return true;
+
+fail:
+    if (vector) {
+        qemu_vfio_pci_set_irq(s->vfio, NULL, VFIO_PCI_MSIX_IRQ_INDEX, vector,
+                              NULL);
+        event_notifier_cleanup(&q->irq_notifier);
+    }
+    nvme_free_queue_pair(q);
+    return false;
+}
+
+/*
+ * Move an I/O queue other than INDEX_IO(0) to the IOThread @ctx, or unbind
+ * it from any with @ctx == NULL.  The queue must be idle: this is called
+ * under s->queue_lock for a queue that is not bound, or with the node
+ * drained.
+ */
+static void nvme_bind_queue(NVMeQueuePair *q, AioContext *ctx)
+{
+    AioContext *old_ctx = q->aio_context;
+
+    if (old_ctx) {
+        aio_set_event_notifier(old_ctx, &q->irq_notifier, false, NULL, NULL);
+    }
+
+    qemu_mutex_lock(&q->lock);
+    if (q->completion_bh) {
+        qemu_bh_delete(q->completion_bh);
+        q->completion_bh = NULL;
+    }
+    if (ctx) {
+        q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+    }
+    atomic_set(&q->aio_context, ctx);
+    qemu_mutex_unlock(&q->lock);
+
+    if (ctx) {
+        aio_set_event_notifier(ctx, &q->irq_notifier, false,
+                               nvme_handle_queue_event, nvme_queue_poll_cb);
+    }
+    trace_nvme_bind_queue(q->s, q->index, old_ctx, ctx);
+}
+
+/* Unbind the I/O queues of the IOThreads, which may be about to go away */
+static void nvme_unbind_queues(BDRVNVMeState *s)
+{
+    int i;
+
+    for (i = INDEX_IO(1); i < s->nr_queues; i++) {
+        if (s->queues[i]->aio_context) {
+            nvme_bind_queue(s->queues[i], NULL);
+        }
+    }
+}
+
+/* Returns NULL if @ctx has no I/O queue of its own yet */
+static NVMeQueuePair *nvme_find_queue(BDRVNVMeState *s, AioContext *ctx)
+{
+    int i, n;
+
+    if (ctx == s->aio_context) {
+        return s->queues[INDEX_IO(0)];
+    }
+    n = atomic_load_acquire(&s->nr_queues);
+    for (i = INDEX_IO(1); i < n; i++) {
+        if (atomic_read(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Return the I/O queue for a request running in the current AioContext.
+ * With a multiqueue BlockBackend, each IOThread that submits requests gets
+ * a queue pair of its own the first time it does so, reusing one that was
+ * unbound if possible.  Queues are unbound when the node changes AioContext
+ * or a BlockBackend stops multiqueue, so none outlives its IOThread.  When
+ * the controller runs out of queues or interrupt vectors, the remaining
+ * IOThreads share INDEX_IO(0) and are woken up through a BH.
+ */
+static coroutine_fn NVMeQueuePair *nvme_get_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_coroutine_get_aio_context(qemu_coroutine_self());
+    NVMeQueuePair *q;
+    Error *local_err = NULL;
+
+    q = nvme_find_queue(s, ctx);
+    if (q) {
+        return q;
+    }
+
+    qemu_co_mutex_lock(&s->queue_lock);
+    q = nvme_find_queue(s, ctx);
+    if (!q) {
+        q = nvme_find_queue(s, NULL);
+        if (q) {
+            nvme_bind_queue(q, ctx);
+        }
+    }
+    if (!q && s->nr_queues < s->max_queues) {
+        if (nvme_add_io_queue(bs, ctx, &local_err)) {
+            q = s->queues[s->nr_queues - 1];
+        } else {
+            warn_reportf_err(local_err, "nvme: sharing I/O queues: ");
+            s->max_queues = s->nr_queues;
+        }
+    }
+    qemu_co_mutex_unlock(&s->queue_lock);
+
+    return q ?: s->queues[INDEX_IO(0)];
 }
 
 static bool nvme_poll_cb(void *opaque)
@@ -675,6 +913,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     Error *local_err = NULL;
 
     qemu_co_mutex_init(&s->dma_map_lock);
+    qemu_co_mutex_init(&s->queue_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
     s->device = g_strdup(device);
     s->nsid = namespace;
@@ -727,17 +966,19 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
-    s->queues[0] = nvme_create_queue_pair(bs, 0, NVME_QUEUE_SIZE, errp);
-    if (!s->queues[0]) {
+    s->queues = g_new0(NVMeQueuePair *, NVME_MAX_QUEUES);
+    s->queues[INDEX_ADMIN] = nvme_create_queue_pair(bs, s->aio_context,
+                                                    INDEX_ADMIN,
+                                                    NVME_QUEUE_SIZE, errp);
+    if (!s->queues[INDEX_ADMIN]) {
         ret = -EINVAL;
         goto out;
     }
     s->nr_queues = 1;
     QEMU_BUILD_BUG_ON(NVME_QUEUE_SIZE & 0xF000);
     s->regs->aqa = cpu_to_le32((NVME_QUEUE_SIZE << 16) | NVME_QUEUE_SIZE);
-    s->regs->asq = cpu_to_le64(s->queues[0]->sq.iova);
-    s->regs->acq = cpu_to_le64(s->queues[0]->cq.iova);
+    s->regs->asq = cpu_to_le64(s->queues[INDEX_ADMIN]->sq.iova);
+    s->regs->acq = cpu_to_le64(s->queues[INDEX_ADMIN]->cq.iova);
 
     /* After setting up all control registers we can enable device now. */
     s->regs->cc = cpu_to_le32((ctz32(NVME_CQ_ENTRY_BYTES) << 20) |
@@ -756,11 +997,21 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
-    if (ret) {
+    /*
+     * Vector 0 serves the admin queue and the first I/O queue, every further
+     * I/O queue needs one more vector and a doorbell pair in the BAR.
+     */
+    ret = qemu_vfio_pci_init_irqs(s->vfio, &s->irq_notifier,
+                                  VFIO_PCI_MSIX_IRQ_INDEX,
+                                  NVME_MAX_QUEUES - INDEX_IO(0), errp);
+    if (ret < 0) {
         goto out;
     }
+    s->max_queues = MIN(INDEX_IO(ret), NVME_MAX_QUEUES);
+    s->max_queues = MIN(s->max_queues,
+                        (NVME_BAR_SIZE - offsetof(NVMeRegs, doorbells)) /
+                        (2 * s->doorbell_scale * sizeof(uint32_t)));
+    ret = 0;
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
 
@@ -771,8 +1022,26 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    /*
+     * Ask for as many I/O queues as we may create; IOThreads share the
+     * first one if the controller does not grant them.
+     */
+    if (s->max_queues > INDEX_IO(1)) {
+        uint32_t nr_io_queues = s->max_queues - INDEX_IO(0);
+        NvmeCmd cmd = {
+            .opcode = NVME_ADM_CMD_SET_FEATURES,
+            .cdw10 = cpu_to_le32(0x07),
+            .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) |
+                                 (nr_io_queues - 1)),
+        };
+
+        if (nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd)) {
+            s->max_queues = INDEX_IO(1);
+        }
+    }
+
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queue(bs, s->aio_context, errp)) {
         ret = -EIO;
     }
 out:
@@ -828,7 +1097,7 @@ static int nvme_enable_disable_write_cache(BlockDriverState *bs, bool enable,
         .cdw11 = cpu_to_le32(enable ? 0x01 : 0x00),
     };
 
-    ret = nvme_cmd_sync(bs, s->queues[0], &cmd);
+    ret = nvme_cmd_sync(bs, s->queues[INDEX_ADMIN], &cmd);
     if (ret) {
         error_setg(errp, "Failed to configure NVMe write cache");
     }
@@ -841,7 +1110,15 @@ static void nvme_close(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (i = 0; i < s->nr_queues; ++i) {
-        nvme_free_queue_pair(s->queues[i]);
+        NVMeQueuePair *q = s->queues[i];
+
+        if (i >= INDEX_IO(1)) {
+            if (q->aio_context) {
+                nvme_bind_queue(q, NULL);
+            }
+            event_notifier_cleanup(&q->irq_notifier);
+        }
+        nvme_free_queue_pair(q);
     }
     g_free(s->queues);
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
@@ -1014,29 +1291,6 @@ fail:
     return r;
 }
 
-typedef struct {
-    Coroutine *co;
-    int ret;
-    AioContext *ctx;
-} NVMeCoData;
-
-static void nvme_rw_cb_bh(void *opaque)
-{
-    NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
-}
-
-static void nvme_rw_cb(void *opaque, int ret)
-{
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
-    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
-}
-
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
                                             uint64_t offset, uint64_t bytes,
                                             QEMUIOVector *qiov,
@@ -1045,7 +1299,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1057,10 +1311,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
         .cdw12 = cpu_to_le32(cdw12),
     };
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
+    int ret;
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
     assert(s->nr_queues > 1);
@@ -1074,12 +1325,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         nvme_put_free_req_and_wake(ioq, req);
         return r;
     }
-    nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    ret = nvme_co_submit(ioq, req, &cmd);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     r = nvme_cmd_unmap_qiov(bs, qiov);
@@ -1088,8 +1334,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         return r;
     }
 
-    trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
-    return data.ret;
+    trace_nvme_rw_done(s, is_write, offset, bytes, ret);
+    return ret;
 }
 
 static inline bool nvme_qiov_aligned(BlockDriverState *bs,
@@ -1160,28 +1406,17 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_queue(bs);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
 
     assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
-    nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    if (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
-
-    return data.ret;
+    return nvme_co_submit(ioq, req, &cmd);
 }
 
 
@@ -1191,8 +1426,9 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
+    int ret;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
 
@@ -1207,11 +1443,6 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
     };
 
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
-
     if (flags & BDRV_REQ_MAY_UNMAP) {
         cdw12 |= (1 << 25);
     }
@@ -1224,18 +1455,14 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
 
     trace_nvme_write_zeroes(s, offset, bytes, flags);
     assert(s->nr_queues > 1);
+    ioq = nvme_get_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
-    nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
+    ret = nvme_co_submit(ioq, req, &cmd);
 
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
-
-    trace_nvme_rw_done(s, true, offset, bytes, data.ret);
-    return data.ret;
+    trace_nvme_rw_done(s, true, offset, bytes, ret);
+    return ret;
 }
 
 
@@ -1244,11 +1471,11 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq;
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
-    int ret;
+    int ret, r;
 
     NvmeCmd cmd = {
         .opcode = NVME_CMD_DSM,
@@ -1257,11 +1484,6 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         .cdw11 = cpu_to_le32(1 << 2), /*deallocate bit*/
     };
 
-    NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
-        .ret = -EINPROGRESS,
-    };
-
     if (!s->supports_discard) {
         return -ENOTSUP;
     }
@@ -1280,6 +1502,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     qemu_iovec_init(&local_qiov, 1);
     qemu_iovec_add(&local_qiov, buf, 4096);
 
+    ioq = nvme_get_queue(bs);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1294,12 +1517,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
 
     trace_nvme_dsm(s, offset, bytes);
 
-    nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    r = nvme_co_submit(ioq, req, &cmd);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
@@ -1309,7 +1527,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
         goto out;
     }
 
-    ret = data.ret;
+    ret = r;
     trace_nvme_dsm_done(s, offset, bytes, ret);
 out:
     qemu_iovec_destroy(&local_qiov);
@@ -1346,7 +1564,8 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
-    for (int i = 0; i < s->nr_queues; i++) {
+    nvme_unbind_queues(s);
+    for (int i = INDEX_ADMIN; i <= INDEX_IO(0) && i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
 
         qemu_bh_delete(q->completion_bh);
@@ -1366,32 +1585,58 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     aio_set_event_notifier(new_context, &s->irq_notifier,
                            false, nvme_handle_event, nvme_poll_cb);
 
-    for (int i = 0; i < s->nr_queues; i++) {
+    for (int i = INDEX_ADMIN; i <= INDEX_IO(0) && i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        q->aio_context = new_context;
         q->completion_bh =
             aio_bh_new(new_context, nvme_process_completion_bh, q);
     }
 }
 
+static void nvme_drop_multiqueue(BlockDriverState *bs)
+{
+    nvme_unbind_queues(bs->opaque);
+}
+
+/* Batch the doorbell writes of the calling thread's queue until unplug */
 static void nvme_aio_plug(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    assert(!s->plugged);
-    s->plugged = true;
+    NVMeQueuePair *q = nvme_find_queue(s, qemu_get_current_aio_context());
+
+    if (q) {
+        qemu_mutex_lock(&q->lock);
+        q->plugged = true;
+        qemu_mutex_unlock(&q->lock);
+    }
 }
 
+/*
+ * bdrv_io_unplug() only calls this for the last unplug of the node, which
+ * with a multiqueue BlockBackend may come from a different IOThread than
+ * the plug.  Kick every plugged queue, but leave completions to the event
+ * loop that owns the queue.
+ */
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
     int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    s->plugged = false;
-    for (i = 1; i < s->nr_queues; i++) {
+    AioContext *ctx = qemu_get_current_aio_context();
+    int nr_queues = atomic_load_acquire(&s->nr_queues);
+
+    for (i = INDEX_IO(0); i < nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
         qemu_mutex_lock(&q->lock);
-        nvme_kick(q);
-        nvme_process_completion(q);
+        if (q->plugged) {
+            q->plugged = false;
+            nvme_kick(q);
+            if (q->aio_context == ctx) {
+                nvme_process_completion(q);
+            } else if (q->completion_bh) {
+                qemu_bh_schedule(q->completion_bh);
+            }
+        }
         qemu_mutex_unlock(&q->lock);
     }
 }
@@ -1428,6 +1673,7 @@ static BlockDriver bdrv_nvme = {
     .format_name              = "nvme",
     .protocol_name            = "nvme",
     .instance_size            = sizeof(BDRVNVMeState),
+    .supports_multiqueue      = true,
 
     .bdrv_co_create_opts      = bdrv_co_create_opts_simple,
     .create_opts              = &bdrv_create_opts_simple,
@@ -1453,6 +1699,7 @@ static BlockDriver bdrv_nvme = {
 
     .bdrv_detach_aio_context  = nvme_detach_aio_context,
     .bdrv_attach_aio_context  = nvme_attach_aio_context,
+    .bdrv_drop_multiqueue     = nvme_drop_multiqueue,
 
     .bdrv_io_plug             = nvme_aio_plug,
     .bdrv_io_unplug           = nvme_aio_unplug,
@@ -466,6 +466,8 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
     ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
     ds->unmap_merged = stats->merged[BLOCK_ACCT_UNMAP];
+    ds->rd_merged_cross_queue = stats->merged_cross_queue[BLOCK_ACCT_READ];
+    ds->wr_merged_cross_queue = stats->merged_cross_queue[BLOCK_ACCT_WRITE];
     ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
     ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
     ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
@@ -734,6 +734,86 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     return 0;
 }
 
+/*
+ * qcow2_get_l2_entry
+ *
+ * Stores the raw L2 entry for the guest cluster at @offset in *l2_entry,
+ * or 0 if there is no L2 table for it.  Unlike get_cluster_table(), this
+ * does not allocate anything.
+ *
+ * Return 0 on success and -errno in error cases
+ */
+int qcow2_get_l2_entry(BlockDriverState *bs, uint64_t offset,
+                       uint64_t *l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset;
+    uint64_t *l2_slice;
+    int ret;
+
+    l1_index = offset_to_l1_index(s, offset);
+    l2_offset = l1_index < s->l1_size ?
+                s->l1_table[l1_index] & L1E_OFFSET_MASK : 0;
+    if (!l2_offset) {
+        *l2_entry = 0;
+        return 0;
+    }
+
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#" PRIx64
+                                " unaligned (L1 index: %#" PRIx64 ")",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *l2_entry = be64_to_cpu(l2_slice[offset_to_l2_slice_index(s, offset)]);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
+/*
+ * qcow2_set_l2_entry
+ *
+ * Replaces the L2 entry for the guest cluster at @offset with @l2_entry,
+ * allocating or copying the L2 table if needed.  The caller is responsible
+ * for the refcounts of the old and the new cluster.
+ *
+ * Return 0 on success and -errno in error cases
+ */
+int qcow2_set_l2_entry(BlockDriverState *bs, uint64_t offset,
+                       uint64_t l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    int l2_index;
+    int ret;
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    l2_slice[l2_index] = cpu_to_be64(l2_entry);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
 /*
  * alloc_compressed_cluster_offset
  *
@@ -0,0 +1,612 @@
+/*
+ * Deduplication of data clusters for the QCOW version 2 format
+ *
+ * When deduplication is enabled, every full cluster that is written is
+ * fingerprinted with SHA-256.  If a cluster with the same fingerprint has
+ * been written before, the guest cluster is pointed at the existing host
+ * cluster and its refcount is increased, instead of writing the data again.
+ * Shared clusters have no QCOW_OFLAG_COPIED, so the next write to either
+ * of the guest clusters copies it, just like clusters shared with internal
+ * snapshots.
+ *
+ * The fingerprint index is bounded in size; least recently used
+ * fingerprints are dropped first.  It is written to the image when the image
+ * is closed or inactivated, and loaded again when it is opened with
+ * deduplication enabled.  Its entries are only hints: the data in the host
+ * cluster is always read back and compared before a cluster is shared, so
+ * stale entries are harmless, and a stored index that a program without
+ * deduplication support may have modified is simply dropped.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Number of stored index entries that are read or written at once */
+#define DEDUP_INDEX_CHUNK 1024
+
+typedef struct Qcow2DedupEntry {
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    uint64_t host_offset;
+    /* A guest cluster that was mapped to @host_offset */
+    uint64_t guest_offset;
+    QTAILQ_ENTRY(Qcow2DedupEntry) next;
+} Qcow2DedupEntry;
+
+struct Qcow2DedupIndex {
+    /* Digest -> Qcow2DedupEntry */
+    GHashTable *entries;
+    /* Most recently used first */
+    QTAILQ_HEAD(, Qcow2DedupEntry) lru;
+    uint64_t max_entries;
+    /* The index differs from the copy stored in the image */
+    bool dirty;
+};
+
+static guint dedup_digest_hash(gconstpointer key)
+{
+    guint hash;
+
+    /* SHA-256 output is uniformly distributed already */
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean dedup_digest_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_DIGEST_SIZE);
+}
+
+static void dedup_remove(Qcow2DedupIndex *index, const uint8_t *digest)
+{
+    Qcow2DedupEntry *e = g_hash_table_lookup(index->entries, digest);
+
+    if (e) {
+        QTAILQ_REMOVE(&index->lru, e, next);
+        g_hash_table_remove(index->entries, e->digest);
+        index->dirty = true;
+    }
+}
+
+/*
+ * Enable deduplication with room for @index_size fingerprints, or change
+ * the size of the index if it is enabled already.
+ */
+void qcow2_dedup_init(BlockDriverState *bs, uint64_t index_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *index = s->dedup;
+
+    assert(index_size > 0);
+
+    if (!index) {
+        index = g_new0(Qcow2DedupIndex, 1);
+        index->entries = g_hash_table_new_full(dedup_digest_hash,
+                                               dedup_digest_equal,
+                                               NULL, g_free);
+        QTAILQ_INIT(&index->lru);
+        s->dedup = index;
+    }
+
+    index->max_entries = index_size;
+    while (g_hash_table_size(index->entries) > index->max_entries) {
+        dedup_remove(index, QTAILQ_LAST(&index->lru)->digest);
+    }
+}
+
+void qcow2_dedup_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup) {
+        g_hash_table_destroy(s->dedup->entries);
+        g_free(s->dedup);
+        s->dedup = NULL;
+    }
+}
+
+/*
+ * Fill the fingerprint index from the copy stored in the image.  The
+ * entries are only hints, so entries that cannot be read or make no sense
+ * are skipped.
+ */
+void qcow2_dedup_load(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *index = s->dedup;
+    Qcow2DedupIndexEntry *buf;
+    Qcow2DedupEntry *e;
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t host_offset, guest_offset;
+    uint32_t i, j, n;
+    int ret = 0;
+
+    if (!index || !s->dedup_index_entries) {
+        return;
+    }
+
+    buf = g_new(Qcow2DedupIndexEntry, DEDUP_INDEX_CHUNK);
+    for (i = 0; i < s->dedup_index_entries; i += n) {
+        n = MIN(s->dedup_index_entries - i, DEDUP_INDEX_CHUNK);
+        ret = bdrv_pread(bs->file,
+                         s->dedup_index_offset + (uint64_t)i * sizeof(*buf),
+                         buf, n * sizeof(*buf));
+        if (ret < 0) {
+            break;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (g_hash_table_size(index->entries) >= index->max_entries) {
+                goto out;
+            }
+
+            host_offset = be64_to_cpu(buf[j].host_offset);
+            guest_offset = be64_to_cpu(buf[j].guest_offset);
+            if (!host_offset || offset_into_cluster(s, host_offset) ||
+                offset_into_cluster(s, guest_offset) ||
+                guest_offset >= disk_size ||
+                g_hash_table_contains(index->entries, buf[j].digest)) {
+                continue;
+            }
+
+            e = g_new(Qcow2DedupEntry, 1);
+            memcpy(e->digest, buf[j].digest, sizeof(e->digest));
+            e->host_offset = host_offset;
+            e->guest_offset = guest_offset;
+            g_hash_table_insert(index->entries, e->digest, e);
+            /* The stored entries are most recently used first */
+            QTAILQ_INSERT_TAIL(&index->lru, e, next);
+        }
+    }
+
+out:
+    g_free(buf);
+    trace_qcow2_dedup_load(bs, g_hash_table_size(index->entries),
+                           MIN(ret, 0));
+}
+
+/*
+ * Write the fingerprint index to the image, so that it is still there when
+ * the image is opened with deduplication again.  The previous copy is only
+ * freed once the image header refers to the new one.
+ */
+int qcow2_dedup_store(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *index = s->dedup;
+    Qcow2DedupIndexEntry *buf;
+    Qcow2DedupEntry *e;
+    uint32_t old_entries = s->dedup_index_entries;
+    uint64_t old_offset = s->dedup_index_offset;
+    uint64_t old_autoclear = s->autoclear_features;
+    uint64_t size, done = 0;
+    uint32_t nb_entries, n = 0;
+    int64_t offset = 0;
+    int ret = 0;
+
+    /* Version 2 images have no autoclear bit to protect the stored index */
+    if (!index || !index->dirty || bs->read_only || s->qcow_version < 3) {
+        return 0;
+    }
+
+    nb_entries = g_hash_table_size(index->entries);
+    size = (uint64_t)nb_entries * sizeof(*buf);
+    if (!nb_entries && !old_entries) {
+        index->dirty = false;
+        return 0;
+    }
+
+    if (nb_entries) {
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            error_setg_errno(errp, -offset, "Failed to allocate clusters for "
+                             "the deduplication index");
+            return offset;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Deduplication index overlaps with "
+                             "metadata");
+            goto fail;
+        }
+
+        buf = g_new(Qcow2DedupIndexEntry, DEDUP_INDEX_CHUNK);
+        QTAILQ_FOREACH(e, &index->lru, next) {
+            memcpy(buf[n].digest, e->digest, sizeof(buf[n].digest));
+            buf[n].host_offset = cpu_to_be64(e->host_offset);
+            buf[n].guest_offset = cpu_to_be64(e->guest_offset);
+            if (++n == DEDUP_INDEX_CHUNK || !QTAILQ_NEXT(e, next)) {
+                ret = bdrv_pwrite(bs->file, offset + done, buf,
+                                  n * sizeof(*buf));
+                if (ret < 0) {
+                    break;
+                }
+                done += n * sizeof(*buf);
+                n = 0;
+            }
+        }
+        g_free(buf);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write the deduplication "
+                             "index");
+            goto fail;
+        }
+
+        /* The header must not refer to clusters that are not allocated yet */
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to flush the refcount block "
+                             "cache");
+            goto fail;
+        }
+    }
+
+    s->dedup_index_entries = nb_entries;
+    s->dedup_index_offset = offset;
+    if (nb_entries) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP_INDEX;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP_INDEX;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_index_entries = old_entries;
+        s->dedup_index_offset = old_offset;
+        s->autoclear_features = old_autoclear;
+        error_setg_errno(errp, -ret, "Failed to update the image header");
+        goto fail;
+    }
+
+    if (old_entries) {
+        qcow2_free_clusters(bs, old_offset,
+                            (uint64_t)old_entries * sizeof(*buf),
+                            QCOW2_DISCARD_OTHER);
+    }
+    index->dirty = false;
+    return 0;
+
+fail:
+    if (nb_entries) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+    return ret;
+}
+
+int qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                void **refcount_table,
+                                int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->dedup_index_entries) {
+        return 0;
+    }
+
+    return qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                    refcount_table_size,
+                                    s->dedup_index_offset,
+                                    (uint64_t)s->dedup_index_entries *
+                                    sizeof(Qcow2DedupIndexEntry));
+}
+
+void qcow2_dedup_insert(BlockDriverState *bs, const Qcow2DedupDigest *digest,
+                        uint64_t host_offset, uint64_t guest_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *index = s->dedup;
+    Qcow2DedupEntry *e;
+
+    if (!index || !digest->valid) {
+        return;
+    }
+
+    e = g_hash_table_lookup(index->entries, digest->data);
+    if (e) {
+        QTAILQ_REMOVE(&index->lru, e, next);
+    } else {
+        if (g_hash_table_size(index->entries) >= index->max_entries) {
+            Qcow2DedupEntry *last = QTAILQ_LAST(&index->lru);
+            dedup_remove(index, last->digest);
+        }
+        e = g_new(Qcow2DedupEntry, 1);
+        memcpy(e->digest, digest->data, sizeof(e->digest));
+        g_hash_table_insert(index->entries, e->digest, e);
+    }
+
+    e->host_offset = host_offset;
+    e->guest_offset = guest_offset;
+    QTAILQ_INSERT_HEAD(&index->lru, e, next);
+    index->dirty = true;
+}
+
+/*
+ * Take a reference to the host cluster at @host_offset, so that it can
+ * neither be freed nor be written in place while its data is compared.
+ *
+ * If it has a single reference, this must be the guest cluster at
+ * @guest_offset, whose QCOW_OFLAG_COPIED is cleared to make further writes
+ * to it allocate a new cluster.
+ *
+ * Returns 1 if the reference has been taken, 0 if the cluster cannot be
+ * shared, and -errno on failure.  Called with s->lock held.
+ */
+static int coroutine_fn dedup_pin(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t host_offset, uint64_t guest_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount, l2_entry;
+    int ret;
+
+    if (bdrv_co_has_overlapping_writes(bs, offset, s->cluster_size, true)) {
+        return 0;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    }
+    if (refcount == 0 || refcount >= s->refcount_max) {
+        return 0;
+    }
+
+    if (refcount == 1) {
+        /*
+         * Writes to it that are already under way, including earlier
+         * clusters of this very request, may still change it
+         */
+        if (bdrv_co_has_overlapping_writes(bs, guest_offset,
+                                           s->cluster_size, false)) {
+            return 0;
+        }
+
+        ret = qcow2_get_l2_entry(bs, guest_offset, &l2_entry);
+        if (ret < 0) {
+            return ret;
+        }
+        if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+            (l2_entry & L2E_OFFSET_MASK) != host_offset) {
+            return 0;
+        }
+
+        if (l2_entry & QCOW_OFLAG_COPIED) {
+            ret = qcow2_set_l2_entry(bs, guest_offset,
+                                     l2_entry & ~QCOW_OFLAG_COPIED);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    return ret < 0 ? ret : 1;
+}
+
+/*
+ * Drop the reference taken by dedup_pin(), and restore QCOW_OFLAG_COPIED
+ * if @guest_offset is the only user of the cluster again.  Called with
+ * s->lock held.
+ */
+static int coroutine_fn dedup_unpin(BlockDriverState *bs,
+                                    uint64_t host_offset,
+                                    uint64_t guest_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount, l2_entry;
+    int ret;
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, true, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0 || refcount != 1) {
+        return ret;
+    }
+
+    ret = qcow2_get_l2_entry(bs, guest_offset, &l2_entry);
+    if (ret < 0) {
+        return ret;
+    }
+    if (qcow2_get_cluster_type(bs, l2_entry) == QCOW2_CLUSTER_NORMAL &&
+        (l2_entry & L2E_OFFSET_MASK) == host_offset &&
+        !(l2_entry & QCOW_OFLAG_COPIED)) {
+        return qcow2_set_l2_entry(bs, guest_offset,
+                                  l2_entry | QCOW_OFLAG_COPIED);
+    }
+
+    return 0;
+}
+
+/*
+ * Point the guest cluster at @offset to the pinned host cluster at
+ * @host_offset, handing the reference over to it.  Called with s->lock
+ * held.
+ */
+static int coroutine_fn dedup_link(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t host_offset)
+{
+    uint64_t old_entry;
+    int ret;
+
+    ret = qcow2_get_l2_entry(bs, offset, &old_entry);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_set_l2_entry(bs, offset, host_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_free_any_clusters(bs, old_entry, 1, QCOW2_DISCARD_OTHER);
+    return 0;
+}
+
+/*
+ * For writes of unchanged data, remember the cluster that already holds it
+ * instead of writing it again.  Returns 1 if this is possible.
+ */
+static int coroutine_fn dedup_index_current(BlockDriverState *bs,
+                                            uint64_t offset,
+                                            const Qcow2DedupDigest *digest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_entry;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_l2_entry(bs, offset, &l2_entry);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL) {
+        return 0;
+    }
+
+    qcow2_dedup_insert(bs, digest, l2_entry & L2E_OFFSET_MASK, offset);
+    return 1;
+}
+
+/*
+ * qcow2_co_dedup_write
+ *
+ * Try to deduplicate the write of one full cluster at guest @offset, whose
+ * data is at @qiov_offset in @qiov.
+ *
+ * Returns 1 if the guest cluster now refers to a host cluster with the same
+ * data, so that there is nothing left to write, 0 if the data must be
+ * written as usual, and -errno on failure.  In the latter case, @digest is
+ * set to the fingerprint to pass to qcow2_dedup_insert() once the cluster
+ * has been allocated; it is invalid if the data should not be indexed.
+ *
+ * Called with s->lock unlocked.
+ */
+int coroutine_fn qcow2_co_dedup_write(BlockDriverState *bs, uint64_t offset,
+                                      QEMUIOVector *qiov, size_t qiov_offset,
+                                      int flags, Qcow2DedupDigest *digest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+    uint64_t host_offset, guest_offset;
+    uint8_t *buf, *cmp_buf = NULL;
+    bool match;
+    int ret;
+
+    digest->valid = false;
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, s->cluster_size);
+
+    /* Zero clusters are cheaper, leave these to detect-zeroes */
+    if (buffer_is_zero(buf, s->cluster_size)) {
+        ret = 0;
+        goto out;
+    }
+
+    ret = qcow2_co_hash(bs, buf, s->cluster_size, digest->data);
+    if (ret < 0) {
+        goto out;
+    }
+    digest->valid = true;
+
+    e = s->dedup ? g_hash_table_lookup(s->dedup->entries, digest->data) : NULL;
+    if (!e || e->guest_offset == offset) {
+        goto no_match;
+    }
+
+    /* @e may go away while we yield */
+    host_offset = e->host_offset;
+    guest_offset = e->guest_offset;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_pin(bs, offset, host_offset, guest_offset);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    } else if (ret == 0) {
+        goto stale;
+    }
+
+    cmp_buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (cmp_buf) {
+        ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size,
+                            cmp_buf, 0);
+        match = ret >= 0 && !memcmp(buf, cmp_buf, s->cluster_size);
+    } else {
+        match = false;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (match && !bdrv_co_has_overlapping_writes(bs, offset,
+                                                 s->cluster_size, true)) {
+        ret = dedup_link(bs, offset, host_offset);
+    } else {
+        match = false;
+        ret = dedup_unpin(bs, host_offset, guest_offset);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (match) {
+        trace_qcow2_dedup_share(qemu_coroutine_self(), offset, host_offset);
+        qcow2_dedup_insert(bs, digest, host_offset, guest_offset);
+        ret = 1;
+        goto out;
+    }
+
+stale:
+    trace_qcow2_dedup_stale(qemu_coroutine_self(), offset, host_offset);
+    if (s->dedup) {
+        dedup_remove(s->dedup, digest->data);
+    }
+
+no_match:
+    ret = 0;
+    if (flags & BDRV_REQ_WRITE_UNCHANGED) {
+        ret = dedup_index_current(bs, offset, digest);
+    }
+
+out:
+    qemu_vfree(cmp_buf);
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Recompute QCOW_OFLAG_COPIED in the active L1 and L2 tables, if some
+ * cluster that may have been shared by deduplication has lost a reference.
+ */
+int qcow2_dedup_fix_copied(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->dedup_fix_copied || !s->l1_table) {
+        return 0;
+    }
+
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dedup_fix_copied = false;
+    return 0;
+}
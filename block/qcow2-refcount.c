@@ -1152,6 +1152,33 @@ void qcow2_free_clusters(BlockDriverState *bs,
     }
 }
 
+/*
+ * Without snapshots, a data cluster only has several references if they
+ * were created by deduplication.  If freeing one of them leaves a single
+ * reference, that reference lacks QCOW_OFLAG_COPIED even when the image is
+ * written with dedup off; have it fixed on close.  Images that have been
+ * deduplicated keep their fingerprint index, so others need no checking.
+ */
+static void qcow2_check_dedup_shared(BlockDriverState *bs, uint64_t offset,
+                                     int nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount;
+    int i;
+
+    if (!s->dedup_index_entries || s->dedup_fix_copied || s->nb_snapshots) {
+        return;
+    }
+
+    for (i = 0; i < nb_clusters; i++) {
+        if (qcow2_get_refcount(bs, (offset >> s->cluster_bits) + i,
+                               &refcount) == 0 && refcount == 1) {
+            s->dedup_fix_copied = true;
+            return;
+        }
+    }
+}
+
 /*
  * Free a cluster using its L2 entry (handles clusters of all types, e.g.
  * normal cluster, compressed cluster, etc.)
@@ -1173,6 +1200,14 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
         return;
     }
 
+    if (s->dedup) {
+        /*
+         * This may leave a single reference to a cluster that was shared by
+         * deduplication, and that reference has no QCOW_OFLAG_COPIED.
+         */
+        s->dedup_fix_copied = true;
+    }
+
     switch (ctype) {
     case QCOW2_CLUSTER_COMPRESSED:
         {
@@ -1192,6 +1227,8 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
         } else {
             qcow2_free_clusters(bs, l2_entry & L2E_OFFSET_MASK,
                                 nb_clusters << s->cluster_bits, type);
+            qcow2_check_dedup_shared(bs, l2_entry & L2E_OFFSET_MASK,
+                                     nb_clusters);
         }
         break;
     case QCOW2_CLUSTER_ZERO_PLAIN:
@@ -2181,6 +2218,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* deduplication index */
+    ret = qcow2_check_dedup_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -41,6 +41,7 @@
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/qapi-visit-block-core.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 #include "block/aio_task.h"
 
 /*
@@ -71,6 +72,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_DEDUP_INDEX 0x44454455
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -194,6 +196,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     uint64_t offset;
     int ret;
     Qcow2BitmapHeaderExt bitmaps_ext;
+    Qcow2DedupHeaderExt dedup_ext;
 
     if (need_update_header != NULL) {
         *need_update_header = false;
@@ -303,7 +306,8 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->max_threads,
+                                           errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -399,6 +403,63 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 #endif
             break;
 
+        case QCOW2_EXT_MAGIC_DEDUP_INDEX:
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP_INDEX)) {
+                warn_report("a program lacking deduplication support "
+                            "modified this file, so the deduplication index "
+                            "is dropped");
+                error_printf("Some clusters may be leaked, "
+                             "run 'qemu-img check -r' on the image "
+                             "file to fix.\n");
+                if (need_update_header != NULL) {
+                    /* Updating is needed to drop the stale index */
+                    *need_update_header = true;
+                }
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &dedup_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (dedup_ext.reserved32 != 0) {
+                error_setg(errp, "dedup_ext: Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            dedup_ext.nb_entries = be32_to_cpu(dedup_ext.nb_entries);
+            dedup_ext.index_offset = be64_to_cpu(dedup_ext.index_offset);
+
+            if (dedup_ext.nb_entries == 0 ||
+                dedup_ext.nb_entries > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+                error_setg(errp, "dedup_ext: Invalid number of index "
+                           "entries (%" PRIu32 ")", dedup_ext.nb_entries);
+                return -EINVAL;
+            }
+
+            if (offset_into_cluster(s, dedup_ext.index_offset)) {
+                error_setg(errp, "dedup_ext: Invalid index offset");
+                return -EINVAL;
+            }
+
+            s->dedup_index_entries = dedup_ext.nb_entries;
+            s->dedup_index_offset = dedup_ext.index_offset;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got deduplication index extension: "
+                   "offset=%" PRIu64 " nb_entries=%" PRIu32 "\n",
+                   s->dedup_index_offset, s->dedup_index_entries);
+#endif
+            break;
+
         case QCOW2_EXT_MAGIC_DATA_FILE:
         {
             s->image_data_file = g_malloc0(ext.len + 1);
@@ -684,6 +745,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DEDUP,
+    QCOW2_OPT_DEDUP_INDEX_SIZE,
     NULL
 };
 
@@ -795,6 +858,23 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads used for compression and "
+                    "encryption",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share clusters with identical data",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP_INDEX_SIZE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of cluster fingerprints kept in memory "
+                    "for deduplication",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -954,6 +1034,8 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    int max_threads;
+    uint64_t dedup_index_size; /* 0 if deduplication is off */
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -967,6 +1049,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t max_threads;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1060,6 +1143,53 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    max_threads = qemu_opt_get_number(opts, QCOW2_OPT_THREADS,
+                                      QCOW2_DEFAULT_THREADS);
+    if (max_threads < 1 || max_threads > QCOW2_MAX_THREADS) {
+        error_setg(errp, QCOW2_OPT_THREADS " must be between 1 and %d",
+                   QCOW2_MAX_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->max_threads = max_threads;
+    /* The crypto context has one cipher per thread, set up when it opens */
+    if (s->crypto && r->max_threads != s->max_threads) {
+        error_setg(errp, "Cannot change the number of threads of an "
+                   "encrypted image");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false)) {
+        if (s->crypt_method_header != QCOW_CRYPT_NONE) {
+            error_setg(errp, "Deduplication is not supported for encrypted "
+                       "images");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE) {
+            error_setg(errp, "Deduplication is not supported for images "
+                       "with an external data file");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (!qcrypto_hash_supports(QCRYPTO_HASH_ALG_SHA256)) {
+            error_setg(errp, "Deduplication requires SHA-256 support");
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        r->dedup_index_size =
+            qemu_opt_get_number(opts, QCOW2_OPT_DEDUP_INDEX_SIZE,
+                                QCOW2_DEFAULT_DEDUP_INDEX_SIZE);
+        if (r->dedup_index_size < 1 ||
+            r->dedup_index_size > QCOW2_MAX_DEDUP_INDEX_SIZE) {
+            error_setg(errp, QCOW2_OPT_DEDUP_INDEX_SIZE " must be between 1 "
+                       "and %d", QCOW2_MAX_DEDUP_INDEX_SIZE);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1199,6 +1329,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->max_threads = r->max_threads;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1210,6 +1341,17 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    if (r->dedup_index_size) {
+        bool enable = !s->dedup;
+
+        qcow2_dedup_init(bs, r->dedup_index_size);
+        if (enable) {
+            qcow2_dedup_load(bs);
+        }
+    } else {
+        qcow2_dedup_close(bs);
+    }
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1649,7 +1791,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->max_threads, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -1706,6 +1848,11 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
     }
 
+    /* The options were parsed before the index location was known */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        qcow2_dedup_load(bs);
+    }
+
     /* == Handle persistent dirty bitmaps ==
      *
      * We want load dirty bitmaps in three cases:
@@ -1787,6 +1934,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     bs->supported_zero_flags = header.version >= 3 ?
                                BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK : 0;
     bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
+    /* Used by deduplication to index data that is already there */
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED;
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
@@ -1816,6 +1965,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     return ret;
 
  fail:
+    qcow2_dedup_close(bs);
     g_free(s->image_data_file);
     if (has_data_file(bs)) {
         bdrv_unref_child(bs, s->data_file);
@@ -1917,6 +2067,14 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         goto fail;
     }
 
+    /* Keep the fingerprint index if deduplication is turned off */
+    if (!r->dedup_index_size) {
+        ret = qcow2_dedup_store(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
         ret = qcow2_reopen_bitmaps_ro(state->bs, errp);
@@ -1924,6 +2082,11 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        ret = qcow2_dedup_store(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2226,8 +2389,7 @@ static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
         BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-        return bdrv_co_preadv_part(bs->backing, offset, bytes,
-                                   qiov, qiov_offset, 0);
+        return bdrv_co_preadv_backing(bs, offset, bytes, qiov, qiov_offset, 0);
 
     case QCOW2_CLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, file_cluster_offset,
@@ -2546,12 +2708,14 @@ static coroutine_fn int qcow2_co_pwritev_part(
     uint64_t cluster_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    Qcow2DedupDigest digest;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
         l2meta = NULL;
+        digest.valid = false;
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
         offset_in_cluster = offset_into_cluster(s, offset);
@@ -2562,6 +2726,20 @@ static coroutine_fn int qcow2_co_pwritev_part(
                             - offset_in_cluster);
         }
 
+        if (s->dedup) {
+            /* Deduplicate one cluster at a time, partial ones are written */
+            cur_bytes = MIN(cur_bytes, s->cluster_size - offset_in_cluster);
+            if (cur_bytes == s->cluster_size) {
+                ret = qcow2_co_dedup_write(bs, offset, qiov, qiov_offset,
+                                           flags, &digest);
+                if (ret < 0) {
+                    goto fail_nometa;
+                } else if (ret > 0) {
+                    goto next;
+                }
+            }
+        }
+
         qemu_co_mutex_lock(&s->lock);
 
         ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
@@ -2592,6 +2770,13 @@ static coroutine_fn int qcow2_co_pwritev_part(
             goto fail_nometa;
         }
 
+        /*
+         * The data may still be in flight, but the index is only a hint and
+         * anything found through it is compared before it is used
+         */
+        qcow2_dedup_insert(bs, &digest, cluster_offset, offset);
+
+next:
         bytes -= cur_bytes;
         offset += cur_bytes;
         qiov_offset += cur_bytes;
@@ -2626,6 +2811,13 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    ret = qcow2_dedup_fix_copied(bs);
+    if (ret < 0) {
+        result = ret;
+        error_report("Failed to update the copied flags of shared clusters: "
+                     "%s", strerror(-ret));
+    }
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2634,6 +2826,14 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    ret = qcow2_dedup_store(bs, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_reportf_err(local_err, "Lost the deduplication index during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2658,6 +2858,15 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    if (!(s->flags & BDRV_O_INACTIVE)) {
+        /* This needs the active L1 table, which is freed below */
+        if (qcow2_dedup_fix_copied(bs) < 0) {
+            error_report("Failed to update the copied flags of shared "
+                         "clusters");
+        }
+    }
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2665,6 +2874,7 @@ static void qcow2_close(BlockDriverState *bs)
     if (!(s->flags & BDRV_O_INACTIVE)) {
         qcow2_inactivate(bs);
     }
+    qcow2_dedup_close(bs);
 
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
@@ -2935,6 +3145,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR,
+                .name = "deduplication index",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2965,6 +3180,21 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Deduplication index extension */
+    if (s->dedup_index_entries > 0) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .nb_entries = cpu_to_be32(s->dedup_index_entries),
+            .index_offset = cpu_to_be64(s->dedup_index_offset),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP_INDEX,
+                             &dedup_header, sizeof(dedup_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -4532,7 +4762,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            /* Let every compression thread work on this request */
+            aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS, s->max_threads));
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
@@ -4763,13 +4994,15 @@ static int qcow2_make_empty(BlockDriverState *bs)
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
+        !s->dedup_index_entries &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
+         * LUKS header, persistent bitmaps, or a deduplication index),
+         * because it completely
          * empties the image.  Furthermore, the L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. It
@@ -5128,6 +5361,7 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
 {
     BDRVQcow2State *s = bs->opaque;
     int current_version = s->qcow_version;
+    uint32_t dedup_index_entries = s->dedup_index_entries;
     int ret;
     int i;
 
@@ -5195,13 +5429,25 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return ret;
     }
 
+    /* Without its autoclear bit, the deduplication index cannot be kept */
+    s->dedup_index_entries = 0;
+
     s->qcow_version = target_version;
     ret = qcow2_update_header(bs);
     if (ret < 0) {
         s->qcow_version = current_version;
+        s->dedup_index_entries = dedup_index_entries;
         error_setg_errno(errp, -ret, "Failed to update the image header");
         return ret;
     }
+
+    if (dedup_index_entries) {
+        qcow2_free_clusters(bs, s->dedup_index_offset,
+                            (uint64_t)dedup_index_entries *
+                            sizeof(Qcow2DedupIndexEntry),
+                            QCOW2_DISCARD_OTHER);
+        s->dedup_index_offset = 0;
+    }
     return 0;
 }
 
@@ -123,6 +123,9 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_THREADS "threads"
+#define QCOW2_OPT_DEDUP "dedup"
+#define QCOW2_OPT_DEDUP_INDEX_SIZE "dedup-index-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -248,11 +251,14 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR   = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP_INDEX         = 1 << QCOW2_AUTOCLEAR_DEDUP_INDEX_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_DEDUP_INDEX,
 };
 
 enum qcow2_discard_type {
@@ -289,7 +295,32 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
-#define QCOW2_MAX_THREADS 4
+#define QCOW2_DEFAULT_THREADS 4
+#define QCOW2_MAX_THREADS 64
+
+#define QCOW2_DEFAULT_DEDUP_INDEX_SIZE 65536
+#define QCOW2_MAX_DEDUP_INDEX_SIZE (1 << 26)
+#define QCOW2_DEDUP_DIGEST_SIZE 32 /* SHA-256 */
+
+typedef struct Qcow2DedupHeaderExt {
+    uint32_t nb_entries;
+    uint32_t reserved32;
+    uint64_t index_offset;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+/* Entry of the deduplication index as stored in the image */
+typedef struct Qcow2DedupIndexEntry {
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    uint64_t host_offset;
+    uint64_t guest_offset;
+} QEMU_PACKED Qcow2DedupIndexEntry;
+
+typedef struct Qcow2DedupIndex Qcow2DedupIndex;
+
+typedef struct Qcow2DedupDigest {
+    bool valid;
+    uint8_t data[QCOW2_DEDUP_DIGEST_SIZE];
+} Qcow2DedupDigest;
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -372,6 +403,15 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
+
+    /* Fingerprints of written clusters, NULL if deduplication is off */
+    Qcow2DedupIndex *dedup;
+    /* QCOW_OFLAG_COPIED in the active L2 tables needs to be recomputed */
+    bool dedup_fix_copied;
+    /* Fingerprint index stored in the image, 0 entries if there is none */
+    uint32_t dedup_index_entries;
+    uint64_t dedup_index_offset;
 
     BdrvChild *data_file;
 
@@ -704,6 +744,10 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                           int compressed_size,
                                           uint64_t *host_offset);
 
+int qcow2_get_l2_entry(BlockDriverState *bs, uint64_t offset,
+                       uint64_t *l2_entry);
+int qcow2_set_l2_entry(BlockDriverState *bs, uint64_t offset,
+                       uint64_t l2_entry);
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
@@ -798,5 +842,23 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+int coroutine_fn
+qcow2_co_hash(BlockDriverState *bs, const void *buf, size_t len,
+              uint8_t *digest);
+
+/* qcow2-dedup.c functions */
+void qcow2_dedup_init(BlockDriverState *bs, uint64_t index_size);
+void qcow2_dedup_close(BlockDriverState *bs);
+void qcow2_dedup_load(BlockDriverState *bs);
+int qcow2_dedup_store(BlockDriverState *bs, Error **errp);
+int qcow2_check_dedup_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                void **refcount_table,
+                                int64_t *refcount_table_size);
+int coroutine_fn qcow2_co_dedup_write(BlockDriverState *bs, uint64_t offset,
+                                      QEMUIOVector *qiov, size_t qiov_offset,
+                                      int flags, Qcow2DedupDigest *digest);
+void qcow2_dedup_insert(BlockDriverState *bs, const Qcow2DedupDigest *digest,
+                        uint64_t host_offset, uint64_t guest_offset);
+int qcow2_dedup_fix_copied(BlockDriverState *bs);
 
 #endif
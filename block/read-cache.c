@@ -0,0 +1,846 @@
+/*
+ * Persistent read cache filter block driver
+ *
+ * Keeps the data read from a slow image (e.g. one on NBD, iSCSI or HTTP)
+ * in a local file, so that it does not need to be fetched again, neither
+ * in this run nor after a restart.
+ *
+ * The cache file starts with a header, followed by an index with one
+ * entry per cache slot and then the slots themselves.  Each slot holds one
+ * cluster of the image.  The index is only written when the cache is
+ * closed; while it is open, the header is marked dirty so that a cache
+ * that was not shut down cleanly is discarded on the next open.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "block/block_int.h"
+#include "qemu/cutils.h"
+#include "qemu/hbitmap.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "trace.h"
+
+/* Disk format stuff */
+
+#define READ_CACHE_MAGIC        0x5152444341434845ULL /* "QRDCACHE" */
+#define READ_CACHE_VERSION      1
+
+#define READ_CACHE_FLAG_DIRTY   (1 << 0)
+
+#define READ_CACHE_SOURCE_LEN   256
+
+/* All fields are big-endian */
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_bits;
+    uint32_t nb_slots;
+    uint64_t image_size;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    /* Filename of the cached image, to not reuse the cache for another one */
+    char source[READ_CACHE_SOURCE_LEN];
+} QEMU_PACKED ReadCacheHeader;
+
+/*
+ * The index has one big-endian uint64_t per slot: the number of the
+ * cluster of the image that the slot holds, plus one, or zero if the slot
+ * is free.
+ */
+#define READ_CACHE_INDEX_OFFSET 4096
+
+/* End of disk format structures. */
+
+#define READ_CACHE_OPT_SIZE         "size"
+#define READ_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+
+#define READ_CACHE_DEFAULT_SIZE         (1 * GiB)
+#define READ_CACHE_DEFAULT_CLUSTER_SIZE (64 * KiB)
+#define READ_CACHE_MIN_CLUSTER_SIZE     (4 * KiB)
+#define READ_CACHE_MAX_CLUSTER_SIZE     (2 * MiB)
+#define READ_CACHE_MAX_SLOTS            (1 << 24)
+
+typedef struct ReadCacheSlot {
+    /* Cluster of the image held in this slot, if @cached */
+    uint64_t cluster;
+    /* Number of reads from this slot in flight; it cannot be reused */
+    int pinned;
+    bool cached;
+    /*
+     * In s->lru if @cached, in s->free if neither @cached nor @pinned, in
+     * no list otherwise (while the slot is being filled, or when it was
+     * invalidated while pinned).
+     */
+    QTAILQ_ENTRY(ReadCacheSlot) next;
+} ReadCacheSlot;
+
+/* Data read from the image that is on its way into the cache */
+typedef struct ReadCacheFill {
+    BlockDriverState *bs;
+    uint64_t start;     /* first cluster */
+    uint64_t end;       /* last cluster + 1 */
+    uint8_t *buf;
+    /* Set when a write to the image overlaps the clusters in @buf */
+    bool stale;
+    QLIST_ENTRY(ReadCacheFill) next;
+} ReadCacheFill;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache_file;
+
+    uint32_t cluster_size;
+    int cluster_bits;
+    uint32_t nb_slots;
+    uint64_t image_size;
+    uint64_t nb_clusters;
+    uint64_t data_offset;
+    char source[READ_CACHE_SOURCE_LEN];
+
+    /* False for inactive nodes and nodes opened without I/O */
+    bool writable;
+
+    ReadCacheSlot *slots;
+    /* Cluster number -> ReadCacheSlot */
+    GHashTable *clusters;
+    /* Clusters of the image that are in the cache */
+    HBitmap *cached;
+    /* Cached slots, most recently used first */
+    QTAILQ_HEAD(, ReadCacheSlot) lru;
+    QTAILQ_HEAD(, ReadCacheSlot) free;
+    QLIST_HEAD(, ReadCacheFill) fills;
+} BDRVReadCacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of cached data",
+        },
+        {
+            .name = READ_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Caching and eviction granularity",
+        },
+        { /* end of list */ }
+    },
+};
+
+static inline uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                              ReadCacheSlot *slot)
+{
+    return s->data_offset + ((uint64_t)(slot - s->slots) << s->cluster_bits);
+}
+
+static void read_cache_reset(BDRVReadCacheState *s)
+{
+    uint32_t i;
+
+    g_hash_table_remove_all(s->clusters);
+    hbitmap_reset_all(s->cached);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->free);
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i] = (ReadCacheSlot) { 0 };
+        QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], next);
+    }
+}
+
+static void read_cache_insert(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                              uint64_t cluster)
+{
+    slot->cluster = cluster;
+    slot->cached = true;
+    g_hash_table_insert(s->clusters, &slot->cluster, slot);
+    hbitmap_set(s->cached, cluster, 1);
+    QTAILQ_INSERT_HEAD(&s->lru, slot, next);
+}
+
+static void read_cache_remove(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    assert(slot->cached);
+    g_hash_table_remove(s->clusters, &slot->cluster);
+    hbitmap_reset(s->cached, slot->cluster, 1);
+    QTAILQ_REMOVE(&s->lru, slot, next);
+    slot->cached = false;
+    if (!slot->pinned) {
+        QTAILQ_INSERT_TAIL(&s->free, slot, next);
+    }
+}
+
+static ReadCacheSlot *read_cache_lookup(BDRVReadCacheState *s,
+                                        uint64_t cluster)
+{
+    if (cluster >= s->nb_clusters || !hbitmap_get(s->cached, cluster)) {
+        return NULL;
+    }
+    return g_hash_table_lookup(s->clusters, &cluster);
+}
+
+/* Take a slot off the free list, evicting the least recently used one */
+static ReadCacheSlot *read_cache_get_free_slot(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot;
+
+    if (QTAILQ_EMPTY(&s->free)) {
+        QTAILQ_FOREACH_REVERSE(slot, &s->lru, next) {
+            if (!slot->pinned) {
+                trace_read_cache_evict(bs, slot->cluster, slot - s->slots);
+                read_cache_remove(s, slot);
+                break;
+            }
+        }
+    }
+
+    slot = QTAILQ_FIRST(&s->free);
+    if (slot) {
+        QTAILQ_REMOVE(&s->free, slot, next);
+    }
+    return slot;
+}
+
+/* Drop the clusters in [@offset, @offset + @bytes) from the cache */
+static void read_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = offset >> s->cluster_bits;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, s->cluster_size);
+    ReadCacheFill *fill;
+    int64_t cluster;
+
+    QLIST_FOREACH(fill, &s->fills, next) {
+        if (fill->start < end && start < fill->end) {
+            fill->stale = true;
+        }
+    }
+
+    end = MIN(end, s->nb_clusters);
+    if (start >= end) {
+        return;
+    }
+
+    trace_read_cache_invalidate(bs, offset, bytes);
+    while ((cluster = hbitmap_next_dirty(s->cached, start, end - start)) >= 0) {
+        read_cache_remove(s, read_cache_lookup(s, cluster));
+        start = cluster + 1;
+    }
+}
+
+static int read_cache_write_header(BlockDriverState *bs, uint32_t flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header = {
+        .magic          = cpu_to_be64(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .flags          = cpu_to_be32(flags),
+        .cluster_bits   = cpu_to_be32(s->cluster_bits),
+        .nb_slots       = cpu_to_be32(s->nb_slots),
+        .image_size     = cpu_to_be64(s->image_size),
+        .index_offset   = cpu_to_be64(READ_CACHE_INDEX_OFFSET),
+        .data_offset    = cpu_to_be64(s->data_offset),
+    };
+    int ret;
+
+    memcpy(header.source, s->source, sizeof(header.source));
+    ret = bdrv_pwrite(s->cache_file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(s->cache_file->bs);
+}
+
+/* Write the index and mark the cache file clean */
+static int read_cache_persist(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t *index;
+    uint32_t i;
+    int ret;
+
+    if (!s->writable) {
+        return 0;
+    }
+
+    index = g_new0(uint64_t, s->nb_slots);
+    for (i = 0; i < s->nb_slots; i++) {
+        if (s->slots[i].cached) {
+            index[i] = cpu_to_be64(s->slots[i].cluster + 1);
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache_file, READ_CACHE_INDEX_OFFSET, index,
+                      s->nb_slots * sizeof(uint64_t));
+    g_free(index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache_file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_read_cache_persist(bs, g_hash_table_size(s->clusters));
+    return read_cache_write_header(bs, 0);
+}
+
+/*
+ * Take over the index of the cache file if it was written for the same
+ * image and geometry and closed cleanly, and start with an empty cache
+ * otherwise.
+ */
+static int read_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    uint64_t *index = NULL;
+    uint32_t i;
+    int64_t len;
+    int ret;
+
+    read_cache_reset(s);
+
+    len = bdrv_getlength(s->cache_file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get cache file length");
+        return len;
+    }
+
+    if (len >= s->data_offset) {
+        ret = bdrv_pread(s->cache_file, 0, &header, sizeof(header));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read cache header");
+            return ret;
+        }
+
+        if (be64_to_cpu(header.magic) == READ_CACHE_MAGIC &&
+            be32_to_cpu(header.version) == READ_CACHE_VERSION &&
+            !(be32_to_cpu(header.flags) & READ_CACHE_FLAG_DIRTY) &&
+            be32_to_cpu(header.cluster_bits) == s->cluster_bits &&
+            be32_to_cpu(header.nb_slots) == s->nb_slots &&
+            be64_to_cpu(header.image_size) == s->image_size &&
+            be64_to_cpu(header.index_offset) == READ_CACHE_INDEX_OFFSET &&
+            be64_to_cpu(header.data_offset) == s->data_offset &&
+            !memcmp(header.source, s->source, sizeof(s->source)))
+        {
+            index = g_try_new(uint64_t, s->nb_slots);
+            if (!index) {
+                error_setg(errp, "Could not allocate cache index");
+                return -ENOMEM;
+            }
+            ret = bdrv_pread(s->cache_file, READ_CACHE_INDEX_OFFSET, index,
+                             s->nb_slots * sizeof(uint64_t));
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read cache index");
+                g_free(index);
+                return ret;
+            }
+        }
+    }
+
+    if (index) {
+        for (i = 0; i < s->nb_slots; i++) {
+            uint64_t entry = be64_to_cpu(index[i]);
+            ReadCacheSlot *slot = &s->slots[i];
+
+            if (!entry || entry > s->nb_clusters ||
+                hbitmap_get(s->cached, entry - 1)) {
+                continue;
+            }
+            QTAILQ_REMOVE(&s->free, slot, next);
+            read_cache_insert(s, slot, entry - 1);
+        }
+        g_free(index);
+        trace_read_cache_load(bs, g_hash_table_size(s->clusters));
+        return 0;
+    }
+
+    if (!s->writable) {
+        return 0;
+    }
+
+    /* Make room for all slots; the file stays sparse until they are used */
+    return bdrv_truncate(s->cache_file,
+                         s->data_offset +
+                         ((uint64_t)s->nb_slots << s->cluster_bits),
+                         false, PREALLOC_MODE_OFF, 0, errp);
+}
+
+/* Any change to the cache makes the index on disk out of date */
+static int read_cache_activate(BlockDriverState *bs, Error **errp)
+{
+    int ret = read_cache_write_header(bs, READ_CACHE_FLAG_DIRTY);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write cache header");
+    }
+    return ret;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t size, cluster_size;
+    int64_t image_size;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /* The cache is updated even if the image is only read */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                              "off");
+    }
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_of_bds, BDRV_CHILD_METADATA, false,
+                                    &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    cluster_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CLUSTER_SIZE,
+                                     READ_CACHE_DEFAULT_CLUSTER_SIZE);
+    if (!is_power_of_2(cluster_size) ||
+        cluster_size < READ_CACHE_MIN_CLUSTER_SIZE ||
+        cluster_size > READ_CACHE_MAX_CLUSTER_SIZE)
+    {
+        ret = -EINVAL;
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %d", READ_CACHE_MIN_CLUSTER_SIZE,
+                   READ_CACHE_MAX_CLUSTER_SIZE);
+        goto fail;
+    }
+
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE,
+                             READ_CACHE_DEFAULT_SIZE);
+    if (size < cluster_size || size / cluster_size > READ_CACHE_MAX_SLOTS) {
+        ret = -EINVAL;
+        error_setg(errp, "Cache size must hold between 1 and %d clusters",
+                   READ_CACHE_MAX_SLOTS);
+        goto fail;
+    }
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        ret = image_size;
+        error_setg_errno(errp, -ret, "Could not get image length");
+        goto fail;
+    }
+
+    s->cluster_size = cluster_size;
+    s->cluster_bits = ctz32(cluster_size);
+    s->nb_slots = size / cluster_size;
+    s->image_size = image_size;
+    s->nb_clusters = DIV_ROUND_UP(image_size, cluster_size);
+    s->data_offset = ROUND_UP(READ_CACHE_INDEX_OFFSET +
+                              s->nb_slots * sizeof(uint64_t), cluster_size);
+    pstrcpy(s->source, sizeof(s->source), bs->file->bs->filename);
+    s->writable = !(flags & (BDRV_O_INACTIVE | BDRV_O_NO_IO));
+
+    s->slots = g_new0(ReadCacheSlot, s->nb_slots);
+    s->clusters = g_hash_table_new(g_int64_hash, g_int64_equal);
+    s->cached = hbitmap_alloc(s->nb_clusters, 0);
+    QLIST_INIT(&s->fills);
+
+    if (!(flags & BDRV_O_NO_IO)) {
+        ret = read_cache_load(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else {
+        read_cache_reset(s);
+    }
+
+    if (s->writable) {
+        ret = read_cache_activate(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->cached) {
+            hbitmap_free(s->cached);
+            s->cached = NULL;
+        }
+        if (s->clusters) {
+            g_hash_table_destroy(s->clusters);
+            s->clusters = NULL;
+        }
+        g_free(s->slots);
+        s->slots = NULL;
+        bdrv_unref_child(bs, s->cache_file);
+        s->cache_file = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_persist(bs);
+    if (ret < 0) {
+        error_report("Failed to save read cache index: %s", strerror(-ret));
+    }
+
+    hbitmap_free(s->cached);
+    g_hash_table_destroy(s->clusters);
+    g_free(s->slots);
+
+    bdrv_unref_child(bs, s->cache_file);
+    s->cache_file = NULL;
+}
+
+static int read_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_persist(bs);
+    s->writable = false;
+    return ret;
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /*
+     * Another host may have changed the image through its own read cache,
+     * so whatever our cache file holds cannot be trusted any more.
+     */
+    read_cache_reset(s);
+    s->writable = true;
+    read_cache_activate(bs, errp);
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  BdrvChildRole role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (role & BDRV_CHILD_FILTERED) {
+        bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                           nperm, nshared);
+        return;
+    }
+
+    /*
+     * The cache file belongs to this node alone, and it is written even
+     * if nothing above writes to the image.
+     */
+    *nperm = 0;
+    if (!(bs->open_flags & BDRV_O_NO_IO)) {
+        *nperm |= BLK_PERM_CONSISTENT_READ;
+        if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+            *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+        }
+    }
+    *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED |
+               BLK_PERM_GRAPH_MOD;
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void coroutine_fn read_cache_co_store(void *opaque)
+{
+    ReadCacheFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t cluster;
+    uint64_t end = MIN(fill->end, fill->start + s->nb_slots);
+
+    for (cluster = fill->start; cluster < end && !fill->stale; cluster++) {
+        uint8_t *data = fill->buf +
+                        ((cluster - fill->start) << s->cluster_bits);
+        ReadCacheSlot *slot;
+        int ret;
+
+        if (read_cache_lookup(s, cluster)) {
+            continue;
+        }
+
+        slot = read_cache_get_free_slot(bs);
+        if (!slot) {
+            break;
+        }
+
+        ret = bdrv_co_pwrite(s->cache_file, read_cache_slot_offset(s, slot),
+                             s->cluster_size, data, 0);
+        if (ret < 0 || fill->stale || read_cache_lookup(s, cluster)) {
+            QTAILQ_INSERT_TAIL(&s->free, slot, next);
+            if (ret < 0) {
+                break;
+            }
+            continue;
+        }
+
+        read_cache_insert(s, slot, cluster);
+    }
+
+    QLIST_REMOVE(fill, next);
+    qemu_vfree(fill->buf);
+    g_free(fill);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Read [@offset, @offset + @bytes) from the image, which is not cached, and
+ * put the clusters it covers into the cache in the background.
+ */
+static int coroutine_fn read_cache_co_fill(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    uint64_t end = MIN(ROUND_UP(offset + bytes, s->cluster_size),
+                       s->image_size);
+    ReadCacheFill *fill;
+    Coroutine *co;
+    int ret;
+
+    trace_read_cache_miss(bs, offset, bytes);
+
+    if (!s->writable || offset + bytes > s->image_size) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   0);
+    }
+
+    fill = g_new0(ReadCacheFill, 1);
+    fill->bs = bs;
+    fill->start = start >> s->cluster_bits;
+    fill->end = DIV_ROUND_UP(end, s->cluster_size);
+    fill->buf = qemu_try_blockalign0(bs->file->bs,
+                                     (fill->end - fill->start) <<
+                                     s->cluster_bits);
+    if (!fill->buf) {
+        g_free(fill);
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   0);
+    }
+
+    /* Writes from now on must keep this data out of the cache */
+    QLIST_INSERT_HEAD(&s->fills, fill, next);
+
+    ret = bdrv_co_pread(bs->file, start, end - start, fill->buf, 0);
+    if (ret < 0) {
+        QLIST_REMOVE(fill, next);
+        qemu_vfree(fill->buf);
+        g_free(fill);
+        return ret;
+    }
+
+    if (qiov) {
+        qemu_iovec_from_buf(qiov, qiov_offset, fill->buf + (offset - start),
+                            bytes);
+    }
+
+    /* Do not hold up the request while the data is written to the cache */
+    co = qemu_coroutine_create(read_cache_co_store, fill);
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_preadv_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    int ret;
+
+    while (offset < end) {
+        uint64_t cluster = offset >> s->cluster_bits;
+        ReadCacheSlot *slot = read_cache_lookup(s, cluster);
+        uint64_t n;
+
+        if (!slot) {
+            /* Read everything up to the next cached cluster at once */
+            int64_t next = cluster + 1 < s->nb_clusters ?
+                hbitmap_next_dirty(s->cached, cluster + 1, INT64_MAX) : -1;
+
+            n = next < 0 ? end - offset :
+                MIN(end, (uint64_t)next << s->cluster_bits) - offset;
+            ret = read_cache_co_fill(bs, offset, n, qiov, qiov_offset);
+            if (ret < 0) {
+                return ret;
+            }
+            goto next;
+        }
+
+        n = MIN(end, (cluster + 1) << s->cluster_bits) - offset;
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        QTAILQ_INSERT_HEAD(&s->lru, slot, next);
+        if (!qiov) {
+            goto next;
+        }
+
+        trace_read_cache_hit(bs, offset, n);
+        slot->pinned++;
+        ret = bdrv_co_preadv_part(s->cache_file,
+                                  read_cache_slot_offset(s, slot) +
+                                  (offset & (s->cluster_size - 1)),
+                                  n, qiov, qiov_offset, 0);
+        slot->pinned--;
+        if (!slot->pinned && !slot->cached) {
+            QTAILQ_INSERT_TAIL(&s->free, slot, next);
+        }
+        if (ret < 0) {
+            /* Fall back to the image, and do not use this slot again */
+            if (slot->cached) {
+                read_cache_remove(s, slot);
+            }
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      0);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+next:
+        offset += n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes are passed through and evict the clusters they touch.  Invalidate
+ * once more when the write is done, for clusters that were read from the
+ * image while it was in flight.
+ */
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    read_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    int ret;
+
+    read_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    read_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_SIZE,
+    READ_CACHE_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = read_cache_child_perm,
+    .bdrv_reopen_prepare                = read_cache_reopen_prepare,
+    .bdrv_inactivate                    = read_cache_inactivate,
+    .bdrv_co_invalidate_cache           = read_cache_co_invalidate_cache,
+
+    .bdrv_getlength                     = read_cache_getlength,
+
+    .bdrv_co_preadv_part                = read_cache_co_preadv_part,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+
+    .bdrv_co_block_status               = bdrv_co_block_status_from_file,
+
+    .is_filter                          = true,
+    .strong_runtime_opts                = read_cache_strong_runtime_opts,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
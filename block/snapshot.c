@@ -197,6 +197,8 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
         return -EBUSY;
     }
 
+    bdrv_alloc_map_reset(bs);
+
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
         if (ret < 0) {
@@ -140,6 +140,7 @@ vu_request_to_string(unsigned int req)
         REQ(VHOST_USER_GET_MAX_MEM_SLOTS),
         REQ(VHOST_USER_ADD_MEM_REG),
         REQ(VHOST_USER_REM_MEM_REG),
+        REQ(VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT),
         REQ(VHOST_USER_MAX),
     };
 #undef REQ
@@ -472,6 +473,8 @@ vu_log_write(VuDev *dev, uint64_t address, uint64_t length)
     vu_log_kick(dev);
 }
 
+static void vu_queue_poll(VuDev *dev, int index);
+
 static void
 vu_kick_cb(VuDev *dev, int condition, void *data)
 {
@@ -489,7 +492,7 @@ vu_kick_cb(VuDev *dev, int condition, void *data)
         DPRINT("Got kick_data: %016"PRIx64" handler:%p idx:%d\n",
                kick_data, vq->handler, index);
         if (vq->handler) {
-            vq->handler(dev, index);
+            vu_queue_poll(dev, index);
         }
     }
 }
@@ -1115,6 +1118,7 @@ vu_get_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
     vmsg->size = sizeof(vmsg->payload.state);
 
     dev->vq[index].started = false;
+    dev->vq[index].idle_start = 0;
     if (dev->iface->queue_set_started) {
         dev->iface->queue_set_started(dev, index, false);
     }
@@ -1483,6 +1487,26 @@ vu_set_vring_enable_exec(VuDev *dev, VhostUserMsg *vmsg)
     return false;
 }
 
+static bool
+vu_set_vring_busyloop_timeout_exec(VuDev *dev, VhostUserMsg *vmsg)
+{
+    unsigned int index = vmsg->payload.state.index;
+    unsigned int timeout = vmsg->payload.state.num;
+
+    DPRINT("State.index: %d\n", index);
+    DPRINT("State.timeout:  %d\n", timeout);
+
+    if (index >= dev->max_queues) {
+        vu_panic(dev, "Invalid vring_busyloop_timeout index: %u", index);
+        return false;
+    }
+
+    dev->vq[index].busyloop_timeout = timeout;
+    dev->vq[index].poll_ns = 0;
+    dev->vq[index].idle_start = 0;
+    return false;
+}
+
 static bool
 vu_set_slave_req_fd(VuDev *dev, VhostUserMsg *vmsg)
 {
@@ -1845,6 +1869,8 @@ vu_process_message(VuDev *dev, VhostUserMsg *vmsg)
         return vu_add_mem_reg(dev, vmsg);
     case VHOST_USER_REM_MEM_REG:
         return vu_rem_mem_reg(dev, vmsg);
+    case VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT:
+        return vu_set_vring_busyloop_timeout_exec(dev, vmsg);
     default:
         vmsg_close_fds(vmsg);
         vu_panic(dev, "Unhandled request: %d", vmsg->request);
@@ -2407,6 +2433,103 @@ vu_queue_set_notification(VuDev *dev, VuVirtq *vq, int enable)
     }
 }
 
+/* Initial polling window and its growth factor, as in util/aio-posix.c */
+#define VU_POLL_NS_START 4000
+#define VU_POLL_GROW 2
+
+/* Handler runs for a single kick before other watches get a turn */
+#define VU_POLL_MAX_ROUNDS 64
+
+static int64_t
+vu_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Adapt the polling window to how long the ring stayed idle before the
+ * guest queued more requests.  This is the policy aio_poll() applies to
+ * its poll_ns with the default grow and shrink parameters, bounded by
+ * the busyloop timeout the master configured.
+ */
+static void
+vu_queue_poll_adjust(VuVirtq *vq, int64_t idle_ns)
+{
+    int64_t max_ns = vq->busyloop_timeout * 1000LL;
+
+    if (idle_ns <= vq->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (idle_ns > max_ns) {
+        /* We'd have to poll for too long, fall back to the eventfd */
+        vq->poll_ns = 0;
+    } else if (vq->poll_ns < max_ns) {
+        /* There is room to grow, poll longer */
+        if (vq->poll_ns) {
+            vq->poll_ns *= VU_POLL_GROW;
+        } else {
+            vq->poll_ns = VU_POLL_NS_START;
+        }
+        vq->poll_ns = MIN(vq->poll_ns, max_ns);
+    }
+}
+
+/*
+ * Run the queue handler for a kick.  With VHOST_USER_PROTOCOL_F_VRING_POLL
+ * the ring is then busy-polled with guest notifications suppressed for up
+ * to poll_ns; if nothing arrives in that window notifications are enabled
+ * again and we go back to waiting on the kick eventfd.
+ */
+static void
+vu_queue_poll(VuDev *dev, int index)
+{
+    VuVirtq *vq = &dev->vq[index];
+    int64_t start, now;
+    uint16_t avail;
+    int rounds = 0;
+
+    if (vq->idle_start) {
+        vu_queue_poll_adjust(vq, vu_clock_ns() - vq->idle_start);
+        vq->idle_start = 0;
+    }
+
+    while (vq->handler) {
+        vq->handler(dev, index);
+
+        if (!vq->busyloop_timeout || !vq->started ||
+            unlikely(dev->broken) || unlikely(!vq->vring.avail)) {
+            return;
+        }
+
+        /* Requests the handler left on the ring do not count as new work */
+        start = now = vu_clock_ns();
+        avail = vring_avail_idx(vq);
+        if (vq->poll_ns) {
+            vu_queue_set_notification(dev, vq, 0);
+            while (vring_avail_idx(vq) == avail && now - start < vq->poll_ns) {
+                now = vu_clock_ns();
+            }
+            vu_queue_set_notification(dev, vq, 1);
+        }
+
+        if (vring_avail_idx(vq) == avail) {
+            vq->idle_start = start;
+            return;
+        }
+        vu_queue_poll_adjust(vq, now - start);
+
+        if (++rounds == VU_POLL_MAX_ROUNDS) {
+            /* Come back through the kick eventfd after the other watches */
+            if (eventfd_write(vq->kick_fd, 1) < 0) {
+                vu_panic(dev, "Error writing eventfd: %s", strerror(errno));
+            }
+            return;
+        }
+    }
+}
+
 static void
 virtqueue_map_desc(VuDev *dev,
                    unsigned int *p_num_sg, struct iovec *iov,
@@ -62,6 +62,7 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD = 12,
     VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS = 14,
     VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
+    VHOST_USER_PROTOCOL_F_VRING_POLL = 16,
 
     VHOST_USER_PROTOCOL_F_MAX
 };
@@ -107,6 +108,7 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_MAX_MEM_SLOTS = 36,
     VHOST_USER_ADD_MEM_REG = 37,
     VHOST_USER_REM_MEM_REG = 38,
+    VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT = 39,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -338,6 +340,15 @@ typedef struct VuVirtq {
     /* Notification enabled? */
     bool notification;
 
+    /* Polling limit set by the master in microseconds, 0 if disabled */
+    uint32_t busyloop_timeout;
+
+    /* Current adaptive polling window, at most busyloop_timeout */
+    int64_t poll_ns;
+
+    /* When the ring went idle after the last request, 0 if busy */
+    int64_t idle_start;
+
     int inuse;
 
     vu_queue_handler_cb handler;
@@ -395,7 +395,8 @@ static uint64_t
 vub_get_protocol_features(VuDev *dev)
 {
     return 1ull << VHOST_USER_PROTOCOL_F_CONFIG |
-           1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD;
+           1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD |
+           1ull << VHOST_USER_PROTOCOL_F_VRING_POLL;
 }
 
 static int
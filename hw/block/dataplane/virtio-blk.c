@@ -43,13 +43,23 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * With the iothreads property, virtqueue i is served by
+     * iothreads[i % num_iothreads], and requests are submitted from
+     * there.  Otherwise all virtqueues use ctx.
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    AioContext **vq_ctx;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
     if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
+        /* Requests on different virtqueues complete in different threads */
+        set_bit_atomic(virtio_get_queue_index(vq), s->batch_notify_vqs);
         qemu_bh_schedule(s->bh);
     } else {
         virtio_notify_irqfd(s->vdev, vq);
@@ -63,8 +73,9 @@ static void notify_guest_bh(void *opaque)
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    for (j = 0; j < BITS_TO_LONGS(nvqs); j++) {
+        bitmap[j] = atomic_xchg(&s->batch_notify_vqs[j], 0);
+    }
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
         unsigned long bits = bitmap[j / BITS_PER_LONG];
@@ -88,18 +99,41 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    unsigned i;
 
     *dataplane = NULL;
 
+    if (conf->num_iothreads) {
+        if (!conf->iothread) {
+            error_setg(errp, "iothreads requires the iothread property, "
+                       "which sets where the drive lives");
+            return false;
+        }
+        iothreads = g_new0(IOThread *, conf->num_iothreads);
+        for (i = 0; i < conf->num_iothreads; i++) {
+            iothreads[i] = conf->iothreads[i] ?
+                           iothread_by_id(conf->iothreads[i]) : NULL;
+            if (!iothreads[i]) {
+                error_setg(errp, "IOThread '%s' not found",
+                           conf->iothreads[i] ?: "");
+                g_free(iothreads);
+                return false;
+            }
+        }
+    }
+
     if (conf->iothread) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
                        "(transport does not support notifiers)");
+            g_free(iothreads);
             return false;
         }
         if (!virtio_device_ioeventfd_enabled(vdev)) {
             error_setg(errp, "ioeventfd is required for iothread");
+            g_free(iothreads);
             return false;
         }
 
@@ -108,11 +142,13 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
          */
         if (blk_op_is_blocked(conf->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
+            g_free(iothreads);
             return false;
         }
     }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
+        g_free(iothreads);
         return false;
     }
 
@@ -130,6 +166,22 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
+    s->iothreads = iothreads;
+    s->num_iothreads = conf->num_iothreads;
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        if (s->num_iothreads) {
+            IOThread *iothread = s->iothreads[i % s->num_iothreads];
+            s->vq_ctx[i] = iothread_get_aio_context(iothread);
+        } else {
+            s->vq_ctx[i] = s->ctx;
+        }
+    }
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_ref(OBJECT(s->iothreads[i]));
+    }
+    blk_set_allow_multiqueue(conf->conf.blk, s->num_iothreads > 0);
+
     *dataplane = s;
 
     return true;
@@ -139,6 +191,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -146,11 +199,17 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
+    blk_set_allow_multiqueue(s->conf->conf.blk, false);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    g_free(s->vq_ctx);
     g_free(s);
 }
 
@@ -231,14 +290,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(s->vq_ctx[i]);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -269,6 +328,19 @@ static void virtio_blk_data_plane_stop_bh(void *opaque)
     }
 }
 
+/* Like virtio_blk_data_plane_stop_bh(), for a single virtqueue that is
+ * served by another IOThread.
+ *
+ * Context: BH in IOThread
+ */
+static void virtio_blk_data_plane_stop_vq_bh(void *opaque)
+{
+    VirtQueue *vq = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_stop(VirtIODevice *vdev)
 {
@@ -292,8 +364,22 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    if (s->num_iothreads) {
+        for (i = 0; i < nvqs; i++) {
+            aio_context_acquire(s->vq_ctx[i]);
+            aio_wait_bh_oneshot(s->vq_ctx[i], virtio_blk_data_plane_stop_vq_bh,
+                                virtio_get_queue(s->vdev, i));
+            aio_context_release(s->vq_ctx[i]);
+        }
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+    if (!s->num_iothreads) {
+        aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+    }
+
+    /* No more requests are popped, submit what the merge window holds */
+    virtio_blk_flush_merge_window(vblk);
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
@@ -311,7 +311,8 @@ static int vhost_user_blk_connect(DeviceState *dev)
 
     vhost_dev_set_config_notifier(&s->dev, &blk_ops);
 
-    ret = vhost_dev_init(&s->dev, &s->vhost_user, VHOST_BACKEND_TYPE_USER, 0);
+    ret = vhost_dev_init(&s->dev, &s->vhost_user, VHOST_BACKEND_TYPE_USER,
+                         s->poll_us);
     if (ret < 0) {
         error_report("vhost-user-blk: vhost initialization failed: %s",
                      strerror(-ret));
@@ -534,6 +535,7 @@ static Property vhost_user_blk_properties[] = {
     DEFINE_PROP_UINT16("num-queues", VHostUserBlk, num_queues, 1),
     DEFINE_PROP_UINT32("queue-size", VHostUserBlk, queue_size, 128),
     DEFINE_PROP_BIT("config-wce", VHostUserBlk, config_wce, 0, true),
+    DEFINE_PROP_UINT32("poll-us", VHostUserBlk, poll_us, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
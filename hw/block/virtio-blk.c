@@ -33,6 +33,9 @@
 #include "migration/qemu-file-types.h"
 #include "hw/virtio/virtio-access.h"
 
+/* Requests taken off the ring with a single avail index read */
+#define VIRTIO_BLK_POP_BATCH 64
+
 /* Config size before the discard support (hide associated config fields) */
 #define VIRTIO_BLK_CFG_SIZE offsetof(struct virtio_blk_config, \
                                      max_discard_sectors)
@@ -69,7 +72,16 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    virtqueue_element_free(req->vq, req);
+}
+
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane, vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(s), vq);
+    }
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -81,10 +93,38 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 
     stb_p(&req->in->status, status);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+    virtio_blk_notify(s, req->vq);
+}
+
+/*
+ * Complete @num successful requests of the same virtqueue with a single
+ * used index update and a single guest notification.  The requests are
+ * freed.
+ */
+static void virtio_blk_req_complete_batch(VirtIOBlock *s,
+                                          VirtIOBlockReq **reqs,
+                                          unsigned int num)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtQueue *vq = reqs[0]->vq;
+    VirtQueueElement *elems[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int lens[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i;
+
+    assert(num <= VIRTIO_BLK_MAX_MERGE_REQS);
+    for (i = 0; i < num; i++) {
+        assert(reqs[i]->vq == vq);
+        trace_virtio_blk_req_complete(vdev, reqs[i], VIRTIO_BLK_S_OK);
+        stb_p(&reqs[i]->in->status, VIRTIO_BLK_S_OK);
+        elems[i] = &reqs[i]->elem;
+        lens[i] = reqs[i]->in_len;
+    }
+
+    virtqueue_push_batch(vq, elems, lens, num);
+    virtio_blk_notify(s, vq);
+
+    for (i = 0; i < num; i++) {
+        virtio_blk_free_request(reqs[i]);
     }
 }
 
@@ -117,6 +157,8 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOBlockReq *done[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int num_done = 0;
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (next) {
@@ -147,9 +189,18 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
         block_acct_done(blk_get_stats(s->blk), &req->acct);
-        virtio_blk_free_request(req);
+
+        /* Merged requests complete together, publish them in one go */
+        if (num_done == VIRTIO_BLK_MAX_MERGE_REQS ||
+            (num_done && done[0]->vq != req->vq)) {
+            virtio_blk_req_complete_batch(s, done, num_done);
+            num_done = 0;
+        }
+        done[num_done++] = req;
+    }
+    if (num_done) {
+        virtio_blk_req_complete_batch(s, done, num_done);
     }
     aio_context_release(blk_get_aio_context(s->conf.conf.blk));
 }
@@ -251,14 +302,17 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
+static unsigned int virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq,
+                                            VirtIOBlockReq **reqs,
+                                            unsigned int max)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
+    unsigned int i, num;
 
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
+    num = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs, max);
+    for (i = 0; i < num; i++) {
+        virtio_blk_init_request(s, vq, reqs[i]);
     }
-    return req;
+    return num;
 }
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
@@ -389,7 +443,7 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
     bool is_write = mrb->is_write;
 
     if (num_reqs > 1) {
-        int i;
+        int i, cross_queue = 0;
         struct iovec *tmp_iov = qiov->iov;
         int tmp_niov = qiov->niov;
 
@@ -406,6 +460,9 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
             qemu_iovec_concat(qiov, &mrb->reqs[i]->qiov, 0,
                               mrb->reqs[i]->qiov.size);
             mrb->reqs[i - 1]->mr_next = mrb->reqs[i];
+            if (mrb->reqs[i]->vq != mrb->reqs[start]->vq) {
+                cross_queue++;
+            }
         }
 
         trace_virtio_blk_submit_multireq(VIRTIO_DEVICE(mrb->reqs[start]->dev),
@@ -415,6 +472,12 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
         block_acct_merge_done(blk_get_stats(blk),
                               is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
                               num_reqs - 1);
+        if (cross_queue) {
+            block_acct_merge_cross_queue_done(blk_get_stats(blk),
+                                              is_write ? BLOCK_ACCT_WRITE
+                                                       : BLOCK_ACCT_READ,
+                                              cross_queue);
+        }
     }
 
     if (is_write) {
@@ -495,6 +558,86 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     mrb->num_reqs = 0;
 }
 
+static void virtio_blk_close_merge_window(VirtIOBlock *s)
+{
+    s->merge_window_open = false;
+    if (s->mrb.num_reqs) {
+        virtio_blk_submit_multireq(s->blk, &s->mrb);
+    }
+}
+
+static void virtio_blk_merge_window_expired(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    trace_virtio_blk_merge_window_expired(VIRTIO_DEVICE(s), s->mrb.num_reqs);
+    virtio_blk_close_merge_window(s);
+    aio_context_release(ctx);
+}
+
+/*
+ * Submit the requests held in the merge window now.  Draining the
+ * BlockBackend does not know about them, so this must be called before a
+ * drain that has to complete them: on reset, when stopping dataplane and
+ * when the VM stops.
+ *
+ * Context: the BlockBackend's AioContext lock must be held
+ */
+void virtio_blk_flush_merge_window(VirtIOBlock *s)
+{
+    if (!s->merge_window_open) {
+        return;
+    }
+
+    trace_virtio_blk_flush_merge_window(VIRTIO_DEVICE(s), s->mrb.num_reqs);
+    timer_del(s->merge_timer);
+    virtio_blk_close_merge_window(s);
+}
+
+/*
+ * Called when a virtqueue handler is done popping requests.  Without a
+ * merge window the collected requests are submitted right away.  With
+ * one, they stay in s->mrb until the window expires, so that requests
+ * of a sequential stream that the guest spread over several virtqueues
+ * can be merged too.
+ */
+static void virtio_blk_end_batch(VirtIOBlock *s)
+{
+    MultiReqBuffer *mrb = &s->mrb;
+    AioContext *ctx;
+
+    if (!mrb->num_reqs) {
+        return;
+    }
+
+    if (!s->conf.merge_window_us || !s->conf.request_merging ||
+        mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS) {
+        virtio_blk_submit_multireq(s->blk, mrb);
+        return;
+    }
+
+    if (s->merge_window_open) {
+        return;
+    }
+
+    /* The BlockBackend moves between AioContexts only while drained */
+    ctx = blk_get_aio_context(s->blk);
+    if (s->merge_timer_ctx != ctx) {
+        if (s->merge_timer) {
+            timer_free(s->merge_timer);
+        }
+        s->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_US,
+                                       virtio_blk_merge_window_expired, s);
+        s->merge_timer_ctx = ctx;
+    }
+
+    s->merge_window_open = true;
+    timer_mod(s->merge_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                              s->conf.merge_window_us);
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     VirtIOBlock *s = req->dev;
@@ -762,8 +905,8 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+    unsigned int i, num;
     bool suppress_notifications = virtio_queue_get_notification(vq);
     bool progress = false;
 
@@ -775,13 +918,23 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
             virtio_queue_set_notification(vq, 0);
         }
 
-        while ((req = virtio_blk_get_request(s, vq))) {
+        while ((num = virtio_blk_get_requests(s, vq, reqs,
+                                              ARRAY_SIZE(reqs)))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
-                break;
+            for (i = 0; i < num; i++) {
+                if (virtio_blk_handle_request(reqs[i], &s->mrb)) {
+                    break;
+                }
+            }
+            if (i == num) {
+                continue;
+            }
+            /* The device is broken, drop the rest of the batch as well */
+            for (; i < num; i++) {
+                virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                virtio_blk_free_request(reqs[i]);
             }
+            break;
         }
 
         if (suppress_notifications) {
@@ -789,9 +942,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         }
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
-    }
+    virtio_blk_end_batch(s);
 
     blk_io_unplug(s->blk);
     aio_context_release(blk_get_aio_context(s->blk));
@@ -871,6 +1022,12 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtioBusState *bus = VIRTIO_BUS(qbus);
 
     if (!running) {
+        AioContext *ctx = blk_get_aio_context(s->conf.conf.blk);
+
+        /* Requests held in the merge window must be in flight for the drain */
+        aio_context_acquire(ctx);
+        virtio_blk_flush_merge_window(s);
+        aio_context_release(ctx);
         return;
     }
 
@@ -894,6 +1051,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
@@ -1235,12 +1393,19 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
     VirtIOBlkConf *conf = &s->conf;
+    AioContext *ctx = blk_get_aio_context(s->blk);
     unsigned i;
 
+    aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
+    aio_context_release(ctx);
     blk_drain(s->blk);
     del_boot_device_lchs(dev, "/disk@0,0");
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
+    if (s->merge_timer) {
+        timer_free(s->merge_timer);
+    }
     for (i = 0; i < conf->num_queues; i++) {
         virtio_del_queue(vdev, i);
     }
@@ -1281,11 +1446,15 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us,
+                       0),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 256),
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_ARRAY("iothreads", VirtIOBlock, conf.num_iothreads,
+                      conf.iothreads, qdev_prop_string, char *),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
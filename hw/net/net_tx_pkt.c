@@ -56,6 +56,7 @@ struct NetTxPkt {
     uint8_t l4proto;
 
     bool is_loopback;
+    bool tcp_segmentation;
 };
 
 void net_tx_pkt_init(struct NetTxPkt **pkt, PCIDevice *pci_dev,
@@ -405,6 +406,22 @@ bool net_tx_pkt_has_fragments(struct NetTxPkt *pkt)
     return pkt->raw_frags > 0;
 }
 
+void net_tx_pkt_add_raw_buf(struct NetTxPkt *pkt, void *base, size_t len)
+{
+    struct iovec *ventry;
+    assert(pkt);
+    assert(!pkt->pci_dev);
+    assert(pkt->max_raw_frags > pkt->raw_frags);
+
+    if (!len) {
+        return;
+    }
+
+    ventry = &pkt->raw[pkt->raw_frags++];
+    ventry->iov_base = base;
+    ventry->iov_len = len;
+}
+
 eth_pkt_types_e net_tx_pkt_get_packet_type(struct NetTxPkt *pkt)
 {
     assert(pkt);
@@ -448,7 +465,7 @@ void net_tx_pkt_reset(struct NetTxPkt *pkt)
     pkt->payload_frags = 0;
 
     assert(pkt->raw);
-    for (i = 0; i < pkt->raw_frags; i++) {
+    for (i = 0; pkt->pci_dev && i < pkt->raw_frags; i++) {
         assert(pkt->raw[i].iov_base);
         pci_dma_unmap(pkt->pci_dev, pkt->raw[i].iov_base, pkt->raw[i].iov_len,
                       DMA_DIRECTION_TO_DEVICE, 0);
@@ -459,6 +476,20 @@ void net_tx_pkt_reset(struct NetTxPkt *pkt)
     pkt->l4proto = 0;
 }
 
+static uint32_t net_tx_pkt_calc_pseudo_hdr_csum(struct NetTxPkt *pkt,
+                                                uint16_t csl, uint32_t *cso)
+{
+    void *l3_hdr = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_base;
+    uint16_t l3_proto;
+
+    l3_proto = eth_get_l3_proto(&pkt->vec[NET_TX_PKT_L2HDR_FRAG], 1,
+                                pkt->vec[NET_TX_PKT_L2HDR_FRAG].iov_len);
+    if (l3_proto == ETH_P_IPV6) {
+        return eth_calc_ip6_pseudo_hdr_csum(l3_hdr, csl, pkt->l4proto, cso);
+    }
+    return eth_calc_ip4_pseudo_hdr_csum(l3_hdr, csl, cso);
+}
+
 static void net_tx_pkt_do_sw_csum(struct NetTxPkt *pkt)
 {
     struct iovec *iov = &pkt->vec[NET_TX_PKT_L2HDR_FRAG];
@@ -468,7 +499,6 @@ static void net_tx_pkt_do_sw_csum(struct NetTxPkt *pkt)
     /* num of iovec without vhdr */
     uint32_t iov_len = pkt->payload_frags + NET_TX_PKT_PL_START_FRAG - 1;
     uint16_t csl;
-    struct ip_header *iphdr;
     size_t csum_offset = pkt->virt_hdr.csum_start + pkt->virt_hdr.csum_offset;
 
     /* Put zero to checksum field */
@@ -478,8 +508,7 @@ static void net_tx_pkt_do_sw_csum(struct NetTxPkt *pkt)
     csl = pkt->payload_len;
 
     /* add pseudo header to csum */
-    iphdr = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_base;
-    csum_cntr = eth_calc_ip4_pseudo_hdr_csum(iphdr, csl, &cso);
+    csum_cntr = net_tx_pkt_calc_pseudo_hdr_csum(pkt, csl, &cso);
 
     /* data checksum */
     csum_cntr +=
@@ -496,17 +525,29 @@ enum {
     NET_TX_PKT_FRAGMENT_HEADER_NUM
 };
 
+/* TCP segments also carry their own copy of the L4 header */
+enum {
+    NET_TX_PKT_SEGMENT_L4_HDR_POS = NET_TX_PKT_FRAGMENT_HEADER_NUM,
+    NET_TX_PKT_SEGMENT_HEADER_NUM
+};
+
 #define NET_MAX_FRAG_SG_LIST (64)
 
+/* th_off is four bits wide */
+#define NET_TX_PKT_MAX_TCP_HDR_LEN (15 * sizeof(uint32_t))
+
+/*
+ * Append up to @max_len bytes of payload, starting at @src_idx/@src_offset,
+ * to @dst after the @dst_idx entries already filled in.
+ */
 static size_t net_tx_pkt_fetch_fragment(struct NetTxPkt *pkt,
-    int *src_idx, size_t *src_offset, struct iovec *dst, int *dst_idx)
+    int *src_idx, size_t *src_offset, size_t max_len,
+    struct iovec *dst, int *dst_idx)
 {
     size_t fetched = 0;
     struct iovec *src = pkt->vec;
 
-    *dst_idx = NET_TX_PKT_FRAGMENT_HEADER_NUM;
-
-    while (fetched < IP_FRAG_ALIGN_SIZE(pkt->virt_hdr.gso_size)) {
+    while (fetched < max_len) {
 
         /* no more place in fragment iov */
         if (*dst_idx == NET_MAX_FRAG_SG_LIST) {
@@ -521,7 +562,7 @@ static size_t net_tx_pkt_fetch_fragment(struct NetTxPkt *pkt,
 
         dst[*dst_idx].iov_base = src[*src_idx].iov_base + *src_offset;
         dst[*dst_idx].iov_len = MIN(src[*src_idx].iov_len - *src_offset,
-            IP_FRAG_ALIGN_SIZE(pkt->virt_hdr.gso_size) - fetched);
+            max_len - fetched);
 
         *src_offset += dst[*dst_idx].iov_len;
         fetched += dst[*dst_idx].iov_len;
@@ -575,8 +616,9 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
 
     /* Put as much data as possible and send */
     do {
+        dst_idx = NET_TX_PKT_FRAGMENT_HEADER_NUM;
         fragment_len = net_tx_pkt_fetch_fragment(pkt, &src_idx, &src_offset,
-            fragment, &dst_idx);
+            IP_FRAG_ALIGN_SIZE(pkt->virt_hdr.gso_size), fragment, &dst_idx);
 
         more_frags = (fragment_offset + fragment_len < pkt->payload_len);
 
@@ -594,12 +636,134 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
+/*
+ * Split a TCP packet into gso_size sized segments, each with its own copy
+ * of the headers and a complete checksum, the way a TSO capable NIC would.
+ */
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
+{
+    struct iovec segment[NET_MAX_FRAG_SG_LIST];
+    uint8_t l4_hdr[NET_TX_PKT_MAX_TCP_HDR_LEN];
+    struct tcp_hdr *tcp = (struct tcp_hdr *)l4_hdr;
+    void *l3_iov_base = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_base;
+    size_t l3_iov_len = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_len;
+    bool is_ip6;
+    uint16_t ip_id = 0;
+    uint32_t seq, csum_cntr, cso;
+    uint8_t flags;
+    size_t l4_hdr_len, data_len, segment_len, offset;
+    int src_idx = NET_TX_PKT_PL_START_FRAG, dst_idx;
+    size_t src_offset = 0;
+
+    if (!pkt->virt_hdr.gso_size || !l3_iov_len ||
+        pkt->l4proto != IP_PROTO_TCP) {
+        return false;
+    }
+
+    if (iov_to_buf(&pkt->vec[NET_TX_PKT_PL_START_FRAG], pkt->payload_frags,
+                   0, l4_hdr, sizeof(*tcp)) < sizeof(*tcp)) {
+        return false;
+    }
+
+    l4_hdr_len = tcp->th_off * sizeof(uint32_t);
+    if (l4_hdr_len < sizeof(*tcp) || l4_hdr_len > pkt->payload_len ||
+        iov_to_buf(&pkt->vec[NET_TX_PKT_PL_START_FRAG], pkt->payload_frags,
+                   0, l4_hdr, l4_hdr_len) < l4_hdr_len) {
+        return false;
+    }
+
+    /* Skip the original L4 header, each segment gets its own copy */
+    while (src_idx < pkt->payload_frags + NET_TX_PKT_PL_START_FRAG &&
+           src_offset + pkt->vec[src_idx].iov_len <= l4_hdr_len) {
+        src_offset += pkt->vec[src_idx++].iov_len;
+    }
+    src_offset = l4_hdr_len - src_offset;
+
+    segment[NET_TX_PKT_FRAGMENT_L2_HDR_POS] = pkt->vec[NET_TX_PKT_L2HDR_FRAG];
+    segment[NET_TX_PKT_FRAGMENT_L3_HDR_POS] = pkt->vec[NET_TX_PKT_L3HDR_FRAG];
+    segment[NET_TX_PKT_SEGMENT_L4_HDR_POS].iov_base = l4_hdr;
+    segment[NET_TX_PKT_SEGMENT_L4_HDR_POS].iov_len = l4_hdr_len;
+
+    is_ip6 = IP_HEADER_VERSION((struct ip_header *)l3_iov_base) ==
+             IP_HEADER_VERSION_6;
+    if (!is_ip6) {
+        ip_id = be16_to_cpu(((struct ip_header *)l3_iov_base)->ip_id);
+    }
+    seq = be32_to_cpu(tcp->th_seq);
+    flags = tcp->th_flags;
+    data_len = pkt->payload_len - l4_hdr_len;
+    offset = 0;
+
+    do {
+        dst_idx = NET_TX_PKT_SEGMENT_HEADER_NUM;
+        segment_len = net_tx_pkt_fetch_fragment(pkt, &src_idx, &src_offset,
+            pkt->virt_hdr.gso_size, segment, &dst_idx);
+
+        if (is_ip6) {
+            struct ip6_header *ip6 = l3_iov_base;
+
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l3_iov_len - sizeof(*ip6) +
+                            l4_hdr_len + segment_len);
+        } else {
+            struct ip_header *ip = l3_iov_base;
+
+            ip->ip_len = cpu_to_be16(l3_iov_len + l4_hdr_len + segment_len);
+            ip->ip_id = cpu_to_be16(ip_id++);
+            eth_fix_ip4_checksum(l3_iov_base, l3_iov_len);
+        }
+
+        /* FIN and PSH only belong on the last segment, CWR on the first */
+        tcp->th_seq = cpu_to_be32(seq + offset);
+        tcp->th_flags = flags;
+        if (offset) {
+            tcp->th_flags &= ~TH_CWR;
+        }
+        if (offset + segment_len < data_len) {
+            tcp->th_flags &= ~(TH_FIN | TH_PUSH);
+        }
+
+        tcp->th_sum = 0;
+        csum_cntr = net_tx_pkt_calc_pseudo_hdr_csum(pkt,
+            l4_hdr_len + segment_len, &cso);
+        csum_cntr += net_checksum_add_iov(
+            &segment[NET_TX_PKT_SEGMENT_L4_HDR_POS],
+            dst_idx - NET_TX_PKT_SEGMENT_L4_HDR_POS,
+            0, l4_hdr_len + segment_len, cso);
+        tcp->th_sum = cpu_to_be16(net_checksum_finish(csum_cntr));
+
+        net_tx_pkt_sendv(pkt, nc, segment, dst_idx);
+
+        offset += segment_len;
+    } while (segment_len && offset < data_len);
+
+    return true;
+}
+
+void net_tx_pkt_set_tcp_segmentation(struct NetTxPkt *pkt, bool enable)
+{
+    assert(pkt);
+
+    pkt->tcp_segmentation = enable;
+}
+
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 {
+    uint8_t gso_type;
+    bool tcp_segments;
+
     assert(pkt);
 
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    tcp_segments = pkt->tcp_segmentation &&
+                   (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+                    gso_type == VIRTIO_NET_HDR_GSO_TCPV6);
+
+    /* TCP segments are checksummed one by one */
     if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM &&
+        !tcp_segments) {
         net_tx_pkt_do_sw_csum(pkt);
     }
 
@@ -622,6 +786,10 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         return true;
     }
 
+    if (tcp_segments) {
+        return net_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
     return net_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
 
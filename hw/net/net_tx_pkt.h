@@ -30,7 +30,8 @@ struct NetTxPkt;
  * Init function for tx packet functionality
  *
  * @pkt:            packet pointer
- * @pci_dev:        PCI device processing this packet
+ * @pci_dev:        PCI device processing this packet, or NULL if the
+ *                  fragments are added with net_tx_pkt_add_raw_buf()
  * @max_frags:      max tx ip fragments
  * @has_virt_hdr:   device uses virtio header.
  */
@@ -100,6 +101,17 @@ net_tx_pkt_setup_vlan_header(struct NetTxPkt *pkt, uint16_t vlan)
 bool net_tx_pkt_add_raw_fragment(struct NetTxPkt *pkt, hwaddr pa,
     size_t len);
 
+/**
+ * populate data fragment that is already mapped into QEMU's address space.
+ * Only valid for packets initialized without a PCI device.
+ *
+ * @pkt:            packet
+ * @base:           host address of fragment
+ * @len:            length of fragment
+ *
+ */
+void net_tx_pkt_add_raw_buf(struct NetTxPkt *pkt, void *base, size_t len);
+
 /**
  * Fix ip header fields and calculate IP header and pseudo header checksums.
  *
@@ -150,6 +162,17 @@ void net_tx_pkt_dump(struct NetTxPkt *pkt);
  */
 void net_tx_pkt_reset(struct NetTxPkt *pkt);
 
+/**
+ * Choose how TCP GSO packets are split when vhdr is not supported.  By
+ * default they are sent as IP fragments; when enabled, they are cut into
+ * gso_size TCP segments with their own headers and checksums instead.
+ *
+ * @pkt:            packet
+ * @enable:         segment TCP GSO packets
+ *
+ */
+void net_tx_pkt_set_tcp_segmentation(struct NetTxPkt *pkt, bool enable);
+
 /**
  * Send packet to qemu. handles sw offloads if vhdr is not supported.
  *
@@ -43,6 +43,7 @@
 #include "monitor/qdev.h"
 #include "hw/pci/pci.h"
 #include "net_rx_pkt.h"
+#include "net_tx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -57,6 +58,12 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* TX packets taken off the ring with a single avail index read */
+#define VIRTIO_NET_TX_BATCH 64
+
+/* Packets that RSS can have in flight to a queue pair in another IOThread */
+#define VIRTIO_NET_RSS_STEER_MAX 256
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -120,6 +127,55 @@ static int vq2q(int queue_index)
  * - we could suppress RX interrupt if we were so inclined.
  */
 
+/*
+ * With the iothreads property, the state of a queue pair is protected by
+ * the AioContext of its IOThread.  The main loop takes it before touching
+ * the queues; the IOThread takes it in every callback.
+ */
+static void virtio_net_queue_acquire(VirtIONetQueue *q)
+{
+    if (q->ctx) {
+        aio_context_acquire(q->ctx);
+    }
+}
+
+static void virtio_net_queue_release(VirtIONetQueue *q)
+{
+    if (q->ctx) {
+        aio_context_release(q->ctx);
+    }
+}
+
+static void virtio_net_acquire_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_queue_acquire(&n->vqs[i]);
+    }
+}
+
+static void virtio_net_release_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = n->max_queues - 1; i >= 0; i--) {
+        virtio_net_queue_release(&n->vqs[i]);
+    }
+}
+
+/* Notify the guest about a queue pair's rx_vq or tx_vq */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -315,7 +371,7 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -329,6 +385,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    virtio_net_acquire_queues(n);
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -374,6 +431,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_release_queues(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -683,14 +741,20 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
     if (!peer_has_vnet_hdr(n)) {
-        virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
-
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        /*
+         * With sw_offload, checksums and TSO are done in software on
+         * transmit, and received TCP segments are coalesced by GRO.
+         */
+        if (!n->sw_offload) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
+
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
 
         virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
@@ -743,6 +807,21 @@ static void virtio_net_apply_guest_offloads(VirtIONet *n)
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_UFO)));
 }
 
+/* Decide whether TCP segments are coalesced before passing them up */
+static void virtio_net_set_rsc(VirtIONet *n, uint64_t offloads)
+{
+    bool rsc_ext = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT);
+
+    /* RSC chains are per device, so GRO is not done from IOThreads */
+    n->sw_gro = !rsc_ext && !n->has_vnet_hdr && n->sw_offload &&
+        !n->net_conf.num_iothreads &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_CSUM);
+    n->rsc4_enabled = (rsc_ext || n->sw_gro) &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
+    n->rsc6_enabled = (rsc_ext || n->sw_gro) &&
+        virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+}
+
 static uint64_t virtio_net_guest_offloads_by_features(uint32_t features)
 {
     static const uint64_t guest_offloads_mask =
@@ -877,10 +956,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_HASH_REPORT));
 
-    n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
-        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
-    n->rsc6_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
-        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
+    virtio_net_set_rsc(n, features);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
 
     if (n->has_vnet_hdr) {
@@ -981,14 +1057,11 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->sw_offload) {
             return VIRTIO_NET_ERR;
         }
 
-        n->rsc4_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
-            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
-        n->rsc6_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
-            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+        virtio_net_set_rsc(n, offloads);
         virtio_clear_feature(&offloads, VIRTIO_NET_F_RSC_EXT);
 
         supported_offloads = virtio_net_supported_guest_offloads(n);
@@ -997,7 +1070,9 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -1146,6 +1221,15 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+static void virtio_net_rss_update_key(VirtIONet *n)
+{
+    if (!n->rss_data.toeplitz) {
+        n->rss_data.toeplitz = g_new(NetToeplitzTable, 1);
+    }
+    net_toeplitz_table_init(n->rss_data.toeplitz, n->rss_data.key,
+                            sizeof(n->rss_data.key));
+}
+
 static void virtio_net_disable_rss(VirtIONet *n)
 {
     if (n->rss_data.enabled) {
@@ -1265,6 +1349,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         err_value = (uint32_t)s;
         goto error;
     }
+    virtio_net_rss_update_key(n);
     n->rss_data.enabled = true;
     trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                 n->rss_data.indirections_len,
@@ -1340,7 +1425,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             virtio_error(vdev, "virtio-net ctrl missing headers");
             virtqueue_detach_element(vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(vq, elem);
             break;
         }
 
@@ -1348,6 +1433,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov2 = iov = g_memdup(elem->out_sg, sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+        virtio_net_acquire_queues(n);
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -1363,6 +1449,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+        virtio_net_release_queues(n);
 
         s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
@@ -1370,7 +1457,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
         g_free(iov2);
-        g_free(elem);
+        virtqueue_element_free(vq, elem);
     }
 }
 
@@ -1380,8 +1467,12 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    VirtIONetQueue *q = &n->vqs[queue_index];
 
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    if (q->rss_bh) {
+        qemu_bh_schedule(q->rss_bh);
+    }
 }
 
 static bool virtio_net_can_receive(NetClientState *nc)
@@ -1465,9 +1556,13 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                           const struct virtio_net_hdr *hdr,
                            const void *buf, size_t size)
 {
-    if (n->has_vnet_hdr) {
+    if (hdr) {
+        /* Built by virtio-net itself, already in guest byte order */
+        iov_from_buf(iov, iov_cnt, 0, hdr, sizeof(*hdr));
+    } else if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
@@ -1588,7 +1683,7 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     unsigned int index = nc->queue_index, new_index = index;
-    struct NetRxPkt *pkt = n->rx_pkt;
+    struct NetRxPkt *pkt = virtio_net_get_subqueue(nc)->rx_pkt;
     uint8_t net_hash_type;
     uint32_t hash;
     bool isip4, isip6, isudp, istcp;
@@ -1622,7 +1717,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
         return n->rss_data.redirect ? n->rss_data.default_queue : -1;
     }
 
-    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, n->rss_data.key);
+    hash = net_rx_pkt_calc_rss_hash_table(pkt, net_hash_type,
+                                          n->rss_data.toeplitz);
 
     if (n->rss_data.populate_hash) {
         virtio_set_packet_hash(buf, reports[net_hash_type], hash);
@@ -1636,8 +1732,44 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
     return (index == new_index) ? -1 : new_index;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size, bool no_rss)
+/*
+ * Hand a packet over to queue pair @q, which runs in another IOThread.
+ * Like a NIC whose receive ring is full, drop it if too many are pending.
+ */
+static ssize_t virtio_net_rss_steer(VirtIONetQueue *q,
+                                    const struct virtio_net_hdr *hdr,
+                                    const uint8_t *buf, size_t size)
+{
+    VirtIONetRssPacket *pkt;
+
+    /* GRO, the only source of @hdr, is not done with IOThreads */
+    assert(!hdr);
+
+    pkt = g_malloc(sizeof(*pkt) + size);
+    pkt->size = size;
+    memcpy(pkt->data, buf, size);
+
+    qemu_mutex_lock(&q->rss_lock);
+    if (q->rss_bh && q->rss_pending < VIRTIO_NET_RSS_STEER_MAX) {
+        QSIMPLEQ_INSERT_TAIL(&q->rss_packets, pkt, next);
+        q->rss_pending++;
+        qemu_bh_schedule(q->rss_bh);
+        pkt = NULL;
+    }
+    qemu_mutex_unlock(&q->rss_lock);
+
+    g_free(pkt);
+    return size;
+}
+
+/*
+ * Pass the packet in @buf to the guest.  @hdr, if not NULL, replaces the
+ * header that the peer provided or that would be synthesized for it.
+ */
+static ssize_t virtio_net_receive_rcu(NetClientState *nc,
+                                      const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size,
+                                      bool no_rss)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1655,7 +1787,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         int index = virtio_net_process_rss(nc, buf, size);
         if (index >= 0) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
-            return virtio_net_receive_rcu(nc2, buf, size, true);
+
+            if (n->dataplane_started && n->vqs[index].ctx != q->ctx) {
+                return virtio_net_rss_steer(&n->vqs[index], hdr, buf, size);
+            }
+            return virtio_net_receive_rcu(nc2, hdr, buf, size, true);
         }
     }
 
@@ -1694,7 +1830,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             return -1;
         }
 
@@ -1708,7 +1844,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, hdr, buf, size);
             if (n->rss_data.populate_hash) {
                 offset = sizeof(mhdr);
                 iov_from_buf(sg, elem->in_num, offset,
@@ -1731,13 +1867,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
         virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_element_free(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1748,7 +1884,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_notify_deferred) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 }
@@ -1758,7 +1898,7 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
 {
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size, false);
+    return virtio_net_receive_rcu(nc, NULL, buf, size, false);
 }
 
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
@@ -1768,7 +1908,7 @@ static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
     uint16_t ip_hdrlen;
     struct ip_header *ip;
 
-    ip = (struct ip_header *)(buf + chain->n->guest_hdr_len
+    ip = (struct ip_header *)(buf + chain->n->host_hdr_len
                               + sizeof(struct eth_header));
     unit->ip = (void *)ip;
     ip_hdrlen = (ip->ip_ver_len & 0xF) << 2;
@@ -1784,7 +1924,7 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
 {
     struct ip6_header *ip6;
 
-    ip6 = (struct ip6_header *)(buf + chain->n->guest_hdr_len
+    ip6 = (struct ip6_header *)(buf + chain->n->host_hdr_len
                                  + sizeof(struct eth_header));
     unit->ip = ip6;
     unit->ip_plen = &(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
@@ -1797,28 +1937,79 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
     unit->payload = htons(*unit->ip_plen) - unit->tcp_hdrlen;
 }
 
+/*
+ * Peers without vnet headers leave no room for one in seg->buf, so the
+ * header for the guest is built separately.  Unless the guest asked for
+ * RSC_EXT, a coalesced segment is passed up like a GSO packet from tap:
+ * partial checksum, and gso_size set to the size of the original segments.
+ */
+static ssize_t virtio_net_rsc_receive_seg(VirtioNetRscChain *chain,
+                                          VirtioNetRscSeg *seg)
+{
+    VirtIONet *n = chain->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRscUnit *unit = &seg->unit;
+    struct virtio_net_hdr_v1 h = {
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+    uint16_t csum_start, l4_len;
+    uint32_t cntr, cso;
+
+    if (seg->is_coalesced && !n->sw_gro) {
+        h.flags = VIRTIO_NET_HDR_F_RSC_INFO;
+        h.gso_type = chain->gso_type;
+        virtio_stw_p(vdev, &h.rsc.segments, seg->packets);
+        virtio_stw_p(vdev, &h.rsc.dup_acks, seg->dup_ack);
+    } else if (seg->is_coalesced) {
+        csum_start = (uint8_t *)unit->tcp - (uint8_t *)seg->buf;
+        l4_len = seg->size - csum_start;
+        if (chain->proto == ETH_P_IP) {
+            eth_fix_ip4_checksum(unit->ip, sizeof(struct ip_header));
+            cntr = eth_calc_ip4_pseudo_hdr_csum(unit->ip, l4_len, &cso);
+        } else {
+            cntr = eth_calc_ip6_pseudo_hdr_csum(unit->ip, l4_len,
+                                                IP_PROTO_TCP, &cso);
+        }
+        unit->tcp->th_sum = cpu_to_be16(~net_checksum_finish(cntr));
+
+        h.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        virtio_stw_p(vdev, &h.csum_start, csum_start);
+        virtio_stw_p(vdev, &h.csum_offset, offsetof(struct tcp_header, th_sum));
+        if (unit->payload > seg->mss) {
+            h.gso_type = chain->gso_type;
+            virtio_stw_p(vdev, &h.hdr_len, csum_start + unit->tcp_hdrlen);
+            virtio_stw_p(vdev, &h.gso_size, seg->mss);
+        }
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    return virtio_net_receive_rcu(seg->nc, (struct virtio_net_hdr *)&h,
+                                  seg->buf, seg->size, false);
+}
+
 static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
                                        VirtioNetRscSeg *seg)
 {
     int ret;
     struct virtio_net_hdr_v1 *h;
 
-    h = (struct virtio_net_hdr_v1 *)seg->buf;
-    h->flags = 0;
-    h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-
-    if (seg->is_coalesced) {
-        h->rsc.segments = seg->packets;
-        h->rsc.dup_acks = seg->dup_ack;
-        h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
-        if (chain->proto == ETH_P_IP) {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-        } else {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    if (!chain->n->has_vnet_hdr) {
+        ret = virtio_net_rsc_receive_seg(chain, seg);
+    } else {
+        h = (struct virtio_net_hdr_v1 *)seg->buf;
+        h->flags = 0;
+        h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+        if (seg->is_coalesced) {
+            h->rsc.segments = seg->packets;
+            h->rsc.dup_acks = seg->dup_ack;
+            h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
+            h->gso_type = chain->gso_type;
         }
-    }
 
-    ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
+        ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
+    }
     QTAILQ_REMOVE(&chain->buffers, seg, next);
     g_free(seg->buf);
     g_free(seg);
@@ -1859,6 +2050,7 @@ static void virtio_net_rsc_cleanup(VirtIONet *n)
 
         timer_del(chain->drain_timer);
         timer_free(chain->drain_timer);
+        qemu_bh_delete(chain->drain_bh);
         QTAILQ_REMOVE(&n->rsc_chains, chain, next);
         g_free(chain);
     }
@@ -1871,7 +2063,7 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscSeg *seg;
 
-    hdr_len = chain->n->guest_hdr_len;
+    hdr_len = chain->n->host_hdr_len;
     seg = g_malloc(sizeof(VirtioNetRscSeg));
     seg->buf = g_malloc(hdr_len + sizeof(struct eth_header)
         + sizeof(struct ip6_header) + VIRTIO_NET_MAX_TCP_PAYLOAD);
@@ -1895,6 +2087,18 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     default:
         g_assert_not_reached();
     }
+    seg->mss = seg->unit.payload;
+}
+
+static void virtio_net_rsc_arm(VirtioNetRscChain *chain)
+{
+    if (chain->n->sw_gro) {
+        /* Flush as soon as the peer is done with its current burst */
+        qemu_bh_schedule(chain->drain_bh);
+    } else {
+        timer_mod(chain->drain_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->n->rsc_timeout);
+    }
 }
 
 static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
@@ -1975,6 +2179,16 @@ coalesce:
             return RSC_FINAL;
         }
 
+        /* Only the last segment of a GSO packet may be shorter than mss */
+        if (chain->n->sw_gro && seg->mss &&
+            (o_unit->payload % seg->mss || n_unit->payload > seg->mss)) {
+            chain->stat.over_size++;
+            return RSC_FINAL;
+        }
+        if (!seg->mss) {
+            seg->mss = n_unit->payload;
+        }
+
         /* Here comes the right data, the payload length in v4/v6 is different,
            so use the field value to update and record the new data len */
         o_unit->payload += n_unit->payload; /* update new data len */
@@ -2078,8 +2292,7 @@ static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
     if (QTAILQ_EMPTY(&chain->buffers)) {
         chain->stat.empty_cache++;
         virtio_net_rsc_cache_buf(chain, nc, buf, size);
-        timer_mod(chain->drain_timer,
-              qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->n->rsc_timeout);
+        virtio_net_rsc_arm(chain);
         return size;
     }
 
@@ -2177,7 +2390,7 @@ static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
 
     ip_len = htons(ip->ip_len);
     if (ip_len < (sizeof(struct ip_header) + sizeof(struct tcp_header))
-        || ip_len > (size - chain->n->guest_hdr_len -
+        || ip_len > (size - chain->n->host_hdr_len -
                      sizeof(struct eth_header))) {
         chain->stat.ip_hacked++;
         return RSC_BYPASS;
@@ -2194,7 +2407,7 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     uint16_t hdr_len;
     VirtioNetRscUnit unit;
 
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
+    hdr_len = ((VirtIONet *)(chain->n))->host_hdr_len;
 
     if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header)
         + sizeof(struct tcp_header))) {
@@ -2240,7 +2453,7 @@ static int32_t virtio_net_rsc_sanity_check6(VirtioNetRscChain *chain,
 
     ip_len = htons(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
     if (ip_len < sizeof(struct tcp_header) ||
-        ip_len > (size - chain->n->guest_hdr_len - sizeof(struct eth_header)
+        ip_len > (size - chain->n->host_hdr_len - sizeof(struct eth_header)
                   - sizeof(struct ip6_header))) {
         chain->stat.ip_hacked++;
         return RSC_BYPASS;
@@ -2264,7 +2477,7 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
     VirtioNetRscUnit unit;
 
     chain = (VirtioNetRscChain *)opq;
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
+    hdr_len = ((VirtIONet *)(chain->n))->host_hdr_len;
 
     if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip6_header)
         + sizeof(tcp_header))) {
@@ -2319,6 +2532,7 @@ static VirtioNetRscChain *virtio_net_rsc_lookup_chain(VirtIONet *n,
     }
     chain->drain_timer = timer_new_ns(QEMU_CLOCK_HOST,
                                       virtio_net_rsc_purge, chain);
+    chain->drain_bh = qemu_bh_new(virtio_net_rsc_purge, chain);
     memset(&chain->stat, 0, sizeof(chain->stat));
 
     QTAILQ_INIT(&chain->buffers);
@@ -2341,7 +2555,7 @@ static ssize_t virtio_net_rsc_receive(NetClientState *nc,
         return virtio_net_do_receive(nc, buf, size);
     }
 
-    eth = (struct eth_header *)(buf + n->guest_hdr_len);
+    eth = (struct eth_header *)(buf + n->host_hdr_len);
     proto = htons(eth->h_proto);
 
     chain = virtio_net_rsc_lookup_chain(n, nc, proto);
@@ -2367,18 +2581,41 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
     }
 }
 
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *iov, int count,
+                                    ssize_t *ret)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int i;
+
+    q->rx_notify_deferred = true;
+    for (i = 0; i < count; i++) {
+        ret[i] = virtio_net_receive(nc, iov[i].iov_base, iov[i].iov_len);
+        if (ret[i] == 0) {
+            break;
+        }
+    }
+    q->rx_notify_deferred = false;
+
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(n, q->rx_vq);
+    }
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2386,13 +2623,135 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+
+/*
+ * Checksum and segment the packet in @out_sg in software if the guest
+ * asked for offloads that the peer cannot do.  Returns false if there is
+ * nothing to do.  Otherwise, the packet has been sent or dropped.
+ */
+static bool virtio_net_tx_sw_offload(VirtIONetQueue *q,
+                                     const struct iovec *out_sg,
+                                     unsigned int out_num)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    struct virtio_net_hdr hdr, *vhdr;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, sg_num;
+
+    if (iov_to_buf(out_sg, out_num, 0, &hdr, sizeof(hdr)) < sizeof(hdr) ||
+        (!(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+         hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE)) {
+        return false;
+    }
+
+    if (!q->tx_pkt) {
+        net_tx_pkt_init(&q->tx_pkt, NULL, VIRTQUEUE_MAX_SIZE, false);
+        net_tx_pkt_set_tcp_segmentation(q->tx_pkt, true);
+    }
+
+    sg_num = iov_copy(sg, ARRAY_SIZE(sg), out_sg, out_num,
+                      n->guest_hdr_len, -1);
+    for (i = 0; i < sg_num; i++) {
+        net_tx_pkt_add_raw_buf(q->tx_pkt, sg[i].iov_base, sg[i].iov_len);
+    }
+
+    if (net_tx_pkt_parse(q->tx_pkt)) {
+        vhdr = net_tx_pkt_get_vhdr(q->tx_pkt);
+        vhdr->flags = hdr.flags;
+        vhdr->gso_type = hdr.gso_type;
+        vhdr->hdr_len = virtio_lduw_p(vdev, &hdr.hdr_len);
+        vhdr->gso_size = virtio_lduw_p(vdev, &hdr.gso_size);
+        vhdr->csum_start = virtio_lduw_p(vdev, &hdr.csum_start);
+        vhdr->csum_offset = virtio_lduw_p(vdev, &hdr.csum_offset);
+        net_tx_pkt_send(q->tx_pkt, qemu_get_subqueue(n->nic, queue_index));
+    }
+    net_tx_pkt_reset(q->tx_pkt);
+
+    return true;
+}
+
+/*
+ * Send the packet in @elem.  Returns 0 if the packet was sent or dropped
+ * and @elem can be pushed back to the guest, -EBUSY if the backend queued
+ * it and will call virtio_net_tx_complete() later, and -EINVAL if the
+ * device is broken, in which case @elem has been detached and freed.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        virtqueue_detach_element(q->tx_vq, elem, 0);
+        virtqueue_element_free(q->tx_vq, elem);
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            virtqueue_detach_element(q->tx_vq, elem, 0);
+            virtqueue_element_free(q->tx_vq, elem);
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                return 0;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    } else if (n->sw_offload && virtio_net_tx_sw_offload(q, out_sg, out_num)) {
+        return 0;
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    return ret == 0 ? -EBUSY : 0;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, j, num;
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    int ret = 0;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2402,80 +2761,43 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+    while (num_packets < n->tx_burst) {
+        num = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                  (void **)elems,
+                                  MIN(ARRAY_SIZE(elems),
+                                      (size_t)(n->tx_burst - num_packets)));
+        if (!num) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (i = 0; i < num; i++) {
+            ret = virtio_net_tx_one(q, elems[i]);
+            if (ret < 0) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-                }
-                out_num += 1;
-                out_sg = sg2;
+        /* Everything before elems[i] was sent or dropped */
+        if (i) {
+            virtqueue_push_batch(q->tx_vq, elems, NULL, i);
+            virtio_net_notify(n, q->tx_vq);
+            for (j = 0; j < i; j++) {
+                virtqueue_element_free(q->tx_vq, elems[j]);
             }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
+            num_packets += i;
         }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (ret < 0) {
+            /* Hand back the part of the batch that was not looked at */
+            for (j = num - 1; j > i; j--) {
+                virtqueue_unpop(q->tx_vq, elems[j], 0);
+                virtqueue_element_free(q->tx_vq, elems[j]);
+            }
+            if (ret == -EBUSY) {
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elems[i];
+            }
+            return ret;
         }
     }
     return num_packets;
@@ -2534,9 +2856,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     qemu_bh_schedule(q->tx_bh);
 }
 
-static void virtio_net_tx_timer(void *opaque)
+static void virtio_net_do_tx_timer(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     /* This happens when device was stopped but BH wasn't. */
@@ -2557,9 +2878,17 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+static void virtio_net_tx_timer(void *opaque)
 {
     VirtIONetQueue *q = opaque;
+
+    virtio_net_queue_acquire(q);
+    virtio_net_do_tx_timer(q);
+    virtio_net_queue_release(q);
+}
+
+static void virtio_net_do_tx_bh(VirtIONetQueue *q)
+{
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int32_t ret;
@@ -2606,6 +2935,351 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_queue_acquire(q);
+    virtio_net_do_tx_bh(q);
+    virtio_net_queue_release(q);
+}
+
+/* IOThreads */
+
+static NetClientState *virtio_net_queue_peer(VirtIONetQueue *q)
+{
+    NICState *nic = q->n->nic;
+
+    /* A deleted netdev stays around, cleaned up, until the NIC goes away */
+    if (nic->peer_deleted) {
+        return NULL;
+    }
+    return qemu_get_subqueue(nic, q - q->n->vqs)->peer;
+}
+
+/*
+ * Deliver the packets that RSS steered to @q from other IOThreads.
+ *
+ * Context: BH in q->ctx
+ */
+static void virtio_net_rss_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, q - q->n->vqs);
+    VirtIONetRssPacket *pkt;
+    ssize_t ret = 0;
+
+    virtio_net_queue_acquire(q);
+    for (;;) {
+        /* Only this BH removes packets, so the head stays valid */
+        qemu_mutex_lock(&q->rss_lock);
+        pkt = QSIMPLEQ_FIRST(&q->rss_packets);
+        qemu_mutex_unlock(&q->rss_lock);
+        if (!pkt) {
+            break;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = virtio_net_receive_rcu(nc, NULL, pkt->data, pkt->size,
+                                         true);
+        }
+        if (ret == 0) {
+            /* Retried by virtio_net_handle_rx() when buffers are added */
+            break;
+        }
+
+        qemu_mutex_lock(&q->rss_lock);
+        QSIMPLEQ_REMOVE_HEAD(&q->rss_packets, next);
+        q->rss_pending--;
+        qemu_mutex_unlock(&q->rss_lock);
+        g_free(pkt);
+    }
+    virtio_net_queue_release(q);
+}
+
+/* Stop accepting steered packets for @q and drop the pending ones */
+static void virtio_net_rss_steer_stop(VirtIONetQueue *q)
+{
+    VirtIONetRssPacket *pkt;
+    QEMUBH *bh;
+
+    qemu_mutex_lock(&q->rss_lock);
+    bh = q->rss_bh;
+    q->rss_bh = NULL;
+    while ((pkt = QSIMPLEQ_FIRST(&q->rss_packets))) {
+        QSIMPLEQ_REMOVE_HEAD(&q->rss_packets, next);
+        g_free(pkt);
+    }
+    q->rss_pending = 0;
+    qemu_mutex_unlock(&q->rss_lock);
+
+    qemu_bh_delete(bh);
+}
+
+/* Move the TX bottom half or timer of @q to @ctx, NULL for the main loop */
+static void virtio_net_queue_set_ctx(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIONet *n = q->n;
+
+    if (!ctx) {
+        ctx = qemu_get_aio_context();
+    }
+
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+        timer_free(q->tx_timer);
+        q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                    virtio_net_tx_timer, q);
+        if (q->tx_waiting) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+        }
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    assert(n->dataplane_started);
+    virtio_net_queue_acquire(q);
+    virtio_net_handle_rx(vdev, vq);
+    virtio_net_queue_release(q);
+
+    /* New rx buffers are not work by themselves */
+    return false;
+}
+
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    assert(n->dataplane_started);
+    virtio_net_queue_acquire(q);
+    if (q->tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+    virtio_net_queue_release(q);
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+static int virtio_net_dataplane_start(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    if (!n->net_conf.num_iothreads) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    if (n->dataplane_started) {
+        return 0;
+    }
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = virtio_net_queue_peer(&n->vqs[i]);
+
+        if (peer && !qemu_can_set_aio_context(peer)) {
+            error_report("virtio-net: netdev '%s' cannot be moved to an "
+                         "iothread while filters are attached", peer->name);
+            return -ENOSYS;
+        }
+    }
+
+    /* Set up guest notifier (irq) for the queue pairs */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        return -ENOSYS;
+    }
+
+    /* Set up virtqueue notify, the control queue stays in the main loop */
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            return -ENOSYS;
+        }
+    }
+
+    /* Ready to take packets steered by RSS before any peer is moved */
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_mutex_lock(&q->rss_lock);
+        q->rss_bh = aio_bh_new(q->ctx, virtio_net_rss_bh, q);
+        qemu_mutex_unlock(&q->rss_lock);
+    }
+
+    n->dataplane_started = true;
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *peer = virtio_net_queue_peer(q);
+
+        aio_context_acquire(q->ctx);
+        virtio_net_queue_set_ctx(q, q->ctx);
+        if (peer) {
+            qemu_set_aio_context(peer, q->ctx);
+        }
+
+        /* Kick right away to begin processing what is already in vring */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                virtio_net_dataplane_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                virtio_net_dataplane_handle_tx);
+        aio_context_release(q->ctx);
+    }
+    return 0;
+}
+
+/*
+ * Hand a queue pair and its peer back to the main loop.
+ *
+ * Context: BH in IOThread
+ */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    NetClientState *peer = virtio_net_queue_peer(q);
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+    if (peer) {
+        qemu_set_aio_context(peer, NULL);
+    }
+    virtio_net_queue_set_ctx(q, NULL);
+    virtio_net_rss_steer_stop(q);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    if (!n->net_conf.num_iothreads) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        aio_context_release(q->ctx);
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    n->dataplane_started = false;
+}
+
+/* Context: QEMU global mutex held */
+static bool virtio_net_iothreads_setup(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_autofree IOThread **iothreads = NULL;
+    unsigned i;
+
+    if (!n->net_conf.num_iothreads) {
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothreads "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothreads");
+        return false;
+    }
+
+    /* Receive segment coalescing keeps per-device state */
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        error_setg(errp, "iothreads cannot be used with guest_rsc_ext");
+        return false;
+    }
+
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothreads cannot be used with vhost");
+            return false;
+        }
+        if (!qemu_can_set_aio_context(peer)) {
+            error_setg(errp, "netdev '%s' cannot be used with iothreads",
+                       peer->name);
+            return false;
+        }
+    }
+
+    /* virtio_net_guest_notifier_mask() only knows about vhost */
+    vdev->use_guest_notifier_mask = false;
+
+    iothreads = g_new0(IOThread *, n->net_conf.num_iothreads);
+    for (i = 0; i < n->net_conf.num_iothreads; i++) {
+        iothreads[i] = n->net_conf.iothreads[i] ?
+                       iothread_by_id(n->net_conf.iothreads[i]) : NULL;
+        if (!iothreads[i]) {
+            error_setg(errp, "IOThread '%s' not found",
+                       n->net_conf.iothreads[i] ?: "");
+            return false;
+        }
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->iothread = iothreads[i % n->net_conf.num_iothreads];
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
+    }
+    return true;
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2629,6 +3303,9 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    net_rx_pkt_init(&n->vqs[index].rx_pkt, false);
+    qemu_mutex_init(&n->vqs[index].rss_lock);
+    QSIMPLEQ_INIT(&n->vqs[index].rss_packets);
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -2649,6 +3326,12 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         q->tx_bh = NULL;
     }
     q->tx_waiting = 0;
+    net_tx_pkt_uninit(q->tx_pkt);
+    q->tx_pkt = NULL;
+    net_rx_pkt_uninit(q->rx_pkt);
+    q->rx_pkt = NULL;
+    assert(!q->rss_bh && QSIMPLEQ_EMPTY(&q->rss_packets));
+    qemu_mutex_destroy(&q->rss_lock);
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
@@ -2758,6 +3441,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     }
 
     if (n->rss_data.enabled) {
+        virtio_net_rss_update_key(n);
         trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                     n->rss_data.indirections_len,
                                     sizeof(n->rss_data.key));
@@ -3028,6 +3712,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3312,6 +3997,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
+    if (!virtio_net_iothreads_setup(n, errp)) {
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
 
@@ -3376,8 +4066,6 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
-
-    net_rx_pkt_init(&n->rx_pkt, false);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev)
@@ -3411,11 +4099,16 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     /* delete also control vq */
     virtio_del_queue(vdev, max_queues * 2);
     qemu_announce_timer_del(&n->announce_timer, false);
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].iothread) {
+            object_unref(OBJECT(n->vqs[i].iothread));
+        }
+    }
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
-    net_rx_pkt_uninit(n->rx_pkt);
+    g_free(n->rss_data.toeplitz);
     virtio_cleanup(vdev);
 }
 
@@ -3525,6 +4218,7 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
+    DEFINE_PROP_BOOL("sw_offload", VirtIONet, sw_offload, true),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -3540,6 +4234,8 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_ARRAY("iothreads", VirtIONet, net_conf.num_iothreads,
+                      net_conf.iothreads, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3560,6 +4256,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->bad_features = virtio_net_bad_features;
     vdc->reset = virtio_net_reset;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_dataplane_start;
+    vdc->stop_ioeventfd = virtio_net_dataplane_stop;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
@@ -79,6 +79,7 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_RESET_DEVICE = 13,
     /* Feature 14 reserved for VHOST_USER_PROTOCOL_F_INBAND_NOTIFICATIONS. */
     VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
+    VHOST_USER_PROTOCOL_F_VRING_POLL = 16,
     VHOST_USER_PROTOCOL_F_MAX
 };
 
@@ -124,6 +125,7 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_MAX_MEM_SLOTS = 36,
     VHOST_USER_ADD_MEM_REG = 37,
     VHOST_USER_REM_MEM_REG = 38,
+    VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT = 39,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -1127,6 +1129,21 @@ static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
     return 0;
 }
 
+static int vhost_user_set_vring_busyloop_timeout(struct vhost_dev *dev,
+                                                 struct vhost_vring_state *s)
+{
+    /*
+     * Polling is an optimization the backend opts into; without it the
+     * backend keeps waiting on the kick eventfd, which is still correct.
+     */
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_VRING_POLL)) {
+        return 0;
+    }
+
+    return vhost_set_vring(dev, VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT, s);
+}
+
 static int vhost_user_get_vring_base(struct vhost_dev *dev,
                                      struct vhost_vring_state *ring)
 {
@@ -2374,6 +2391,8 @@ const VhostOps user_ops = {
         .vhost_reset_device = vhost_user_reset_device,
         .vhost_get_vq_index = vhost_user_get_vq_index,
         .vhost_set_vring_enable = vhost_user_set_vring_enable,
+        .vhost_set_vring_busyloop_timeout =
+                                vhost_user_set_vring_busyloop_timeout,
         .vhost_requires_shm_log = vhost_user_requires_shm_log,
         .vhost_migration_done = vhost_user_migration_done,
         .vhost_backend_can_merge = vhost_user_can_merge,
@@ -20,6 +20,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-packed-ring.h"
 #include "migration/qemu-file-types.h"
 #include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
@@ -43,13 +44,6 @@ typedef struct VRingDesc
     uint16_t next;
 } VRingDesc;
 
-typedef struct VRingPackedDesc {
-    uint64_t addr;
-    uint32_t len;
-    uint16_t id;
-    uint16_t flags;
-} VRingPackedDesc;
-
 typedef struct VRingAvail
 {
     uint16_t flags;
@@ -122,6 +116,14 @@ struct VirtQueue
 
     unsigned int inuse;
 
+    /* Recycled elements, linked through their first word.  All of them
+     * were allocated for requests of pool_sz bytes, see
+     * virtqueue_alloc_element().
+     */
+    void *pool;
+    unsigned int pool_len;
+    size_t pool_sz;
+
     uint16_t vector;
     VirtIOHandleOutput handle_output;
     VirtIOHandleAIOOutput handle_aio_output;
@@ -503,11 +505,31 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+/*
+ * Return the descriptor table behind @cache if it is plain host memory
+ * covering descriptor @i, NULL if it has to go through the slow accessors.
+ */
+static inline VRingPackedDesc *vring_packed_desc_ring(MemoryRegionCache *cache,
+                                                      int i)
+{
+    if (likely(cache->ptr)) {
+        assert(i < cache->len / sizeof(VRingPackedDesc));
+    }
+    return cache->ptr;
+}
+
 static void vring_packed_desc_read_flags(VirtIODevice *vdev,
                                          uint16_t *flags,
                                          MemoryRegionCache *cache,
                                          int i)
 {
+    VRingPackedDesc *ring = vring_packed_desc_ring(cache, i);
+
+    if (ring) {
+        *flags = lduw_le_p(&ring[i].flags);
+        return;
+    }
+
     address_space_read_cached(cache,
                               i * sizeof(VRingPackedDesc) +
                               offsetof(VRingPackedDesc, flags),
@@ -520,8 +542,21 @@ static void vring_packed_desc_read(VirtIODevice *vdev,
                                    MemoryRegionCache *cache,
                                    int i, bool strict_order)
 {
+    VRingPackedDesc *ring = vring_packed_desc_ring(cache, i);
     hwaddr off = i * sizeof(VRingPackedDesc);
 
+    if (ring) {
+        uint16_t flags = lduw_le_p(&ring[i].flags);
+
+        if (strict_order) {
+            /* Make sure flags is read before the rest fields. */
+            smp_rmb();
+        }
+        vring_packed_desc_load(ring, i, desc);
+        desc->flags = flags;
+        return;
+    }
+
     vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
 
     if (strict_order) {
@@ -575,6 +610,16 @@ static void vring_packed_desc_write(VirtIODevice *vdev,
                                     MemoryRegionCache *cache,
                                     int i, bool strict_order)
 {
+    VRingPackedDesc *ring = vring_packed_desc_ring(cache, i);
+
+    if (ring) {
+        vring_packed_desc_store_used(ring, i, desc->id, desc->len,
+                                     desc->flags, strict_order);
+        address_space_cache_invalidate(cache, i * sizeof(VRingPackedDesc),
+                                       sizeof(VRingPackedDesc));
+        return;
+    }
+
     vring_packed_desc_write_data(vdev, desc, cache, i);
     if (strict_order) {
         /* Make sure data is wrote before flags. */
@@ -583,15 +628,6 @@ static void vring_packed_desc_write(VirtIODevice *vdev,
     vring_packed_desc_write_flags(vdev, desc, cache, i);
 }
 
-static inline bool is_desc_avail(uint16_t flags, bool wrap_counter)
-{
-    bool avail, used;
-
-    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
-    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
-    return (avail != used) && (avail == wrap_counter);
-}
-
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers.
  * Called within rcu_read_lock().  */
@@ -650,7 +686,8 @@ static int virtio_queue_packed_empty_rcu(VirtQueue *vq)
     vring_packed_desc_read_flags(vq->vdev, &desc.flags, &cache->desc,
                                  vq->last_avail_idx);
 
-    return !is_desc_avail(desc.flags, vq->last_avail_wrap_counter);
+    return !vring_packed_desc_is_avail(desc.flags,
+                                       vq->last_avail_wrap_counter);
 }
 
 static int virtio_queue_packed_empty(VirtQueue *vq)
@@ -737,7 +774,7 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
 {
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        virtqueue_packed_rewind(vq, 1);
+        virtqueue_packed_rewind(vq, elem->ndescs);
     } else {
         virtqueue_split_rewind(vq, 1);
     }
@@ -918,6 +955,32 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* virtqueue_push_batch:
+ * @vq: The #VirtQueue
+ * @elems: The elements to complete, in any order
+ * @lens: Number of bytes written for each element, or NULL if none
+ * @num: Number of elements
+ *
+ * Same as calling virtqueue_push() for each element, but the used index is
+ * only published once.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int num)
+{
+    unsigned int i;
+
+    if (!num) {
+        return;
+    }
+
+    assert(num <= vq->vring.num);
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < num; i++) {
+        virtqueue_fill(vq, elems[i], lens ? lens[i] : 0, i);
+    }
+    virtqueue_flush(vq, num);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1158,7 +1221,7 @@ static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
 
         desc_cache = &caches->desc;
         vring_packed_desc_read(vdev, &desc, desc_cache, idx, true);
-        if (!is_desc_avail(desc.flags, wrap_counter)) {
+        if (!vring_packed_desc_is_avail(desc.flags, wrap_counter)) {
             break;
         }
 
@@ -1387,7 +1450,25 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static size_t virtqueue_element_size(size_t sz, unsigned int num_sg)
+{
+    size_t addr_end = QEMU_ALIGN_UP(sz, __alignof__(hwaddr)) +
+                      num_sg * sizeof(hwaddr);
+
+    return QEMU_ALIGN_UP(addr_end, __alignof__(struct iovec)) +
+           num_sg * sizeof(struct iovec);
+}
+
+/* Elements with up to VIRTQUEUE_POOL_SG mappings are allocated with room for
+ * that many, so that they can be recycled by virtqueue_element_free() for
+ * any later request on the same queue.  Up to VIRTQUEUE_POOL_SIZE of them
+ * are kept per queue.
+ */
+#define VIRTQUEUE_POOL_SG       64
+#define VIRTQUEUE_POOL_SIZE     64
+
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
@@ -1396,10 +1477,26 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
     size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    bool pooled = false;
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (vq && out_num + in_num <= VIRTQUEUE_POOL_SG &&
+        (!vq->pool_sz || vq->pool_sz == sz)) {
+        vq->pool_sz = sz;
+        pooled = true;
+    }
+
+    if (pooled && vq->pool) {
+        elem = vq->pool;
+        vq->pool = *(void **)elem;
+        vq->pool_len--;
+    } else if (pooled) {
+        elem = g_malloc(virtqueue_element_size(sz, VIRTQUEUE_POOL_SG));
+    } else {
+        elem = g_malloc(out_sg_end);
+    }
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+    elem->pooled = pooled;
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -1409,7 +1506,10 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/* Called within rcu_read_lock(), when the ring is known to have available
+ * elements.  The caller updates the avail event.
+ */
+static void *virtqueue_split_pop_rcu(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     VRingMemoryRegionCaches *caches;
@@ -1424,14 +1524,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1446,10 +1538,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
     caches = vring_get_region_caches(vq);
@@ -1521,7 +1609,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1546,7 +1634,61 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    elem = virtqueue_split_pop_rcu(vq, sz);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    unsigned int num = 0;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* A single read of the avail index covers the whole batch.  */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    while (num < max) {
+        elems[num] = virtqueue_split_pop_rcu(vq, sz);
+        if (!elems[num]) {
+            break;
+        }
+        num++;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return num;
+}
+
+/* Called within rcu_read_lock(), when the ring is known to have available
+ * elements.
+ */
+static void *virtqueue_packed_pop_rcu(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
     VRingMemoryRegionCaches *caches;
@@ -1558,15 +1700,11 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     unsigned out_num, in_num, elem_entries;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc *ring;
     VRingPackedDesc desc;
     uint16_t id;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1591,7 +1729,20 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     }
 
     desc_cache = &caches->desc;
-    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    ring = vring_packed_desc_ring(desc_cache, i);
+    if (ring) {
+        /* The next element most likely starts in the following line */
+        unsigned int ahead = i + VRING_PACKED_DESC_PER_LINE;
+
+        vring_packed_desc_prefetch(ring, ahead < max ? ahead : ahead - max);
+        if (!vring_packed_desc_load_avail(ring, i,
+                                          vq->last_avail_wrap_counter,
+                                          &desc)) {
+            goto done;
+        }
+    } else {
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    }
     id = desc.id;
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingPackedDesc)) {
@@ -1647,7 +1798,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1681,6 +1832,32 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+
+    return virtqueue_packed_pop_rcu(vq, sz);
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    unsigned int num = 0;
+
+    RCU_READ_LOCK_GUARD();
+    while (num < max && !virtio_queue_packed_empty_rcu(vq)) {
+        elems[num] = virtqueue_packed_pop_rcu(vq, sz);
+        if (!elems[num]) {
+            break;
+        }
+        num++;
+    }
+    return num;
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -1694,6 +1871,69 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/* virtqueue_pop_batch:
+ * @vq: The #VirtQueue
+ * @sz: Size of each element, as for virtqueue_pop()
+ * @elems: Array of at least @max pointers, filled with the popped elements
+ * @max: Maximum number of elements to pop
+ *
+ * Pop up to @max elements in one go, with a single read of the avail index
+ * and a single update of the avail event for split rings.  The elements are
+ * returned in ring order and should be freed with virtqueue_element_free().
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop_batch(vq, sz, elems, max);
+    } else {
+        return virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+}
+
+/* virtqueue_element_free:
+ * @vq: The #VirtQueue the element was popped from
+ * @opaque: The element, or the device request that embeds it
+ *
+ * Free an element returned by virtqueue_pop() or virtqueue_pop_batch(),
+ * keeping it around for reuse by the next pops on @vq if possible.
+ * Elements from qemu_get_virtqueue_element() can be freed this way too.
+ */
+void virtqueue_element_free(VirtQueue *vq, void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+
+    if (!elem) {
+        return;
+    }
+
+    if (elem->pooled && vq && vq->pool_len < VIRTQUEUE_POOL_SIZE) {
+        *(void **)elem = vq->pool;
+        vq->pool = elem;
+        vq->pool_len++;
+        return;
+    }
+    g_free(elem);
+}
+
+static void virtqueue_pool_drain(VirtQueue *vq)
+{
+    while (vq->pool) {
+        void *elem = vq->pool;
+
+        vq->pool = *(void **)elem;
+        g_free(elem);
+    }
+    vq->pool_len = 0;
+    vq->pool_sz = 0;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1720,7 +1960,8 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
          */
         vring_packed_desc_read(vdev, &desc, desc_cache,
                                vq->last_avail_idx , true);
-        if (!is_desc_avail(desc.flags, vq->last_avail_wrap_counter)) {
+        if (!vring_packed_desc_is_avail(desc.flags,
+                                        vq->last_avail_wrap_counter)) {
             break;
         }
         elem.index = desc.id;
@@ -1827,7 +2068,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -2424,6 +2665,7 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_aio_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    virtqueue_pool_drain(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -3653,6 +3895,9 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         return;
     }
 
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtqueue_pool_drain(&vdev->vq[i]);
+    }
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         if (vdev->vq[i].vring.num == 0) {
             break;
@@ -3680,7 +3925,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -3742,7 +3987,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
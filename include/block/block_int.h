@@ -32,6 +32,7 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
 
@@ -68,6 +69,8 @@ enum BdrvTrackedRequestType {
     BDRV_TRACKED_TRUNCATE,
 };
 
+typedef struct BdrvAllocMap BdrvAllocMap;
+
 typedef struct BdrvTrackedRequest {
     BlockDriverState *bs;
     int64_t offset;
@@ -79,6 +82,8 @@ typedef struct BdrvTrackedRequest {
     uint64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    /* Keyed by overlap_offset/overlap_bytes, in bs->tracked_requests_tree */
+    IntervalTreeNode overlap_node;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
@@ -102,6 +107,13 @@ struct BlockDriver {
      * on those children.
      */
     bool is_format;
+    /*
+     * Set to true if the driver's request callbacks may run in several
+     * AioContexts at once, which lets a multiqueue BlockBackend submit
+     * requests from the IOThread it received them in.  See
+     * bdrv_supports_multiqueue().
+     */
+    bool supports_multiqueue;
     /*
      * Return true if @to_replace can be replaced by a BDS with the
      * same data as @bs without it affecting @bs's behavior (that is,
@@ -473,6 +485,13 @@ struct BlockDriver {
     void (*bdrv_attach_aio_context)(BlockDriverState *bs,
                                     AioContext *new_context);
 
+    /*
+     * Release per-AioContext resources set up for requests that came from
+     * AioContexts other than the node's own (see supports_multiqueue).
+     * Called with no in-flight requests.
+     */
+    void (*bdrv_drop_multiqueue)(BlockDriverState *bs);
+
     /* io queue for linux-aio */
     void (*bdrv_io_plug)(BlockDriverState *bs);
     void (*bdrv_io_unplug)(BlockDriverState *bs);
@@ -910,6 +929,9 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Which layer of the backing chain allocates what, see alloc-map.c */
+    BdrvAllocMap *alloc_map;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -939,6 +961,7 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_requests_tree;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -987,6 +1010,9 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     int64_t offset, unsigned int bytes,
     QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_preadv_backing(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes,
+    QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags);
 int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
@@ -1015,7 +1041,13 @@ void bdrv_apply_subtree_drain(BdrvChild *child, BlockDriverState *new_parent);
 void bdrv_unapply_subtree_drain(BdrvChild *child, BlockDriverState *old_parent);
 
 bool coroutine_fn bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align);
+bool bdrv_supports_multiqueue(BlockDriverState *bs);
+void bdrv_drop_multiqueue(BlockDriverState *bs);
 BdrvTrackedRequest *coroutine_fn bdrv_co_get_self_request(BlockDriverState *bs);
+bool coroutine_fn bdrv_co_has_overlapping_writes(BlockDriverState *bs,
+                                                 int64_t offset,
+                                                 int64_t bytes,
+                                                 bool ignore_self);
 
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
@@ -1306,6 +1338,20 @@ bool blk_dev_is_medium_locked(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+enum {
+    BDRV_ALLOC_MAP_ALLOCATED = 1,
+    BDRV_ALLOC_MAP_UNALLOCATED = 2,
+};
+
+BdrvAllocMap *bdrv_alloc_map_new(void);
+void bdrv_alloc_map_free(BdrvAllocMap *map);
+int bdrv_alloc_map_lookup(BlockDriverState *bs, BlockDriverState *base,
+                          int64_t offset, int64_t bytes, int64_t *pnum,
+                          int *depth, BdrvChild **child);
+void bdrv_alloc_map_invalidate(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes);
+void bdrv_alloc_map_reset(BlockDriverState *bs);
+
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
 void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup);
 bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
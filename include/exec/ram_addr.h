@@ -438,6 +438,35 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/*
+ * Shift the dirty history of the BITS_PER_LONG pages starting at page
+ * (@word * BITS_PER_LONG) of @rb, recording which of them are in @bits,
+ * i.e. were dirtied since the previous sync.
+ */
+static inline void ramblock_dirty_history_record(RAMBlock *rb,
+                                                 unsigned long word,
+                                                 unsigned long bits)
+{
+    uint8_t *history = rb->dirty_history + word * BITS_PER_LONG;
+    const uint64_t *h64 = (const uint64_t *)history;
+    uint64_t any = 0;
+    int i;
+
+    if (!bits) {
+        for (i = 0; i < BITS_PER_LONG / 8; i++) {
+            any |= h64[i];
+        }
+        if (!any) {
+            /* Never dirtied recently, nothing to age */
+            return;
+        }
+    }
+
+    for (i = 0; i < BITS_PER_LONG; i++) {
+        history[i] = (history[i] << 1) | ((bits >> i) & 1);
+    }
+}
+
 /* Called with RCU critical section */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
@@ -466,9 +495,11 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
         for (k = page; k < page + nr; k++) {
+            unsigned long bits = 0;
+
             if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
+                bits = atomic_xchg(&src[idx][offset], 0);
                 *real_dirty_pages += ctpopl(bits);
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
@@ -476,6 +507,10 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 num_dirty += ctpopl(new_dirty);
             }
 
+            if (rb->dirty_history) {
+                ramblock_dirty_history_record(rb, k, bits);
+            }
+
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
@@ -498,16 +533,21 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
         ram_addr_t offset = rb->offset;
 
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_test_and_clear_dirty(
+            long k = (start + addr) >> TARGET_PAGE_BITS;
+            bool dirty = cpu_physical_memory_test_and_clear_dirty(
                         start + addr + offset,
                         TARGET_PAGE_SIZE,
-                        DIRTY_MEMORY_MIGRATION)) {
+                        DIRTY_MEMORY_MIGRATION);
+
+            if (dirty) {
                 *real_dirty_pages += 1;
-                long k = (start + addr) >> TARGET_PAGE_BITS;
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
             }
+            if (rb->dirty_history) {
+                rb->dirty_history[k] = (rb->dirty_history[k] << 1) | dirty;
+            }
         }
     }
 
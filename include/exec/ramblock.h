@@ -59,6 +59,14 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * One byte per target page, recording in which of the last 8 dirty
+     * bitmap syncs the page was dirtied (bit 0 is the most recent sync).
+     * Only allocated during migration with the defer-hot-pages
+     * capability; padded to a multiple of BITS_PER_LONG pages.
+     */
+    uint8_t *dirty_history;
 };
 #endif
 #endif
@@ -33,6 +33,7 @@ typedef struct VHostUserBlk {
     uint16_t num_queues;
     uint32_t queue_size;
     uint32_t config_wce;
+    uint32_t poll_us;
     struct vhost_dev dev;
     struct vhost_inflight *inflight;
     VhostUserState vhost_user;
@@ -34,8 +34,12 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    /* IOThreads (by id) that the virtqueues are spread over */
+    uint32_t num_iothreads;
+    char **iothreads;
     char *serial;
     uint32_t request_merging;
+    uint32_t merge_window_us;
     uint16_t num_queues;
     uint16_t queue_size;
     bool seg_max_adjust;
@@ -47,6 +51,15 @@ struct VirtIOBlkConf
 struct VirtIOBlockDataPlane;
 
 struct VirtIOBlockReq;
+
+#define VIRTIO_BLK_MAX_MERGE_REQS 32
+
+typedef struct MultiReqBuffer {
+    struct VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int num_reqs;
+    bool is_write;
+} MultiReqBuffer;
+
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -61,6 +74,16 @@ typedef struct VirtIOBlock {
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
+
+    /*
+     * Read/write requests not yet submitted, shared by all virtqueues and
+     * protected by the BlockBackend's AioContext lock.  With a merge window
+     * they are held until merge_timer fires or the window is flushed.
+     */
+    MultiReqBuffer mrb;
+    QEMUTimer *merge_timer;
+    AioContext *merge_timer_ctx;
+    bool merge_window_open;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -77,15 +100,8 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-#define VIRTIO_BLK_MAX_MERGE_REQS 32
-
-typedef struct MultiReqBuffer {
-    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
-    unsigned int num_reqs;
-    bool is_write;
-} MultiReqBuffer;
-
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
 void virtio_blk_process_queued_requests(VirtIOBlock *s, bool is_bh);
+void virtio_blk_flush_merge_window(VirtIOBlock *s);
 
 #endif
@@ -19,6 +19,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
 #include "qemu/option_int.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -45,6 +46,9 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    /* IOThreads (by id) that the queue pairs are spread over */
+    uint32_t num_iothreads;
+    char **iothreads;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -104,6 +108,7 @@ typedef struct VirtioNetRscSeg {
     size_t size;
     uint16_t packets;
     uint16_t dup_ack;
+    uint16_t mss;           /* payload of the first data packet */
     bool is_coalesced;      /* need recal ipv4 header checksum, mark here */
     VirtioNetRscUnit unit;
     NetClientState *nc;
@@ -119,6 +124,7 @@ typedef struct VirtioNetRscChain {
     uint8_t  gso_type;
     uint16_t max_payload;
     QEMUTimer *drain_timer;
+    QEMUBH *drain_bh;
     QTAILQ_HEAD(, VirtioNetRscSeg) buffers;
     VirtioNetRscStat stat;
 } VirtioNetRscChain;
@@ -138,8 +144,17 @@ typedef struct VirtioNetRssData {
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
+    /* Built from key whenever it changes */
+    struct NetToeplitzTable *toeplitz;
 } VirtioNetRssData;
 
+/* A packet that RSS steered to a queue pair in another IOThread */
+typedef struct VirtIONetRssPacket {
+    QSIMPLEQ_ENTRY(VirtIONetRssPacket) next;
+    size_t size;
+    uint8_t data[];
+} VirtIONetRssPacket;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -149,7 +164,22 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* Software checksum/segmentation for peers without vnet headers */
+    struct NetTxPkt *tx_pkt;
+    /* Used to compute the RSS hash of received packets */
+    struct NetRxPkt *rx_pkt;
+    /* Packets steered here by RSS from other IOThreads */
+    QemuMutex rss_lock;
+    QSIMPLEQ_HEAD(, VirtIONetRssPacket) rss_packets;
+    unsigned int rss_pending;
+    QEMUBH *rss_bh;
+    /* Receiving a batch of packets, notify the guest once at the end */
+    bool rx_notify_deferred;
+    bool rx_notify_pending;
     struct VirtIONet *n;
+    /* IOThread the queue pair and its peer run in, if any */
+    IOThread *iothread;
+    AioContext *ctx;
 } VirtIONetQueue;
 
 struct VirtIONet {
@@ -171,6 +201,10 @@ struct VirtIONet {
     uint32_t rsc_timeout;
     uint8_t rsc4_enabled;
     uint8_t rsc6_enabled;
+    /* Offloads emulated in software when the peer has no vnet header */
+    bool sw_offload;
+    /* Coalesced packets are passed to the guest as GSO packets */
+    bool sw_gro;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
@@ -214,7 +248,7 @@ struct VirtIONet {
     DeviceListener primary_listener;
     Notifier migration_state;
     VirtioNetRssData rss_data;
-    struct NetRxPkt *rx_pkt;
+    bool dataplane_started;
 };
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
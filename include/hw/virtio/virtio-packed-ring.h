@@ -0,0 +1,100 @@
+/*
+ * Packed virtqueue descriptor access for rings in host memory
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef QEMU_VIRTIO_PACKED_RING_H
+#define QEMU_VIRTIO_PACKED_RING_H
+
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+/* Descriptors in one 64-byte cache line */
+#define VRING_PACKED_DESC_PER_LINE (64 / sizeof(VRingPackedDesc))
+
+static inline bool vring_packed_desc_is_avail(uint16_t flags,
+                                              bool wrap_counter)
+{
+    bool avail, used;
+
+    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+    return (avail != used) && (avail == wrap_counter);
+}
+
+/*
+ * The helpers below work on a ring that is directly addressable host
+ * memory, as returned in MemoryRegionCache.ptr.  Packed virtqueues require
+ * VIRTIO_F_VERSION_1, so descriptors are always little-endian and each one
+ * is read with two 64-bit loads: addr, then len, id and flags together.
+ */
+
+static inline void vring_packed_desc_load(const VRingPackedDesc *ring,
+                                          unsigned int i,
+                                          VRingPackedDesc *desc)
+{
+    uint64_t w = ldq_le_p(&ring[i].len);
+
+    desc->addr = ldq_le_p(&ring[i].addr);
+    desc->len = w;
+    desc->id = w >> 32;
+    desc->flags = w >> 48;
+}
+
+/*
+ * Read descriptor @i if the driver made it available for @wrap_counter.
+ * The flags are validated before the other fields are read.
+ */
+static inline bool vring_packed_desc_load_avail(const VRingPackedDesc *ring,
+                                                unsigned int i,
+                                                bool wrap_counter,
+                                                VRingPackedDesc *desc)
+{
+    uint64_t w = ldq_le_p(&ring[i].len);
+
+    if (!vring_packed_desc_is_avail(w >> 48, wrap_counter)) {
+        return false;
+    }
+
+    /* Make sure flags is read before the rest fields. */
+    smp_rmb();
+    vring_packed_desc_load(ring, i, desc);
+    desc->flags = w >> 48;
+    return true;
+}
+
+/* Write back a used descriptor; flags go last with @strict_order */
+static inline void vring_packed_desc_store_used(VRingPackedDesc *ring,
+                                                unsigned int i,
+                                                uint16_t id, uint32_t len,
+                                                uint16_t flags,
+                                                bool strict_order)
+{
+    stl_le_p(&ring[i].len, len);
+    stw_le_p(&ring[i].id, id);
+    if (strict_order) {
+        /* Make sure data is wrote before flags. */
+        smp_wmb();
+    }
+    stw_le_p(&ring[i].flags, flags);
+}
+
+/* Start loading the cache line that holds descriptor @i */
+static inline void vring_packed_desc_prefetch(const VRingPackedDesc *ring,
+                                              unsigned int i)
+{
+    __builtin_prefetch(&ring[i]);
+}
+
+#endif
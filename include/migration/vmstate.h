@@ -182,6 +182,14 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * With x-parallel-device-state, the section may be saved on a worker
+     * thread that does not hold the iothread lock, concurrently with other
+     * sections, and may be loaded after other sections of the same
+     * priority.  Only set it when the hooks, needed callbacks and fields
+     * only touch state that is private to the device.
+     */
+    bool parallel_save;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
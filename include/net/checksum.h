@@ -103,4 +103,33 @@ void net_toeplitz_add(uint32_t *result,
     *result = accumulator;
 }
 
+/* Longest Toeplitz input used for RSS: IPv6 addresses and L4 ports */
+#define NET_TOEPLITZ_MAX_INPUT_LEN 36
+
+/*
+ * Toeplitz hash with one table lookup per input byte rather than one
+ * shift and test per input bit.  The table only depends on the key, so
+ * it is built once whenever the key changes.
+ */
+typedef struct NetToeplitzTable {
+    uint32_t t[NET_TOEPLITZ_MAX_INPUT_LEN][256];
+} NetToeplitzTable;
+
+void net_toeplitz_table_init(NetToeplitzTable *table,
+                             const uint8_t *key, size_t key_len);
+
+static inline uint32_t
+net_toeplitz_table_hash(const NetToeplitzTable *table,
+                        const uint8_t *input, size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    assert(len <= NET_TOEPLITZ_MAX_INPUT_LEN);
+    for (i = 0; i < len; i++) {
+        hash ^= table->t[i][input[i]];
+    }
+    return hash;
+}
+
 #endif /* QEMU_NET_CHECKSUM_H */
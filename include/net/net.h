@@ -60,6 +60,14 @@ typedef int (SetVnetBE)(NetClientState *, bool);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
+typedef void (SetAioContext)(NetClientState *, AioContext *);
+/*
+ * Receive a batch of packets, one buffer per packet.  Returns how many
+ * were consumed, with each result in the ssize_t array; the client stops
+ * at the first packet it cannot take yet, which will be redelivered.
+ */
+typedef int (NetReceiveIOVBatch)(NetClientState *, const struct iovec *,
+                                 int, ssize_t *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -67,6 +75,7 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveIOVBatch *receive_iov_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -81,6 +90,7 @@ typedef struct NetClientInfo {
     SetVnetLE *set_vnet_le;
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
+    SetAioContext *set_aio_context;
 } NetClientInfo;
 
 struct NetClientState {
@@ -100,6 +110,8 @@ struct NetClientState {
     int vnet_hdr_len;
     bool is_netdev;
     QTAILQ_HEAD(, NetFilterState) filters;
+    /* AioContext the backend runs in, NULL for the main loop */
+    AioContext *ctx;
 };
 
 typedef struct NICState {
@@ -165,6 +177,8 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_can_set_aio_context(NetClientState *nc);
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
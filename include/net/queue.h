@@ -44,7 +44,19 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/*
+ * Deliver @count packets, packet i being the buffer @iov[i].  Stops at
+ * the first packet that would return 0 and returns how many it consumed,
+ * storing their results in @ret.  Only used for packets without flags.
+ */
+typedef int (NetQueueDeliverBatchFunc)(const struct iovec *iov,
+                                       int count,
+                                       ssize_t *ret,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
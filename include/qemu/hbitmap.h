@@ -42,6 +42,9 @@ struct HBitmapIter {
     /* Entry offset into the last-level array of longs.  */
     size_t pos;
 
+    /* Copied from hb when the current last-level word was loaded.  */
+    uint64_t gen;
+
     /* The currently-active path in the tree.  Each item of cur[i] stores
      * the bits (i.e. the subtrees) yet to be processed under that node.
      */
@@ -57,10 +60,24 @@ struct HBitmapIter {
  * in, and then affect the entire set; iteration will only visit the first
  * bit of each group.
  *
- * Allocate a new HBitmap.
+ * Allocate a new HBitmap.  Large bitmaps use a sparse representation,
+ * whose memory usage depends on how many bits are set and how they are
+ * clustered rather than on @size.
  */
 HBitmap *hbitmap_alloc(uint64_t size, int granularity);
 
+/**
+ * hbitmap_alloc_dense:
+ * @size: Number of bits in the bitmap.
+ * @granularity: Granularity of the bitmap.
+ *
+ * Like hbitmap_alloc, but always store the bitmap as a flat array of
+ * words, whatever its size.  Growing the bitmap with hbitmap_truncate
+ * may still switch it to the sparse representation.  This is mostly
+ * useful to compare the two representations in tests and benchmarks.
+ */
+HBitmap *hbitmap_alloc_dense(uint64_t size, int granularity);
+
 /**
  * hbitmap_truncate:
  * @hb: The bitmap to change the size of.
@@ -71,6 +88,14 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity);
  */
 void hbitmap_truncate(HBitmap *hb, uint64_t size);
 
+/**
+ * hbitmap_memory_usage:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes of memory allocated for @hb.
+ */
+uint64_t hbitmap_memory_usage(const HBitmap *hb);
+
 /**
  * hbitmap_merge:
  *
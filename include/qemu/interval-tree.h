@@ -0,0 +1,83 @@
+/*
+ * Intrusive interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * A balanced search tree of closed intervals [start, last] that answers
+ * "which intervals overlap this range" in O(log n + k).  Unlike IOVATree,
+ * intervals may overlap each other and no memory is allocated: callers
+ * embed an IntervalTreeNode in their own structure and use container_of()
+ * to get back to it.
+ *
+ * There is no locking; callers must serialise accesses to a tree.
+ */
+
+typedef struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;              /* Inclusive */
+
+    /* Private */
+    uint64_t subtree_last;
+    uint32_t priority;
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+    uint32_t seed;
+} IntervalTreeRoot;
+
+/* Return true to select @node */
+typedef bool IntervalTreeMatchFunc(IntervalTreeNode *node, void *opaque);
+
+/**
+ * interval_tree_insert:
+ *
+ * @root: the tree to insert into
+ * @node: the node to insert, with start and last filled in
+ *
+ * @node must not already be in a tree.  A zero-initialized
+ * IntervalTreeRoot is an empty tree.
+ */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_remove:
+ *
+ * @root: the tree @node was inserted into
+ * @node: the node to remove
+ *
+ * The start of @node must not have been changed since it was inserted.
+ */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_find:
+ *
+ * @root: the tree to search
+ * @start: first point of the range to look up
+ * @last: last point of the range to look up (inclusive)
+ * @match: optional filter, called on every overlapping node in
+ *         order of increasing start until it returns true
+ * @opaque: passed to @match
+ *
+ * Returns: the first node overlapping [@start, @last] that @match
+ * accepts, or NULL if there is none.  @match must not modify the tree.
+ */
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t last,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque);
+
+static inline bool interval_tree_is_empty(IntervalTreeRoot *root)
+{
+    return !root->root;
+}
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Estimates how fast the guest dirties its memory, by enabling dirty
+ * logging for a while and counting the pages that were written.  This
+ * lets management predict how a migration will converge before it is
+ * started.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "exec/ram_addr.h"
+#include "sysemu/runstate.h"
+#include "migration.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+#define DIRTYRATE_MIN_CALC_TIME 1
+#define DIRTYRATE_MAX_CALC_TIME 60
+
+/* All of these are protected by the iothread lock */
+static DirtyRateStatus dirtyrate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static int64_t dirtyrate_start_time;
+static int64_t dirtyrate_calc_time;
+static uint64_t dirtyrate_pages;
+
+bool dirtyrate_is_measuring(void)
+{
+    return dirtyrate_status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+/* Called with RCU critical section */
+static uint64_t dirtyrate_count_block(RAMBlock *block)
+{
+    DirtyMemoryBlocks *blocks =
+        atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+    unsigned long page = block->offset >> TARGET_PAGE_BITS;
+    unsigned long end = page + (block->used_length >> TARGET_PAGE_BITS);
+    uint64_t count = 0;
+
+    while (page < end) {
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long num = MIN(end - page,
+                                DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        count += bitmap_count_one_with_offset(blocks->blocks[idx],
+                                              offset, num);
+        page += num;
+    }
+
+    return count;
+}
+
+/* Called with iothread lock held */
+static uint64_t dirtyrate_sync(bool count)
+{
+    RAMBlock *block;
+    uint64_t pages = 0;
+
+    memory_global_dirty_log_sync();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH(block) {
+            if (!qemu_ram_is_migratable(block) || !block->used_length) {
+                continue;
+            }
+            if (count) {
+                pages += dirtyrate_count_block(block);
+            }
+            cpu_physical_memory_test_and_clear_dirty(block->offset,
+                                                     block->used_length,
+                                                     DIRTY_MEMORY_MIGRATION);
+        }
+    }
+
+    return pages;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    uint64_t pages;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* Throw away whatever was logged before we started */
+    dirtyrate_sync(false);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(dirtyrate_calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    pages = dirtyrate_sync(true);
+    memory_global_dirty_log_stop();
+    dirtyrate_pages = pages;
+    dirtyrate_status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirtyrate_measured(dirtyrate_calc_time, pages);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    QemuThread thread;
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer between 1 and 60");
+        return;
+    }
+
+    if (dirtyrate_is_measuring()) {
+        error_setg(errp, "The dirty rate is already being measured");
+        return;
+    }
+
+    if (migration_is_running(s->state) ||
+        runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    dirtyrate_status = DIRTY_RATE_STATUS_MEASURING;
+    dirtyrate_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    dirtyrate_calc_time = calc_time;
+    dirtyrate_pages = 0;
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = dirtyrate_status;
+    info->start_time = dirtyrate_start_time;
+    info->calc_time = dirtyrate_calc_time;
+    info->page_size = TARGET_PAGE_SIZE;
+
+    if (dirtyrate_status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_pages = true;
+        info->dirty_pages = dirtyrate_pages;
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirtyrate_pages * TARGET_PAGE_SIZE / MiB /
+                           dirtyrate_calc_time;
+    }
+
+    return info;
+}
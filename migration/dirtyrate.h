@@ -0,0 +1,17 @@
+/*
+ * Dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/*
+ * Dirty logging is shared with migration, so the two must not run at
+ * the same time.
+ */
+bool dirtyrate_is_measuring(void);
+
+#endif
@@ -96,6 +96,9 @@ struct MigrationIncomingState {
      * */
     struct PostcopyBlocktimeContext *blocktime_ctx;
 
+    /* Fault latency statistics and prefetch state for postcopy */
+    struct PostcopyFaultContext *fault_ctx;
+
     /* notify PAUSED postcopy incoming migrations to try to continue */
     bool postcopy_recover_triggered;
     QemuSemaphore postcopy_pause_sem_dst;
@@ -111,6 +114,7 @@ void migration_incoming_state_destroy(void);
  * Functions to work with blocktime context
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
+void fill_destination_postcopy_fault_info(MigrationInfo *info);
 
 #define TYPE_MIGRATION "migration"
 
@@ -295,9 +299,15 @@ bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
+bool migrate_defer_hot_pages(void);
+int migrate_hot_page_threshold(void);
+bool migrate_parallel_device_state(void);
+int migrate_device_state_threads(void);
+uint32_t migrate_postcopy_prefetch_pages(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_zero_copy_send(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
@@ -100,7 +100,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_all_flags(p->c, p->pages->iov, used,
+                                        p->write_flags, errp);
 }
 
 /**
@@ -609,6 +610,32 @@ void multifd_send_sync_main(QEMUFile *f)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
     }
+
+    /*
+     * With zero copy the kernel may still be reading from guest memory
+     * for pages we have already handed to it.  Wait for all of them to
+     * complete, so that everything before the sync point has really
+     * been sent before we go on.  The channel threads are idle here.
+     */
+    if (migrate_zero_copy_send()) {
+        for (i = 0; i < migrate_multifd_channels(); i++) {
+            MultiFDSendParams *p = &multifd_send_state->params[i];
+            Error *local_err = NULL;
+            int ret;
+
+            if (!p->c) {
+                continue;
+            }
+            ret = qio_channel_flush(p->c, &local_err);
+            if (ret < 0) {
+                migrate_set_error(migrate_get_current(), local_err);
+                error_report_err(local_err);
+                qemu_file_set_error(f, -EIO);
+                return;
+            }
+            trace_multifd_send_sync_main_flush(p->id, ret == 1);
+        }
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
@@ -737,6 +764,17 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
         p->quit = true;
         object_unref(OBJECT(sioc));
         error_free(local_err);
+    } else if (migrate_zero_copy_send() &&
+               !qio_channel_has_feature(QIO_CHANNEL(sioc),
+                                        QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd channel %d does not support "
+                   "zero copy send", p->id);
+        migrate_set_error(migrate_get_current(), local_err);
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        qemu_sem_post(&p->sem_sync);
+        p->quit = true;
+        object_unref(OBJECT(sioc));
+        error_free(local_err);
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
@@ -755,6 +793,12 @@ int multifd_save_setup(Error **errp)
     if (!migrate_use_multifd()) {
         return 0;
     }
+    if (migrate_zero_copy_send() &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "Zero copy send cannot be used with "
+                   "multifd compression");
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
@@ -772,6 +816,8 @@ int multifd_save_setup(Error **errp)
         p->quit = false;
         p->pending_job = 0;
         p->id = i;
+        p->write_flags = migrate_zero_copy_send() ?
+                         QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
         p->pages = multifd_pages_init(page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
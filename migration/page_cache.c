@@ -17,6 +17,9 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/error.h"
 #include "qemu/host-utils.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -30,6 +33,13 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * Upper bound on the number of independently locked shards.  Each shard
+ * covers a contiguous range of cache slots, so that threads working on
+ * different areas of guest memory rarely contend for the same lock.
+ */
+#define PAGE_CACHE_MAX_SHARDS 64
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -39,7 +49,11 @@ struct CacheItem {
 };
 
 struct PageCache {
+    struct rcu_head rcu;
     CacheItem *page_cache;
+    QemuMutex *shard_locks;
+    unsigned int shard_shift;
+    size_t num_shards;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
@@ -93,6 +107,14 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
         cache->page_cache[i].it_addr = -1;
     }
 
+    cache->num_shards = MIN(cache->max_num_items, PAGE_CACHE_MAX_SHARDS);
+    cache->shard_shift = ctz64(cache->max_num_items) -
+                         ctz64(cache->num_shards);
+    cache->shard_locks = g_new(QemuMutex, cache->num_shards);
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_init(&cache->shard_locks[i]);
+    }
+
     return cache;
 }
 
@@ -107,11 +129,21 @@ void cache_fini(PageCache *cache)
         g_free(cache->page_cache[i].it_data);
     }
 
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_destroy(&cache->shard_locks[i]);
+    }
+    g_free(cache->shard_locks);
+
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
+void cache_fini_rcu(PageCache *cache)
+{
+    call_rcu(cache, cache_fini, rcu);
+}
+
 static size_t cache_get_cache_pos(const PageCache *cache,
                                   uint64_t address)
 {
@@ -119,6 +151,22 @@ static size_t cache_get_cache_pos(const PageCache *cache,
     return (address / cache->page_size) & (cache->max_num_items - 1);
 }
 
+static QemuMutex *cache_get_shard_lock(PageCache *cache, uint64_t addr)
+{
+    return &cache->shard_locks[cache_get_cache_pos(cache, addr) >>
+                               cache->shard_shift];
+}
+
+void cache_lock_page(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_lock(cache_get_shard_lock(cache, addr));
+}
+
+void cache_unlock_page(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_unlock(cache_get_shard_lock(cache, addr));
+}
+
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
     size_t pos;
@@ -172,7 +220,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             DPRINTF("Error allocating page\n");
             return -1;
         }
-        cache->num_items++;
+        atomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
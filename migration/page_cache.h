@@ -35,6 +35,37 @@ PageCache *cache_init(int64_t cache_size, size_t page_size, Error **errp);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_fini_rcu: free all cache resources after an RCU grace period
+ *
+ * Use this when other threads may still be accessing @cache from within
+ * an RCU read-side critical section.
+ *
+ * @cache pointer to the PageCache struct
+ */
+void cache_fini_rcu(PageCache *cache);
+
+/**
+ * cache_lock_page: lock the cache slot used by a page
+ *
+ * The cache is split into shards that are locked independently, so that
+ * several threads may look up, encode against and update different pages
+ * concurrently.  The lock must be held across cache_is_cached,
+ * get_cached_data, cache_insert and any access to the cached data.
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_lock_page(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_unlock_page: unlock the cache slot used by a page
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_unlock_page(PageCache *cache, uint64_t addr);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -171,6 +171,8 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    fill_destination_postcopy_fault_info(info);
+
     if (!bc) {
         return;
     }
@@ -193,6 +195,188 @@ static uint32_t get_postcopy_total_blocktime(void)
     return bc->total_blocktime;
 }
 
+/* Largest access stride, in host pages, that prefetch will follow */
+#define POSTCOPY_PREFETCH_MAX_STRIDE 16
+
+typedef struct PostcopyFaultContext {
+    /*
+     * Protects the counters and @pending, which are updated from both
+     * the fault thread and the thread placing the pages
+     */
+    QemuMutex lock;
+    /* host page address -> time (ns) the first fault on it was seen */
+    GHashTable *pending;
+    uint64_t faults;
+    uint64_t latency_total;
+    uint64_t latency_max;
+    uint64_t prefetch_requests;
+    uint64_t prefetch_pages;
+
+    /* Access pattern detection, only used by the fault thread */
+    RAMBlock *last_rb;
+    ram_addr_t last_offset;
+    int64_t stride;
+    uint32_t window;
+
+    /*
+     * Handler for exit event, necessary for
+     * releasing whole fault_ctx
+     */
+    Notifier exit_notifier;
+} PostcopyFaultContext;
+
+static void fault_context_exit_cb(Notifier *n, void *data)
+{
+    PostcopyFaultContext *ctx = container_of(n, PostcopyFaultContext,
+                                             exit_notifier);
+
+    g_hash_table_destroy(ctx->pending);
+    qemu_mutex_destroy(&ctx->lock);
+    g_free(ctx);
+}
+
+static PostcopyFaultContext *fault_context_new(void)
+{
+    PostcopyFaultContext *ctx = g_new0(PostcopyFaultContext, 1);
+
+    qemu_mutex_init(&ctx->lock);
+    ctx->pending = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    ctx->exit_notifier.notify = fault_context_exit_cb;
+    qemu_add_exit_notifier(&ctx->exit_notifier);
+    return ctx;
+}
+
+static void fault_context_reset_prefetch(PostcopyFaultContext *ctx)
+{
+    ctx->last_rb = NULL;
+    ctx->last_offset = 0;
+    ctx->stride = 0;
+    ctx->window = 0;
+}
+
+/*
+ * Remember when a vCPU first faulted on @host_page; later faults on the
+ * same page, while it is still in flight, keep the original time.
+ */
+static void postcopy_fault_begin(MigrationIncomingState *mis, void *host_page)
+{
+    PostcopyFaultContext *ctx = mis->fault_ctx;
+    int64_t *start;
+
+    if (!ctx) {
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->lock);
+    if (!g_hash_table_contains(ctx->pending, host_page)) {
+        ctx->faults++;
+        start = g_new(int64_t, 1);
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(ctx->pending, host_page, start);
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+/* @host_page has been placed; account the latency of a pending fault */
+static void postcopy_fault_end(MigrationIncomingState *mis, void *host_page)
+{
+    PostcopyFaultContext *ctx = mis->fault_ctx;
+    int64_t *start, latency;
+
+    if (!ctx) {
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->lock);
+    start = g_hash_table_lookup(ctx->pending, host_page);
+    if (start) {
+        latency = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start;
+        ctx->latency_total += latency;
+        ctx->latency_max = MAX(ctx->latency_max, latency);
+        g_hash_table_remove(ctx->pending, host_page);
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Populate MigrationInfo with the fault latency and prefetch counters.
+ * Latencies are reported in microseconds.
+ *
+ * @info: pointer to MigrationInfo to populate
+ */
+void fill_destination_postcopy_fault_info(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyFaultContext *ctx = mis->fault_ctx;
+    PostcopyFaultStats *stats;
+    uint64_t completed;
+
+    if (!ctx) {
+        return;
+    }
+
+    stats = g_new0(PostcopyFaultStats, 1);
+    qemu_mutex_lock(&ctx->lock);
+    completed = ctx->faults - g_hash_table_size(ctx->pending);
+    stats->faults = ctx->faults;
+    stats->latency_avg = completed ?
+                         ctx->latency_total / completed / SCALE_US : 0;
+    stats->latency_max = ctx->latency_max / SCALE_US;
+    stats->prefetch_requests = ctx->prefetch_requests;
+    stats->prefetch_pages = ctx->prefetch_pages;
+    qemu_mutex_unlock(&ctx->lock);
+
+    info->has_postcopy_fault_stats = true;
+    info->postcopy_fault_stats = stats;
+}
+
+/*
+ * Work out how many pages to prefetch after a fault at @rb_offset.
+ *
+ * Faults that keep landing a constant number of host pages apart (a
+ * sequential scan being the common case) open up a prefetch window that
+ * doubles on every fault that follows the pattern, up to the
+ * postcopy-prefetch-pages parameter.  Any fault that breaks the pattern
+ * closes the window again.
+ *
+ * Returns the number of pages to prefetch, and their stride in @stride.
+ */
+static uint32_t postcopy_prefetch_window(MigrationIncomingState *mis,
+                                         RAMBlock *rb, ram_addr_t rb_offset,
+                                         int64_t *stride)
+{
+    PostcopyFaultContext *ctx = mis->fault_ctx;
+    uint32_t max = migrate_postcopy_prefetch_pages();
+    int64_t pagesize = qemu_ram_pagesize(rb);
+    int64_t delta = 0;
+
+    if (!ctx || !max) {
+        return 0;
+    }
+
+    if (rb == ctx->last_rb) {
+        delta = ((int64_t)rb_offset - (int64_t)ctx->last_offset) / pagesize;
+    }
+
+    /*
+     * When pages are prefetched the next fault lands past the window we
+     * asked for, so accept any multiple of the stride up to that point.
+     */
+    if (ctx->stride && delta && delta % ctx->stride == 0 &&
+        delta / ctx->stride >= 1 && delta / ctx->stride <= ctx->window + 1) {
+        ctx->window = ctx->window ? MIN(ctx->window * 2, max) : 1;
+    } else {
+        ctx->window = 0;
+        ctx->stride = (delta && ABS(delta) <= POSTCOPY_PREFETCH_MAX_STRIDE) ?
+                      delta : 0;
+    }
+    ctx->last_rb = rb;
+    ctx->last_offset = rb_offset;
+
+    *stride = ctx->stride;
+    return ctx->window;
+}
+
 /**
  * receive_ufd_features: check userfault fd features, to request only supported
  * features in the future.
@@ -869,6 +1053,77 @@ static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
     return true;
 }
 
+static int postcopy_request_range(MigrationIncomingState *mis, RAMBlock *rb,
+                                  ram_addr_t start, size_t len)
+{
+    if (rb != mis->last_rb) {
+        mis->last_rb = rb;
+        return migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
+                                         start, len);
+    }
+    /* Save some space */
+    return migrate_send_rp_req_pages(mis, NULL, start, len);
+}
+
+/*
+ * Send the request to the source - we want to request one of our host
+ * page sizes (which is >= TPS), followed by up to @prefetch pages that
+ * are @stride host pages apart.  A sequential prefetch is folded into
+ * the request for the faulting page; any other stride needs a request
+ * per page.  Pages we already have are never asked for.
+ */
+static int postcopy_request_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                  ram_addr_t rb_offset, uint32_t prefetch,
+                                  int64_t stride)
+{
+    PostcopyFaultContext *ctx = mis->fault_ctx;
+    ram_addr_t used_length = qemu_ram_get_used_length(rb);
+    int64_t pagesize = qemu_ram_pagesize(rb);
+    size_t len = pagesize;
+    uint32_t i, sent = 0;
+    int64_t offset;
+    int ret;
+
+    if (stride == 1) {
+        for (i = 1; i <= prefetch; i++) {
+            offset = rb_offset + i * pagesize;
+            /* The length goes on the wire as 32 bits */
+            if (offset >= used_length || len + pagesize > UINT32_MAX ||
+                ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+                break;
+            }
+            len += pagesize;
+        }
+        sent = len / pagesize - 1;
+        prefetch = 0;
+    }
+
+    ret = postcopy_request_range(mis, rb, rb_offset, len);
+
+    for (i = 1; !ret && i <= prefetch; i++) {
+        offset = rb_offset + i * stride * pagesize;
+        if (offset < 0 || offset >= used_length) {
+            break;
+        }
+        if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+            continue;
+        }
+        ret = postcopy_request_range(mis, rb, offset, pagesize);
+        sent++;
+    }
+
+    if (sent) {
+        trace_postcopy_ram_fault_prefetch(qemu_ram_get_idstr(rb), rb_offset,
+                                          stride, sent);
+        qemu_mutex_lock(&ctx->lock);
+        ctx->prefetch_requests++;
+        ctx->prefetch_pages += sent;
+        qemu_mutex_unlock(&ctx->lock);
+    }
+
+    return ret;
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -906,6 +1161,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
     while (true) {
         ram_addr_t rb_offset;
+        uint32_t prefetch;
+        int64_t stride = 0;
         int poll_result;
 
         /*
@@ -928,6 +1185,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
              */
             if (postcopy_pause_fault_thread(mis)) {
                 mis->last_rb = NULL;
+                if (mis->fault_ctx) {
+                    fault_context_reset_prefetch(mis->fault_ctx);
+                }
                 /* Continue to read the userfaultfd */
             } else {
                 error_report("%s: paused but don't allow to continue",
@@ -997,26 +1257,15 @@ static void *postcopy_ram_fault_thread(void *opaque)
             mark_postcopy_blocktime_begin(
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
+            postcopy_fault_begin(mis, (void *)(uintptr_t)
+                                 (msg.arg.pagefault.address &
+                                  ~(uint64_t)(qemu_ram_pagesize(rb) - 1)));
+            prefetch = postcopy_prefetch_window(mis, rb, rb_offset,
+                                                &stride);
 
 retry:
-            /*
-             * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
-             */
-            if (rb != mis->last_rb) {
-                mis->last_rb = rb;
-                ret = migrate_send_rp_req_pages(mis,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset,
-                                                qemu_ram_pagesize(rb));
-            } else {
-                /* Save some space */
-                ret = migrate_send_rp_req_pages(mis,
-                                                NULL,
-                                                rb_offset,
-                                                qemu_ram_pagesize(rb));
-            }
-
+            ret = postcopy_request_pages(mis, rb, rb_offset, prefetch,
+                                         stride);
             if (ret) {
                 /* May be network failure, try to wait for recovery */
                 if (ret == -EIO && postcopy_pause_fault_thread(mis)) {
@@ -1121,6 +1370,12 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
+    /* don't create fault_ctx if it exists, as for recovery */
+    if (!mis->fault_ctx) {
+        mis->fault_ctx = fault_context_new();
+    }
+    fault_context_reset_prefetch(mis->fault_ctx);
+
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -1193,7 +1448,7 @@ static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
-
+        postcopy_fault_end(migration_incoming_get_current(), host_addr);
     }
     return ret;
 }
@@ -1276,6 +1531,10 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
 {
 }
 
+void fill_destination_postcopy_fault_info(MigrationInfo *info)
+{
+}
+
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis)
 {
     error_report("%s: No OS support", __func__);
@@ -88,6 +88,13 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/* @val must have been finished with qjson_finish() */
+void json_prop_qjson(QJSON *json, const char *name, QJSON *val)
+{
+    json_emit_element(json, name);
+    qstring_append(json->str, qjson_get_str(val));
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
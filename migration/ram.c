@@ -89,7 +89,11 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE.  The pointer is replaced under lock and read
+     * with RCU; the cached pages themselves are protected by the
+     * cache's own per-shard locks.
+     */
     PageCache *cache;
     QemuMutex lock;
     /* it will store a page full of zeros */
@@ -116,7 +120,9 @@ static void XBZRLE_cache_unlock(void)
  * This function is called from qmp_migrate_set_cache_size in main
  * thread, possibly while a migration is in progress.  A running
  * migration may be using the cache and might finish during this call,
- * hence changes to the cache are protected by XBZRLE.lock().
+ * hence changes to the cache are protected by XBZRLE.lock().  Threads
+ * that are encoding against the old cache hold the RCU read lock, so
+ * it is only freed once they are done with it.
  *
  * Returns 0 for success or -1 for error
  *
@@ -125,7 +131,7 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(int64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
+    PageCache *new_cache, *old_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -149,8 +155,10 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        /* Only readers that saw the old cache can still be using it */
+        old_cache = XBZRLE.cache;
+        atomic_rcu_set(&XBZRLE.cache, new_cache);
+        cache_fini_rcu(old_cache);
     }
 out:
     XBZRLE_cache_unlock();
@@ -346,6 +354,10 @@ struct RAMState {
     uint64_t target_page_count;
     /* number of dirty bits in the bitmap */
     uint64_t migration_dirty_pages;
+    /* number of dirty pages that were hot at the last bitmap sync */
+    uint64_t hot_dirty_pages;
+    /* hot pages are currently held back until the completion stage */
+    bool defer_hot_pages;
     /* Protects modification of the bitmap and migration dirty pages */
     QemuMutex bitmap_mutex;
     /* The RAMBlock used in the last src_page_requests */
@@ -665,14 +677,20 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
  */
 static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 {
+    PageCache *cache;
+
     if (rs->ram_bulk_stage || !migrate_use_xbzrle()) {
         return;
     }
 
+    cache = atomic_rcu_read(&XBZRLE.cache);
+
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+    cache_lock_page(cache, current_addr);
+    cache_insert(cache, current_addr, XBZRLE.zero_target_page,
                  ram_counters.dirty_sync_count);
+    cache_unlock_page(cache, current_addr);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -684,31 +702,35 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
  *          0 means that page is identical to the one already sent
  *          -1 means that xbzrle would be longer than normal
  *
+ * The caller must hold the lock for @current_addr in @cache.
+ *
  * @rs: current RAM state
+ * @cache: XBZRLE page cache
  * @current_data: pointer to the address of the page contents
  * @current_addr: addr of the page
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
  * @last_stage: if we are at the completion stage
  */
-static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
+static int save_xbzrle_page(RAMState *rs, PageCache *cache,
+                            uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr,
+    if (!cache_is_cached(cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
+            if (cache_insert(cache, current_addr, *current_data,
                              ram_counters.dirty_sync_count) == -1) {
                 return -1;
             } else {
                 /* update *current_data when the page has been
                    inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+                *current_data = get_cached_data(cache, current_addr);
             }
         }
         return -1;
@@ -726,7 +748,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
      * guest page is good for xbzrle encoding.
      */
     xbzrle_counters.pages++;
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    prev_cached_page = get_cached_data(cache, current_addr);
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
@@ -778,11 +800,29 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     return 1;
 }
 
+/**
+ * ramblock_page_is_hot: check whether a page is dirtied frequently
+ *
+ * Returns true if @page was dirtied in at least hot-page-threshold of
+ * the last 8 dirty bitmap syncs
+ *
+ * @rb: RAMBlock that contains the page
+ * @page: page offset within the RAMBlock
+ */
+static inline bool ramblock_page_is_hot(RAMBlock *rb, unsigned long page)
+{
+    return rb->dirty_history &&
+           ctpop8(rb->dirty_history[page]) >= migrate_hot_page_threshold();
+}
+
 /**
  * migration_bitmap_find_dirty: find the next dirty page from start
  *
  * Returns the page offset within memory region of the start of a dirty page
  *
+ * Pages that are dirtied frequently are skipped while hot pages are
+ * being held back, so that colder pages are sent first.
+ *
  * @rs: current RAM state
  * @rb: RAMBlock where to search for dirty pages
  * @start: page where we start the search
@@ -807,6 +847,10 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
         next = start + 1;
     } else {
         next = find_next_bit(bitmap, size, start);
+        while (rs->defer_hot_pages && next < size &&
+               ramblock_page_is_hot(rb, next)) {
+            next = find_next_bit(bitmap, size, next + 1);
+        }
     }
 
     return next;
@@ -864,6 +908,26 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
                                               &rs->num_dirty_pages_period);
 }
 
+/* Called with RCU critical section and bitmap_mutex held */
+static uint64_t ramblock_count_hot_dirty(RAMBlock *rb)
+{
+    unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long page;
+    uint64_t count = 0;
+
+    if (!rb->dirty_history) {
+        return 0;
+    }
+
+    for (page = find_first_bit(rb->bmap, size); page < size;
+         page = find_next_bit(rb->bmap, size, page + 1)) {
+        if (ramblock_page_is_hot(rb, page)) {
+            count++;
+        }
+    }
+    return count;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -988,10 +1052,13 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
+        rs->hot_dirty_pages = 0;
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             ramblock_sync_dirty_bitmap(rs, block);
+            rs->hot_dirty_pages += ramblock_count_hot_dirty(block);
         }
         ram_counters.remaining = ram_bytes_remaining();
+        ram_counters.hot_pages = rs->hot_dirty_pages;
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
@@ -1180,14 +1247,16 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
+    PageCache *cache = NULL;
 
     p = block->host + offset;
     trace_ram_save_page(block->idstr, (uint64_t)offset, p);
 
-    XBZRLE_cache_lock();
     if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
         migrate_use_xbzrle()) {
-        pages = save_xbzrle_page(rs, &p, current_addr, block,
+        cache = atomic_rcu_read(&XBZRLE.cache);
+        cache_lock_page(cache, current_addr);
+        pages = save_xbzrle_page(rs, cache, &p, current_addr, block,
                                  offset, last_stage);
         if (!last_stage) {
             /* Can't send this cached data async, since the cache page
@@ -1202,7 +1271,9 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         pages = save_normal_page(rs, block, offset, p, send_async);
     }
 
-    XBZRLE_cache_unlock();
+    if (cache) {
+        cache_unlock_page(cache, current_addr);
+    }
 
     return pages;
 }
@@ -1673,9 +1744,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
          * page would be stale
          */
         if (!save_page_use_compression(rs)) {
-            XBZRLE_cache_lock();
             xbzrle_cache_zero_page(rs, block->offset + offset);
-            XBZRLE_cache_unlock();
         }
         ram_release_pages(block->idstr, offset, res);
         return res;
@@ -1894,6 +1963,8 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->dirty_history);
+        block->dirty_history = NULL;
     }
 
     xbzrle_cleanup();
@@ -2335,6 +2406,10 @@ static void ram_list_init_bitmaps(void)
             bitmap_set(block->bmap, 0, pages);
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (migrate_defer_hot_pages()) {
+                block->dirty_history = g_new0(uint8_t, BITS_TO_LONGS(pages) *
+                                                       BITS_PER_LONG);
+            }
         }
     }
 }
@@ -2635,6 +2710,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     RAMState *rs = *temp;
     int ret = 0;
 
+    /* Everything that is still dirty has to go now, hot or not */
+    rs->defer_hot_pages = false;
+
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
             migration_bitmap_sync_precopy(rs);
@@ -2693,6 +2771,16 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
         remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
     }
 
+    /*
+     * Hot pages are still counted as remaining, so they are included in
+     * the downtime estimate.  Only hold them back while they can all be
+     * sent within the downtime limit; if there are more of them, holding
+     * them back would prevent the migration from ever converging.
+     */
+    rs->defer_hot_pages = migrate_defer_hot_pages() &&
+                          !migration_in_postcopy() &&
+                          rs->hot_dirty_pages * TARGET_PAGE_SIZE < max_size;
+
     if (migrate_postcopy_ram()) {
         /* We can do postcopy, and all the data is postcopiable */
         *res_compatible += remaining_size;
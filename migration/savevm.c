@@ -85,10 +85,12 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_DEVICE_STATE,      /* Device sections to load in parallel */
     MIG_CMD_MAX
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE UINT32_MAX
+#define MAX_VM_CMD_DEVICE_STATE_SECTIONS 65536
 static struct mig_cmd_args {
     ssize_t     len; /* -1 = variable */
     const char *name;
@@ -104,6 +106,7 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_DEVICE_STATE]     = { .len =  4, .name = "DEVICE_STATE" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -1353,12 +1356,199 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
+/*
+ * Device sections that are saved on several threads when
+ * x-parallel-device-state is enabled.  Only sections whose
+ * VMStateDescription sets parallel_save are grouped, and only with
+ * sections of the same priority; everything else goes through the
+ * stream in sequence.
+ */
+typedef struct SaveVMDeviceJob {
+    SaveStateEntry *se;
+    /* Buffer file holding the complete section, and its channel */
+    QEMUFile *f;
+    QIOChannelBuffer *bioc;
+    /* The section's entry in the "devices" array of the vmdesc */
+    QJSON *vmdesc;
+    int ret;
+} SaveVMDeviceJob;
+
+typedef struct SaveVMDeviceJobs {
+    SaveVMDeviceJob *jobs;
+    unsigned int count;
+    /* Index of the next job to be picked up */
+    unsigned int next;
+} SaveVMDeviceJobs;
+
+static bool savevm_section_parallel_ok(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel_save && !se->is_ram;
+}
+
+static void savevm_save_device_job(SaveVMDeviceJob *job)
+{
+    SaveStateEntry *se = job->se;
+    /* The file keeps a reference to the channel until it is closed */
+    job->bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(job->bioc), "migration-device-state");
+    job->f = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+    object_unref(OBJECT(job->bioc));
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+
+    job->vmdesc = qjson_new();
+    json_prop_str(job->vmdesc, "name", se->idstr);
+    json_prop_int(job->vmdesc, "instance_id", se->instance_id);
+
+    save_section_header(job->f, se, QEMU_VM_SECTION_FULL);
+    job->ret = vmstate_save(job->f, se, job->vmdesc);
+    if (job->ret) {
+        return;
+    }
+    trace_savevm_section_end(se->idstr, se->section_id, 0);
+    save_section_footer(job->f, se);
+    qjson_finish(job->vmdesc);
+    qemu_fflush(job->f);
+    job->ret = qemu_file_get_error(job->f);
+}
+
+static void savevm_device_jobs_process(SaveVMDeviceJobs *jobs)
+{
+    unsigned int i;
+
+    while ((i = atomic_fetch_inc(&jobs->next)) < jobs->count) {
+        savevm_save_device_job(&jobs->jobs[i]);
+    }
+}
+
+static void *savevm_device_jobs_thread(void *opaque)
+{
+    rcu_register_thread();
+    savevm_device_jobs_process(opaque);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Run all the jobs on up to device-state-threads threads, including the
+ * calling one, and wait for them to finish.  The other threads do not
+ * hold the iothread lock, which is why only sections that opted in with
+ * parallel_save are handed to them.
+ */
+static void savevm_device_jobs_run(SaveVMDeviceJobs *jobs)
+{
+    int n_threads = MIN(migrate_device_state_threads(), jobs->count) - 1;
+    QemuThread *threads = NULL;
+    int i;
+
+    if (n_threads > 0) {
+        threads = g_new(QemuThread, n_threads);
+    }
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_create(&threads[i], "devstate", savevm_device_jobs_thread,
+                           jobs, QEMU_THREAD_JOINABLE);
+    }
+    savevm_device_jobs_process(jobs);
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+}
+
+static int savevm_save_section_full(QEMUFile *f, SaveStateEntry *se,
+                                    QJSON *vmdesc)
+{
+    int ret;
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+
+    json_start_object(vmdesc, NULL);
+    json_prop_str(vmdesc, "name", se->idstr);
+    json_prop_int(vmdesc, "instance_id", se->instance_id);
+
+    save_section_header(f, se, QEMU_VM_SECTION_FULL);
+    ret = vmstate_save(f, se, vmdesc);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    trace_savevm_section_end(se->idstr, se->section_id, 0);
+    save_section_footer(f, se);
+
+    json_end_object(vmdesc);
+    return 0;
+}
+
+/*
+ * Save a group of independent device sections, emptying @group.
+ *
+ * The sections are serialized concurrently into separate buffers and
+ * sent as a single MIG_CMD_DEVICE_STATE command:
+ *   be32 number of sections
+ *   for each section: be32 length, then the section as it would
+ *   otherwise appear in the stream (header, state, footer)
+ * Their vmdesc entries are added in the same order.
+ */
+static int savevm_save_device_state_group(QEMUFile *f, GPtrArray *group,
+                                          QJSON *vmdesc)
+{
+    SaveVMDeviceJobs jobs = { 0 };
+    uint32_t tmp;
+    unsigned int i;
+    int ret = 0;
+
+    if (group->len <= 1) {
+        if (group->len) {
+            ret = savevm_save_section_full(f, g_ptr_array_index(group, 0),
+                                           vmdesc);
+        }
+        g_ptr_array_set_size(group, 0);
+        return ret;
+    }
+
+    jobs.count = group->len;
+    jobs.jobs = g_new0(SaveVMDeviceJob, jobs.count);
+    for (i = 0; i < jobs.count; i++) {
+        jobs.jobs[i].se = g_ptr_array_index(group, i);
+    }
+    g_ptr_array_set_size(group, 0);
+
+    savevm_device_jobs_run(&jobs);
+
+    for (i = 0; i < jobs.count && !ret; i++) {
+        ret = jobs.jobs[i].ret;
+    }
+    if (!ret) {
+        trace_savevm_send_device_state(jobs.count);
+        tmp = cpu_to_be32(jobs.count);
+        qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE, 4, (uint8_t *)&tmp);
+        for (i = 0; i < jobs.count; i++) {
+            QIOChannelBuffer *bioc = jobs.jobs[i].bioc;
+
+            qemu_put_be32(f, bioc->usage);
+            qemu_put_buffer(f, bioc->data, bioc->usage);
+            json_prop_qjson(vmdesc, NULL, jobs.jobs[i].vmdesc);
+        }
+    } else {
+        qemu_file_set_error(f, ret);
+    }
+
+    for (i = 0; i < jobs.count; i++) {
+        qemu_fclose(jobs.jobs[i].f);
+        qjson_destroy(jobs.jobs[i].vmdesc);
+    }
+    g_free(jobs.jobs);
+    return ret;
+}
+
 static
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
     g_autoptr(QJSON) vmdesc = NULL;
+    g_autoptr(GPtrArray) group = g_ptr_array_new();
+    bool parallel = migrate_parallel_device_state();
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
@@ -1376,22 +1566,28 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
-        trace_savevm_section_start(se->idstr, se->section_id);
-
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
+        /* A change of priority is an ordering point */
+        if (group->len &&
+            save_state_priority(g_ptr_array_index(group, 0)) !=
+            save_state_priority(se)) {
+            ret = savevm_save_device_state_group(f, group, vmdesc);
+            if (ret) {
+                return ret;
+            }
+        }
+        if (parallel && savevm_section_parallel_ok(se)) {
+            g_ptr_array_add(group, se);
+            continue;
+        }
 
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        ret = vmstate_save(f, se, vmdesc);
+        ret = savevm_save_section_full(f, se, vmdesc);
         if (ret) {
-            qemu_file_set_error(f, ret);
             return ret;
         }
-        trace_savevm_section_end(se->idstr, se->section_id, 0);
-        save_section_footer(f, se);
-
-        json_end_object(vmdesc);
+    }
+    ret = savevm_save_device_state_group(f, group, vmdesc);
+    if (ret) {
+        return ret;
     }
 
     if (inactivate_disks) {
@@ -2066,6 +2262,69 @@ static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis)
     return ret;
 }
 
+static int qemu_loadvm_section_start_full(QEMUFile *f,
+                                          MigrationIncomingState *mis);
+
+/*
+ * Load a group of device sections sent by savevm_save_device_state_group().
+ * @f is the file the command arrived on: in postcopy that is the packaged
+ * buffer rather than mis->from_src_file.  Only the source saves them in
+ * parallel: here they are loaded one after the other, in stream order and
+ * with the iothread lock held, just like sections sent on their own.
+ */
+static int loadvm_handle_device_state(QEMUFile *f,
+                                      MigrationIncomingState *mis)
+{
+    uint32_t count = qemu_get_be32(f);
+    uint32_t i;
+    int ret = 0;
+
+    trace_loadvm_handle_device_state(count);
+
+    if (count > MAX_VM_CMD_DEVICE_STATE_SECTIONS) {
+        error_report("CMD_DEVICE_STATE: too many sections: %u", count);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < count && !ret; i++) {
+        uint32_t length = qemu_get_be32(f);
+        QIOChannelBuffer *bioc;
+        QEMUFile *section_f;
+        uint8_t section_type;
+
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+
+        bioc = qio_channel_buffer_new(length);
+        qio_channel_set_name(QIO_CHANNEL(bioc), "migration-device-state");
+        if (qemu_get_buffer(f, bioc->data, length) != length) {
+            object_unref(OBJECT(bioc));
+            error_report("CMD_DEVICE_STATE: Buffer receive fail for "
+                         "section %u length=%u", i, length);
+            ret = qemu_file_get_error(f) ?: -EINVAL;
+            break;
+        }
+        bioc->usage = length;
+        /* The file keeps a reference to the channel until it is closed */
+        section_f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+        object_unref(OBJECT(bioc));
+
+        section_type = qemu_get_byte(section_f);
+        if (section_type != QEMU_VM_SECTION_FULL) {
+            error_report("CMD_DEVICE_STATE: unexpected section type 0x%x",
+                         section_type);
+            ret = -EINVAL;
+        } else {
+            ret = qemu_loadvm_section_start_full(section_f, mis);
+        }
+        qemu_fclose(section_f);
+    }
+
+    return ret;
+}
+
 /*
  * Handle request that source requests for recved_bitmap on
  * destination. Payload format:
@@ -2177,6 +2436,9 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_PACKAGED:
         return loadvm_handle_cmd_packaged(mis);
 
+    case MIG_CMD_DEVICE_STATE:
+        return loadvm_handle_device_state(f, mis);
+
     case MIG_CMD_POSTCOPY_ADVISE:
         return loadvm_postcopy_handle_advise(mis, len);
 
@@ -18,4 +18,11 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * The encoder is picked at startup from the vector extensions supported
+ * by the host; all of them produce the same output.
+ */
+const char *xbzrle_encode_accel(void);
+bool test_xbzrle_encode_next_accel(void);
 #endif
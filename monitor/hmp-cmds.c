@@ -281,6 +281,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->hot_pages) {
+            monitor_printf(mon, "hot pages: %" PRIu64 " pages\n",
+                           info->ram->hot_pages);
+        }
     }
 
     if (info->has_disk) {
@@ -343,6 +347,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_fault_stats) {
+        monitor_printf(mon, "postcopy faults: %" PRIu64 "\n",
+                       info->postcopy_fault_stats->faults);
+        monitor_printf(mon, "postcopy fault latency avg: %" PRIu64 " us\n",
+                       info->postcopy_fault_stats->latency_avg);
+        monitor_printf(mon, "postcopy fault latency max: %" PRIu64 " us\n",
+                       info->postcopy_fault_stats->latency_max);
+        monitor_printf(mon, "postcopy prefetch requests: %" PRIu64 "\n",
+                       info->postcopy_fault_stats->prefetch_requests);
+        monitor_printf(mon, "postcopy prefetch pages: %" PRIu64 "\n",
+                       info->postcopy_fault_stats->prefetch_pages);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -430,6 +447,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
             params->max_cpu_throttle);
+        assert(params->has_hot_page_threshold);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_HOT_PAGE_THRESHOLD),
+            params->hot_page_threshold);
+        assert(params->has_device_state_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DEVICE_STATE_THREADS),
+            params->device_state_threads);
+        assert(params->has_postcopy_prefetch_pages);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES),
+            params->postcopy_prefetch_pages);
         assert(params->has_tls_creds);
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_CREDS),
@@ -1293,6 +1322,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_max_cpu_throttle = true;
         visit_type_int(v, param, &p->max_cpu_throttle, &err);
         break;
+    case MIGRATION_PARAMETER_HOT_PAGE_THRESHOLD:
+        p->has_hot_page_threshold = true;
+        visit_type_int(v, param, &p->hot_page_threshold, &err);
+        break;
+    case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+        p->has_device_state_threads = true;
+        visit_type_int(v, param, &p->device_state_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+        p->has_postcopy_prefetch_pages = true;
+        visit_type_int(v, param, &p->postcopy_prefetch_pages, &err);
+        break;
     case MIGRATION_PARAMETER_TLS_CREDS:
         p->has_tls_creds = true;
         p->tls_creds = g_new0(StrOrNull, 1);
@@ -0,0 +1,477 @@
+/*
+ * AF_XDP network backend
+ *
+ * Packets are exchanged with the kernel through rings that point into a
+ * memory area (the UMEM) shared between QEMU and the network device.
+ * Each queue of the netdev has its own socket and UMEM, bound to one
+ * queue of the host interface.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <bpf/libbpf.h>
+#include <bpf/xsk.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+
+/* Descriptors taken off the RX ring per wakeup */
+#define AF_XDP_BATCH_SIZE       64
+
+#define AF_XDP_FRAME_SIZE       XSK_UMEM__DEFAULT_FRAME_SIZE
+#define AF_XDP_NUM_FRAMES       (XSK_RING_PROD__DEFAULT_NUM_DESCS * 2 + \
+                                 XSK_RING_CONS__DEFAULT_NUM_DESCS * 2)
+
+typedef struct AFXDPState {
+    NetClientState       nc;
+
+    struct xsk_socket    *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+
+    char                 ifname[IFNAMSIZ];
+    int                  ifindex;
+    int                  queue;
+    uint32_t             xdp_flags;
+    uint16_t             bind_flags;
+    bool                 read_poll;
+    bool                 write_poll;
+
+    /* Frames submitted to the TX ring that did not complete yet */
+    uint32_t             outstanding_tx;
+    /* Wakes up the kernel once for all the packets of a guest TX burst */
+    QEMUBH               *kick_bh;
+
+    /* Stack of UMEM frames owned by QEMU */
+    uint64_t             *pool;
+    uint32_t             n_pool;
+    char                 *buffer;
+    struct xsk_umem      *umem;
+
+    /* Only set on the first queue, which detaches the XDP program */
+    uint32_t             n_queues;
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+/* Set the event-loop handlers for the AF_XDP backend. */
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    int fd = xsk_socket__fd(s->xsk);
+    IOHandler *fd_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *fd_write = s->write_poll ? af_xdp_writable : NULL;
+
+    if (s->nc.ctx) {
+        aio_set_fd_handler(s->nc.ctx, fd, false, fd_read, fd_write,
+                           NULL, s);
+    } else {
+        qemu_set_fd_handler(fd, fd_read, fd_write, s);
+    }
+}
+
+/* Update the read handler. */
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Update the write handler. */
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->write_poll = enable;
+        s->read_poll  = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Return the frames of completed transmissions to the pool. */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t i, done, idx = 0;
+
+    if (!s->outstanding_tx) {
+        return;
+    }
+
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS,
+                               &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+        s->outstanding_tx -= done;
+    }
+}
+
+/* Give up to @n frames from the pool to the kernel for receiving. */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    n = MIN(n, s->n_pool);
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static void af_xdp_kick(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+/*
+ * The fd_write() callback, invoked if the socket is marked as
+ * writable after a poll.  Reclaim completed frames and flush any
+ * buffered packets.
+ */
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+    AioContext *ctx = s->nc.ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    af_xdp_complete_tx(s);
+    af_xdp_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t len = iov_size(iov, iovcnt);
+    struct xdp_desc *desc;
+    uint32_t idx;
+
+    if (len > AF_XDP_FRAME_SIZE) {
+        /* Does not fit a frame, like a packet above the MTU. */
+        return len;
+    }
+
+    af_xdp_complete_tx(s);
+    if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        /* Wait for the kernel to complete some transmissions. */
+        af_xdp_write_poll(s, true);
+        qemu_bh_schedule(s->kick_bh);
+        return 0;
+    }
+
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = s->pool[--s->n_pool];
+    desc->len = len;
+    iov_to_buf(iov, iovcnt, 0, xsk_umem__get_data(s->buffer, desc->addr),
+               len);
+
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+    qemu_bh_schedule(s->kick_bh);
+
+    return len;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+/*
+ * Complete a previous send (backend --> guest) and enable the
+ * fd_read callback.
+ */
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    AioContext *ctx = s->nc.ctx;
+    uint32_t i, n_rx, idx = 0;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+
+    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    for (i = 0; i < n_rx; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+        struct iovec iov = {
+            .iov_base = xsk_umem__get_data(s->buffer, desc->addr),
+            .iov_len = desc->len,
+        };
+
+        /*
+         * The peer either consumes the packet or copies it to its queue,
+         * so the frame can be reused right away.  The address may include
+         * the headroom reserved by the kernel.
+         */
+        s->pool[s->n_pool++] = desc->addr & ~(uint64_t)(AF_XDP_FRAME_SIZE - 1);
+
+        if (!qemu_sendv_packet_async(&s->nc, &iov, 1,
+                                     af_xdp_send_completed)) {
+            /*
+             * The peer does not receive anymore.  Packet is queued, stop
+             * reading from the backend until af_xdp_send_completed().
+             * The descriptors after it stay in the ring.
+             */
+            af_xdp_read_poll(s, false);
+            s->rx.cached_cons -= n_rx - i - 1;
+            n_rx = i + 1;
+            break;
+        }
+    }
+
+    if (n_rx) {
+        xsk_ring_cons__release(&s->rx, n_rx);
+        af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+    }
+
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    /* Unregister from the old context, then register in the new one */
+    af_xdp_poll(nc, false);
+    qemu_bh_delete(s->kick_bh);
+    nc->ctx = ctx;
+    s->kick_bh = aio_bh_new(ctx ?: qemu_get_aio_context(), af_xdp_kick, s);
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    af_xdp_update_fd_handler(s);
+}
+
+/* Flush and close. */
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    if (s->kick_bh) {
+        qemu_bh_delete(s->kick_bh);
+        s->kick_bh = NULL;
+    }
+
+    g_free(s->pool);
+    s->pool = NULL;
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+
+    /* The XDP program loaded by libbpf is shared by all the queues. */
+    if (s->n_queues &&
+        bpf_set_link_xdp_fd(s->ifindex, -1, s->xdp_flags)) {
+        error_report("Unable to detach XDP program from %s", s->ifname);
+    }
+}
+
+static int af_xdp_umem_create(AFXDPState *s, Error **errp)
+{
+    size_t size = (size_t)AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE;
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = AF_XDP_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint64_t i;
+    int ret;
+
+    s->buffer = qemu_memalign(qemu_real_host_page_size, size);
+    memset(s->buffer, 0, size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, size, &s->fq, &s->cq,
+                           &config);
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to create UMEM for %s queue %d",
+                         s->ifname, s->queue);
+        return -1;
+    }
+
+    s->pool = g_new(uint64_t, AF_XDP_NUM_FRAMES);
+    for (i = 0; i < AF_XDP_NUM_FRAMES; i++) {
+        s->pool[s->n_pool++] = i * AF_XDP_FRAME_SIZE;
+    }
+
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s, Error **errp)
+{
+    struct xsk_socket_config config = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libbpf_flags = 0,
+        .xdp_flags = s->xdp_flags | XDP_FLAGS_UPDATE_IF_NOEXIST,
+        .bind_flags = s->bind_flags,
+    };
+    int ret;
+
+    ret = xsk_socket__create(&s->xsk, s->ifname, s->queue, s->umem,
+                             &s->rx, &s->tx, &config);
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to create AF_XDP socket "
+                         "for %s queue %d", s->ifname, s->queue);
+        return -1;
+    }
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+/* NetClientInfo methods */
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .set_aio_context = af_xdp_set_aio_context,
+    .cleanup = af_xdp_cleanup,
+};
+
+/*
+ * The exported init function
+ *
+ * ... -netdev af-xdp,ifname="..."
+ */
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    uint32_t xdp_flags = 0;
+    uint16_t bind_flags = XDP_USE_NEED_WAKEUP;
+    int64_t i, queues, start_queue;
+    unsigned int ifindex;
+    AFXDPState *s;
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "failed to get ifindex for '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    queues = opts->has_queues ? opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "invalid number of queues (%" PRIi64 ") for '%s'",
+                   queues, opts->ifname);
+        return -1;
+    }
+
+    start_queue = opts->has_start_queue ? opts->start_queue : 0;
+    if (start_queue < 0 || start_queue > INT_MAX - queues) {
+        error_setg(errp, "invalid start-queue (%" PRIi64 ") for '%s'",
+                   start_queue, opts->ifname);
+        return -1;
+    }
+
+    if (opts->has_mode) {
+        xdp_flags |= opts->mode == AFXDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE
+                                                     : XDP_FLAGS_SKB_MODE;
+    }
+    if (opts->has_force_copy && opts->force_copy) {
+        bind_flags |= XDP_COPY;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s,queue=%"
+                 PRIi64, opts->ifname, start_queue + i);
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+        s->ifindex = ifindex;
+        s->queue = start_queue + i;
+        s->xdp_flags = xdp_flags;
+        s->bind_flags = bind_flags;
+        s->kick_bh = qemu_bh_new(af_xdp_kick, s);
+
+        if (af_xdp_umem_create(s, errp) || af_xdp_socket_create(s, errp)) {
+            qemu_del_net_client(nc0);
+            return -1;
+        }
+
+        /* The first socket attached the XDP program. */
+        if (i == 0) {
+            s->n_queues = queues;
+        }
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
+    }
+
+    return 0;
+}
@@ -16,6 +16,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/host-utils.h"
 #include "net/checksum.h"
 #include "net/eth.h"
 
@@ -190,3 +191,32 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+void net_toeplitz_table_init(NetToeplitzTable *table,
+                             const uint8_t *key, size_t key_len)
+{
+    uint32_t bit_key[8];
+    uint64_t window;
+    unsigned int i, j, v;
+
+    for (i = 0; i < NET_TOEPLITZ_MAX_INPUT_LEN; i++) {
+        /*
+         * Bit j of input byte i, counting from the most significant one,
+         * selects the 32 key bits that start at bit i * 8 + j.
+         */
+        window = 0;
+        for (j = 0; j < 5; j++) {
+            window = (window << 8) | (i + j < key_len ? key[i + j] : 0);
+        }
+        for (j = 0; j < 8; j++) {
+            bit_key[j] = window >> (8 - j);
+        }
+
+        table->t[i][0] = 0;
+        for (v = 1; v < 256; v++) {
+            /* Clear the lowest set bit and add the key it selects */
+            j = 7 - ctz32(v);
+            table->t[i][v] = table->t[i][v & (v - 1)] ^ bit_key[j];
+        }
+    }
+}
@@ -46,6 +46,7 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "block/aio-wait.h"
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
 #include "sysemu/sysemu.h"
@@ -230,6 +231,10 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        const struct iovec *iov,
                                        int iovcnt,
                                        void *opaque);
+static int qemu_deliver_packet_batch(const struct iovec *iov,
+                                     int count,
+                                     ssize_t *ret,
+                                     void *opaque);
 
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
@@ -254,6 +259,10 @@ static void qemu_net_client_setup(NetClientState *nc,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    if (info->receive_iov_batch) {
+        qemu_net_queue_set_deliver_batch(nc->incoming_queue,
+                                         qemu_deliver_packet_batch);
+    }
     nc->destructor = destructor;
     QTAILQ_INIT(&nc->filters);
 }
@@ -349,6 +358,27 @@ static void qemu_free_net_client(NetClientState *nc)
     }
 }
 
+static void qemu_net_client_detach_bh(void *opaque)
+{
+    qemu_set_aio_context(opaque, NULL);
+}
+
+/* Bring clients back to the main loop before they are torn down */
+static void qemu_detach_net_clients(NetClientState **ncs, int queues)
+{
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        AioContext *ctx = ncs[i]->ctx;
+
+        if (ctx) {
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, qemu_net_client_detach_bh, ncs[i]);
+            aio_context_release(ctx);
+        }
+    }
+}
+
 void qemu_del_net_client(NetClientState *nc)
 {
     NetClientState *ncs[MAX_QUEUE_NUM];
@@ -380,6 +410,7 @@ void qemu_del_net_client(NetClientState *nc)
         for (i = 0; i < queues; i++) {
             ncs[i]->peer->link_down = true;
         }
+        qemu_detach_net_clients(ncs, queues);
 
         if (nc->peer->info->link_status_changed) {
             nc->peer->info->link_status_changed(nc->peer);
@@ -392,6 +423,7 @@ void qemu_del_net_client(NetClientState *nc)
         return;
     }
 
+    qemu_detach_net_clients(ncs, queues);
     for (i = 0; i < queues; i++) {
         qemu_cleanup_net_client(ncs[i]);
         qemu_free_net_client(ncs[i]);
@@ -516,6 +548,33 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Only backends that implement set_aio_context can be moved out of the
+ * main loop, and only while no filter is attached: filters rely on the
+ * BQL.
+ */
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context && QTAILQ_EMPTY(&nc->filters);
+}
+
+/*
+ * Move the file descriptors of @nc to @ctx, or back to the main loop if
+ * @ctx is NULL.  Must be called with the BQL held, and from the old
+ * AioContext's thread if it is an IOThread.  Packets delivered to @nc
+ * are then processed with @ctx acquired.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(!ctx || qemu_can_set_aio_context(nc));
+    if (nc->ctx == ctx) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    assert(nc->ctx == ctx);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -625,6 +684,7 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
+    AioContext *ctx;
     int ret;
 
 #ifdef DEBUG_NET
@@ -650,8 +710,16 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
     }
 
     queue = sender->peer->incoming_queue;
+    ctx = sender->peer->ctx;
 
-    return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    ret = qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+    return ret;
 }
 
 ssize_t qemu_send_packet_async(NetClientState *sender,
@@ -735,11 +803,39 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+static int qemu_deliver_packet_batch(const struct iovec *iov,
+                                     int count,
+                                     ssize_t *ret,
+                                     void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i, done;
+
+    if (nc->link_down) {
+        for (i = 0; i < count; i++) {
+            ret[i] = iov[i].iov_len;
+        }
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    done = nc->info->receive_iov_batch(nc, iov, count, ret);
+    if (done < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return done;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
 {
     NetQueue *queue;
+    AioContext *ctx;
     size_t size = iov_size(iov, iovcnt);
     int ret;
 
@@ -765,10 +861,18 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
     }
 
     queue = sender->peer->incoming_queue;
+    ctx = sender->peer->ctx;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
-                                   iov, iovcnt, sent_cb);
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    ret = qemu_net_queue_send_iov(queue, sender,
+                                  QEMU_NET_PACKET_FLAG_NONE,
+                                  iov, iovcnt, sent_cb);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+    return ret;
 }
 
 ssize_t
@@ -952,6 +1056,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1037,6 +1144,9 @@ static void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
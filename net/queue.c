@@ -23,7 +23,6 @@
 
 #include "qemu/osdep.h"
 #include "net/queue.h"
-#include "qemu/queue.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,12 +39,25 @@
  * unbounded queueing.
  */
 
+/* Packets queued with one buffer delivery before flushing */
+#define NET_QUEUE_BATCH         64
+
+/*
+ * Packets up to this size use preallocated buffers, carved from a slab the
+ * first time the queue has to hold a packet.  That covers standard MTU
+ * frames; larger ones, and any beyond the slab, are allocated one by one.
+ */
+#define NET_QUEUE_SLAB_DATA     2048
+#define NET_QUEUE_SLAB_PACKETS  64
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
+    /* Free list or purged packets; not used while in the queue */
+    NetPacket *next;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    bool from_slab;
     uint8_t data[];
 };
 
@@ -54,8 +66,19 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
+
+    /*
+     * FIFO of queued packets in a ring of nq_ring_size (a power of two)
+     * pointers.  nq_head is free-running, the oldest packet is at
+     * nq_head & (nq_ring_size - 1).  The ring grows when it is full.
+     */
+    NetPacket **ring;
+    uint32_t nq_ring_size;
+    uint32_t nq_head;
 
-    QTAILQ_HEAD(, NetPacket) packets;
+    uint8_t *slab;
+    NetPacket *free_list;
 
     unsigned delivering : 1;
 };
@@ -71,22 +94,127 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->nq_count = 0;
     queue->deliver = deliver;
 
-    QTAILQ_INIT(&queue->packets);
-
     queue->delivering = 0;
 
     return queue;
 }
 
-void qemu_del_net_queue(NetQueue *queue)
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch)
 {
-    NetPacket *packet, *next;
+    queue->deliver_batch = deliver_batch;
+}
+
+static size_t qemu_net_queue_slab_stride(void)
+{
+    return ROUND_UP(sizeof(NetPacket) + NET_QUEUE_SLAB_DATA,
+                    __alignof__(NetPacket));
+}
+
+static void qemu_net_queue_alloc_slab(NetQueue *queue)
+{
+    size_t stride = qemu_net_queue_slab_stride();
+    NetPacket *packet;
+    int i;
+
+    queue->slab = g_malloc(stride * NET_QUEUE_SLAB_PACKETS);
+    for (i = NET_QUEUE_SLAB_PACKETS - 1; i >= 0; i--) {
+        packet = (NetPacket *)(queue->slab + i * stride);
+        packet->from_slab = true;
+        packet->next = queue->free_list;
+        queue->free_list = packet;
+    }
+}
+
+static NetPacket *qemu_net_queue_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
+    if (size <= NET_QUEUE_SLAB_DATA) {
+        if (!queue->slab) {
+            qemu_net_queue_alloc_slab(queue);
+        }
+        packet = queue->free_list;
+        if (packet) {
+            queue->free_list = packet->next;
+            return packet;
+        }
+    }
+
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->from_slab = false;
+    return packet;
+}
+
+static void qemu_net_queue_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->from_slab) {
+        packet->next = queue->free_list;
+        queue->free_list = packet;
+    } else {
         g_free(packet);
     }
+}
+
+static inline NetPacket **qemu_net_queue_slot(NetQueue *queue, uint32_t i)
+{
+    return &queue->ring[(queue->nq_head + i) & (queue->nq_ring_size - 1)];
+}
+
+static void qemu_net_queue_reserve(NetQueue *queue)
+{
+    NetPacket **ring;
+    uint32_t i, size;
+
+    if (queue->nq_count < queue->nq_ring_size) {
+        return;
+    }
+
+    size = queue->nq_ring_size ? queue->nq_ring_size * 2 : 64;
+    ring = g_new(NetPacket *, size);
+    for (i = 0; i < queue->nq_count; i++) {
+        ring[i] = *qemu_net_queue_slot(queue, i);
+    }
+    g_free(queue->ring);
+    queue->ring = ring;
+    queue->nq_ring_size = size;
+    queue->nq_head = 0;
+}
+
+static void qemu_net_queue_push_tail(NetQueue *queue, NetPacket *packet)
+{
+    qemu_net_queue_reserve(queue);
+    *qemu_net_queue_slot(queue, queue->nq_count) = packet;
+    queue->nq_count++;
+}
+
+static void qemu_net_queue_push_head(NetQueue *queue, NetPacket *packet)
+{
+    qemu_net_queue_reserve(queue);
+    queue->nq_head--;
+    *qemu_net_queue_slot(queue, 0) = packet;
+    queue->nq_count++;
+}
+
+static NetPacket *qemu_net_queue_pop_head(NetQueue *queue)
+{
+    NetPacket *packet = *qemu_net_queue_slot(queue, 0);
+
+    queue->nq_head++;
+    queue->nq_count--;
+    return packet;
+}
+
+void qemu_del_net_queue(NetQueue *queue)
+{
+    while (queue->nq_count) {
+        NetPacket *packet = qemu_net_queue_pop_head(queue);
+
+        qemu_net_queue_free(queue, packet);
+    }
 
+    g_free(queue->ring);
+    g_free(queue->slab);
     g_free(queue);
 }
 
@@ -102,15 +230,14 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_push_tail(queue, packet);
 }
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -131,7 +258,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -144,8 +271,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_push_tail(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -234,29 +360,87 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    NetPacket *purged = NULL, **tail = &purged, *packet;
+    uint32_t i, kept = 0;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
+    /* Compact the ring first, the callbacks may queue more packets */
+    for (i = 0; i < queue->nq_count; i++) {
+        packet = *qemu_net_queue_slot(queue, i);
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            if (packet->sent_cb) {
-                packet->sent_cb(packet->sender, 0);
-            }
-            g_free(packet);
+            packet->next = NULL;
+            *tail = packet;
+            tail = &packet->next;
+        } else {
+            *qemu_net_queue_slot(queue, kept++) = packet;
+        }
+    }
+    queue->nq_count = kept;
+
+    while (purged) {
+        packet = purged;
+        purged = packet->next;
+        if (packet->sent_cb) {
+            packet->sent_cb(packet->sender, 0);
         }
+        qemu_net_queue_free(queue, packet);
     }
 }
 
+/*
+ * Hand over to deliver_batch() the packets at the head of the queue that
+ * do not need special handling.  Returns false if some were left queued.
+ */
+static bool qemu_net_queue_flush_batch(NetQueue *queue)
+{
+    NetPacket *batch[NET_QUEUE_BATCH];
+    struct iovec iov[NET_QUEUE_BATCH];
+    ssize_t ret[NET_QUEUE_BATCH];
+    int i, n = 0, done;
+
+    while (n < NET_QUEUE_BATCH && queue->nq_count &&
+           (*qemu_net_queue_slot(queue, 0))->flags ==
+           QEMU_NET_PACKET_FLAG_NONE) {
+        batch[n] = qemu_net_queue_pop_head(queue);
+        iov[n].iov_base = batch[n]->data;
+        iov[n].iov_len = batch[n]->size;
+        n++;
+    }
+
+    queue->delivering = 1;
+    done = queue->deliver_batch(iov, n, ret, queue->opaque);
+    queue->delivering = 0;
+
+    /* Anything queued meanwhile went to the tail, so order is preserved */
+    for (i = n - 1; i >= done; i--) {
+        qemu_net_queue_push_head(queue, batch[i]);
+    }
+
+    for (i = 0; i < done; i++) {
+        if (batch[i]->sent_cb) {
+            batch[i]->sent_cb(batch[i]->sender, ret[i]);
+        }
+        qemu_net_queue_free(queue, batch[i]);
+    }
+
+    return done == n;
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
+    while (queue->nq_count) {
         NetPacket *packet;
         int ret;
 
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
+        if (queue->deliver_batch &&
+            (*qemu_net_queue_slot(queue, 0))->flags ==
+            QEMU_NET_PACKET_FLAG_NONE) {
+            if (!qemu_net_queue_flush_batch(queue)) {
+                return false;
+            }
+            continue;
+        }
+
+        packet = qemu_net_queue_pop_head(queue);
 
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
@@ -264,8 +448,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
                                      packet->data,
                                      packet->size);
         if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
+            qemu_net_queue_push_head(queue, packet);
             return false;
         }
 
@@ -273,7 +456,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free(queue, packet);
     }
     return true;
 }
@@ -47,6 +47,13 @@
 
 #include "net/vhost_net.h"
 
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#include "qemu/iov.h"
+
+typedef struct TapUring TapUring;
+#endif
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -61,6 +68,10 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Non-NULL if reads and writes go through io_uring */
+    TapUring *uring;
+#endif
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -68,13 +79,30 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_uring_update_fd_handler(TAPState *s);
+static ssize_t tap_uring_write_packet(TAPState *s, const struct iovec *iov,
+                                      int iovcnt);
+#endif
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_update_fd_handler(s);
+        return;
+    }
+#endif
+
+    if (s->nc.ctx) {
+        aio_set_fd_handler(s->nc.ctx, s->fd, false, fd_read, fd_write,
+                           NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -92,16 +120,29 @@ static void tap_write_poll(TAPState *s, bool enable)
 static void tap_writable(void *opaque)
 {
     TAPState *s = opaque;
+    AioContext *ctx = s->nc.ctx;
 
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
     tap_write_poll(s, false);
 
     qemu_flush_queued_packets(&s->nc);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
 }
 
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        return tap_uring_write_packet(s, iov, iovcnt);
+    }
+#endif
+
     do {
         len = writev(s->fd, iov, iovcnt);
     } while (len == -1 && errno == EINTR);
@@ -184,9 +225,13 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
+    AioContext *ctx = s->nc.ctx;
     int size;
     int packets = 0;
 
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -219,7 +264,315 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * io_uring mode: a set of receive buffers stays posted to a ring owned by
+ * the backend, so that packets are read without a syscall each.  Writes
+ * are copied and queued on the same ring, and submitted together by a
+ * bottom half at the end of the peer's burst.  Completions are handled
+ * through the ring fd, which the AioContext monitors like any other fd.
+ */
+
+/* Receive buffers kept posted to the ring */
+#define TAP_URING_RX_BUFS   32
+/* Writes in flight before the peer has to wait */
+#define TAP_URING_TX_MAX    256
+/* Room for all of the above plus the cancellations done on cleanup */
+#define TAP_URING_ENTRIES   512
+
+typedef enum {
+    TAP_URING_BUF_IDLE,
+    TAP_URING_BUF_POSTED,
+    TAP_URING_BUF_BACKLOG,
+} TapUringBufState;
+
+typedef struct TapUringBuf {
+    bool is_tx;
+    TapUringBufState state;
+    ssize_t len;
+    QSIMPLEQ_ENTRY(TapUringBuf) next;
+    struct iovec iov;
+    uint8_t data[];
+} TapUringBuf;
+
+struct TapUring {
+    struct io_uring ring;
+    QEMUBH *submit_bh;
+    unsigned int rx_posted;
+    unsigned int tx_in_flight;
+    /* Received packets that the peer has not taken yet, in order */
+    QSIMPLEQ_HEAD(, TapUringBuf) rx_backlog;
+    TapUringBuf *rx_bufs[TAP_URING_RX_BUFS];
+};
+
+static void tap_uring_post_rx(TAPState *s, TapUringBuf *buf)
+{
+    TapUring *u = s->uring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    /* See TAP_URING_ENTRIES */
+    assert(sqe);
+    io_uring_prep_readv(sqe, s->fd, &buf->iov, 1, 0);
+    io_uring_sqe_set_data(sqe, buf);
+    buf->state = TAP_URING_BUF_POSTED;
+    u->rx_posted++;
+}
+
+/* Pass received packets to the peer until it stops accepting them. */
+static void tap_uring_drain(TAPState *s)
+{
+    TapUring *u = s->uring;
+    TapUringBuf *buf;
+
+    while (s->read_poll && (buf = QSIMPLEQ_FIRST(&u->rx_backlog))) {
+        uint8_t *data = buf->data;
+        ssize_t size = buf->len;
+
+        QSIMPLEQ_REMOVE_HEAD(&u->rx_backlog, next);
+        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+            data += s->host_vnet_hdr_len;
+            size -= s->host_vnet_hdr_len;
+        }
+
+        /* Like tap_send(), the packet was queued even if 0 is returned */
+        size = qemu_send_packet_async(&s->nc, data, size, tap_send_completed);
+        if (size == 0) {
+            tap_read_poll(s, false);
+        }
+        tap_uring_post_rx(s, buf);
+    }
+}
+
+static void tap_uring_submit_bh(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->nc.ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    tap_uring_drain(s);
+    io_uring_submit(&s->uring->ring);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static void tap_uring_completion(void *opaque)
+{
+    TAPState *s = opaque;
+    TapUring *u = s->uring;
+    AioContext *ctx = s->nc.ctx;
+    struct io_uring_cqe *cqe;
+    bool tx_done = false;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    while (!io_uring_peek_cqe(&u->ring, &cqe)) {
+        TapUringBuf *buf = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&u->ring, cqe);
+        if (buf->is_tx) {
+            u->tx_in_flight--;
+            g_free(buf);
+            tx_done = true;
+            continue;
+        }
+
+        u->rx_posted--;
+        if (ret == -EAGAIN || ret == -EINTR) {
+            tap_uring_post_rx(s, buf);
+        } else if (ret <= 0) {
+            /*
+             * For example a queue detached by tap_disable().  Posted
+             * again by tap_uring_update_fd_handler().
+             */
+            buf->state = TAP_URING_BUF_IDLE;
+        } else {
+            buf->len = ret;
+            buf->state = TAP_URING_BUF_BACKLOG;
+            QSIMPLEQ_INSERT_TAIL(&u->rx_backlog, buf, next);
+        }
+    }
+
+    tap_uring_drain(s);
+    if (tx_done && s->write_poll) {
+        tap_write_poll(s, false);
+        qemu_flush_queued_packets(&s->nc);
+    }
+    io_uring_submit(&u->ring);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static void tap_uring_set_fd_handler(TAPState *s, IOHandler *fd_read)
+{
+    int fd = s->uring->ring.ring_fd;
+
+    if (s->nc.ctx) {
+        aio_set_fd_handler(s->nc.ctx, fd, false, fd_read, NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(fd, fd_read, NULL, s);
+    }
+}
+
+/*
+ * Completions are processed whenever the queue is enabled; read_poll
+ * only decides whether received packets are passed to the peer.
+ */
+static void tap_uring_update_fd_handler(TAPState *s)
+{
+    TapUring *u = s->uring;
+    int i;
+
+    tap_uring_set_fd_handler(s, s->enabled ? tap_uring_completion : NULL);
+    if (!s->enabled) {
+        return;
+    }
+
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        if (u->rx_bufs[i]->state == TAP_URING_BUF_IDLE) {
+            tap_uring_post_rx(s, u->rx_bufs[i]);
+        }
+    }
+    qemu_bh_schedule(u->submit_bh);
+}
+
+static ssize_t tap_uring_write_packet(TAPState *s, const struct iovec *iov,
+                                      int iovcnt)
+{
+    TapUring *u = s->uring;
+    size_t len = iov_size(iov, iovcnt);
+    struct io_uring_sqe *sqe = NULL;
+    TapUringBuf *buf;
+
+    if (u->tx_in_flight < TAP_URING_TX_MAX) {
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+    if (!sqe) {
+        /* Retried from tap_uring_completion() */
+        tap_write_poll(s, true);
+        return 0;
+    }
+
+    buf = g_malloc(sizeof(*buf) + len);
+    buf->is_tx = true;
+    buf->iov.iov_base = buf->data;
+    buf->iov.iov_len = len;
+    iov_to_buf(iov, iovcnt, 0, buf->data, len);
+
+    io_uring_prep_writev(sqe, s->fd, &buf->iov, 1, 0);
+    io_uring_sqe_set_data(sqe, buf);
+    u->tx_in_flight++;
+    qemu_bh_schedule(u->submit_bh);
+
+    return len;
+}
+
+static void tap_uring_set_aio_context(TAPState *s, AioContext *ctx)
+{
+    TapUring *u = s->uring;
+
+    /* s->nc.ctx is still the old context */
+    tap_uring_set_fd_handler(s, NULL);
+    qemu_bh_delete(u->submit_bh);
+    u->submit_bh = aio_bh_new(ctx ?: qemu_get_aio_context(),
+                              tap_uring_submit_bh, s);
+}
+
+static void tap_uring_init(TAPState *s, Error **errp)
+{
+    TapUring *u = g_new0(TapUring, 1);
+    int i, ret;
+
+    ret = io_uring_queue_init(TAP_URING_ENTRIES, &u->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to initialize io_uring");
+        g_free(u);
+        return;
+    }
+
+    QSIMPLEQ_INIT(&u->rx_backlog);
+    u->submit_bh = aio_bh_new(s->nc.ctx ?: qemu_get_aio_context(),
+                              tap_uring_submit_bh, s);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        TapUringBuf *buf = g_malloc0(sizeof(*buf) + NET_BUFSIZE);
+
+        buf->iov.iov_base = buf->data;
+        buf->iov.iov_len = NET_BUFSIZE;
+        u->rx_bufs[i] = buf;
+    }
+
+    /* Stop reading the fd directly, then switch over to the ring */
+    tap_read_poll(s, false);
+    tap_write_poll(s, false);
+
+    /* io_uring honours O_NONBLOCK and would complete reads with -EAGAIN */
+    qemu_set_block(s->fd);
+    s->uring = u;
+    tap_read_poll(s, true);
+}
+
+static void tap_uring_cleanup(TAPState *s)
+{
+    TapUring *u = s->uring;
+    struct io_uring_cqe *cqe;
+    int i;
+
+    tap_uring_set_fd_handler(s, NULL);
+    qemu_bh_delete(u->submit_bh);
+
+    /* The kernel may still fill the buffers until the reads complete */
+    io_uring_submit(&u->ring);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        if (u->rx_bufs[i]->state == TAP_URING_BUF_POSTED) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+            io_uring_prep_cancel(sqe, u->rx_bufs[i], 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+    }
+    io_uring_submit(&u->ring);
+
+    while (u->rx_posted || u->tx_in_flight) {
+        TapUringBuf *buf;
+
+        if (io_uring_wait_cqe(&u->ring, &cqe) < 0) {
+            break;
+        }
+        buf = io_uring_cqe_get_data(cqe);
+        io_uring_cqe_seen(&u->ring, cqe);
+        if (!buf) {
+            /* Result of a cancellation */
+        } else if (buf->is_tx) {
+            u->tx_in_flight--;
+            g_free(buf);
+        } else {
+            u->rx_posted--;
+        }
+    }
+
+    io_uring_queue_exit(&u->ring);
+    for (i = 0; i < TAP_URING_RX_BUFS; i++) {
+        g_free(u->rx_bufs[i]);
+    }
+    g_free(u);
+    s->uring = NULL;
+}
+#else
+static void tap_uring_init(TAPState *s, Error **errp)
+{
+    error_setg(errp, "io-uring=on is not supported by this QEMU build");
 }
+#endif
 
 static bool tap_has_ufo(NetClientState *nc)
 {
@@ -326,6 +679,11 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_cleanup(s);
+    }
+#endif
     close(s->fd);
     s->fd = -1;
 }
@@ -337,6 +695,25 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    /* Unregister from the old context, then register in the new one */
+    tap_poll(nc, false);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_set_aio_context(s, ctx);
+    }
+#endif
+    nc->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -362,6 +739,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -660,6 +1038,14 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+    if (tap->has_io_uring && tap->io_uring) {
+        tap_uring_init(s, &err);
+        if (err) {
+            error_propagate(errp, err);
+            return;
+        }
+    }
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
@@ -773,6 +1159,15 @@ int net_init_tap(const Netdev *netdev, const char *name,
     queues = tap->has_queues ? tap->queues : 1;
     vhostfdname = tap->has_vhostfd ? tap->vhostfd : NULL;
 
+    /* vhost-net reads and writes the tap fd by itself */
+    if (tap->has_io_uring && tap->io_uring &&
+        (tap->has_vhost ? tap->vhost :
+         tap->has_vhostfd || tap->has_vhostfds ||
+         (tap->has_vhostforce && tap->vhostforce))) {
+        error_setg(errp, "io-uring=on is invalid with vhost");
+        return -1;
+    }
+
     /* QEMU hubs do not support multiqueue tap, in this case peer is set.
      * For -netdev, peer is always NULL. */
     if (peer && (tap->has_queues || tap->has_fds || tap->has_vhostfds)) {
@@ -79,6 +79,7 @@ enum {
     OPTION_DISABLE = 273,
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
+    OPTION_THREADS = 276,
 };
 
 typedef enum OutputFormat {
@@ -196,6 +197,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--threads' specifies how many threads qcow2 images may use for\n"
+           "       compression, decompression and encryption (defaults to 4)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1664,7 +1667,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
+#define MAX_THREADS 64
 
 typedef struct ImgConvertState {
     BlockBackend **src;
@@ -2176,6 +2180,91 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst)
 
 #define MAX_BUF_SECTORS 32768
 
+/*
+ * Open a convert source or target; with @threads, every qcow2 node in its
+ * backing chain may run that many compression, decompression or
+ * encryption jobs at the same time.
+ *
+ * The thread count has to be given when the image is opened, because an
+ * encrypted image sets up one cipher per thread then and cannot change
+ * their number on a reopen.  So the chain is opened once without I/O
+ * first, to find out which of its nodes are qcow2.
+ */
+static BlockBackend *convert_open(bool image_opts, const char *filename,
+                                  QDict *options, const char *fmt, int flags,
+                                  bool writethrough, bool quiet,
+                                  bool force_share, int threads)
+{
+    QemuOpts *opts = NULL;
+    QDict *probe_opts;
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    GString *prefix;
+
+    if (!threads) {
+        if (image_opts) {
+            assert(!options);
+            return img_open(true, filename, fmt, flags, writethrough, quiet,
+                            force_share);
+        }
+        return img_open_file(filename, options, fmt, flags, writethrough,
+                             quiet, force_share);
+    }
+
+    if (image_opts) {
+        assert(!options);
+        if (fmt) {
+            error_report("--image-opts and --format are mutually exclusive");
+            return NULL;
+        }
+        opts = qemu_opts_parse_noisily(qemu_find_opts("source"),
+                                       filename, true);
+        if (!opts) {
+            return NULL;
+        }
+        probe_opts = qemu_opts_to_qdict(opts, NULL);
+    } else {
+        if (!options) {
+            options = qdict_new();
+        }
+        probe_opts = qdict_clone_shallow(options);
+        if (fmt) {
+            qdict_put_str(probe_opts, "driver", fmt);
+        }
+    }
+
+    /* If this fails, the real open below reports why */
+    qdict_put_bool(probe_opts, BDRV_OPT_FORCE_SHARE, true);
+    blk = blk_new_open(image_opts ? NULL : filename, NULL, probe_opts,
+                       BDRV_O_NO_IO, NULL);
+
+    prefix = g_string_new(NULL);
+    for (bs = blk ? blk_bs(blk) : NULL; bs; bs = backing_bs(bs)) {
+        if (bs->drv && !strcmp(bs->drv->format_name, "qcow2")) {
+            char *key = g_strdup_printf("%sthreads", prefix->str);
+
+            if (opts) {
+                if (!qemu_opt_get(opts, key)) {
+                    qemu_opt_set_number(opts, key, threads, &error_abort);
+                }
+            } else if (!qdict_haskey(options, key)) {
+                qdict_put_int(options, key, threads);
+            }
+            g_free(key);
+        }
+        g_string_append(prefix, "backing.");
+    }
+    g_string_free(prefix, true);
+    blk_unref(blk);
+
+    if (opts) {
+        return img_open_opts(filename, opts, flags, writethrough, quiet,
+                             force_share);
+    }
+    return img_open_file(filename, options, fmt, flags, writethrough, quiet,
+                         force_share);
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, bs_i, flags, src_flags = 0;
@@ -2195,7 +2284,9 @@ static int img_convert(int argc, char **argv)
     int64_t ret = -EINVAL;
     bool force_share = false;
     bool explict_min_sparse = false;
+    bool explicit_num_coroutines = false;
     bool bitmaps = false;
+    int threads = 0;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2216,6 +2307,7 @@ static int img_convert(int argc, char **argv)
             {"salvage", no_argument, 0, OPTION_SALVAGE},
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
+            {"threads", required_argument, 0, OPTION_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2308,6 +2400,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            explicit_num_coroutines = true;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2344,6 +2437,14 @@ static int img_convert(int argc, char **argv)
         case OPTION_BITMAPS:
             bitmaps = true;
             break;
+        case OPTION_THREADS:
+            if (qemu_strtoi(optarg, NULL, 0, &threads) ||
+                threads < 1 || threads > MAX_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d", MAX_THREADS);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2387,6 +2488,15 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    /*
+     * Keep enough requests in flight to feed all threads, which also makes
+     * the source read further ahead of the writes
+     */
+    if (threads && !explicit_num_coroutines) {
+        s.num_coroutines = MIN(MAX_COROUTINES,
+                               MAX(s.num_coroutines, 2 * threads));
+    }
+
     s.src_num = argc - optind - 1;
     out_filename = s.src_num >= 1 ? argv[argc - 1] : NULL;
 
@@ -2423,9 +2533,9 @@ static int img_convert(int argc, char **argv)
     s.src_sectors = g_new(int64_t, s.src_num);
 
     for (bs_i = 0; bs_i < s.src_num; bs_i++) {
-        s.src[bs_i] = img_open(image_opts, argv[optind + bs_i],
-                               fmt, src_flags, src_writethrough, s.quiet,
-                               force_share);
+        s.src[bs_i] = convert_open(image_opts, argv[optind + bs_i], NULL,
+                                   fmt, src_flags, src_writethrough, s.quiet,
+                                   force_share, threads);
         if (!s.src[bs_i]) {
             ret = -1;
             goto out;
@@ -2606,16 +2716,16 @@ static int img_convert(int argc, char **argv)
     }
 
     if (skip_create) {
-        s.target = img_open(tgt_image_opts, out_filename, out_fmt,
-                            flags, writethrough, s.quiet, false);
+        s.target = convert_open(tgt_image_opts, out_filename, NULL, out_fmt,
+                                flags, writethrough, s.quiet, false, threads);
     } else {
         /* TODO ultimately we should allow --target-image-opts
          * to be used even when -n is not given.
          * That has to wait for bdrv_create to be improved
          * to allow filenames in option syntax
          */
-        s.target = img_open_file(out_filename, open_opts, out_fmt,
-                                 flags, writethrough, s.quiet, false);
+        s.target = convert_open(false, out_filename, open_opts, out_fmt,
+                                flags, writethrough, s.quiet, false, threads);
         open_opts = NULL; /* blk_new_open will have freed it */
     }
     if (!s.target) {
@@ -3036,12 +3146,22 @@ static int get_block_status(BlockDriverState *bs, int64_t offset,
     int64_t map;
     char *filename = NULL;
 
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
+    /* The allocation map of deep chains tells us where to start */
+    ret = bdrv_alloc_map_lookup(bs, NULL, offset, bytes, &bytes, &depth, NULL);
+    if (ret == 0) {
+        depth = 0;
+    } else {
+        int i;
+
+        /* The bottom layer answers for data that no layer allocates */
+        if (ret == BDRV_ALLOC_MAP_UNALLOCATED) {
+            depth--;
+        }
+        for (i = 0; i < depth; i++) {
+            bs = backing_bs(bs);
+        }
+    }
 
-    depth = 0;
     for (;;) {
         ret = bdrv_block_status(bs, offset, bytes, &bytes, &map, &file);
         if (ret < 0) {
@@ -5191,6 +5311,212 @@ static void dump_json_block_measure_info(BlockMeasureInfo *info)
     qobject_unref(str);
 }
 
+static int img_dedup(int argc, char **argv)
+{
+    int c, flags, ret = 0;
+    const char *filename, *fmt = NULL, *cache = BDRV_DEFAULT_CACHE;
+    BlockBackend *blk = NULL;
+    BlockDriverState *bs;
+    BlockDriverInfo bdi;
+    bool image_opts = false, quiet = false, progress = false, writethrough;
+    int64_t size, offset, cluster_size;
+    int64_t nb_clusters = 0, nb_shared = 0;
+    uint8_t *buf = NULL;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"format", required_argument, 0, 'f'},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, ":hf:t:pq", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case ':':
+            missing_argument(argv[optind - 1]);
+            break;
+        case '?':
+            unrecognized_option(argv[optind - 1]);
+            break;
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'p':
+            progress = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case OPTION_OBJECT: {
+            QemuOpts *opts;
+            opts = qemu_opts_parse_noisily(&qemu_object_opts,
+                                           optarg, true);
+            if (!opts) {
+                return 1;
+            }
+        }   break;
+        case OPTION_IMAGE_OPTS:
+            image_opts = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[optind];
+
+    if (quiet) {
+        progress = false;
+    }
+
+    if (qemu_opts_foreach(&qemu_object_opts,
+                          user_creatable_add_opts_foreach,
+                          qemu_img_object_print_help, &error_fatal)) {
+        return 1;
+    }
+
+    flags = BDRV_O_RDWR;
+    ret = bdrv_parse_cache_mode(cache, &flags, &writethrough);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+
+    /* Clusters are shared by the format driver as they are rewritten */
+    if (image_opts) {
+        QemuOpts *opts;
+
+        if (fmt) {
+            error_report("--image-opts and --format are mutually exclusive");
+            return 1;
+        }
+        opts = qemu_opts_parse_noisily(qemu_find_opts("source"),
+                                       filename, true);
+        if (!opts) {
+            return 1;
+        }
+        qemu_opt_set(opts, "dedup", "on", &error_abort);
+        blk = img_open_opts(filename, opts, flags, writethrough, quiet, false);
+    } else {
+        QDict *options = qdict_new();
+
+        qdict_put_str(options, "dedup", "on");
+        blk = img_open_file(filename, options, fmt, flags, writethrough, quiet,
+                            false);
+    }
+    if (!blk) {
+        return 1;
+    }
+    bs = blk_bs(blk);
+
+    ret = bdrv_get_info(bs, &bdi);
+    if (ret < 0 || bdi.cluster_size <= 0) {
+        error_report("Could not get the cluster size of '%s'", filename);
+        ret = -1;
+        goto out;
+    }
+    cluster_size = bdi.cluster_size;
+
+    size = blk_getlength(blk);
+    if (size < 0) {
+        error_report("Could not get the image size: %s", strerror(-size));
+        ret = -1;
+        goto out;
+    }
+
+    buf = blk_blockalign(blk, cluster_size);
+    qemu_progress_init(progress, 1.f);
+    qemu_progress_print(0.f, 100);
+
+    /*
+     * Write every full data cluster of the image back unchanged.  The
+     * driver either shares an earlier cluster with the same data, or
+     * remembers this one for the clusters that follow.
+     */
+    offset = 0;
+    while (offset < size) {
+        int64_t pnum, map, new_map;
+
+        ret = bdrv_block_status(bs, offset, size - offset, &pnum, &map, NULL);
+        if (ret < 0) {
+            error_report("Could not get the block status at %" PRId64 ": %s",
+                         offset, strerror(-ret));
+            goto out;
+        }
+
+        if (!(ret & BDRV_BLOCK_ALLOCATED) || !(ret & BDRV_BLOCK_DATA) ||
+            (ret & BDRV_BLOCK_ZERO) || !(ret & BDRV_BLOCK_OFFSET_VALID)) {
+            offset += pnum;
+            continue;
+        }
+
+        if (!QEMU_IS_ALIGNED(offset, cluster_size) ||
+            size - offset < cluster_size) {
+            offset += MIN(pnum, cluster_size - offset % cluster_size);
+            continue;
+        }
+
+        ret = blk_pread(blk, offset, buf, cluster_size);
+        if (ret < 0) {
+            error_report("Could not read at %" PRId64 ": %s", offset,
+                         strerror(-ret));
+            goto out;
+        }
+
+        ret = blk_pwrite(blk, offset, buf, cluster_size,
+                         BDRV_REQ_WRITE_UNCHANGED);
+        if (ret < 0) {
+            error_report("Could not write at %" PRId64 ": %s", offset,
+                         strerror(-ret));
+            goto out;
+        }
+
+        ret = bdrv_block_status(bs, offset, cluster_size, &pnum, &new_map,
+                                NULL);
+        if (ret < 0) {
+            error_report("Could not get the block status at %" PRId64 ": %s",
+                         offset, strerror(-ret));
+            goto out;
+        }
+
+        nb_clusters++;
+        if (!(ret & BDRV_BLOCK_OFFSET_VALID) || new_map != map) {
+            nb_shared++;
+        }
+
+        offset += cluster_size;
+        qemu_progress_print(100.f * offset / size, 0);
+    }
+
+    ret = blk_flush(blk);
+    if (ret < 0) {
+        error_report("Could not flush the image: %s", strerror(-ret));
+        goto out;
+    }
+
+    qemu_progress_end();
+    qprintf(quiet, "Deduplicated %" PRId64 " of %" PRId64 " data clusters\n",
+            nb_shared, nb_clusters);
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    blk_unref(blk);
+    return ret < 0;
+}
+
 static int img_measure(int argc, char **argv)
 {
     static const struct option long_options[] = {
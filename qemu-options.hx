@@ -2338,7 +2338,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,io-uring=on|off]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -2361,6 +2361,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to speciy the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use io-uring=on to read and write the TAP device through io_uring\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -2415,9 +2416,17 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "                [,queues=n][,start-queue=m]\n"
+    "                attach to the host network interface 'name' with AF_XDP sockets,\n"
+    "                using 'n' queues of the interface starting at queue 'm'\n"
+#endif
 #ifdef CONFIG_POSIX
-    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
+    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off][,poll-us=n]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
+    "                use 'poll-us=n' to let the backend busy poll the rings for\n"
+    "                up to n microseconds before waiting for a kick\n"
 #endif
     "-netdev hubport,id=str,hubid=n[,netdev=nd]\n"
     "                configure a hub port on the hub with ID 'n'\n", QEMU_ARCH_ALL)
@@ -2435,6 +2444,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2679,6 +2691,12 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    ``io-uring=on`` keeps a set of receive buffers posted to a Linux
+    io_uring and submits writes in batches, which avoids a system call
+    per packet when vhost is not used. It cannot be combined with vhost
+    and is only available if QEMU has been compiled with io_uring
+    support.
+
     Examples:
 
     .. parsed-literal::
@@ -2878,14 +2896,40 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
-``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
+``-netdev af-xdp,id=id,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m]``
+    Configure an AF_XDP backend attached to the host network interface
+    name. An XDP program that redirects the packets of the interface
+    to the sockets is loaded when the backend is created and removed
+    when it is deleted. ``mode=native`` runs the program in the device
+    driver, which allows zero-copy operation; ``mode=skb`` works with
+    any device but always copies packets. By default native mode is
+    used when the driver supports it. ``force-copy=on`` disables
+    zero-copy. Use 'queues=n' to create n queues for multiqueue
+    virtio-net; queue i of the netdev uses queue start-queue + i of
+    the interface. This option is only available if QEMU has been
+    compiled with AF_XDP support.
+
+    Example:
+
+    .. parsed-literal::
+
+        # use 4 queues on eth0
+        ethtool -L eth0 combined 4
+        # launch QEMU instance
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1,mq=on \
+            -netdev af-xdp,id=n1,ifname=eth0,queues=4
+
+``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n][,poll-us=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
     specifically defined protocol to pass vhost ioctl replacement
     messages to an application on the other end of the socket. On
     non-MSIX guests, the feature can be forced with vhostforce. Use
     'queues=n' to specify the number of queues to be created for
-    multiqueue vhost-user.
+    multiqueue vhost-user. Use 'poll-us=n' to let a backend that
+    supports ring polling busy poll each ring for up to n microseconds
+    after handling requests, instead of waiting for the guest to kick
+    it; the backend shrinks the polling window when the ring is idle.
 
     Example:
 
@@ -486,7 +486,9 @@ class MigrationDump(object):
     QEMU_VM_SUBSECTION    = 0x05
     QEMU_VM_VMDESCRIPTION = 0x06
     QEMU_VM_CONFIGURATION = 0x07
+    QEMU_VM_COMMAND       = 0x08
     QEMU_VM_SECTION_FOOTER= 0x7e
+    MIG_CMD_DEVICE_STATE  = 11
 
     def __init__(self, filename):
         self.section_classes = { ( 'ram', 0 ) : [ RamSection, None ],
@@ -530,26 +532,58 @@ class MigrationDump(object):
                 section = ConfigurationSection(file)
                 section.read()
             elif section_type == self.QEMU_VM_SECTION_START or section_type == self.QEMU_VM_SECTION_FULL:
-                section_id = file.read32()
-                name = file.readstr()
-                instance_id = file.read32()
-                version_id = file.read32()
-                section_key = (name, instance_id)
-                classdesc = self.section_classes[section_key]
-                section = classdesc[0](file, version_id, classdesc[1], section_key)
-                self.sections[section_id] = section
-                section.read()
+                section_id = self.read_section_start(file)
             elif section_type == self.QEMU_VM_SECTION_PART or section_type == self.QEMU_VM_SECTION_END:
                 section_id = file.read32()
                 self.sections[section_id].read()
             elif section_type == self.QEMU_VM_SECTION_FOOTER:
-                read_section_id = file.read32()
-                if read_section_id != section_id:
-                    raise Exception("Mismatched section footer: %x vs %x" % (read_section_id, section_id))
+                self.check_section_footer(file, section_id)
+            elif section_type == self.QEMU_VM_COMMAND:
+                self.read_command(file)
             else:
                 raise Exception("Unknown section type: %d" % section_type)
         file.close()
 
+    def read_section_start(self, file):
+        section_id = file.read32()
+        name = file.readstr()
+        instance_id = file.read32()
+        version_id = file.read32()
+        section_key = (name, instance_id)
+        classdesc = self.section_classes[section_key]
+        section = classdesc[0](file, version_id, classdesc[1], section_key)
+        self.sections[section_id] = section
+        section.read()
+        return section_id
+
+    def check_section_footer(self, file, section_id):
+        read_section_id = file.read32()
+        if read_section_id != section_id:
+            raise Exception("Mismatched section footer: %x vs %x" %
+                            (read_section_id, section_id))
+
+    def read_command(self, file):
+        cmd = file.read16()
+        length = file.read16()
+        if cmd != self.MIG_CMD_DEVICE_STATE:
+            file.readvar(length)
+            return
+
+        # Sections saved in parallel, each prefixed with its length
+        count = file.read32()
+        for i in range(count):
+            section_len = file.read32()
+            section_end = file.tell() + section_len
+            if file.read8() != self.QEMU_VM_SECTION_FULL:
+                raise Exception("Unexpected section type in "
+                                "device state command")
+            section_id = self.read_section_start(file)
+            if file.tell() < section_end:
+                if file.read8() != self.QEMU_VM_SECTION_FOOTER:
+                    raise Exception("Missing section footer in "
+                                    "device state command")
+                self.check_section_footer(file, section_id)
+
     def load_vmsd_json(self, file):
         vmsd_json = file.read_migration_debug_json()
         self.vmsd_desc = json.loads(vmsd_json, object_pairs_hook=collections.OrderedDict)
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# Benchmark compressed qemu-img convert with a growing number of threads
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import os
+import subprocess
+import sys
+import time
+
+import simplebench
+
+
+def bench_convert(qemu_img, source, target, threads):
+    """Time compressing @source into a new qcow2 image @target
+
+    Returns {'seconds': float} on success and {'error': str} on failure,
+    compatible with simplebench lib.
+    """
+    cmd = [qemu_img, 'convert', '-c', '-O', 'qcow2']
+    if threads:
+        cmd += ['--threads', str(threads)]
+    cmd += [source, target]
+
+    start = time.time()
+    p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+    seconds = time.time() - start
+    if os.path.exists(target):
+        os.remove(target)
+
+    if p.returncode != 0:
+        return {'error': 'qemu-img failed: ' + p.stdout}
+
+    return {'seconds': seconds}
+
+
+# You may set the following variables to correct values, to turn this into
+# a real benchmark.  The source should hold real, compressible guest data.
+source = '/path-to-source-image'
+target = '/path-to-scratch-dir/bench-convert-threads.qcow2'
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    return bench_convert(env['qemu_img'], source, target, case['threads'])
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('USAGE: {} <qemu-img binary>...'.format(sys.argv[0]))
+        exit(1)
+
+    # Test-cases are "rows" in benchmark resulting table; 0 means that
+    # --threads is not passed at all
+    test_cases = [{'id': '{} threads'.format(n) if n else 'default',
+                   'threads': n}
+                  for n in (0, 1, 4, 16, 32)]
+
+    # Test-envs are "columns": one per qemu-img binary to compare
+    test_envs = [{'id': path, 'qemu_img': path} for path in sys.argv[1:]]
+
+    result = simplebench.bench(bench_func, test_envs, test_cases, count=3)
+    print(simplebench.ascii(result))
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+#
+# Benchmark the CPU cost of io_uring requests with registered files and
+# SQPOLL
+#
+# qemu-io keeps a queue of random 4k O_DIRECT reads in flight, and the
+# resulting table shows the CPU time that qemu-io spent per request, in
+# microseconds.  The SQPOLL kernel thread is not accounted to qemu-io, so
+# that row shows the work that moved out of the process rather than the
+# total.  Registered buffers only cover guest RAM and therefore need a guest
+# to be measured.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import random
+import resource
+import subprocess
+import sys
+
+import simplebench
+
+
+def child_cpu_seconds():
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
+def bench_random_reads(qemu_io, image, file_opts, offsets, queue_depth):
+    """Read 4k at each of @offsets, @queue_depth requests at a time
+
+    Returns {'seconds': float} on success and {'error': str} on failure,
+    compatible with simplebench lib.  'seconds' is the CPU time per request
+    in microseconds.
+    """
+    opts = ','.join(['driver=file',
+                     'filename=' + image,
+                     'cache.direct=on',
+                     'aio=io_uring'] + file_opts)
+
+    cmds = []
+    for i, off in enumerate(offsets):
+        cmds.append('aio_read -q {} 4k'.format(off))
+        if i % queue_depth == queue_depth - 1:
+            cmds.append('aio_flush')
+    cmds = '\n'.join(cmds) + '\n'
+
+    start = child_cpu_seconds()
+    p = subprocess.run([qemu_io, '--image-opts', opts], input=cmds,
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+    cpu = child_cpu_seconds() - start
+
+    if p.returncode != 0 or p.stdout.strip():
+        return {'error': 'qemu-io failed: ' + p.stdout}
+
+    return {'seconds': cpu * 1000000 / len(offsets)}
+
+
+# You may set the following variables to correct values, to turn this into
+# a real benchmark.
+image = '/path-to-raw-image-at-nvme'
+image_size = 16 * 1024 * 1024 * 1024
+num_reads = 500000
+queue_depth = 32
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    return bench_random_reads(env['qemu_io'], image, case['opts'],
+                              env['offsets'], queue_depth)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('USAGE: {} <qemu-io binary>...'.format(sys.argv[0]))
+        exit(1)
+
+    rng = random.Random(0)
+    offsets = [rng.randrange(image_size // 4096) * 4096
+               for _ in range(num_reads)]
+
+    # Test-cases are "rows" in benchmark resulting table
+    test_cases = [
+        {'id': 'io_uring', 'opts': []},
+        {'id': 'fixed files', 'opts': ['io-uring-fixed-files=on']},
+        {'id': 'sqpoll', 'opts': ['io-uring-sqpoll=on']},
+    ]
+
+    # Test-envs are "columns": one per qemu-io binary to compare
+    test_envs = [{'id': path, 'qemu_io': path, 'offsets': offsets}
+                 for path in sys.argv[1:]]
+
+    result = simplebench.bench(bench_func, test_envs, test_cases, count=3)
+    print(simplebench.ascii(result))
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+#
+# Benchmark qcow2 metadata cache lookups with random 4K reads
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+
+import simplebench
+
+
+def bench_random_reads(qemu_io, image, l2_cache_size, offsets):
+    """Time qemu-io doing a 4K read at each of @offsets
+
+    The reads are fed to qemu-io through stdin, so that starting the
+    process and opening the image is paid only once per run.
+
+    Returns {'seconds': float} on success and {'error': str} on failure,
+    compatible with simplebench lib.
+    """
+    opts = ','.join(['driver=qcow2',
+                     'file.driver=file',
+                     'file.filename=' + image,
+                     'l2-cache-size={}'.format(l2_cache_size),
+                     'cache-clean-interval=0'])
+    cmds = ''.join('read -q {} 4k\n'.format(off) for off in offsets)
+
+    start = time.time()
+    p = subprocess.run([qemu_io, '--image-opts', opts], input=cmds,
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+    seconds = time.time() - start
+
+    if p.returncode != 0 or p.stdout.strip():
+        return {'error': 'qemu-io failed: ' + p.stdout}
+
+    return {'seconds': seconds}
+
+
+def create_image(qemu_img, image, size):
+    """Create an image whose L2 tables are all allocated"""
+    subprocess.run([qemu_img, 'create', '-f', 'qcow2',
+                    '-o', 'preallocation=metadata', image, size],
+                   stdout=subprocess.DEVNULL, check=True)
+
+
+# You may set the following variables to correct values, to turn this into
+# a real benchmark.  The image is created on first use; with 64K clusters a
+# 4T image needs 512M of L2 tables to be fully cached.
+image = '/path-to-scratch-dir/bench-qcow2-cache.qcow2'
+image_size = '4T'
+num_reads = 200000
+
+MiB = 1024 * 1024
+GiB = 1024 * MiB
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    return bench_random_reads(env['qemu_io'], image, case['l2-cache-size'],
+                              env['offsets'])
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print('USAGE: {} <qemu-img binary> <qemu-io binary>...'.format(
+            sys.argv[0]))
+        exit(1)
+
+    if not os.path.exists(image):
+        create_image(sys.argv[1], image, image_size)
+
+    # The same reads for every run, spread over the whole image
+    rng = random.Random(0)
+    info = json.loads(subprocess.check_output(
+        [sys.argv[1], 'info', '--output=json', image],
+        universal_newlines=True))
+    virtual_size = info['virtual-size']
+    offsets = [rng.randrange(virtual_size // 4096) * 4096
+               for _ in range(num_reads)]
+
+    # Test-cases are "rows" in benchmark resulting table
+    test_cases = [{'id': '{}M'.format(size // MiB), 'l2-cache-size': size}
+                  for size in (1 * MiB, 8 * MiB, 64 * MiB, 256 * MiB,
+                               1 * GiB)]
+
+    # Test-envs are "columns": one per qemu-io binary to compare
+    test_envs = [{'id': path, 'qemu_io': path, 'offsets': offsets}
+                 for path in sys.argv[2:]]
+
+    result = simplebench.bench(bench_func, test_envs, test_cases, count=3)
+    print(simplebench.ascii(result))
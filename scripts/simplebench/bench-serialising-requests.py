@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+#
+# Benchmark deep queues of unaligned writes
+#
+# Writes that are not aligned to the request alignment turn into
+# read-modify-write cycles, which must be serialised against every
+# overlapping in-flight request.  This keeps a configurable number of such
+# writes in flight with qemu-io, to show how the cost of that check grows
+# with the queue depth.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import random
+import subprocess
+import sys
+import time
+
+import simplebench
+
+
+def bench_unaligned_writes(qemu_io, image, queue_depth, batches):
+    """Time @batches rounds of @queue_depth concurrent 512 byte writes
+
+    blkdebug raises the request alignment to 4k, so that every write needs
+    a read-modify-write and is marked serialising.
+
+    Returns {'seconds': float} on success and {'error': str} on failure,
+    compatible with simplebench lib.
+    """
+    opts = ','.join(['driver=raw',
+                     'file.driver=blkdebug',
+                     'file.align=4096',
+                     'file.image.driver=file',
+                     'file.image.filename=' + image,
+                     'file.image.aio=threads'])
+
+    rng = random.Random(0)
+    cmds = []
+    for _ in range(batches):
+        for _ in range(queue_depth):
+            sector = rng.randrange(image_size // 512)
+            cmds.append('aio_write -q {} 512'.format(sector * 512))
+        cmds.append('aio_flush')
+    cmds = '\n'.join(cmds) + '\n'
+
+    start = time.time()
+    p = subprocess.run([qemu_io, '--image-opts', opts], input=cmds,
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+    seconds = time.time() - start
+
+    if p.returncode != 0 or p.stdout.strip():
+        return {'error': 'qemu-io failed: ' + p.stdout}
+
+    return {'seconds': seconds}
+
+
+# You may set the following variables to correct values, to turn this into
+# a real benchmark.  A small image makes overlapping requests more likely.
+image = '/path-to-raw-image-at-nvme'
+image_size = 64 * 1024 * 1024
+total_writes = 128 * 1024
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    depth = case['queue-depth']
+    return bench_unaligned_writes(env['qemu_io'], image, depth,
+                                  total_writes // depth)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('USAGE: {} <qemu-io binary>...'.format(sys.argv[0]))
+        exit(1)
+
+    # Test-cases are "rows" in benchmark resulting table
+    test_cases = [{'id': 'qd {}'.format(depth), 'queue-depth': depth}
+                  for depth in (1, 8, 32, 128, 512)]
+
+    # Test-envs are "columns": one per qemu-io binary to compare
+    test_envs = [{'id': path, 'qemu_io': path} for path in sys.argv[1:]]
+
+    result = simplebench.bench(bench_func, test_envs, test_cases, count=3)
+    print(simplebench.ascii(result))
@@ -0,0 +1,111 @@
+/*
+ * HBitmap memory and iteration benchmark
+ *
+ * Compares the dense and the sparse representation of the last level
+ * for a few typical dirty patterns.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* 8 TiB at 64 KiB granularity, or 512 GiB at 4 KiB.  */
+#define NB_BITS         (UINT64_C(1) << 27)
+
+typedef struct HBitmapPattern {
+    const char *name;
+
+    /* Length of each dirty run, and average distance between runs.  */
+    uint64_t run;
+    uint64_t stride;
+} HBitmapPattern;
+
+static const HBitmapPattern patterns[] = {
+    { "empty",            0, 0 },
+    { "scattered 0.01%",  1, 10000 },
+    { "scattered 1%",     1, 100 },
+    { "clustered 1%",     256, 25600 },
+    { "clustered 10%",    4096, 40960 },
+    { "random 50%",       1, 2 },
+    { "full",             NB_BITS, NB_BITS },
+};
+
+static void fill(HBitmap *hb, const HBitmapPattern *p, guint32 seed)
+{
+    GRand *rand = g_rand_new_with_seed(seed);
+    uint64_t pos;
+
+    for (pos = 0; p->run && pos < NB_BITS; ) {
+        hbitmap_set(hb, pos, MIN(p->run, NB_BITS - pos));
+        pos += p->run +
+               g_rand_int_range(rand, 0, 2 * (p->stride - p->run) + 1);
+    }
+    g_rand_free(rand);
+}
+
+static void run(const char *name, HBitmap *hb, const HBitmapPattern *p,
+                guint32 seed)
+{
+    HBitmapIter hbi;
+    uint64_t n = 0;
+    int64_t offset, count;
+    double t_set, t_iter, t_area;
+
+    g_test_timer_start();
+    fill(hb, p, seed);
+    t_set = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    hbitmap_iter_init(&hbi, hb, 0);
+    while (hbitmap_iter_next(&hbi) >= 0) {
+        n++;
+    }
+    t_iter = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (offset = 0;
+         hbitmap_next_dirty_area(hb, offset, NB_BITS, INT64_MAX,
+                                 &offset, &count);
+         offset += count) {
+        ;
+    }
+    t_area = g_test_timer_elapsed();
+
+    g_assert_cmpint(n, ==, hbitmap_count(hb));
+    g_print("\n%-16s %-7s %9.2f MiB  set %7.1f ms  iter %7.1f ms  "
+            "areas %7.1f ms",
+            p->name, name, (double)hbitmap_memory_usage(hb) / MiB,
+            t_set * 1000, t_iter * 1000, t_area * 1000);
+}
+
+static void test_hbitmap_speed(const void *opaque)
+{
+    const HBitmapPattern *p = opaque;
+    HBitmap *dense = hbitmap_alloc_dense(NB_BITS, 0);
+    HBitmap *sparse = hbitmap_alloc(NB_BITS, 0);
+    guint32 seed = g_test_rand_int();
+
+    /* Same pseudo-random layout for both */
+    run("dense", dense, p, seed);
+    run("sparse", sparse, p, seed);
+    g_print("\n");
+
+    hbitmap_free(dense);
+    hbitmap_free(sparse);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        char *path = g_strdup_printf("/hbitmap/benchmark/%d", i);
+        g_test_add_data_func(path, &patterns[i], test_hbitmap_speed);
+        g_free(path);
+    }
+    return g_test_run();
+}
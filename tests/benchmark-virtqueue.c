@@ -0,0 +1,349 @@
+/*
+ * Virtqueue pop/push benchmark
+ *
+ * Measures the device side cost per descriptor of consuming and completing
+ * requests on a split ring and on a packed ring, the latter both through
+ * per-field accessors like the ones hw/virtio/virtio.c uses for
+ * MemoryRegionCache and through the direct-mapped fast path in
+ * include/hw/virtio/virtio-packed-ring.h.  The "guest" fills the ring
+ * outside of the timed section.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "hw/virtio/virtio-packed-ring.h"
+
+#define RING_SIZE   256
+#define ROUNDS      20000
+
+/* Descriptors per chain; 1 for virtio-net style, 3 for virtio-blk style */
+static const unsigned int chain_lengths[] = { 1, 3 };
+
+typedef struct Ring {
+    /* split */
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t avail_idx;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+
+    /* packed */
+    VRingPackedDesc *packed;
+    bool avail_wrap_counter;
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    unsigned int chain;
+    uint64_t sum;
+    unsigned long dirty;
+} Ring;
+
+/*
+ * Stand-ins for address_space_{read,write}_cached() on a RAM region and
+ * for address_space_cache_invalidate(), which is out of line.
+ */
+static inline void cached_read(void *ring, hwaddr len, hwaddr off,
+                               void *buf, hwaddr size)
+{
+    assert(off < len && size <= len - off);
+    memcpy(buf, ring + off, size);
+}
+
+static inline void cached_write(void *ring, hwaddr len, hwaddr off,
+                                const void *buf, hwaddr size)
+{
+    assert(off < len && size <= len - off);
+    memcpy(ring + off, buf, size);
+}
+
+static void __attribute__((noinline)) cache_invalidate(Ring *r, hwaddr off,
+                                                        hwaddr size)
+{
+    r->dirty |= 1ul << ((off >> 12) & (BITS_PER_LONG - 1));
+}
+
+static void ring_init(Ring *r, unsigned int chain)
+{
+    memset(r, 0, sizeof(*r));
+    r->desc = g_new0(struct vring_desc, RING_SIZE);
+    r->avail = g_malloc0(sizeof(*r->avail) + RING_SIZE * sizeof(uint16_t));
+    r->used = g_malloc0(sizeof(*r->used) +
+                        RING_SIZE * sizeof(struct vring_used_elem));
+    r->packed = g_new0(VRingPackedDesc, RING_SIZE);
+    r->avail_wrap_counter = r->last_avail_wrap_counter = true;
+    r->used_wrap_counter = true;
+    r->chain = chain;
+}
+
+static void ring_cleanup(Ring *r)
+{
+    g_free(r->desc);
+    g_free(r->avail);
+    g_free(r->used);
+    g_free(r->packed);
+}
+
+/* Guest side: make a full ring of chains available */
+static void split_driver_fill(Ring *r)
+{
+    unsigned int i, j;
+
+    for (i = 0; i + r->chain <= RING_SIZE; i += r->chain) {
+        for (j = 0; j < r->chain; j++) {
+            struct vring_desc *d = &r->desc[i + j];
+
+            d->addr = cpu_to_le64((uint64_t)(i + j) << 12);
+            d->len = cpu_to_le32(512);
+            d->flags = cpu_to_le16(j + 1 < r->chain ? VRING_DESC_F_NEXT : 0);
+            d->next = cpu_to_le16(i + j + 1);
+        }
+        r->avail->ring[r->avail_idx++ % RING_SIZE] = cpu_to_le16(i);
+    }
+    /* Publish the ring entries before the index */
+    smp_wmb();
+    r->avail->idx = cpu_to_le16(r->avail_idx);
+}
+
+static void packed_driver_fill(Ring *r)
+{
+    uint16_t flags = r->avail_wrap_counter ?
+                     1 << VRING_PACKED_DESC_F_AVAIL :
+                     1 << VRING_PACKED_DESC_F_USED;
+    unsigned int i, j;
+
+    for (i = 0; i + r->chain <= RING_SIZE; i += r->chain) {
+        for (j = 0; j < r->chain; j++) {
+            VRingPackedDesc *d = &r->packed[i + j];
+
+            d->addr = cpu_to_le64((uint64_t)(i + j) << 12);
+            d->len = cpu_to_le32(512);
+            d->id = cpu_to_le16(i);
+        }
+        /* Publish the descriptor before its flags */
+        smp_wmb();
+        for (j = r->chain; j-- > 0; ) {
+            r->packed[i + j].flags =
+                cpu_to_le16(flags |
+                            (j + 1 < r->chain ? VRING_DESC_F_NEXT : 0));
+        }
+    }
+    r->avail_wrap_counter ^= 1;
+}
+
+/* Device side, following virtqueue_split_pop() and virtqueue_split_flush() */
+static void split_device_run(Ring *r)
+{
+    hwaddr desc_len = RING_SIZE * sizeof(struct vring_desc);
+    hwaddr used_len = sizeof(*r->used) +
+                      RING_SIZE * sizeof(struct vring_used_elem);
+    uint16_t avail_idx = lduw_le_p(&r->avail->idx);
+    unsigned int i;
+
+    /* Read the entries only after the index */
+    smp_rmb();
+    while (r->last_avail_idx != avail_idx) {
+        struct vring_desc desc;
+        struct vring_used_elem uelem;
+        uint32_t total = 0;
+
+        i = lduw_le_p(&r->avail->ring[r->last_avail_idx++ % RING_SIZE]);
+        uelem.id = cpu_to_le32(i);
+        do {
+            cached_read(r->desc, desc_len, i * sizeof(desc), &desc,
+                        sizeof(desc));
+            desc.addr = le64_to_cpu(desc.addr);
+            desc.len = le32_to_cpu(desc.len);
+            desc.flags = le16_to_cpu(desc.flags);
+            desc.next = le16_to_cpu(desc.next);
+            r->sum += desc.addr;
+            total += desc.len;
+            i = desc.next;
+        } while (desc.flags & VRING_DESC_F_NEXT);
+
+        uelem.len = cpu_to_le32(total);
+        cached_write(r->used, used_len, offsetof(struct vring_used, ring) +
+                     r->used_idx % RING_SIZE * sizeof(uelem),
+                     &uelem, sizeof(uelem));
+        cache_invalidate(r, r->used_idx % RING_SIZE, sizeof(uelem));
+        r->used_idx++;
+    }
+    /* Publish the used entries before the index */
+    smp_wmb();
+    stw_le_p(&r->used->idx, r->used_idx);
+    cache_invalidate(r, 0, sizeof(r->used->idx));
+}
+
+/* Device side with one accessor call per field, as before the fast path */
+static void packed_device_run_slow(Ring *r)
+{
+    hwaddr len = RING_SIZE * sizeof(VRingPackedDesc);
+
+    for (;;) {
+        unsigned int i = r->last_avail_idx;
+        unsigned int head = i;
+        VRingPackedDesc desc;
+        uint16_t flags;
+        uint32_t total = 0;
+
+        cached_read(r->packed, len, i * sizeof(desc) +
+                    offsetof(VRingPackedDesc, flags), &flags, sizeof(flags));
+        if (!vring_packed_desc_is_avail(le16_to_cpu(flags),
+                                        r->last_avail_wrap_counter)) {
+            break;
+        }
+        /* Make sure flags is read before the rest fields */
+        smp_rmb();
+        do {
+            hwaddr off = i * sizeof(desc);
+
+            cached_read(r->packed, len, off + offsetof(VRingPackedDesc, flags),
+                        &desc.flags, sizeof(desc.flags));
+            cached_read(r->packed, len, off + offsetof(VRingPackedDesc, addr),
+                        &desc.addr, sizeof(desc.addr));
+            cached_read(r->packed, len, off + offsetof(VRingPackedDesc, id),
+                        &desc.id, sizeof(desc.id));
+            cached_read(r->packed, len, off + offsetof(VRingPackedDesc, len),
+                        &desc.len, sizeof(desc.len));
+            desc.flags = le16_to_cpu(desc.flags);
+            r->sum += le64_to_cpu(desc.addr);
+            total += le32_to_cpu(desc.len);
+            i++;
+        } while (desc.flags & VRING_DESC_F_NEXT);
+
+        desc.len = cpu_to_le32(total);
+        desc.flags = cpu_to_le16(r->used_wrap_counter ?
+                                 1 << VRING_PACKED_DESC_F_AVAIL |
+                                 1 << VRING_PACKED_DESC_F_USED : 0);
+        cached_write(r->packed, len,
+                     head * sizeof(desc) + offsetof(VRingPackedDesc, id),
+                     &desc.id, sizeof(desc.id));
+        cache_invalidate(r, head, sizeof(desc.id));
+        cached_write(r->packed, len,
+                     head * sizeof(desc) + offsetof(VRingPackedDesc, len),
+                     &desc.len, sizeof(desc.len));
+        cache_invalidate(r, head, sizeof(desc.len));
+        /* Make sure data is wrote before flags */
+        smp_wmb();
+        cached_write(r->packed, len,
+                     head * sizeof(desc) + offsetof(VRingPackedDesc, flags),
+                     &desc.flags, sizeof(desc.flags));
+        cache_invalidate(r, head, sizeof(desc.flags));
+
+        if (i >= RING_SIZE) {
+            i = 0;
+            r->last_avail_wrap_counter ^= 1;
+            r->used_wrap_counter ^= 1;
+        }
+        r->last_avail_idx = i;
+        if (RING_SIZE - i < r->chain) {
+            /* Partial chain slots at the end of the ring are never used */
+            r->last_avail_idx = 0;
+            r->last_avail_wrap_counter ^= 1;
+            r->used_wrap_counter ^= 1;
+        }
+    }
+}
+
+static void packed_device_run_fast(Ring *r)
+{
+    for (;;) {
+        unsigned int i = r->last_avail_idx;
+        unsigned int head = i;
+        unsigned int ahead = i + VRING_PACKED_DESC_PER_LINE;
+        VRingPackedDesc desc;
+        uint32_t total = 0;
+
+        vring_packed_desc_prefetch(r->packed, ahead < RING_SIZE ?
+                                              ahead : ahead - RING_SIZE);
+        if (!vring_packed_desc_load_avail(r->packed, i,
+                                          r->last_avail_wrap_counter,
+                                          &desc)) {
+            break;
+        }
+        for (;;) {
+            r->sum += desc.addr;
+            total += desc.len;
+            i++;
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            vring_packed_desc_load(r->packed, i, &desc);
+        }
+
+        vring_packed_desc_store_used(r->packed, head, desc.id, total,
+                                     r->used_wrap_counter ?
+                                     1 << VRING_PACKED_DESC_F_AVAIL |
+                                     1 << VRING_PACKED_DESC_F_USED : 0,
+                                     true);
+        cache_invalidate(r, head, sizeof(desc));
+
+        if (i >= RING_SIZE) {
+            i = 0;
+            r->last_avail_wrap_counter ^= 1;
+            r->used_wrap_counter ^= 1;
+        }
+        r->last_avail_idx = i;
+        if (RING_SIZE - i < r->chain) {
+            r->last_avail_idx = 0;
+            r->last_avail_wrap_counter ^= 1;
+            r->used_wrap_counter ^= 1;
+        }
+    }
+}
+
+typedef struct RingVariant {
+    const char *name;
+    void (*fill)(Ring *r);
+    void (*run)(Ring *r);
+} RingVariant;
+
+static const RingVariant variants[] = {
+    { "split",        split_driver_fill,  split_device_run },
+    { "packed",       packed_driver_fill, packed_device_run_slow },
+    { "packed-fast",  packed_driver_fill, packed_device_run_fast },
+};
+
+static void test_virtqueue_speed(const void *opaque)
+{
+    unsigned int chain = *(const unsigned int *)opaque;
+    int v, round;
+
+    for (v = 0; v < ARRAY_SIZE(variants); v++) {
+        const RingVariant *var = &variants[v];
+        unsigned int descs = RING_SIZE / chain * chain;
+        int64_t ns = 0, start;
+        Ring r;
+
+        ring_init(&r, chain);
+        for (round = 0; round < ROUNDS; round++) {
+            var->fill(&r);
+            start = get_clock();
+            var->run(&r);
+            ns += get_clock() - start;
+        }
+        g_assert_cmpuint(r.sum, ==, (uint64_t)ROUNDS *
+                         (descs - 1) * descs / 2 << 12);
+        g_print("\n%-12s chain %u  %6.2f ns/desc", var->name, chain,
+                (double)ns / ((uint64_t)ROUNDS * descs));
+        ring_cleanup(&r);
+    }
+    g_print("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(chain_lengths); i++) {
+        char *path = g_strdup_printf("/virtqueue/benchmark/chain-%u",
+                                     chain_lengths[i]);
+        g_test_add_data_func(path, &chain_lengths[i], test_virtqueue_speed);
+        g_free(path);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,84 @@
+/*
+ * XBZRLE encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 256
+
+static const int densities[] = { 0, 1, 5, 10, 25, 50, 100 };
+
+static void fill_pages(uint8_t *old_buf, uint8_t *new_buf, int density)
+{
+    int i;
+
+    for (i = 0; i < NUM_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+        if (g_test_rand_int_range(0, 100) < density) {
+            new_buf[i] = old_buf[i] + 1 + g_test_rand_int_range(0, 255);
+        } else {
+            new_buf[i] = old_buf[i];
+        }
+    }
+}
+
+static void encode_speed(const char *accel, int density,
+                         uint8_t *old_buf, uint8_t *new_buf, uint8_t *dst)
+{
+    const size_t total = 1 * GiB;
+    size_t remain;
+    int i = 0;
+
+    g_test_timer_start();
+    for (remain = total; remain; remain -= PAGE_SIZE) {
+        xbzrle_encode_buffer(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE,
+                             PAGE_SIZE, dst, PAGE_SIZE);
+        i = (i + 1) % NUM_PAGES;
+    }
+    g_test_timer_elapsed();
+
+    g_print("\n%-10s dirty %3d%%: %.2f MB/sec", accel, density,
+            (double)total / MiB / g_test_timer_last());
+}
+
+static void test_encode_speed(void)
+{
+    int n = ARRAY_SIZE(densities);
+    uint8_t *old_buf = g_malloc(n * NUM_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(n * NUM_PAGES * PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    size_t off;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        off = i * NUM_PAGES * PAGE_SIZE;
+        fill_pages(old_buf + off, new_buf + off, densities[i]);
+    }
+
+    /* Run every density through each of the available encoders */
+    do {
+        for (i = 0; i < n; i++) {
+            off = i * NUM_PAGES * PAGE_SIZE;
+            encode_speed(xbzrle_encode_accel(), densities[i],
+                         old_buf + off, new_buf + off, dst);
+        }
+    } while (test_xbzrle_encode_next_accel());
+    g_print("\n");
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark/encode", test_encode_speed);
+    return g_test_run();
+}
@@ -204,6 +204,21 @@ static void read_blocktime(QTestState *who)
     qobject_unref(rsp_return);
 }
 
+/* Check the fault statistics of a postcopy destination, returning them */
+static QDict *read_postcopy_fault_stats(QTestState *who)
+{
+    QDict *rsp_return, *stats;
+
+    rsp_return = migrate_query(who);
+    g_assert(qdict_haskey(rsp_return, "postcopy-fault-stats"));
+    stats = qdict_get_qdict(rsp_return, "postcopy-fault-stats");
+    g_assert_cmpint(qdict_get_int(stats, "latency-avg"), <=,
+                    qdict_get_int(stats, "latency-max"));
+    qobject_ref(stats);
+    qobject_unref(rsp_return);
+    return stats;
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -744,6 +759,7 @@ static void migrate_postcopy_complete(QTestState *from, QTestState *to)
     if (uffd_feature_thread_id) {
         read_blocktime(to);
     }
+    qobject_unref(read_postcopy_fault_stats(to));
 
     test_migrate_end(from, to, true);
 }
@@ -760,6 +776,39 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_prefetch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *stats;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    /* Still in precopy, so nothing has faulted yet */
+    migrate_set_parameter_int(to, "postcopy-prefetch-pages", 64);
+    migrate_postcopy_start(from, to);
+
+    wait_for_migration_complete(from);
+    wait_for_serial("dest_serial");
+
+    /*
+     * The guest scans its memory page by page, so it faults on pages
+     * that are yet to arrive, in a pattern that prefetch follows.
+     */
+    stats = read_postcopy_fault_stats(to);
+    g_assert_cmpint(qdict_get_int(stats, "faults"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "latency-max"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "prefetch-requests"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "prefetch-pages"), >=,
+                    qdict_get_int(stats, "prefetch-requests"));
+    g_assert_cmpint(qdict_get_int(stats, "prefetch-pages"), <=,
+                    qdict_get_int(stats, "prefetch-requests") * 64);
+    qobject_unref(stats);
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -970,6 +1019,195 @@ static void test_xbzrle_unix(void)
     g_free(uri);
 }
 
+static void test_defer_hot_pages(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "hot-page-threshold", 2);
+    migrate_set_capability(from, "defer-hot-pages", "true");
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /*
+     * The guest keeps rewriting the same pages, so after a few syncs
+     * they must be seen as hot.
+     */
+    while (read_ram_property_int(from, "hot-pages") == 0) {
+        g_assert_cmpint(get_migration_pass(from), <, 20);
+        wait_for_migration_pass(from);
+    }
+
+    /* Deferring them must not stop us from converging */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_dirty_rate(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp, *rsp_return;
+    const char *status;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+    g_free(uri);
+
+    /* The guest is dirtying memory once it has printed something */
+    wait_for_serial("src_serial");
+
+    rsp_return = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+    g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==, "unstarted");
+    g_assert(!qdict_haskey(rsp_return, "dirty-rate"));
+    qobject_unref(rsp_return);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                    "  'arguments': { 'calc-time': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    rsp = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                       "  'arguments': { 'calc-time': 1 } }");
+    qobject_unref(rsp);
+
+    /* Only one measurement at a time */
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                    "  'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    do {
+        usleep(1000 * 100);
+        rsp_return = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+        status = qdict_get_str(rsp_return, "status");
+        if (strcmp(status, "measured")) {
+            g_assert_cmpstr(status, ==, "measuring");
+            g_assert(!qdict_haskey(rsp_return, "dirty-pages"));
+            qobject_unref(rsp_return);
+            rsp_return = NULL;
+        }
+    } while (!rsp_return);
+
+    g_assert_cmpint(qdict_get_int(rsp_return, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(rsp_return, "page-size"), >, 0);
+    g_assert_cmpint(qdict_get_int(rsp_return, "dirty-pages"), >, 0);
+    g_assert(qdict_haskey(rsp_return, "dirty-rate"));
+    qobject_unref(rsp_return);
+
+    test_migrate_end(from, to, false);
+}
+
+static void test_parallel_device_state(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "device-state-threads", 4);
+    migrate_set_capability(from, "x-parallel-device-state", true);
+    migrate_set_capability(to, "x-parallel-device-state", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+/*
+ * In postcopy the device state travels inside the MIG_CMD_PACKAGED
+ * buffer, so the grouped sections must be read from it too.
+ */
+static void test_postcopy_parallel_device_state(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+
+    migrate_set_capability(from, "postcopy-ram", true);
+    migrate_set_capability(to, "postcopy-ram", true);
+    migrate_set_parameter_int(from, "device-state-threads", 4);
+    migrate_set_capability(from, "x-parallel-device-state", true);
+    migrate_set_capability(to, "x-parallel-device-state", true);
+
+    /* Slow enough that precopy does not complete on its own */
+    migrate_set_parameter_int(from, "max-bandwidth", 30000000);
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+    g_free(uri);
+
+    wait_for_migration_pass(from);
+
+    migrate_postcopy_start(from, to);
+
+    wait_for_migration_complete(from);
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_precopy_tcp(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1480,6 +1718,7 @@ int main(int argc, char **argv)
     module_call_init(MODULE_INIT_QOM);
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
+    qtest_add_func("/migration/postcopy/prefetch", test_postcopy_prefetch);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
@@ -1487,6 +1726,12 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/defer_hot_pages", test_defer_hot_pages);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
+    qtest_add_func("/migration/parallel_device_state",
+                   test_parallel_device_state);
+    qtest_add_func("/migration/postcopy/parallel_device_state",
+                   test_postcopy_parallel_device_state);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
@@ -12,6 +12,8 @@
 #include "libqtest-single.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
@@ -766,6 +768,265 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+#define MQ_NUM_QUEUES 4
+
+/* Queue a one sector read or write on @vq and kick it; returns the head */
+static uint32_t mq_submit(QTestState *qts, QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *vq,
+                          uint32_t type, uint64_t sector, uint64_t *req_addr)
+{
+    QVirtioBlkReq req;
+    uint32_t free_head;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        snprintf(req.data, 512, "TEST%" PRIu64, sector);
+    }
+
+    *req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, *req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, *req_addr + 16, 512, type == VIRTIO_BLK_T_IN,
+                   true);
+    qvirtqueue_add(qts, vq, *req_addr + 528, 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    return free_head;
+}
+
+static void mq_setup(QVirtioDevice *dev, QGuestAllocator *alloc,
+                     QVirtQueue **vqs)
+{
+    uint64_t features;
+    int i;
+
+    features = qvirtio_get_features(dev);
+    g_assert_cmphex(features & (1u << VIRTIO_BLK_F_MQ), !=, 0);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    g_assert_cmpint(qvirtio_config_readw(dev,
+                        offsetof(struct virtio_blk_config, num_queues)),
+                    ==, MQ_NUM_QUEUES);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vqs[i] = qvirtqueue_setup(dev, alloc, i);
+    }
+    qvirtio_set_driver_ok(dev);
+}
+
+static void mq_cleanup(QVirtioDevice *dev, QGuestAllocator *alloc,
+                       QVirtQueue **vqs)
+{
+    int i;
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->bus, vqs[i], alloc);
+    }
+}
+
+/*
+ * The virtqueues are spread over two IOThreads, while the drive lives in
+ * a third one.  Keep requests in flight on all of them at once, both
+ * when waiting for them to complete and when resetting the device.
+ */
+static void multiqueue_iothreads(void *obj, void *data,
+                                 QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vqs[MQ_NUM_QUEUES];
+    uint32_t free_head[MQ_NUM_QUEUES];
+    uint64_t req_addr[MQ_NUM_QUEUES];
+    char expected[512];
+    char *data;
+    uint8_t status;
+    int i;
+
+    mq_setup(dev, t_alloc, vqs);
+
+    /* Write sector i on queue i, all of them before waiting for any */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        free_head[i] = mq_submit(qts, dev, t_alloc, vqs[i], VIRTIO_BLK_T_OUT,
+                                 i, &req_addr[i]);
+    }
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtio_wait_used_elem(qts, dev, vqs[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    /* Read each sector back through a queue of the other IOThread */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        free_head[i] = mq_submit(qts, dev, t_alloc,
+                                 vqs[(i + 1) % MQ_NUM_QUEUES],
+                                 VIRTIO_BLK_T_IN, i, &req_addr[i]);
+    }
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtio_wait_used_elem(qts, dev, vqs[(i + 1) % MQ_NUM_QUEUES],
+                               free_head[i], NULL, QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        memset(expected, 0, sizeof(expected));
+        snprintf(expected, sizeof(expected), "TEST%d", i);
+        data = g_malloc0(512);
+        memread(req_addr[i] + 16, data, 512);
+        g_assert_cmpmem(data, 512, expected, 512);
+        g_free(data);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    /* Reset while writes are still being submitted on every queue */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        mq_submit(qts, dev, t_alloc, vqs[i], VIRTIO_BLK_T_OUT,
+                  MQ_NUM_QUEUES + i, &req_addr[i]);
+    }
+    qvirtio_reset(dev);
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        guest_free(t_alloc, req_addr[i]);
+    }
+    mq_cleanup(dev, t_alloc, vqs);
+
+    /* The device must come back up on all of its queues */
+    qvirtio_set_acknowledge(dev);
+    qvirtio_set_driver(dev);
+    mq_setup(dev, t_alloc, vqs);
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        free_head[i] = mq_submit(qts, dev, t_alloc, vqs[i], VIRTIO_BLK_T_IN,
+                                 i, &req_addr[i]);
+        qvirtio_wait_used_elem(qts, dev, vqs[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+    mq_cleanup(dev, t_alloc, vqs);
+}
+
+/* Return the BlockDeviceStats member @name of drive0 */
+static int64_t drive0_stat(const char *name)
+{
+    QDict *rsp, *entry;
+    QListEntry *e;
+    int64_t val = -1;
+
+    rsp = qmp("{'execute': 'query-blockstats'}");
+    g_assert(qdict_haskey(rsp, "return"));
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), e) {
+        entry = qobject_to(QDict, qlist_entry_obj(e));
+        if (!g_strcmp0(qdict_get_try_str(entry, "device"), "drive0")) {
+            val = qdict_get_int(qdict_get_qdict(entry, "stats"), name);
+        }
+    }
+    qobject_unref(rsp);
+
+    g_assert_cmpint(val, >=, 0);
+    return val;
+}
+
+static void mq_wait_ok(QTestState *qts, QVirtioDevice *dev,
+                       QGuestAllocator *alloc, QVirtQueue **vqs,
+                       uint32_t *free_head, uint64_t *req_addr,
+                       int first_sector, bool check_data)
+{
+    char expected[512];
+    char *data;
+    uint8_t status;
+    int i;
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtio_wait_used_elem(qts, dev, vqs[i], free_head[i], NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        if (check_data) {
+            memset(expected, 0, sizeof(expected));
+            snprintf(expected, sizeof(expected), "TEST%d", first_sector + i);
+            data = g_malloc0(512);
+            memread(req_addr[i] + 16, data, 512);
+            g_assert_cmpmem(data, 512, expected, 512);
+            g_free(data);
+        }
+        guest_free(alloc, req_addr[i]);
+    }
+}
+
+/*
+ * With a merge window, a sequential stream that the guest spreads over
+ * all virtqueues is submitted as a single request.  Resetting the device
+ * must submit what the window holds rather than drop it.
+ */
+static void merge_window(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QTestState *qts = global_qtest;
+    QVirtQueue *vqs[MQ_NUM_QUEUES], *next_vqs[MQ_NUM_QUEUES];
+    uint32_t free_head[MQ_NUM_QUEUES];
+    uint64_t req_addr[MQ_NUM_QUEUES];
+    int i;
+
+    mq_setup(dev, t_alloc, vqs);
+
+    /* Sector i on queue i; the request for sector 0 absorbs the others */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        free_head[i] = mq_submit(qts, dev, t_alloc, vqs[i], VIRTIO_BLK_T_OUT,
+                                 i, &req_addr[i]);
+    }
+    mq_wait_ok(qts, dev, t_alloc, vqs, free_head, req_addr, 0, false);
+    g_assert_cmpint(drive0_stat("wr_merged"), ==, MQ_NUM_QUEUES - 1);
+    g_assert_cmpint(drive0_stat("wr_merged_cross_queue"), ==,
+                    MQ_NUM_QUEUES - 1);
+
+    /* Sector i on queue i + 1, so that sector 0 is on no other queue */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        next_vqs[i] = vqs[(i + 1) % MQ_NUM_QUEUES];
+        free_head[i] = mq_submit(qts, dev, t_alloc, next_vqs[i],
+                                 VIRTIO_BLK_T_IN, i, &req_addr[i]);
+    }
+    mq_wait_ok(qts, dev, t_alloc, next_vqs, free_head, req_addr, 0, true);
+    g_assert_cmpint(drive0_stat("rd_merged_cross_queue"), ==,
+                    MQ_NUM_QUEUES - 1);
+
+    /* Reset while the writes are still held in the merge window */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        mq_submit(qts, dev, t_alloc, vqs[i], VIRTIO_BLK_T_OUT,
+                  MQ_NUM_QUEUES + i, &req_addr[i]);
+    }
+    qvirtio_reset(dev);
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        guest_free(t_alloc, req_addr[i]);
+    }
+    mq_cleanup(dev, t_alloc, vqs);
+    g_assert_cmpint(drive0_stat("wr_merged_cross_queue"), ==,
+                    2 * (MQ_NUM_QUEUES - 1));
+
+    /* The writes made it to the disk */
+    qvirtio_set_acknowledge(dev);
+    qvirtio_set_driver(dev);
+    mq_setup(dev, t_alloc, vqs);
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        free_head[i] = mq_submit(qts, dev, t_alloc, vqs[i], VIRTIO_BLK_T_IN,
+                                 MQ_NUM_QUEUES + i, &req_addr[i]);
+    }
+    mq_wait_ok(qts, dev, t_alloc, vqs, free_head, req_addr, MQ_NUM_QUEUES,
+               true);
+    mq_cleanup(dev, t_alloc, vqs);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -780,6 +1041,16 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_iothreads_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=io0"
+                    " -object iothread,id=io1"
+                    " -object iothread,id=io2");
+
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -797,6 +1068,24 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_iothreads_setup;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "iothread=io0,"
+                             "num-queues=" stringify(MQ_NUM_QUEUES) ","
+                             "len-iothreads=2,iothreads[0]=io1,"
+                             "iothreads[1]=io2",
+    };
+    qos_add_test("multiqueue-iothreads", "virtio-blk-pci",
+                 multiqueue_iothreads, &opts);
+
+    /* A window long enough that all queues are kicked before it expires */
+    opts.before = virtio_blk_test_setup;
+    opts.edge = (QOSGraphEdgeOptions) {
+        .extra_device_opts = "num-queues=" stringify(MQ_NUM_QUEUES) ","
+                             "merge-window-us=1000000",
+    };
+    qos_add_test("merge-window", "virtio-blk-pci", merge_window, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -10,6 +10,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qdict.h"
@@ -27,6 +28,14 @@
 #define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
 #define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
 
+/* Ethernet, IPv4 and TCP headers without options */
+#define TCP_PKT_IP_OFS          14
+#define TCP_PKT_TCP_OFS         (TCP_PKT_IP_OFS + 20)
+#define TCP_PKT_HDRS_LEN        (TCP_PKT_TCP_OFS + 20)
+#define TCP_PKT_MSS             1000
+#define TCP_PKT_SEGS            3
+#define TCP_PKT_SEQ             0x10000
+
 #ifndef _WIN32
 
 static void rx_test(QVirtioDevice *dev,
@@ -144,6 +153,211 @@ static void rx_stop_cont_test(QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += i & 1 ? buf[i] : buf[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+/* Checksum of the TCP segment in @pkt, including the pseudo header */
+static uint16_t tcp_pkt_csum(const uint8_t *pkt)
+{
+    uint16_t tcp_len = lduw_be_p(pkt + TCP_PKT_IP_OFS + 2) - 20;
+    uint32_t sum;
+
+    sum = csum_add(0, pkt + TCP_PKT_IP_OFS + 12, 8);
+    sum += IPPROTO_TCP + tcp_len;
+    return csum_fold(csum_add(sum, pkt + TCP_PKT_TCP_OFS, tcp_len));
+}
+
+/*
+ * Build an IPv4 TCP packet whose payload bytes are the low bits of their
+ * sequence number, so that data can be checked after (de)segmentation.
+ */
+static size_t build_tcp_pkt(uint8_t *pkt, uint32_t seq, size_t payload_len,
+                            bool fill_csum)
+{
+    static const uint8_t eth_hdr[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+    };
+    uint8_t *ip = pkt + TCP_PKT_IP_OFS;
+    uint8_t *tcp = pkt + TCP_PKT_TCP_OFS;
+    size_t i;
+
+    memset(pkt, 0, TCP_PKT_HDRS_LEN);
+    memcpy(pkt, eth_hdr, sizeof(eth_hdr));
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 40 + payload_len);
+    stw_be_p(ip + 6, 0x4000);                   /* DF */
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+
+    stw_be_p(tcp, 1234);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 0x50;
+    tcp[13] = 0x10;                             /* ACK */
+    stw_be_p(tcp + 14, 0xffff);
+
+    for (i = 0; i < payload_len; i++) {
+        pkt[TCP_PKT_HDRS_LEN + i] = seq + i;
+    }
+
+    if (fill_csum) {
+        stw_be_p(ip + 10, ~csum_fold(csum_add(0, ip, 20)));
+        stw_be_p(tcp + 16, ~tcp_pkt_csum(pkt));
+    }
+    return TCP_PKT_HDRS_LEN + payload_len;
+}
+
+static void check_tcp_pkt(const uint8_t *pkt, size_t len, uint32_t seq)
+{
+    size_t i;
+
+    g_assert_cmpint(len, >, TCP_PKT_HDRS_LEN);
+    g_assert_cmpint(lduw_be_p(pkt + TCP_PKT_IP_OFS + 2), ==,
+                    len - TCP_PKT_IP_OFS);
+    g_assert_cmphex(csum_fold(csum_add(0, pkt + TCP_PKT_IP_OFS, 20)), ==,
+                    0xffff);
+    g_assert_cmphex(tcp_pkt_csum(pkt), ==, 0xffff);
+    g_assert_cmphex(ldl_be_p(pkt + TCP_PKT_TCP_OFS + 4), ==, seq);
+
+    for (i = TCP_PKT_HDRS_LEN; i < len; i++) {
+        g_assert_cmphex(pkt[i], ==, (uint8_t)(seq + i - TCP_PKT_HDRS_LEN));
+    }
+}
+
+static uint16_t vnet_hdr_u16(QVirtioDevice *dev, uint16_t val)
+{
+    return qvirtio_is_big_endian(dev) ? cpu_to_be16(val) : cpu_to_le16(val);
+}
+
+/*
+ * The socket backend has no vnet header, so a TSO packet from the guest
+ * must reach it as MSS sized TCP segments with valid checksums.
+ */
+static void tx_tso_test(QVirtioDevice *dev,
+                        QGuestAllocator *alloc, QVirtQueue *vq,
+                        int socket)
+{
+    QTestState *qts = global_qtest;
+    struct virtio_net_hdr_mrg_rxbuf hdr = {
+        .hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr.hdr_len = vnet_hdr_u16(dev, TCP_PKT_HDRS_LEN),
+        .hdr.gso_size = vnet_hdr_u16(dev, TCP_PKT_MSS),
+        .hdr.csum_start = vnet_hdr_u16(dev, TCP_PKT_TCP_OFS),
+        .hdr.csum_offset = vnet_hdr_u16(dev, 16),
+    };
+    uint8_t pkt[TCP_PKT_HDRS_LEN + TCP_PKT_SEGS * TCP_PKT_MSS];
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint32_t len;
+    size_t pkt_len;
+    int i, ret;
+
+    pkt_len = build_tcp_pkt(pkt, TCP_PKT_SEQ, TCP_PKT_SEGS * TCP_PKT_MSS,
+                            false);
+
+    req_addr = guest_alloc(alloc, VNET_HDR_SIZE + pkt_len);
+    memwrite(req_addr, &hdr, VNET_HDR_SIZE);
+    memwrite(req_addr + VNET_HDR_SIZE, pkt, pkt_len);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, VNET_HDR_SIZE + pkt_len,
+                               false, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    for (i = 0; i < TCP_PKT_SEGS; i++) {
+        ret = qemu_recv(socket, &len, sizeof(len), MSG_WAITALL);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, ==, TCP_PKT_HDRS_LEN + TCP_PKT_MSS);
+
+        ret = qemu_recv(socket, pkt, len, MSG_WAITALL);
+        g_assert_cmpint(ret, ==, len);
+        check_tcp_pkt(pkt, len, TCP_PKT_SEQ + i * TCP_PKT_MSS);
+    }
+}
+
+/*
+ * Consecutive segments of a flow that arrive in one burst are passed to
+ * the guest as a single GSO packet.
+ */
+static void rx_gro_test(QVirtioDevice *dev,
+                        QGuestAllocator *alloc, QVirtQueue *vq,
+                        int socket)
+{
+    QTestState *qts = global_qtest;
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    uint8_t buf[TCP_PKT_SEGS * (sizeof(uint32_t) + TCP_PKT_HDRS_LEN +
+                                TCP_PKT_MSS)];
+    uint8_t pkt[TCP_PKT_HDRS_LEN + TCP_PKT_SEGS * TCP_PKT_MSS];
+    size_t buf_len = 0, pkt_len;
+    uint64_t req_addr;
+    uint32_t free_head, used_len;
+    int i, ret;
+
+    req_addr = guest_alloc(alloc, 4096);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 4096, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    for (i = 0; i < TCP_PKT_SEGS; i++) {
+        pkt_len = build_tcp_pkt(buf + buf_len + sizeof(uint32_t),
+                                TCP_PKT_SEQ + i * TCP_PKT_MSS, TCP_PKT_MSS,
+                                true);
+        stl_be_p(buf + buf_len, pkt_len);
+        buf_len += sizeof(uint32_t) + pkt_len;
+    }
+
+    ret = send(socket, buf, buf_len, 0);
+    g_assert_cmpint(ret, ==, buf_len);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, &used_len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    pkt_len = TCP_PKT_HDRS_LEN + TCP_PKT_SEGS * TCP_PKT_MSS;
+    g_assert_cmpint(used_len, ==, VNET_HDR_SIZE + pkt_len);
+
+    memread(req_addr, &hdr, VNET_HDR_SIZE);
+    g_assert_cmphex(hdr.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM, ==,
+                    VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmpint(hdr.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(vnet_hdr_u16(dev, hdr.hdr.gso_size), ==, TCP_PKT_MSS);
+    g_assert_cmpint(vnet_hdr_u16(dev, hdr.hdr.csum_start), ==,
+                    TCP_PKT_TCP_OFS);
+
+    /* The guest completes the checksum, seeded with the pseudo header */
+    memread(req_addr + VNET_HDR_SIZE, pkt, pkt_len);
+    stw_be_p(pkt + TCP_PKT_TCP_OFS + 16,
+             ~csum_fold(csum_add(0, pkt + TCP_PKT_TCP_OFS,
+                                 pkt_len - TCP_PKT_TCP_OFS)));
+    check_tcp_pkt(pkt, pkt_len, TCP_PKT_SEQ);
+
+    guest_free(alloc, req_addr);
+}
+
 static void send_recv_test(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioNet *net_if = obj;
@@ -166,6 +380,18 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+static void sw_offload_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QVirtQueue *tx = net_if->queues[1];
+    int *sv = data;
+
+    tx_tso_test(dev, t_alloc, tx, sv[0]);
+    rx_gro_test(dev, t_alloc, rx, sv[0]);
+}
+
 #endif
 
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -323,6 +549,7 @@ static void register_virtio_net_test(void)
 #ifndef _WIN32
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
+    qos_add_test("sw_offload", "virtio-net", sw_offload_test, &opts);
 #endif
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
 
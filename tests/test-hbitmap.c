@@ -10,6 +10,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
 #include "block/block.h"
@@ -1042,6 +1043,114 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+/* Large enough to use the sparse representation.  */
+#define LSPARSE                    ((uint64_t)1 << 22)
+#define LCONT                      32768
+
+static void test_hbitmap_sparse_containers(TestHBitmapData *data,
+                                           const void *unused)
+{
+    hbitmap_test_init(data, LSPARSE + L1 + 3, 0);
+
+    /* A few bits, stored as an array of offsets */
+    hbitmap_test_set(data, 5, 1);
+    hbitmap_test_set(data, LCONT - 1, 1);
+    hbitmap_test_set(data, LCONT + 100, 10);
+
+    /* Dense enough to become a bitmap, then an array again */
+    hbitmap_test_set(data, LCONT * 2, 3000);
+    hbitmap_test_reset(data, LCONT * 2 + 100, 2800);
+
+    /* Whole containers become full, then partially reset */
+    hbitmap_test_set(data, LCONT * 3 - 7, LCONT * 2 + 14);
+    hbitmap_test_reset(data, LCONT * 4 + 1, 1);
+    hbitmap_test_reset(data, LCONT * 3, LCONT);
+
+    /* The last container is only partially used */
+    hbitmap_test_set(data, data->size - L1 - 5, L1 + 5);
+    hbitmap_test_check_get(data);
+
+    test_hbitmap_next_x_check(data, 0);
+    test_hbitmap_next_x_check(data, LCONT * 3 - 8);
+    test_hbitmap_next_x_check(data, LCONT * 4 + 2);
+    test_hbitmap_next_x_check(data, data->size - L1 - 6);
+    test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
+    test_hbitmap_next_dirty_area_check(data, LCONT * 4, INT64_MAX);
+    test_hbitmap_next_dirty_area_check(data, LCONT * 5, INT64_MAX);
+
+    hbitmap_test_reset_all(data);
+}
+
+static void test_hbitmap_sparse_dense(TestHBitmapData *data,
+                                      const void *unused)
+{
+    HBitmap *dense = hbitmap_alloc_dense(LSPARSE * 2, 0);
+    uint64_t positions[] = { 0, 1, L1 - 1, LCONT - 1, LCONT, L3 + 5,
+                             LSPARSE - 1, LSPARSE * 2 - L1 };
+    size_t buf_size;
+    uint8_t *buf;
+    char *h1, *h2;
+    int i;
+
+    hbitmap_test_init(data, LSPARSE * 2, 0);
+    for (i = 0; i < ARRAY_SIZE(positions); i++) {
+        hbitmap_set(data->hb, positions[i], L1);
+        hbitmap_set(dense, positions[i], L1);
+    }
+    hbitmap_set(data->hb, LCONT * 8, LCONT * 4);
+    hbitmap_set(dense, LCONT * 8, LCONT * 4);
+    hbitmap_reset(data->hb, LCONT * 9 + L1, L2);
+    hbitmap_reset(dense, LCONT * 9 + L1, L2);
+
+    /* Mostly clean, so much smaller than the dense form */
+    g_assert_cmpint(hbitmap_memory_usage(data->hb) * 16, <,
+                    hbitmap_memory_usage(dense));
+
+    h1 = hbitmap_sha256(data->hb, &error_abort);
+    h2 = hbitmap_sha256(dense, &error_abort);
+    g_assert_cmpstr(h1, ==, h2);
+    g_free(h1);
+    g_free(h2);
+
+    /* The serialized form is the same, too */
+    buf_size = hbitmap_serialization_size(dense, 0, LSPARSE * 2);
+    buf = g_malloc(buf_size);
+    hbitmap_serialize_part(data->hb, buf, 0, LSPARSE * 2);
+    hbitmap_reset_all(dense);
+    hbitmap_deserialize_part(dense, buf, 0, LSPARSE * 2, true);
+    g_assert_cmpint(hbitmap_count(dense), ==, hbitmap_count(data->hb));
+
+    hbitmap_reset_all(data->hb);
+    hbitmap_deserialize_ones(data->hb, LCONT * 20, LCONT * 2, false);
+    hbitmap_deserialize_part(data->hb, buf, 0, LCONT * 16, true);
+    hbitmap_serialize_part(dense, buf, 0, LSPARSE * 2);
+    hbitmap_reset_all(dense);
+    hbitmap_deserialize_part(dense, buf, 0, LSPARSE * 2, true);
+    g_assert_cmpint(hbitmap_count(dense), ==, hbitmap_count(data->hb));
+
+    g_free(buf);
+    hbitmap_free(dense);
+}
+
+static void test_hbitmap_sparse_truncate(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set_boundary_bits(data, 0);
+
+    /* Growing past the threshold switches to the sparse form */
+    hbitmap_test_truncate_impl(data, LSPARSE + L3);
+    hbitmap_test_check(data, 0);
+    hbitmap_test_set(data, LSPARSE, L3);
+    hbitmap_test_set(data, data->size - 1, 1);
+
+    hbitmap_test_truncate_impl(data, LSPARSE + 5);
+    hbitmap_test_check(data, 0);
+    hbitmap_test_truncate_impl(data, LSPARSE + L2);
+    hbitmap_test_check(data, 0);
+    test_hbitmap_next_x_check(data, LSPARSE);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1222,13 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/sparse/containers",
+                     test_hbitmap_sparse_containers);
+    hbitmap_test_add("/hbitmap/sparse/dense",
+                     test_hbitmap_sparse_dense);
+    hbitmap_test_add("/hbitmap/sparse/truncate",
+                     test_hbitmap_sparse_truncate);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,155 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define NUM_NODES 1000
+#define SPACE     10000
+
+typedef struct TestRange {
+    IntervalTreeNode node;
+    bool inserted;
+} TestRange;
+
+static bool overlaps(IntervalTreeNode *n, uint64_t start, uint64_t last)
+{
+    return n->start <= last && start <= n->last;
+}
+
+static bool match_any(IntervalTreeNode *node, void *opaque)
+{
+    return true;
+}
+
+static bool match_odd_start(IntervalTreeNode *node, void *opaque)
+{
+    int *calls = opaque;
+
+    (*calls)++;
+    return node->start & 1;
+}
+
+static void test_interval_tree_simple(void)
+{
+    IntervalTreeRoot root = { 0 };
+    IntervalTreeNode a = { .start = 10, .last = 19 };
+    IntervalTreeNode b = { .start = 15, .last = 30 };
+    IntervalTreeNode c = { .start = 40, .last = 40 };
+
+    g_assert_true(interval_tree_is_empty(&root));
+    g_assert_null(interval_tree_find(&root, 0, UINT64_MAX, NULL, NULL));
+
+    interval_tree_insert(&root, &b);
+    interval_tree_insert(&root, &c);
+    interval_tree_insert(&root, &a);
+    g_assert_false(interval_tree_is_empty(&root));
+
+    g_assert(interval_tree_find(&root, 0, 9, NULL, NULL) == NULL);
+    g_assert(interval_tree_find(&root, 0, 10, NULL, NULL) == &a);
+    g_assert(interval_tree_find(&root, 19, 19, NULL, NULL) == &a);
+    g_assert(interval_tree_find(&root, 20, 35, NULL, NULL) == &b);
+    g_assert(interval_tree_find(&root, 31, 39, NULL, NULL) == NULL);
+    g_assert(interval_tree_find(&root, 40, UINT64_MAX, NULL, NULL) == &c);
+
+    interval_tree_remove(&root, &a);
+    g_assert(interval_tree_find(&root, 0, 19, NULL, NULL) == &b);
+    interval_tree_remove(&root, &b);
+    g_assert(interval_tree_find(&root, 0, 39, NULL, NULL) == NULL);
+    interval_tree_remove(&root, &c);
+    g_assert_true(interval_tree_is_empty(&root));
+}
+
+static void test_interval_tree_same_start(void)
+{
+    IntervalTreeRoot root = { 0 };
+    IntervalTreeNode n[4];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(n); i++) {
+        n[i] = (IntervalTreeNode) { .start = 100, .last = 100 + i * 10 };
+        interval_tree_insert(&root, &n[i]);
+    }
+
+    g_assert(interval_tree_find(&root, 125, 200, NULL, NULL) == &n[3]);
+
+    for (i = 0; i < ARRAY_SIZE(n); i++) {
+        interval_tree_remove(&root, &n[i]);
+        if (i < ARRAY_SIZE(n) - 1) {
+            g_assert(interval_tree_find(&root, 100, 100, NULL, NULL));
+        }
+    }
+    g_assert_true(interval_tree_is_empty(&root));
+}
+
+/* Check every query against a linear scan, as nodes come and go */
+static void test_interval_tree_random(void)
+{
+    IntervalTreeRoot root = { 0 };
+    TestRange *r = g_new0(TestRange, NUM_NODES);
+    int i, j, calls;
+
+    for (i = 0; i < NUM_NODES * 20; i++) {
+        TestRange *t = &r[g_test_rand_int_range(0, NUM_NODES)];
+        uint64_t start = g_test_rand_int_range(0, SPACE);
+        uint64_t last = start + g_test_rand_int_range(0, SPACE / 100);
+        IntervalTreeNode *found;
+        bool expect = false, expect_odd = false;
+
+        if (t->inserted) {
+            interval_tree_remove(&root, &t->node);
+            t->inserted = false;
+        } else {
+            t->node.start = g_test_rand_int_range(0, SPACE);
+            t->node.last = t->node.start +
+                           g_test_rand_int_range(0, SPACE / 50);
+            interval_tree_insert(&root, &t->node);
+            t->inserted = true;
+        }
+
+        for (j = 0; j < NUM_NODES; j++) {
+            if (r[j].inserted && overlaps(&r[j].node, start, last)) {
+                expect = true;
+                expect_odd |= r[j].node.start & 1;
+            }
+        }
+
+        found = interval_tree_find(&root, start, last, match_any, NULL);
+        g_assert_cmpint(!!found, ==, expect);
+        if (found) {
+            g_assert_true(overlaps(found, start, last));
+        }
+
+        calls = 0;
+        found = interval_tree_find(&root, start, last, match_odd_start,
+                                   &calls);
+        g_assert_cmpint(!!found, ==, expect_odd);
+        if (found) {
+            g_assert_true(overlaps(found, start, last));
+            g_assert_true(found->start & 1);
+        }
+        g_assert_cmpint(calls, >=, !!found);
+    }
+
+    for (i = 0; i < NUM_NODES; i++) {
+        if (r[i].inserted) {
+            interval_tree_remove(&root, &r[i].node);
+        }
+    }
+    g_assert_true(interval_tree_is_empty(&root));
+    g_free(r);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/simple", test_interval_tree_simple);
+    g_test_add_func("/interval-tree/same-start",
+                    test_interval_tree_same_start);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    return g_test_run();
+}
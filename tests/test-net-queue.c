@@ -0,0 +1,179 @@
+/*
+ * NetQueue unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "net/queue.h"
+
+#define MAX_PACKETS 1000
+
+/* Two distinct senders; only their addresses are used */
+static int sender_a, sender_b;
+#define SENDER_A ((NetClientState *)&sender_a)
+#define SENDER_B ((NetClientState *)&sender_b)
+
+typedef struct TestState {
+    /* Number of further packets the receiver accepts, -1 for unlimited */
+    int budget;
+    int delivered[MAX_PACKETS];
+    int n_delivered;
+    int n_batches;
+    int n_raw;
+    int sent[MAX_PACKETS];
+    int n_sent;
+} TestState;
+
+static TestState state;
+
+bool qemu_can_send_packet(NetClientState *sender)
+{
+    return state.budget != 0;
+}
+
+/* Packet i is 4 bytes holding i, followed by i % 3000 bytes of padding */
+static void make_packet(int i, uint8_t *buf, size_t *size)
+{
+    *size = sizeof(i) + i % 3000;
+    memset(buf, 0xaa, *size);
+    memcpy(buf, &i, sizeof(i));
+}
+
+static bool receive_one(const struct iovec *iov)
+{
+    int id;
+
+    if (state.budget == 0) {
+        return false;
+    }
+    if (state.budget > 0) {
+        state.budget--;
+    }
+    memcpy(&id, iov->iov_base, sizeof(id));
+    g_assert_cmpint(iov->iov_len, ==, sizeof(id) + id % 3000);
+    state.delivered[state.n_delivered++] = id;
+    return true;
+}
+
+static ssize_t deliver(NetClientState *sender, unsigned flags,
+                       const struct iovec *iov, int iovcnt, void *opaque)
+{
+    g_assert_cmpint(iovcnt, ==, 1);
+    if (!receive_one(iov)) {
+        return 0;
+    }
+    if (flags & QEMU_NET_PACKET_FLAG_RAW) {
+        state.n_raw++;
+    }
+    return iov->iov_len;
+}
+
+static int deliver_batch(const struct iovec *iov, int count, ssize_t *ret,
+                         void *opaque)
+{
+    int i;
+
+    state.n_batches++;
+    for (i = 0; i < count && receive_one(&iov[i]); i++) {
+        ret[i] = iov[i].iov_len;
+    }
+    return i;
+}
+
+static void sent_cb(NetClientState *sender, ssize_t ret)
+{
+    state.sent[state.n_sent++] = ret;
+}
+
+static void send_packet(NetQueue *queue, NetClientState *sender, int i,
+                        unsigned flags)
+{
+    uint8_t buf[4096];
+    size_t size;
+
+    make_packet(i, buf, &size);
+    qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
+}
+
+static void test_net_queue_order(const void *opaque)
+{
+    bool batch = (uintptr_t)opaque;
+    NetQueue *queue = qemu_new_net_queue(deliver, NULL);
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    if (batch) {
+        qemu_net_queue_set_deliver_batch(queue, deliver_batch);
+    }
+
+    /* Enough packets to grow the ring and exhaust the slab */
+    for (i = 0; i < 300; i++) {
+        send_packet(queue, SENDER_A, i,
+                    i % 50 == 7 ? QEMU_NET_PACKET_FLAG_RAW
+                                : QEMU_NET_PACKET_FLAG_NONE);
+    }
+    g_assert_cmpint(state.n_delivered, ==, 0);
+
+    /* Drain in uneven steps */
+    while (state.n_delivered < 300) {
+        state.budget = 37;
+        g_assert(!qemu_net_queue_flush(queue) || state.n_delivered == 300);
+    }
+    state.budget = -1;
+    g_assert(qemu_net_queue_flush(queue));
+
+    for (i = 0; i < 300; i++) {
+        g_assert_cmpint(state.delivered[i], ==, i);
+    }
+    g_assert_cmpint(state.n_sent, ==, 300);
+    g_assert_cmpint(state.n_raw, ==, 6);
+    if (batch) {
+        g_assert_cmpint(state.n_batches, >, 0);
+    } else {
+        g_assert_cmpint(state.n_batches, ==, 0);
+    }
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_net_queue_purge(void)
+{
+    NetQueue *queue = qemu_new_net_queue(deliver, NULL);
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    qemu_net_queue_set_deliver_batch(queue, deliver_batch);
+
+    for (i = 0; i < 200; i++) {
+        send_packet(queue, i % 2 ? SENDER_B : SENDER_A, i,
+                    QEMU_NET_PACKET_FLAG_NONE);
+    }
+
+    qemu_net_queue_purge(queue, SENDER_B);
+    g_assert_cmpint(state.n_sent, ==, 100);
+    for (i = 0; i < 100; i++) {
+        g_assert_cmpint(state.sent[i], ==, 0);
+    }
+
+    state.budget = -1;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(state.n_delivered, ==, 100);
+    for (i = 0; i < 100; i++) {
+        g_assert_cmpint(state.delivered[i], ==, i * 2);
+    }
+
+    qemu_del_net_queue(queue);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/net/queue/order", (void *)false,
+                         test_net_queue_order);
+    g_test_add_data_func("/net/queue/order-batch", (void *)true,
+                         test_net_queue_order);
+    g_test_add_func("/net/queue/purge", test_net_queue_purge);
+    return g_test_run();
+}
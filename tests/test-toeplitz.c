@@ -0,0 +1,72 @@
+/*
+ * Table-driven Toeplitz hash unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+/* Verification suite from the Microsoft RSS specification */
+static uint8_t key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* 66.9.149.187:2794 -> 161.142.100.80:1766 */
+static uint8_t ipv4_tcp[12] = {
+    66, 9, 149, 187, 161, 142, 100, 80, 0x0a, 0xea, 0x06, 0xe6,
+};
+
+static uint32_t toeplitz_bitwise(uint8_t *input, size_t len)
+{
+    net_toeplitz_key k;
+    uint32_t hash = 0;
+
+    net_toeplitz_key_init(&k, key);
+    net_toeplitz_add(&hash, input, len, &k);
+    return hash;
+}
+
+static void test_toeplitz_vectors(void)
+{
+    NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+
+    net_toeplitz_table_init(table, key, sizeof(key));
+    g_assert_cmphex(net_toeplitz_table_hash(table, ipv4_tcp, 12), ==,
+                    0x51ccc178);
+    g_assert_cmphex(net_toeplitz_table_hash(table, ipv4_tcp, 8), ==,
+                    0x323e8fc2);
+    g_free(table);
+}
+
+static void test_toeplitz_random(void)
+{
+    NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT_LEN];
+    int i, j;
+
+    net_toeplitz_table_init(table, key, sizeof(key));
+    for (i = 0; i < 1000; i++) {
+        size_t len = g_test_rand_int_range(1, sizeof(input) + 1);
+
+        for (j = 0; j < len; j++) {
+            input[j] = g_test_rand_int_range(0, 256);
+        }
+        g_assert_cmphex(net_toeplitz_table_hash(table, input, len), ==,
+                        toeplitz_bitwise(input, len));
+    }
+    g_free(table);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/toeplitz/vectors", test_toeplitz_vectors);
+    g_test_add_func("/toeplitz/random", test_toeplitz_random);
+    return g_test_run();
+}
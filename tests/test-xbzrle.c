@@ -174,6 +174,76 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 64
+
+static void fill_pages(uint8_t *old_buf, uint8_t *new_buf, int density)
+{
+    int i;
+
+    for (i = 0; i < ACCEL_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+        if (g_test_rand_int_range(0, 100) < density) {
+            new_buf[i] = old_buf[i] + 1 + g_test_rand_int_range(0, 255);
+        } else {
+            new_buf[i] = old_buf[i];
+        }
+    }
+}
+
+static void test_encode_accel(void)
+{
+    static const int densities[] = { 0, 1, 5, 20, 50, 100 };
+    int n = ARRAY_SIZE(densities);
+    uint8_t *old_buf = g_malloc(n * ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(n * ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(n * ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int ref_len[ARRAY_SIZE(densities) * ACCEL_PAGES];
+    bool first = true;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        fill_pages(old_buf + i * ACCEL_PAGES * PAGE_SIZE,
+                   new_buf + i * ACCEL_PAGES * PAGE_SIZE, densities[i]);
+    }
+
+    /*
+     * Every encoder must produce exactly the same stream, including
+     * reporting overflow for the same pages, since the destination
+     * decodes it without knowing which one was used.
+     */
+    do {
+        for (i = 0; i < n * ACCEL_PAGES; i++) {
+            uint8_t *old_page = old_buf + i * PAGE_SIZE;
+            uint8_t *new_page = new_buf + i * PAGE_SIZE;
+            /* vary the output size so that overflow is hit at random */
+            int dlen = i % 2 ? PAGE_SIZE : PAGE_SIZE / (1 + i % 7);
+            int len;
+
+            len = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                       compressed, dlen);
+            if (first) {
+                ref_len[i] = len;
+                if (len > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, len);
+                }
+            } else {
+                g_assert_cmpint(len, ==, ref_len[i]);
+                if (len > 0) {
+                    g_assert(memcmp(ref + i * PAGE_SIZE, compressed,
+                                    len) == 0);
+                }
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +256,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* must be last, it steps through all the available encoders */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -50,7 +50,58 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The upper levels are only 1/BITS_PER_LONG of the last one, so for large
+ * bitmaps the memory goes almost entirely into the last level.  Bitmaps
+ * with at least HBITMAP_SPARSE_MIN_SIZE bits in the last level therefore
+ * store it as an array of containers, each covering 2^HB_CONTAINER_SHIFT
+ * bits, in the style of roaring bitmaps.  A container is either empty or
+ * full (no memory at all), a sorted array of 16-bit offsets when only a
+ * few bits are set, or a plain bitmap.  Containers switch between
+ * representations automatically as bits are set and reset, so a mostly
+ * clean or mostly dirty bitmap costs a few bytes per container.  All
+ * accesses to the last level go through hb_last_word() and
+ * hb_store_last_word(), which make the representation invisible to the
+ * rest of the code, including the serialization format.
+ */
+
+/* 32768 bits per container, i.e. 4 KiB when stored as a bitmap.  */
+#define HB_CONTAINER_SHIFT     15
+#define HB_CONTAINER_BITS      (1U << HB_CONTAINER_SHIFT)
+#define HB_CONTAINER_WORDS     (HB_CONTAINER_BITS / BITS_PER_LONG)
+
+/* An array container with more entries than this would take more memory
+ * than the bitmap form.  Go back to an array only below half of that, so
+ * that a bitmap hovering around the threshold does not convert back and
+ * forth on every update.
  */
+#define HB_ARRAY_MAX           (HB_CONTAINER_BITS / 16)
+#define HB_ARRAY_MIN           (HB_ARRAY_MAX / 2)
+
+/* Below 4 Mbit (512 KiB of last level) the dense form is cheap enough.  */
+#define HBITMAP_SPARSE_MIN_SIZE (UINT64_C(1) << 22)
+
+typedef enum {
+    HB_CONTAINER_EMPTY,
+    HB_CONTAINER_ARRAY,
+    HB_CONTAINER_BITMAP,
+    HB_CONTAINER_FULL,
+} HBContainerType;
+
+typedef struct HBContainer {
+    uint8_t type;
+
+    /* Number of set bits in the container.  */
+    uint32_t count;
+
+    /* Allocated entries of @array.  */
+    uint32_t alloc;
+
+    union {
+        uint16_t *array;
+        unsigned long *words;
+    };
+} HBContainer;
 
 struct HBitmap {
     /*
@@ -93,14 +144,324 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays, except that the
+     * last one is NULL for sparse bitmaps.
      */
     unsigned long *levels[HBITMAP_LEVELS];
 
     /* The length of each levels[] array. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* The last level of a sparse bitmap, and the length of the array.  */
+    HBContainer *containers;
+    uint64_t nb_containers;
+
+    /* Incremented whenever bits are cleared in a sparse bitmap, so that
+     * iterators know when they have to look at the last level again.
+     */
+    uint64_t gen;
 };
 
+/* First entry in an array container that is >= @off.  */
+static uint32_t hb_array_find(const HBContainer *c, uint32_t off)
+{
+    uint32_t lo = 0, hi = c->count;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (c->array[mid] < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static unsigned long hb_container_word(const HBContainer *c, unsigned w)
+{
+    unsigned long word = 0;
+    uint32_t off, i;
+
+    switch (c->type) {
+    case HB_CONTAINER_EMPTY:
+        return 0;
+    case HB_CONTAINER_FULL:
+        return ~0UL;
+    case HB_CONTAINER_BITMAP:
+        return c->words[w];
+    case HB_CONTAINER_ARRAY:
+        off = w * BITS_PER_LONG;
+        for (i = hb_array_find(c, off);
+             i < c->count && c->array[i] < off + BITS_PER_LONG; i++) {
+            word |= 1UL << (c->array[i] - off);
+        }
+        return word;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void hb_container_clear(HBContainer *c)
+{
+    if (c->type == HB_CONTAINER_ARRAY) {
+        g_free(c->array);
+    } else if (c->type == HB_CONTAINER_BITMAP) {
+        g_free(c->words);
+    }
+    c->type = HB_CONTAINER_EMPTY;
+    c->count = 0;
+    c->alloc = 0;
+    c->array = NULL;
+}
+
+static void hb_container_fill(HBContainer *c)
+{
+    hb_container_clear(c);
+    c->type = HB_CONTAINER_FULL;
+    c->count = HB_CONTAINER_BITS;
+}
+
+static void hb_container_to_bitmap(HBContainer *c)
+{
+    unsigned long *words;
+    uint32_t i;
+
+    switch (c->type) {
+    case HB_CONTAINER_BITMAP:
+        return;
+    case HB_CONTAINER_FULL:
+        words = g_new(unsigned long, HB_CONTAINER_WORDS);
+        memset(words, 0xff, HB_CONTAINER_WORDS * sizeof(unsigned long));
+        break;
+    case HB_CONTAINER_ARRAY:
+        words = g_new0(unsigned long, HB_CONTAINER_WORDS);
+        for (i = 0; i < c->count; i++) {
+            set_bit(c->array[i], words);
+        }
+        g_free(c->array);
+        break;
+    default:
+        words = g_new0(unsigned long, HB_CONTAINER_WORDS);
+        break;
+    }
+    c->type = HB_CONTAINER_BITMAP;
+    c->alloc = 0;
+    c->words = words;
+}
+
+static void hb_container_to_array(HBContainer *c)
+{
+    uint16_t *array = g_new(uint16_t, c->count);
+    unsigned long w;
+    uint32_t n = 0;
+
+    assert(c->type == HB_CONTAINER_BITMAP);
+    for (w = 0; w < HB_CONTAINER_WORDS; w++) {
+        unsigned long word = c->words[w];
+        while (word) {
+            array[n++] = w * BITS_PER_LONG + ctzl(word);
+            word &= word - 1;
+        }
+    }
+    assert(n == c->count);
+    g_free(c->words);
+    c->type = HB_CONTAINER_ARRAY;
+    c->alloc = n;
+    c->array = array;
+}
+
+/* Replace word @w, currently @old, with @new in an array container.  The
+ * bits of @old are exactly the entries starting at hb_array_find().
+ */
+static void hb_array_store(HBContainer *c, unsigned w,
+                           unsigned long old, unsigned long new)
+{
+    uint32_t off = w * BITS_PER_LONG;
+    uint32_t i = hb_array_find(c, off);
+    uint32_t n_old = ctpopl(old), n_new = ctpopl(new);
+    uint32_t count = c->count - n_old + n_new;
+
+    if (count > c->alloc) {
+        c->alloc = MIN(MAX(count, c->alloc * 2), HB_ARRAY_MAX);
+        c->array = g_renew(uint16_t, c->array, c->alloc);
+    }
+    memmove(&c->array[i + n_new], &c->array[i + n_old],
+            (c->count - i - n_old) * sizeof(uint16_t));
+    while (new) {
+        c->array[i++] = off + ctzl(new);
+        new &= new - 1;
+    }
+    c->type = HB_CONTAINER_ARRAY;
+    c->count = count;
+}
+
+/* Replace word @w, currently @old, with @new and pick the best
+ * representation for the result.
+ */
+static void hb_container_store(HBContainer *c, unsigned w,
+                               unsigned long old, unsigned long new)
+{
+    uint32_t count = c->count - ctpopl(old) + ctpopl(new);
+
+    if (old == new) {
+        return;
+    }
+    if (count == 0) {
+        hb_container_clear(c);
+        return;
+    }
+    if (count == HB_CONTAINER_BITS) {
+        hb_container_fill(c);
+        return;
+    }
+
+    if (c->type == HB_CONTAINER_FULL ||
+        (c->type != HB_CONTAINER_BITMAP && count > HB_ARRAY_MAX)) {
+        hb_container_to_bitmap(c);
+    }
+    if (c->type != HB_CONTAINER_BITMAP) {
+        hb_array_store(c, w, old, new);
+        return;
+    }
+
+    /* Only shrink on the way down, a bitmap container can be sparse for
+     * a while when hb_fill_last_words() is populating it.
+     */
+    c->words[w] = new;
+    if (count < HB_ARRAY_MIN && count < c->count) {
+        c->count = count;
+        hb_container_to_array(c);
+    } else {
+        c->count = count;
+    }
+}
+
+static inline unsigned long hb_last_word(const HBitmap *hb, uint64_t pos)
+{
+    if (likely(!hb->containers)) {
+        return hb->levels[HBITMAP_LEVELS - 1][pos];
+    }
+    return hb_container_word(&hb->containers[pos / HB_CONTAINER_WORDS],
+                             pos % HB_CONTAINER_WORDS);
+}
+
+static inline unsigned long hb_level_word(const HBitmap *hb, int level,
+                                          uint64_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb_last_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+/* Returns true if the word changed.  */
+static bool hb_store_last_word(HBitmap *hb, uint64_t pos, unsigned long new)
+{
+    unsigned long old;
+
+    if (!hb->containers) {
+        old = hb->levels[HBITMAP_LEVELS - 1][pos];
+        hb->levels[HBITMAP_LEVELS - 1][pos] = new;
+    } else {
+        HBContainer *c = &hb->containers[pos / HB_CONTAINER_WORDS];
+        old = hb_container_word(c, pos % HB_CONTAINER_WORDS);
+        hb_container_store(c, pos % HB_CONTAINER_WORDS, old, new);
+        if (old & ~new) {
+            hb->gen++;
+        }
+    }
+    return old != new;
+}
+
+/* Store @val (all zeroes or all ones) into @n words of the last level
+ * starting at @pos.  Containers that are covered entirely are replaced
+ * without looking at their contents.  Returns true if anything changed.
+ */
+static bool hb_fill_last_words(HBitmap *hb, uint64_t pos, uint64_t n,
+                               unsigned long val)
+{
+    uint64_t end = pos + n;
+    bool changed = false;
+
+    if (!hb->containers) {
+        unsigned long *words = hb->levels[HBITMAP_LEVELS - 1];
+        for (; pos < end; pos++) {
+            changed |= words[pos] != val;
+            words[pos] = val;
+        }
+        return changed;
+    }
+
+    while (pos < end) {
+        HBContainer *c = &hb->containers[pos / HB_CONTAINER_WORDS];
+        uint64_t c_end = QEMU_ALIGN_DOWN(pos, HB_CONTAINER_WORDS) +
+                         HB_CONTAINER_WORDS;
+
+        if (pos % HB_CONTAINER_WORDS == 0 && c_end <= end) {
+            if (val && c->type != HB_CONTAINER_FULL) {
+                hb_container_fill(c);
+                changed = true;
+            } else if (!val && c->type != HB_CONTAINER_EMPTY) {
+                hb_container_clear(c);
+                hb->gen++;
+                changed = true;
+            }
+            pos = c_end;
+            continue;
+        }
+
+        if (val && c->type != HB_CONTAINER_FULL &&
+            c->count + (MIN(c_end, end) - pos) * BITS_PER_LONG >
+            HB_ARRAY_MAX) {
+            hb_container_to_bitmap(c);
+        }
+        for (; pos < MIN(c_end, end); pos++) {
+            changed |= hb_store_last_word(hb, pos, val);
+        }
+    }
+    return changed;
+}
+
+/* Return the first word of the last level in [@pos, @end) that is not
+ * all ones, or @end if there is none.  Full containers are skipped as
+ * a whole.
+ */
+static uint64_t hb_skip_full_words(const HBitmap *hb, uint64_t pos,
+                                   uint64_t end)
+{
+    while (pos < end) {
+        if (hb->containers &&
+            hb->containers[pos / HB_CONTAINER_WORDS].type ==
+            HB_CONTAINER_FULL) {
+            pos = QEMU_ALIGN_DOWN(pos, HB_CONTAINER_WORDS) + HB_CONTAINER_WORDS;
+            continue;
+        }
+        if (hb_last_word(hb, pos) != ~0UL) {
+            return pos;
+        }
+        pos++;
+    }
+    return end;
+}
+
+static void hb_make_sparse(HBitmap *hb)
+{
+    unsigned long *words = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t pos;
+
+    hb->nb_containers = DIV_ROUND_UP(hb->sizes[HBITMAP_LEVELS - 1],
+                                     HB_CONTAINER_WORDS);
+    hb->containers = g_new0(HBContainer, hb->nb_containers);
+    hb->levels[HBITMAP_LEVELS - 1] = NULL;
+    for (pos = 0; pos < hb->sizes[HBITMAP_LEVELS - 1]; pos++) {
+        if (words[pos]) {
+            hb_store_last_word(hb, pos, words[pos]);
+        }
+    }
+    g_free(words);
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +497,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_level_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -148,10 +509,19 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
-    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+    const HBitmap *hb = hbi->hb;
+    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
     int64_t item;
 
+    /* Drop the bits that were reset since the word was loaded.  Looking
+     * up a word is more expensive for sparse bitmaps, so skip it if
+     * nothing was reset.
+     */
+    if (!hb->containers || hbi->gen != hb->gen) {
+        cur &= hb_last_word(hb, hbi->pos);
+        hbi->gen = hb->gen;
+    }
+
     if (cur == 0) {
         cur = hbitmap_iter_skip_words(hbi);
         if (cur == 0) {
@@ -176,13 +546,14 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     assert(pos < hb->size);
     hbi->pos = pos >> BITS_PER_LEVEL;
     hbi->granularity = hb->granularity;
+    hbi->gen = hb->gen;
 
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         bit = pos & (BITS_PER_LONG - 1);
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_level_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +591,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -241,19 +611,17 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
      * in them, let's set them.
      */
     start_bit_offset = (start >> hb->granularity) & (BITS_PER_LONG - 1);
-    cur |= (1UL << start_bit_offset) - 1;
     assert((start >> hb->granularity) < hb->size);
+    cur = hb_last_word(hb, pos);
+    cur |= (1UL << start_bit_offset) - 1;
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_skip_full_words(hb, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_last_word(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -393,6 +761,38 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
     return old != *elem;
 }
 
+/* Masks for the bits from @start to the end of its word, and from the
+ * beginning of the word up to @last.
+ */
+static inline unsigned long hb_first_mask(uint64_t start)
+{
+    return ~0UL << (start & (BITS_PER_LONG - 1));
+}
+
+static inline unsigned long hb_last_mask(uint64_t last)
+{
+    return ~0UL >> (BITS_PER_LONG - 1 - (last & (BITS_PER_LONG - 1)));
+}
+
+/* Same as hb_set_between for the last level of a sparse bitmap.  */
+static bool hb_set_last_between(HBitmap *hb, uint64_t start, uint64_t last)
+{
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long mask = hb_first_mask(start);
+    bool changed = false;
+
+    if (pos < lastpos) {
+        changed |= hb_store_last_word(hb, pos, hb_last_word(hb, pos) | mask);
+        changed |= hb_fill_last_words(hb, pos + 1, lastpos - pos - 1, ~0UL);
+        mask = ~0UL;
+    }
+    mask &= hb_last_mask(last);
+    changed |= hb_store_last_word(hb, lastpos,
+                                  hb_last_word(hb, lastpos) | mask);
+    return changed;
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
@@ -403,6 +803,11 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     bool changed = false;
     size_t i;
 
+    if (level == HBITMAP_LEVELS - 1 && hb->containers) {
+        changed = hb_set_last_between(hb, start, last);
+        goto out;
+    }
+
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
@@ -419,6 +824,7 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     }
     changed |= hb_set_elem(&hb->levels[level][i], start, last);
 
+out:
     /* If there was any change in this layer, we may have to update
      * the one above.
      */
@@ -471,6 +877,41 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     return blanked;
 }
 
+/* Same as hb_reset_between for the last level of a sparse bitmap,
+ * including the adjustment of *@pos and *@lastpos.
+ */
+static bool hb_reset_last_between(HBitmap *hb, uint64_t start, uint64_t last,
+                                  size_t *pos, size_t *lastpos)
+{
+    uint64_t i = *pos;
+    unsigned long mask = hb_first_mask(start);
+    unsigned long old;
+    bool changed = false;
+
+    if (i < *lastpos) {
+        old = hb_last_word(hb, i);
+        hb_store_last_word(hb, i, old & ~mask);
+        if (old && !(old & ~mask)) {
+            changed = true;
+        } else {
+            (*pos)++;
+        }
+        changed |= hb_fill_last_words(hb, i + 1, *lastpos - i - 1, 0);
+        i = *lastpos;
+        mask = ~0UL;
+    }
+
+    mask &= hb_last_mask(last);
+    old = hb_last_word(hb, i);
+    hb_store_last_word(hb, i, old & ~mask);
+    if (old && !(old & ~mask)) {
+        changed = true;
+    } else {
+        (*lastpos)--;
+    }
+    return changed;
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
@@ -481,6 +922,11 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
     bool changed = false;
     size_t i;
 
+    if (level == HBITMAP_LEVELS - 1 && hb->containers) {
+        changed = hb_reset_last_between(hb, start, last, &pos, &lastpos);
+        goto out;
+    }
+
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
@@ -514,6 +960,7 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
         lastpos--;
     }
 
+out:
     if (level > 0 && changed) {
         hb_reset_between(hb, level - 1, pos, lastpos);
     }
@@ -556,6 +1003,10 @@ void hbitmap_reset_all(HBitmap *hb)
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
+        if (!hb->levels[i]) {
+            hb_fill_last_words(hb, 0, hb->sizes[i], 0);
+            continue;
+        }
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -588,7 +1039,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_last_word(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -605,7 +1056,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,7 +1070,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -627,7 +1078,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -641,7 +1092,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -650,8 +1101,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_last_word(hb, cur);
+
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
@@ -664,7 +1116,8 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
+    unsigned long el;
 
     if (!count) {
         return;
@@ -673,13 +1126,14 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
         }
+        hb_store_last_word(hb, cur, el);
 
         buf += sizeof(unsigned long);
         cur++;
@@ -693,14 +1147,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_last_words(hb, first, el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -710,14 +1164,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_last_words(hb, first, el_count, ~0UL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -737,7 +1191,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_level_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -755,10 +1209,14 @@ void hbitmap_free(HBitmap *hb)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
+    for (i = 0; i < hb->nb_containers; i++) {
+        hb_container_clear(&hb->containers[i]);
+    }
+    g_free(hb->containers);
     g_free(hb);
 }
 
-HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+static HBitmap *hbitmap_do_alloc(uint64_t size, int granularity, bool dense)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
     unsigned i;
@@ -775,6 +1233,12 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1 && !dense &&
+            hb->size >= HBITMAP_SPARSE_MIN_SIZE) {
+            hb->nb_containers = DIV_ROUND_UP(size, HB_CONTAINER_WORDS);
+            hb->containers = g_new0(HBContainer, hb->nb_containers);
+            continue;
+        }
         hb->levels[i] = g_new0(unsigned long, size);
     }
 
@@ -787,6 +1251,16 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     return hb;
 }
 
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, false);
+}
+
+HBitmap *hbitmap_alloc_dense(uint64_t size, int granularity)
+{
+    return hbitmap_do_alloc(size, granularity, true);
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
@@ -829,12 +1303,32 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1 && hb->containers) {
+            uint64_t j, n = DIV_ROUND_UP(size, HB_CONTAINER_WORDS);
+
+            for (j = n; j < hb->nb_containers; j++) {
+                hb_container_clear(&hb->containers[j]);
+            }
+            hb->containers = g_renew(HBContainer, hb->containers, n);
+            if (n > hb->nb_containers) {
+                memset(&hb->containers[hb->nb_containers], 0,
+                       (n - hb->nb_containers) * sizeof(HBContainer));
+            }
+            hb->nb_containers = n;
+            if (!shrink) {
+                hb_fill_last_words(hb, old, size - old, 0);
+            }
+            continue;
+        }
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
                    (size - old) * sizeof(*hb->levels[i]));
         }
     }
+    if (!shrink && !hb->containers && hb->size >= HBITMAP_SPARSE_MIN_SIZE) {
+        hb_make_sparse(hb);
+    }
     if (hb->meta) {
         hbitmap_truncate(hb->meta, hb->size << hb->granularity);
     }
@@ -892,7 +1386,11 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    if (a->granularity != b->granularity) {
+    /* Sparse bitmaps are merged through their dirty areas; mostly clean
+     * containers make this much cheaper than a word by word pass anyway.
+     */
+    if (a->granularity != b->granularity ||
+        a->containers || b->containers || result->containers) {
         if ((a != result) && (b != result)) {
             hbitmap_reset_all(result);
         }
@@ -927,7 +1425,78 @@ char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
     char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    unsigned long *zeroes, *ones, **arrays;
+    struct iovec *iov;
+    uint64_t i, n = bitmap->nb_containers;
+
+    if (!bitmap->containers) {
+        qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+        return hash;
+    }
 
+    /* Hash the same bytes as the dense form, one container at a time.  */
+    zeroes = g_new0(unsigned long, HB_CONTAINER_WORDS);
+    ones = g_new(unsigned long, HB_CONTAINER_WORDS);
+    memset(ones, 0xff, HB_CONTAINER_WORDS * sizeof(unsigned long));
+    arrays = g_new0(unsigned long *, n);
+    iov = g_new(struct iovec, n);
+    for (i = 0; i < n; i++) {
+        const HBContainer *c = &bitmap->containers[i];
+        unsigned w;
+
+        switch (c->type) {
+        case HB_CONTAINER_EMPTY:
+            iov[i].iov_base = zeroes;
+            break;
+        case HB_CONTAINER_FULL:
+            iov[i].iov_base = ones;
+            break;
+        case HB_CONTAINER_BITMAP:
+            iov[i].iov_base = c->words;
+            break;
+        case HB_CONTAINER_ARRAY:
+            arrays[i] = g_new(unsigned long, HB_CONTAINER_WORDS);
+            for (w = 0; w < HB_CONTAINER_WORDS; w++) {
+                arrays[i][w] = hb_container_word(c, w);
+            }
+            iov[i].iov_base = arrays[i];
+            break;
+        }
+        iov[i].iov_len = HB_CONTAINER_WORDS * sizeof(unsigned long);
+    }
+    iov[n - 1].iov_len = size - (n - 1) * HB_CONTAINER_WORDS *
+                                 sizeof(unsigned long);
+
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, n, &hash, errp);
+
+    for (i = 0; i < n; i++) {
+        g_free(arrays[i]);
+    }
+    g_free(arrays);
+    g_free(iov);
+    g_free(ones);
+    g_free(zeroes);
     return hash;
 }
+
+uint64_t hbitmap_memory_usage(const HBitmap *hb)
+{
+    uint64_t usage = sizeof(*hb);
+    uint64_t i;
+
+    for (i = 0; i < HBITMAP_LEVELS; i++) {
+        if (hb->levels[i]) {
+            usage += hb->sizes[i] * sizeof(unsigned long);
+        }
+    }
+    usage += hb->nb_containers * sizeof(HBContainer);
+    for (i = 0; i < hb->nb_containers; i++) {
+        const HBContainer *c = &hb->containers[i];
+        if (c->type == HB_CONTAINER_ARRAY) {
+            usage += c->alloc * sizeof(uint16_t);
+        } else if (c->type == HB_CONTAINER_BITMAP) {
+            usage += HB_CONTAINER_WORDS * sizeof(unsigned long);
+        }
+    }
+    return usage;
+}
@@ -0,0 +1,156 @@
+/*
+ * Intrusive interval tree
+ *
+ * The tree is a treap ordered by (start, node address), where every node
+ * also records the largest end point in its subtree.  That is enough to
+ * skip whole subtrees that cannot contain an overlap.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline bool node_less(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    return a->start < b->start ||
+           (a->start == b->start && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void node_update(IntervalTreeNode *node)
+{
+    uint64_t last = node->last;
+
+    if (node->left && node->left->subtree_last > last) {
+        last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > last) {
+        last = node->right->subtree_last;
+    }
+    node->subtree_last = last;
+}
+
+/* Split @t into the nodes ordered before @key and the rest */
+static void split(IntervalTreeNode *t, IntervalTreeNode *key,
+                  IntervalTreeNode **l, IntervalTreeNode **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+    } else if (node_less(t, key)) {
+        split(t->right, key, &t->right, r);
+        node_update(t);
+        *l = t;
+    } else {
+        split(t->left, key, l, &t->left);
+        node_update(t);
+        *r = t;
+    }
+}
+
+/* Join two treaps where every node of @l is ordered before those of @r */
+static IntervalTreeNode *merge(IntervalTreeNode *l, IntervalTreeNode *r)
+{
+    if (!l) {
+        return r;
+    }
+    if (!r) {
+        return l;
+    }
+    if (l->priority > r->priority) {
+        l->right = merge(l->right, r);
+        node_update(l);
+        return l;
+    } else {
+        r->left = merge(l, r->left);
+        node_update(r);
+        return r;
+    }
+}
+
+static uint32_t next_priority(IntervalTreeRoot *root)
+{
+    /* xorshift32; the state must never be zero */
+    uint32_t x = root->seed ? root->seed : 0x9e3779b9;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    root->seed = x;
+    return x;
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    IntervalTreeNode *l, *r;
+
+    assert(node->start <= node->last);
+
+    node->priority = next_priority(root);
+    node->left = node->right = NULL;
+    node->subtree_last = node->last;
+
+    split(root->root, node, &l, &r);
+    root->root = merge(merge(l, node), r);
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *t,
+                                     IntervalTreeNode *node)
+{
+    assert(t);
+
+    if (t == node) {
+        return merge(t->left, t->right);
+    }
+    if (node_less(node, t)) {
+        t->left = remove_node(t->left, node);
+    } else {
+        t->right = remove_node(t->right, node);
+    }
+    node_update(t);
+    return t;
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->root = remove_node(root->root, node);
+    node->left = node->right = NULL;
+}
+
+static IntervalTreeNode *find_node(IntervalTreeNode *t,
+                                   uint64_t start, uint64_t last,
+                                   IntervalTreeMatchFunc *match,
+                                   void *opaque)
+{
+    IntervalTreeNode *found;
+
+    /* Nothing in this subtree reaches @start */
+    if (!t || t->subtree_last < start) {
+        return NULL;
+    }
+
+    found = find_node(t->left, start, last, match, opaque);
+    if (found) {
+        return found;
+    }
+
+    /* This node and everything to its right begins after @last */
+    if (t->start > last) {
+        return NULL;
+    }
+
+    if (t->last >= start && (!match || match(t, opaque))) {
+        return t;
+    }
+
+    return find_node(t->right, start, last, match, opaque);
+}
+
+IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                     uint64_t start, uint64_t last,
+                                     IntervalTreeMatchFunc *match,
+                                     void *opaque)
+{
+    assert(start <= last);
+    return find_node(root->root, start, last, match, opaque);
+}
@@ -173,12 +173,17 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
 }
 
 /**
- * Initialize device IRQ with @irq_type and and register an event notifier.
+ * Enable up to @count vectors of interrupt @irq_type, and signal @e when the
+ * first one fires.  The other vectors are left unassigned until
+ * qemu_vfio_pci_set_irq() is called for them.
+ *
+ * Returns the number of vectors that were enabled, or -errno.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier *e,
+                            int irq_type, int count, Error **errp)
 {
-    int r;
+    int r, i;
+    int *fds;
     struct vfio_irq_set *irq_set;
     size_t irq_set_size;
     struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
@@ -192,8 +197,9 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         error_setg(errp, "Device interrupt doesn't support eventfd");
         return -EINVAL;
     }
+    count = MAX(MIN(count, irq_info.count), 1);
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set_size = sizeof(*irq_set) + sizeof(int) * count;
     irq_set = g_malloc0(irq_set_size);
 
     /* Get to a known IRQ state */
@@ -202,16 +208,62 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
         .index = irq_info.index,
         .start = 0,
-        .count = 1,
+        .count = count,
     };
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
+    fds = (int *)&irq_set->data;
+    fds[0] = event_notifier_get_fd(e);
+    for (i = 1; i < count; i++) {
+        fds[i] = -1;
+    }
     r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
     g_free(irq_set);
     if (r) {
         error_setg_errno(errp, errno, "Failed to setup device interrupt");
         return -errno;
     }
+    return count;
+}
+
+/**
+ * Initialize device IRQ with @irq_type and and register an event notifier.
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    int r = qemu_vfio_pci_init_irqs(s, e, irq_type, 1, errp);
+    return r < 0 ? r : 0;
+}
+
+/**
+ * Signal @e when @vector of the interrupts enabled by
+ * qemu_vfio_pci_init_irqs() fires, or stop signalling if @e is NULL.
+ */
+int qemu_vfio_pci_set_irq(QEMUVFIOState *s, EventNotifier *e,
+                          int irq_type, int vector, Error **errp)
+{
+    int r;
+    struct vfio_irq_set *irq_set;
+    size_t irq_set_size;
+
+    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set = g_malloc0(irq_set_size);
+    *irq_set = (struct vfio_irq_set) {
+        .argsz = irq_set_size,
+        .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
+        .index = irq_type,
+        .start = vector,
+        .count = 1,
+    };
+
+    *(int *)&irq_set->data = e ? event_notifier_get_fd(e) : -1;
+    r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
+    g_free(irq_set);
+    if (r) {
+        error_setg_errno(errp, errno, "Failed to setup device interrupt %d",
+                         vector);
+        return -errno;
+    }
     return 0;
 }
 